@@ -0,0 +1,281 @@
+/**
+ * \file bench/cache_bench.cpp
+ *
+ * Lookup cost and memory per entry of LRUCache, compared with the previous 
+ * implementation based on std::list and std::unordered_map, and on Zipfian 
+ * access traces like the requests of a real site, alone and under contention.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+#include "cache.h"
+#include "profiling.h"
+
+
+#ifdef HTTP_PROFILING
+/**
+ * Count the bytes allocated through the global operator new, replaced by the
+ * profiling build.
+ */
+static std::size_t allocatedBytes() {
+    return static_cast<std::size_t>(http::threadAllocations().bytes);
+}
+#else
+/**
+ * Count the bytes allocated through the global operator new.
+ */
+static std::atomic<std::size_t> s_allocatedBytes{0};
+
+static std::size_t allocatedBytes() {
+    return s_allocatedBytes.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) {
+    s_allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* p = std::malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+// GCC can't tell that these replace the operator new above
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+#endif
+
+
+namespace {
+
+/**
+ * \brief The LRU cache before the slab/open addressing rewrite, as a baseline.
+ */
+class ListLRUCache {
+private:
+    struct CacheEntry {
+        std::string path;
+        std::vector<unsigned char> body;
+        std::chrono::time_point<std::chrono::system_clock> createAt;
+    };
+
+public:
+    explicit ListLRUCache(std::size_t capacity) : m_capacity(capacity) {}
+
+    void put(const std::string& path, const std::vector<unsigned char>& body) {
+        auto it = m_lookup.find(path);
+        if (it != m_lookup.end()) {
+            it->second->body = body;
+            it->second->createAt = std::chrono::system_clock::now();
+            m_list.splice(m_list.begin(), m_list, it->second);
+        }
+        else {
+            if (m_list.size() >= m_capacity) {
+                m_lookup.erase(m_list.back().path);
+                m_list.pop_back();
+            }
+            m_list.push_front({path, body, std::chrono::system_clock::now()});
+            m_lookup[path] = m_list.begin();
+        }
+    }
+
+    std::vector<unsigned char> get(const std::string& path) {
+        auto it = m_lookup.find(path);
+        if (it == m_lookup.end())
+            return {};
+        m_list.splice(m_list.begin(), m_list, it->second);
+        return it->second->body;
+    }
+
+private:
+    std::size_t m_capacity;
+    std::list<CacheEntry> m_list;
+    std::unordered_map<std::string, std::list<CacheEntry>::iterator> m_lookup;
+};
+
+
+std::vector<std::string> makePaths(std::size_t count) {
+    std::vector<std::string> paths;
+    paths.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+        paths.push_back("../files/static/assets/file-" + std::to_string(i) + ".js");
+    return paths;
+}
+
+
+template <typename Cache>
+void BM_CacheLookupHit(benchmark::State& state) {
+    // 
+    std::size_t count = static_cast<std::size_t>(state.range(0));
+    std::vector<std::string> paths = makePaths(count);
+    Cache cache(count);
+    for (const auto& path : paths)
+        cache.put(path, {});
+
+    // random order, so the LRU list is really updated
+    std::mt19937 rng(42);
+    std::vector<std::size_t> order(4096);
+    for (auto& i : order)
+        i = rng() % count;
+
+    // 
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(cache.get(paths[order[i++ & 4095]]));
+    }
+}
+
+
+template <typename Cache>
+void BM_CacheLookupMiss(benchmark::State& state) {
+    // 
+    std::size_t count = static_cast<std::size_t>(state.range(0));
+    std::vector<std::string> paths = makePaths(2 * count);
+    Cache cache(count);
+    for (std::size_t i = 0; i < count; ++i)
+        cache.put(paths[i], {});
+
+    // 
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(cache.get(paths[count + (i++ % count)]));
+    }
+}
+
+
+template <typename Cache>
+void BM_CachePutEvict(benchmark::State& state) {
+    // every put misses and evicts the least recently used entry
+    std::size_t count = static_cast<std::size_t>(state.range(0));
+    std::vector<std::string> paths = makePaths(2 * count);
+    Cache cache(count);
+
+    // 
+    std::size_t i = 0;
+    for (auto _ : state) {
+        cache.put(paths[i++ % paths.size()], {});
+    }
+}
+
+
+/**
+ * \brief A trace of accesses to `fileCount` files, the k-th most popular file 
+ *        being requested with a probability proportional to 1 / k^exponent.
+ */
+std::vector<std::size_t> makeZipfTrace(std::size_t fileCount, double exponent, std::size_t length) {
+    // 
+    std::vector<double> cdf(fileCount);
+    double sum = 0;
+    for (std::size_t k = 0; k < fileCount; ++k) {
+        sum += 1.0 / std::pow(static_cast<double>(k + 1), exponent);
+        cdf[k] = sum;
+    }
+
+    // 
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> uniform(0, sum);
+    std::vector<std::size_t> trace(length);
+    for (auto& file : trace)
+        file = static_cast<std::size_t>(std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin());
+    return trace;
+}
+
+
+/**
+ * \brief A Zipfian trace (exponent 0.99) over 8 times more files than the 
+ *        capacity, each miss being filled like the server does.
+ */
+template <typename Cache>
+void BM_CacheZipf(benchmark::State& state) {
+    // 
+    std::size_t capacity = static_cast<std::size_t>(state.range(0));
+    std::vector<std::string> paths = makePaths(8 * capacity);
+    std::vector<std::size_t> trace = makeZipfTrace(paths.size(), 0.99, 1 << 16);
+    Cache cache(capacity);
+
+    // 
+    std::size_t i = 0;
+    std::int64_t hits = 0;
+    for (auto _ : state) {
+        const std::string& path = paths[trace[i++ & 0xffff]];
+        if (!cache.get(path).empty())
+            ++hits;
+        else
+            cache.put(path, {'x'});
+    }
+    state.counters["hit_ratio"] = static_cast<double>(hits) / static_cast<double>(state.iterations());
+}
+
+
+/**
+ * \brief The same trace on a cache shared by the threads behind one mutex, 
+ *        like the cache of the server.
+ */
+void BM_CacheZipfContended(benchmark::State& state) {
+    // 
+    static std::mutex s_mutex;
+    static std::unique_ptr<http::LRUCache> s_cache;
+    static std::vector<std::string> s_paths;
+    static std::vector<std::size_t> s_trace;
+    if (state.thread_index() == 0) {
+        s_cache = std::make_unique<http::LRUCache>(1024);
+        s_paths = makePaths(8 * 1024);
+        s_trace = makeZipfTrace(s_paths.size(), 0.99, 1 << 16);
+    }
+
+    // each thread starts at another place of the trace
+    std::size_t i = static_cast<std::size_t>(state.thread_index()) * 7919;
+    for (auto _ : state) {
+        const std::string& path = s_paths[s_trace[i++ & 0xffff]];
+        std::lock_guard<std::mutex> lock(s_mutex);
+        if (s_cache->get(path).empty())
+            s_cache->put(path, {'x'});
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+
+template <typename Cache>
+void BM_CacheMemoryPerEntry(benchmark::State& state) {
+    // the bodies are empty, so only the bookkeeping of the cache is counted
+    std::size_t count = static_cast<std::size_t>(state.range(0));
+    std::vector<std::string> paths = makePaths(count);
+
+    // 
+    std::size_t bytes = 0;
+    for (auto _ : state) {
+        std::size_t before = allocatedBytes();
+        Cache cache(count);
+        for (const auto& path : paths)
+            cache.put(path, {});
+        bytes = allocatedBytes() - before;
+        benchmark::DoNotOptimize(cache);
+    }
+    state.counters["bytes_per_entry"] = static_cast<double>(bytes) / static_cast<double>(count);
+}
+
+} // namespace
+
+
+BENCHMARK_TEMPLATE(BM_CacheLookupHit, ListLRUCache)->Arg(16)->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(BM_CacheLookupHit, http::LRUCache)->Arg(16)->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(BM_CacheLookupMiss, ListLRUCache)->Arg(16)->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(BM_CacheLookupMiss, http::LRUCache)->Arg(16)->Arg(1024)->Arg(65536);
+BENCHMARK_TEMPLATE(BM_CachePutEvict, ListLRUCache)->Arg(16)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_CachePutEvict, http::LRUCache)->Arg(16)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_CacheZipf, ListLRUCache)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_CacheZipf, http::LRUCache)->Arg(1024);
+BENCHMARK(BM_CacheZipfContended)->Threads(1)->Threads(4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CacheMemoryPerEntry, ListLRUCache)->Arg(1024)->Iterations(1);
+BENCHMARK_TEMPLATE(BM_CacheMemoryPerEntry, http::LRUCache)->Arg(1024)->Iterations(1);
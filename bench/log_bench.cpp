@@ -0,0 +1,120 @@
+/**
+ * \file bench/log_bench.cpp
+ *
+ * Cost of a log call on the calling thread, with the synchronous `_mt` sinks
+ * flushed on each message as before, with the AsyncLogSink, and with the
+ * formatting deferred to its background thread. The messages are written to
+ * /dev/null.
+ */
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <spdlog/sinks/basic_file_sink.h>
+
+#include "async_log.h"
+#include "log.h"
+
+
+namespace {
+
+std::shared_ptr<spdlog::logger> makeSyncLogger() {
+    auto sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("/dev/null");
+    sink->set_pattern("[%n][%H:%M:%S][%t][%l]: %v");
+    auto logger = std::make_shared<spdlog::logger>("BENCH", sink);
+    logger->set_level(spdlog::level::trace);
+    logger->flush_on(spdlog::level::trace);
+    return logger;
+}
+
+std::shared_ptr<spdlog::logger> makeAsyncLogger(http::LogOverflowPolicy policy) {
+    auto sink = std::make_shared<spdlog::sinks::basic_file_sink_st>("/dev/null");
+    sink->set_pattern("[%n][%H:%M:%S][%t][%l]: %v");
+    std::vector<spdlog::sink_ptr> sinks{sink};
+    auto logger = std::make_shared<spdlog::logger>("BENCH", std::make_shared<http::AsyncLogSink>("BENCH", sinks, policy));
+    logger->set_level(spdlog::level::trace);
+    return logger;
+}
+
+/**
+ * \brief The logger of a kind, shared by the threads of a benchmark.
+ */
+std::shared_ptr<spdlog::logger>& sharedLogger(std::int64_t kind) {
+    static std::shared_ptr<spdlog::logger> loggers[] = {
+        makeSyncLogger(),
+        makeAsyncLogger(http::LogOverflowPolicy::Drop),
+        makeAsyncLogger(http::LogOverflowPolicy::Block)
+    };
+    return loggers[kind];
+}
+
+} // namespace
+
+
+/**
+ * \brief A message like the ones logged for each request, with 0: sync sinks,
+ *        1: async dropping on overflow, 2: async blocking on overflow.
+ */
+static void BM_LogCall(benchmark::State& state) {
+    auto& logger = sharedLogger(state.range(0));
+    const std::string path = "/images/status/200.jpg";
+    int socket = 42;
+    for (auto _ : state) {
+        logger->info("Handling GET request for path '{}' on client socket #{}", path, socket);
+    }
+    logger->flush();
+    state.SetItemsProcessed(state.iterations());
+}
+
+
+/**
+ * \brief The same message with its arguments copied in binary form, and
+ *        formatted by the background thread, blocking on overflow.
+ */
+static void BM_LogDeferred(benchmark::State& state) {
+    auto sink = std::static_pointer_cast<http::AsyncLogSink>(sharedLogger(2)->sinks().front());
+    const std::string path = "/images/status/200.jpg";
+    int socket = 42;
+    for (auto _ : state) {
+        sink->logDeferred(spdlog::level::info, "Handling GET request for path '{}' on client socket #{}", path, socket);
+    }
+    sink->flush();
+    state.SetItemsProcessed(state.iterations());
+}
+
+
+/**
+ * \brief A sampled logging site, which only formats one call in 64.
+ */
+static void BM_LogSampled(benchmark::State& state) {
+    auto& logger = sharedLogger(1);
+    const std::string path = "/images/status/200.jpg";
+    for (auto _ : state) {
+        static http::LogSite site;
+        if (site.every(64))
+            logger->info("Parsed header: {}: {}", "Host", path);
+    }
+    logger->flush();
+    state.SetItemsProcessed(state.iterations());
+}
+
+
+/**
+ * \brief A site below the runtime level, whose arguments aren't evaluated.
+ */
+static void BM_LogDisabled(benchmark::State& state) {
+    http::Log::setLevel(spdlog::level::warn);
+    const std::string path = "/images/status/200.jpg";
+    for (auto _ : state) {
+        HTTP_INFO("Handling GET request for path '{}'", path + "?query");
+    }
+    http::Log::setLevel(spdlog::level::HTTP_LOG_LEVEL);
+    state.SetItemsProcessed(state.iterations());
+}
+
+
+BENCHMARK(BM_LogCall)->Arg(0)->Arg(1)->Arg(2)->Threads(1)->Threads(4)->UseRealTime();
+BENCHMARK(BM_LogDeferred)->Threads(1)->Threads(4)->UseRealTime();
+BENCHMARK(BM_LogSampled);
+BENCHMARK(BM_LogDisabled);
@@ -0,0 +1,66 @@
+/**
+ * \file bench/metrics_bench.cpp
+ *
+ * Cost of recording a metric on the hot path: the per-thread sharded Counter
+ * and Histogram against a single shared atomic counter, whose cache line
+ * bounces between the cores, and the cost of a scrape.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <benchmark/benchmark.h>
+
+#include "metrics.h"
+
+
+namespace {
+
+const http::Counter s_counter("bench_counter_total", "Incremented by the benchmarks.");
+const http::Histogram s_histogram("bench_duration_seconds", "Recorded by the benchmarks.");
+
+/**
+ * \brief A counter shared by all the threads, as a baseline.
+ */
+alignas(64) std::atomic<std::int64_t> s_sharedCounter{0};
+
+} // namespace
+
+
+static void BM_CounterShared(benchmark::State& state) {
+    for (auto _ : state) {
+        s_sharedCounter.fetch_add(1, std::memory_order_relaxed);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+
+static void BM_CounterSharded(benchmark::State& state) {
+    for (auto _ : state) {
+        s_counter.inc();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+
+static void BM_HistogramRecord(benchmark::State& state) {
+    std::uint64_t value = 1000;
+    for (auto _ : state) {
+        s_histogram.record(value);
+        value = (value * 7 + 13) & 0xfffff;   // spread over the buckets
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+
+static void BM_Scrape(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(http::Metrics::scrape());
+    }
+}
+
+
+BENCHMARK(BM_CounterShared)->Threads(1)->Threads(4)->UseRealTime();
+BENCHMARK(BM_CounterSharded)->Threads(1)->Threads(4)->UseRealTime();
+BENCHMARK(BM_HistogramRecord)->Threads(1)->Threads(4)->UseRealTime();
+BENCHMARK(BM_Scrape);
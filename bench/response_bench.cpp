@@ -0,0 +1,62 @@
+/**
+ * \file bench/response_bench.cpp
+ *
+ * Cost of building the responses with HttpResponseBuilder, for the bodies of
+ * the typical sizes and for the streamed files, and of the MIME type lookup.
+ */
+
+#include <string>
+#include <vector>
+#include <fcntl.h>   // open
+#include <benchmark/benchmark.h>
+
+#include "response.h"
+#include "file.h"
+
+
+/**
+ * \brief A cached file of the given size, as served by serveStaticFile.
+ */
+static void BM_BuildResponse(benchmark::State& state) {
+    const std::vector<unsigned char> body(static_cast<std::size_t>(state.range(0)), 'x');
+    for (auto _ : state) {
+        http::HttpResponseBuilder builder;
+        builder.setStatusCode(http::HttpStatusCode::OK);
+        builder.setHeader("Content-Type", "text/html");
+        builder.setHeader("ETag", "\"5d8c72a5edda8d6a\"");
+        builder.setBody(body);
+        benchmark::DoNotOptimize(builder.build());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+
+/**
+ * \brief The head of a large file, whose body is streamed with sendfile.
+ */
+static void BM_BuildHead(benchmark::State& state) {
+    http::HttpResponseBuilder builder;
+    builder.setStatusCode(http::HttpStatusCode::OK);
+    builder.setHeader("Content-Type", "video/mp4");
+    builder.setBodyFile(http::FileDescriptor(open("/dev/null", O_RDONLY | O_CLOEXEC)), 512 * 1024 * 1024);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(builder.buildHead());
+    }
+}
+
+
+/**
+ * \brief The extensions of a typical page and its assets, and an unknown one.
+ */
+static void BM_MimeType(benchmark::State& state) {
+    const std::string extensions[] = {".html", ".css", ".js", ".png", ".jpg", ".svg", ".woff2", ".unknown"};
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(http::getMimeType(extensions[i++ & 7]));
+    }
+}
+
+
+BENCHMARK(BM_BuildResponse)->Arg(0)->Arg(2 * 1024)->Arg(64 * 1024)->Arg(1024 * 1024);
+BENCHMARK(BM_BuildHead);
+BENCHMARK(BM_MimeType);
@@ -0,0 +1,294 @@
+/**
+ * \file bench/thread_pool_bench.cpp
+ *
+ * Task throughput, idle CPU use and wake-up latency of the work-stealing 
+ * ThreadPool, compared with the previous implementation based on a single 
+ * ThreadsafeQueue and yield spinning, the cost of Task against std::function, 
+ * and the contention on the mutex ThreadsafeQueue against the lock-free queue.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <ctime>        // clock_gettime
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <thread>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+#include "thread_pool.hpp"
+
+
+namespace {
+
+/**
+ * \brief The thread pool before the work-stealing rewrite, as a baseline.
+ */
+class MutexQueuePool {
+public:
+    MutexQueuePool() : m_done(false), m_joiner(m_threads) {
+        std::size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+        for (std::size_t i = 0; i < threadCount; ++i) {
+            m_threads.push_back(std::thread(&MutexQueuePool::worker_thread, this));
+        }
+    }
+
+    ~MutexQueuePool() {
+        m_done = true;
+    }
+
+    template <typename FunctionType>
+    void submit(FunctionType f) {
+        m_workQueue.push(std::function<void()>(f));
+    }
+
+private:
+    void worker_thread() {
+        while (m_done == false) {
+            std::function<void()> task;
+            if (m_workQueue.try_pop(task)) {
+                task();
+            }
+            else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    std::atomic_bool m_done;
+    http::ThreadsafeQueue<std::function<void()>> m_workQueue;
+    std::vector<std::thread> m_threads;
+    http::JoinThreads m_joiner;
+};
+
+
+void waitFor(const std::atomic<std::size_t>& counter, std::size_t expected) {
+    while (counter.load(std::memory_order_acquire) < expected)
+        std::this_thread::yield();
+}
+
+double processCpuSeconds() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) * 1e-9;
+}
+
+/**
+ * \brief Construct a pool, with the given spin budget if it has one.
+ */
+template <typename Pool>
+std::unique_ptr<Pool> makePool(std::size_t spinBudget) {
+    if constexpr (std::is_constructible_v<Pool, std::size_t>)
+        return std::make_unique<Pool>(spinBudget);
+    else
+        return std::make_unique<Pool>();
+}
+
+/**
+ * \brief The push and pop of the queues, which have different interfaces.
+ */
+void queuePush(http::ThreadsafeQueue<std::size_t>& queue, std::size_t value) { queue.push(value); }
+bool queuePop(http::ThreadsafeQueue<std::size_t>& queue, std::size_t& value) { return queue.try_pop(value); }
+void queuePush(http::BoundedMpmcQueue<std::size_t>& queue, std::size_t value) {
+    while (!queue.tryPush(std::move(value)))
+        std::this_thread::yield();
+}
+bool queuePop(http::BoundedMpmcQueue<std::size_t>& queue, std::size_t& value) { return queue.tryPop(value); }
+
+template <typename Queue>
+std::unique_ptr<Queue> makeQueue() {
+    if constexpr (std::is_constructible_v<Queue, std::size_t>)
+        return std::make_unique<Queue>(THREAD_POOL_QUEUE_CAPACITY);
+    else
+        return std::make_unique<Queue>();
+}
+
+} // namespace
+
+
+/**
+ * \brief Tasks submitted from a thread outside the pool, like the accept loop.
+ */
+template <typename Pool>
+static void BM_PoolSubmitExternal(benchmark::State& state) {
+    Pool pool;
+    const std::size_t taskCount = static_cast<std::size_t>(state.range(0));
+    for (auto _ : state) {
+        std::atomic<std::size_t> done{0};
+        for (std::size_t i = 0; i < taskCount; ++i) {
+            pool.submit([&done] { done.fetch_add(1, std::memory_order_release); });
+        }
+        waitFor(done, taskCount);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+
+/**
+ * \brief Tasks submitting subtasks from the workers, which stay in the local deques.
+ */
+template <typename Pool>
+static void BM_PoolFanOut(benchmark::State& state) {
+    Pool pool;
+    const std::size_t fanOut = static_cast<std::size_t>(state.range(0));
+    for (auto _ : state) {
+        std::atomic<std::size_t> done{0};
+        for (std::size_t i = 0; i < fanOut; ++i) {
+            pool.submit([&pool, &done, fanOut] {
+                for (std::size_t j = 0; j < fanOut; ++j) {
+                    pool.submit([&done] { done.fetch_add(1, std::memory_order_release); });
+                }
+            });
+        }
+        waitFor(done, fanOut * fanOut);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0) * state.range(0));
+}
+
+
+/**
+ * \brief CPU used by an idle pool, in percent of one core.
+ */
+template <typename Pool>
+static void BM_PoolIdleCpu(benchmark::State& state) {
+    auto pool = makePool<Pool>(static_cast<std::size_t>(state.range(0)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));   // let the workers settle
+    double cpuSeconds = 0;
+    double wallSeconds = 0;
+    for (auto _ : state) {
+        double cpuStart = processCpuSeconds();
+        auto wallStart = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        cpuSeconds += processCpuSeconds() - cpuStart;
+        wallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    }
+    state.counters["idle_cpu_pct"] = 100.0 * cpuSeconds / wallSeconds;
+}
+
+
+/**
+ * \brief Time from the submit to the start of a task, after the pool was idle for a while.
+ */
+template <typename Pool>
+static void BM_PoolWakeLatency(benchmark::State& state) {
+    auto pool = makePool<Pool>(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::atomic<std::size_t> done{0};
+        std::chrono::steady_clock::time_point started;
+        auto submitted = std::chrono::steady_clock::now();
+        pool->submit([&done, &started] {
+            started = std::chrono::steady_clock::now();
+            done.store(1, std::memory_order_release);
+        });
+        waitFor(done, 1);
+        state.SetIterationTime(std::chrono::duration<double>(started - submitted).count());
+    }
+}
+
+
+/**
+ * \brief Wrap, move through a queue slot and run a callable with a given size of captures.
+ */
+template <typename TaskType, std::size_t CaptureSize>
+static void BM_TaskWrapInvoke(benchmark::State& state) {
+    struct Capture { unsigned char bytes[CaptureSize - sizeof(std::size_t*)]; };
+    std::size_t counter = 0;
+    Capture capture{};
+    for (auto _ : state) {
+        TaskType task([&counter, capture] { counter += capture.bytes[0] + 1; });
+        TaskType slot(std::move(task));
+        slot();
+    }
+    benchmark::DoNotOptimize(counter);
+}
+
+
+/**
+ * \brief Tasks submitted in one batch and waited for with a CompletionToken.
+ */
+static void BM_PoolSubmitBatch(benchmark::State& state) {
+    http::ThreadPool pool;
+    const std::size_t taskCount = static_cast<std::size_t>(state.range(0));
+    std::atomic<std::size_t> sum{0};
+    for (auto _ : state) {
+        std::vector<std::function<void()>> tasks(taskCount, [&sum] { sum.fetch_add(1, std::memory_order_relaxed); });
+        http::CompletionToken token;
+        pool.submitBatch(tasks.begin(), tasks.end(), &token);
+        token.wait();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+
+/**
+ * \brief Latency of a short task submitted behind a burst of long ones, with 
+ *        everything in the same class (0) or the long tasks as bulk (1).
+ */
+static void BM_PoolPriorityLatency(benchmark::State& state) {
+    http::ThreadPool pool;
+    const bool useClasses = state.range(0) != 0;
+    for (auto _ : state) {
+        // a burst of 20 us tasks
+        std::atomic<std::size_t> done{0};
+        for (int i = 0; i < 64; ++i) {
+            pool.submit([&done] {
+                auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(20);
+                while (std::chrono::steady_clock::now() < end) {}
+                done.fetch_add(1, std::memory_order_release);
+            }, useClasses ? http::TaskPriority::Bulk : http::TaskPriority::Normal);
+        }
+
+        // a short task behind them
+        std::atomic<std::size_t> probeDone{0};
+        std::chrono::steady_clock::time_point started;
+        auto submitted = std::chrono::steady_clock::now();
+        pool.submit([&probeDone, &started] {
+            started = std::chrono::steady_clock::now();
+            probeDone.store(1, std::memory_order_release);
+        }, useClasses ? http::TaskPriority::LatencyCritical : http::TaskPriority::Normal);
+        waitFor(probeDone, 1);
+        state.SetIterationTime(std::chrono::duration<double>(started - submitted).count());
+        waitFor(done, 64);
+    }
+}
+
+
+/**
+ * \brief Each thread pushes a value then pops one, on a queue shared by all the threads.
+ */
+template <typename Queue>
+static void BM_QueueContention(benchmark::State& state) {
+    // 
+    static std::unique_ptr<Queue> s_queue;
+    if (state.thread_index() == 0)
+        s_queue = makeQueue<Queue>();
+
+    // 
+    std::size_t value = 0;
+    for (auto _ : state) {
+        queuePush(*s_queue, value);
+        benchmark::DoNotOptimize(queuePop(*s_queue, value));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+
+BENCHMARK_TEMPLATE(BM_PoolSubmitExternal, MutexQueuePool)->Arg(1024)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_PoolSubmitExternal, http::ThreadPool)->Arg(1024)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_PoolFanOut, MutexQueuePool)->Arg(64)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_PoolFanOut, http::ThreadPool)->Arg(64)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_PoolIdleCpu, MutexQueuePool)->Arg(0)->Iterations(5)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_PoolIdleCpu, http::ThreadPool)->Arg(0)->Arg(2048)->Arg(1 << 20)->Iterations(5)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_PoolWakeLatency, MutexQueuePool)->Arg(0)->Iterations(200)->UseManualTime();
+BENCHMARK_TEMPLATE(BM_PoolWakeLatency, http::ThreadPool)->Arg(0)->Arg(2048)->Arg(1 << 20)->Iterations(200)->UseManualTime();
+BENCHMARK_TEMPLATE(BM_TaskWrapInvoke, std::function<void()>, 24);
+BENCHMARK_TEMPLATE(BM_TaskWrapInvoke, http::Task, 24);
+BENCHMARK_TEMPLATE(BM_TaskWrapInvoke, std::function<void()>, 48);
+BENCHMARK_TEMPLATE(BM_TaskWrapInvoke, http::Task, 48);
+BENCHMARK(BM_PoolSubmitBatch)->Arg(1024)->UseRealTime();
+BENCHMARK(BM_PoolPriorityLatency)->Arg(0)->Arg(1)->Iterations(200)->UseManualTime();
+BENCHMARK_TEMPLATE(BM_QueueContention, http::ThreadsafeQueue<std::size_t>)->Threads(1)->Threads(2)->Threads(4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_QueueContention, http::BoundedMpmcQueue<std::size_t>)->Threads(1)->Threads(2)->Threads(4)->UseRealTime();
@@ -0,0 +1,249 @@
+/**
+ * \file include/access_log.h
+ */
+
+#pragma once
+
+#ifndef ACCESS_LOG_H_
+#define ACCESS_LOG_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <netinet/in.h>   // sockaddr_in
+
+#include "cache.h"
+#include "profiling.h"
+#include "request_timing.h"
+
+
+#define ACCESS_LOG_MAGIC          "HTTPACC"      // 8 bytes with the terminating zero
+#define ACCESS_LOG_VERSION        2              // 1 had no stages, still read
+#define ACCESS_LOG_V1_RECORD_SIZE 40
+#define ACCESS_LOG_MAX_PATH       1024           // longer paths are truncated
+#define ACCESS_LOG_BUFFER_SIZE    (1024 * 1024)  // bytes of records buffered before append drops
+#define ACCESS_LOG_FLUSH_INTERVAL std::chrono::milliseconds(500)
+
+namespace http {
+
+
+/**
+ * \brief The methods stored in the access log, any other is Unknown.
+ */
+enum class AccessMethod : std::uint8_t {
+    Unknown, Get, Head, Post, Put, Delete, Options, Patch
+};
+
+
+/**
+ * \brief The header of an access log file.
+ */
+struct AccessLogFileHeader {
+    char          magic[8];     ///< ACCESS_LOG_MAGIC
+    std::uint32_t version;      ///< ACCESS_LOG_VERSION
+    std::uint32_t recordSize;   ///< sizeof(AccessLogRecord)
+};
+
+
+/**
+ * \brief A request in the access log, in the byte order of the host, followed
+ *        by the `pathLength` bytes of the path.
+ *
+ * The records of version 1 are the first ACCESS_LOG_V1_RECORD_SIZE bytes.
+ */
+struct AccessLogRecord {
+    std::int64_t  timeUs;          ///< Wall clock time of the accept, in microseconds since the epoch
+    std::uint64_t bytesSent;       ///< Size of the response, head and body, 0 if it couldn't be sent
+    std::uint32_t durationUs;      ///< From the accept to the last byte sent
+    std::uint32_t clientAddress;   ///< IPv4 address, in network byte order
+    std::uint16_t clientPort;
+    std::uint16_t status;
+    std::uint16_t pathLength;
+    std::uint8_t  method;          ///< AccessMethod
+    std::uint8_t  cacheStatus;     ///< CacheStatus
+    std::uint8_t  httpVersion;     ///< 10 for HTTP/1.0, 11 for HTTP/1.1, 0 if unknown
+    std::uint8_t  reserved[7];
+    std::uint32_t stageUs[static_cast<std::size_t>(RequestStage::Count)];   ///< By RequestStage, 0 if skipped
+    std::uint32_t reserved2;
+};
+static_assert(sizeof(AccessLogRecord) == 80, "the layout of AccessLogRecord is part of the file format");
+
+
+/**
+ * \brief A request to write to the access log.
+ */
+struct AccessLogEntry {
+    std::chrono::steady_clock::time_point acceptedAt;
+    sockaddr_in      client;
+    std::string_view method;
+    std::string_view path;
+    std::string_view version;
+    int              status;
+    std::uint64_t    bytesSent;
+    CacheStatus      cacheStatus;
+    const RequestTimings* timings;   ///< nullptr if the request wasn't read
+};
+
+
+/**
+ * \brief The options of the access log.
+ */
+struct AccessLogOptions {
+    std::string          path = "access.log";
+    std::uint64_t        maxFileSize = 64 * 1024 * 1024;   ///< Rotate before the file grows larger, 0 to disable.
+    std::chrono::seconds rotateInterval = std::chrono::hours(24);   ///< Rotate after writing to a file for this long, 0 to disable.
+};
+
+
+/**
+ * \brief A binary access log, with one fixed-layout record per request.
+ *
+ * Appending a request only copies its record into a buffer, a background
+ * thread writes the buffer every ACCESS_LOG_FLUSH_INTERVAL, or once half full,
+ * with one system call. If the writer falls behind and the buffer fills up,
+ * the records are dropped and counted in `access_log_dropped_total`. When a file would grow over the maximum size, or was
+ * written to for longer than the rotation interval, it's renamed with the
+ * rotation time (UTC) as suffix and a new one is started. The
+ * `http-server-access-log` tool converts the files to Common Log Format or JSON.
+ */
+class AccessLog {
+/* Constructor, Destructor and Operators */
+public:
+    /**
+     * \brief Open the access log, and start the writer thread.
+     *
+     * An existing file is appended to, or renamed aside if of another version.
+     *
+     * \param options: The path and the rotation of the files.
+     * \throws std::runtime_error if the file can't be opened.
+     */
+    explicit AccessLog(const AccessLogOptions& options);
+
+    /**
+     * \brief Destructor
+     *
+     * Writes the buffered records, then joins the writer thread.
+     */
+    ~AccessLog();
+
+    /**
+     * \brief Delete the copy constructor.
+     */
+    AccessLog(const AccessLog& other) = delete;
+
+    /**
+     * \brief Delete the copy assignment operator.
+     */
+    AccessLog& operator=(const AccessLog& other) = delete;
+
+/**/
+public:
+    /**
+     * \brief Append a request. Never blocks, the record is dropped if the buffer is full.
+     */
+    void append(const AccessLogEntry& entry);
+
+/**/
+private:
+    /**
+     * \brief Open the file at the path, and write the file header if it's new.
+     *
+     * \return false if the file can't be opened or has another format.
+     */
+    bool openFile();
+
+    /**
+     * \brief Close the file, if open.
+     */
+    void closeFile();
+
+    /**
+     * \brief Rename the current file with the current time, and open a new one.
+     */
+    void rotate();
+
+    /**
+     * \brief A free path to rename the file to, suffixed with the current time (UTC).
+     */
+    std::string rotatedPath() const;
+
+    /**
+     * \brief Write a buffer to the file, rotating it first if needed.
+     */
+    void writeRecords(const std::string& records);
+
+    /**
+     * \brief The function run by the writer thread.
+     */
+    void writer_thread();
+
+/**/
+private:
+    AccessLogOptions          m_options;
+    int                       m_fd;
+    std::uint64_t             m_fileSize;
+    std::chrono::system_clock::time_point m_fileOpenedAt;
+    bool                      m_done;
+    std::size_t               m_dropped;    ///< Records dropped since the last write
+    std::string               m_buffer;     ///< Records appended since the last write
+    std::string               m_writing;    ///< Records being written, only used by the writer thread
+    Mutex                     m_mutex{HTTP_MUTEX_NAME("access_log_queue")};
+    ConditionVariable         m_notEmpty;
+    std::thread               m_thread;
+};
+
+
+/**
+ * \brief Reads the records of an access log file.
+ */
+class AccessLogReader {
+public:
+    /**
+     * \brief Open a file and check its header, of the current version or 1.
+     *
+     * \throws std::runtime_error if the file can't be opened or isn't an access log.
+     */
+    explicit AccessLogReader(const std::string& path);
+
+    /**
+     * \brief Destructor
+     */
+    ~AccessLogReader();
+
+    AccessLogReader(const AccessLogReader& other) = delete;
+    AccessLogReader& operator=(const AccessLogReader& other) = delete;
+
+    /**
+     * \brief Read the next record.
+     *
+     * \param record: Set to the record.
+     * \param path: Set to the path of the record.
+     * \return false at the end of the file, or if the last record is truncated.
+     */
+    bool next(AccessLogRecord& record, std::string& path);
+
+private:
+    std::FILE*  m_file;
+    std::size_t m_recordSize;   ///< Of the version of the file
+};
+
+
+/**
+ * \brief The method of a request, as stored in the access log.
+ */
+AccessMethod toAccessMethod(std::string_view method);
+
+/**
+ * \brief The name of a method of the access log, "-" if unknown.
+ */
+const char* accessMethodName(AccessMethod method);
+
+
+} // namespace http::
+
+#endif // ACCESS_LOG_H_
@@ -0,0 +1,348 @@
+/**
+ * \file include/async_log.h
+ */
+
+#pragma once
+
+#ifndef ASYNC_LOG_H_
+#define ASYNC_LOG_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include <spdlog/details/null_mutex.h>
+#include <spdlog/sinks/base_sink.h>
+
+#include "profiling.h"
+
+
+#define LOG_RING_SIZE         (256 * 1024)   // bytes of pending messages per thread, a power of two
+#define LOG_MAX_MESSAGE_SIZE  (8 * 1024)     // longer messages, and string arguments, are truncated
+#define LOG_MAX_RECORD_SIZE   (LOG_RING_SIZE / 2)   // larger deferred messages are formatted by the calling thread
+#define LOG_DRAIN_INTERVAL_MS 50             // longest delay before a message is written
+
+namespace http {
+
+
+class LogRing;
+
+
+/**
+ * \brief How a message is stored in a ring.
+ */
+enum class LogRecordKind : std::uint8_t {
+    Text,       ///< The formatted text.
+    Deferred,   ///< A DeferredFormat, followed by the arguments in binary form.
+    Padding     ///< The end of the ring, skipped.
+};
+
+
+/**
+ * \brief Stores an argument of a deferred message in binary form, and reads it
+ *        back on the background thread.
+ *
+ * Only the arithmetic types and the strings can be deferred, the messages with
+ * other arguments are formatted by the calling thread.
+ */
+template <typename T, typename = void>
+struct LogArg {
+    static constexpr bool isDeferred = false;
+};
+
+template <typename T>
+struct LogArg<T, std::enable_if_t<std::is_arithmetic_v<T>>> {
+    static constexpr bool isDeferred = true;
+
+    static std::size_t size(const T&) { return sizeof(T); }
+
+    static unsigned char* encode(unsigned char* destination, const T& value) {
+        std::memcpy(destination, &value, sizeof(T));
+        return destination + sizeof(T);
+    }
+
+    static T decode(const unsigned char*& source) {
+        T value;
+        std::memcpy(&value, source, sizeof(T));
+        source += sizeof(T);
+        return value;
+    }
+};
+
+template <typename T>
+struct LogArg<T, std::enable_if_t<std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>
+                                  || std::is_same_v<T, const char*> || std::is_same_v<T, char*>>> {
+    static constexpr bool isDeferred = true;
+
+    static std::string_view view(const T& value) {
+        std::string_view str;
+        if constexpr (std::is_pointer_v<T>)
+            str = value != nullptr ? std::string_view(value) : std::string_view();
+        else
+            str = std::string_view(value);
+        return str.substr(0, LOG_MAX_MESSAGE_SIZE);
+    }
+
+    static std::size_t size(const T& value) { return sizeof(std::size_t) + view(value).size(); }
+
+    static unsigned char* encode(unsigned char* destination, const T& value) {
+        std::string_view str = view(value);
+        std::size_t length = str.size();
+        std::memcpy(destination, &length, sizeof(std::size_t));
+        std::memcpy(destination + sizeof(std::size_t), str.data(), length);
+        return destination + sizeof(std::size_t) + length;
+    }
+
+    static std::string_view decode(const unsigned char*& source) {
+        std::size_t length;
+        std::memcpy(&length, source, sizeof(std::size_t));
+        std::string_view str(reinterpret_cast<const char*>(source + sizeof(std::size_t)), length);
+        source += sizeof(std::size_t) + length;
+        return str;
+    }
+};
+
+
+/**
+ * \brief Starts the record of a deferred message, followed by its arguments.
+ */
+struct DeferredFormat {
+    /**
+     * \brief Format the arguments, on the background thread.
+     */
+    void (*format)(std::string_view format, const unsigned char* arguments, spdlog::memory_buf_t& out);
+    const char* formatData;   ///< The format string, a literal
+    std::size_t formatSize;
+};
+
+
+/**
+ * \brief What to do with a message when the ring of its thread is full.
+ */
+enum class LogOverflowPolicy {
+    Drop,    ///< Drop the messages below warn, and count them. Warnings and errors still block.
+    Block    ///< Wait for the background thread to make room.
+};
+
+
+/**
+ * \brief Receives the messages of a logger on the calling threads, and writes
+ *        them to the real sinks on a background thread.
+ *
+ * Each thread logs into its own lock-free single-producer ring, so logging a
+ * message is a copy into memory, without lock nor system call. The background
+ * thread drains all the rings every LOG_DRAIN_INTERVAL_MS, or as soon as a ring
+ * is half full or a warning is logged, merges the messages of the threads in
+ * time order, and flushes the sinks once per pass, so the messages reach the
+ * terminal and the file in batches.
+ *
+ * The real sinks are only used by the background thread, so they don't need
+ * the `_mt` variants.
+ */
+class AsyncLogSink : public spdlog::sinks::sink {
+/* Constructor, Destructor and Operators */
+public:
+    /**
+     * \brief Construct an AsyncLogSink and start its background thread.
+     *
+     * \param loggerName: The name of the logger, written with each message.
+     * \param sinks: The sinks the messages are written to.
+     * \param policy: What to do when the ring of a thread is full.
+     */
+    AsyncLogSink(const std::string& loggerName, std::vector<spdlog::sink_ptr> sinks, LogOverflowPolicy policy);
+
+    /**
+     * \brief Destructor
+     *
+     * Writes the pending messages, then joins the background thread.
+     */
+    ~AsyncLogSink() override;
+
+    /**
+     * \brief Delete the copy constructor.
+     */
+    AsyncLogSink(const AsyncLogSink& other) = delete;
+
+    /**
+     * \brief Delete the copy assignment operator.
+     */
+    AsyncLogSink& operator=(const AsyncLogSink& other) = delete;
+
+/**/
+public:
+    /**
+     * \brief Queue a message in the ring of the calling thread.
+     */
+    void log(const spdlog::details::log_msg& msg) override;
+
+    /**
+     * \brief Queue the arguments of a message in the ring of the calling thread,
+     *        to format it on the background thread.
+     *
+     * \param level: The level of the message.
+     * \param format: The format string, which must be a literal.
+     * \param args: The arguments, for which LogArg::isDeferred.
+     */
+    template <typename... Args>
+    void logDeferred(spdlog::level::level_enum level, std::string_view format, const Args&... args) {
+        //
+        using Context = std::tuple<DeferredFormat, const Args*...>;
+        Context context{DeferredFormat{&formatDeferred<Args...>, format.data(), format.size()}, &args...};
+        std::size_t size = sizeof(DeferredFormat) + (LogArg<Args>::size(args) + ... + 0);
+
+        // a record this large might never fit in the ring
+        if (size > LOG_MAX_RECORD_SIZE) {
+            spdlog::memory_buf_t out;
+            fmt::vformat_to(fmt::appender(out), fmt::string_view(format.data(), format.size()), fmt::make_format_args(args...));
+            pushText(level, spdlog::string_view_t(out.data(), out.size()));
+            return;
+        }
+
+        //
+        push(level, LogRecordKind::Deferred, size, [](unsigned char* destination, const void* data) {
+            const Context& context = *static_cast<const Context*>(data);
+            std::memcpy(destination, &std::get<0>(context), sizeof(DeferredFormat));
+            destination += sizeof(DeferredFormat);
+            std::apply([&destination](const DeferredFormat&, const Args*... args) {
+                ((destination = LogArg<Args>::encode(destination, *args)), ...);
+            }, context);
+        }, &context);
+    }
+
+    /**
+     * \brief Block until the messages logged before the call are written and flushed.
+     */
+    void flush() override;
+
+    /**
+     * \brief Set the pattern of all the real sinks.
+     */
+    void set_pattern(const std::string& pattern) override;
+
+    /**
+     * \brief Set the formatter of all the real sinks.
+     */
+    void set_formatter(std::unique_ptr<spdlog::formatter> sinkFormatter) override;
+
+    /**
+     * \brief Number of messages dropped because a ring was full.
+     */
+    std::size_t droppedCount() const;
+
+/**/
+private:
+    /**
+     * \brief Write the bytes of a record.
+     */
+    using RecordWriter = void (*)(unsigned char* destination, const void* data);
+
+    /**
+     * \brief Queue a record in the ring of the calling thread.
+     *
+     * \param size: The size of the record, without the header.
+     * \param writer: Called with the space of the record, and data.
+     */
+    void push(spdlog::level::level_enum level, LogRecordKind kind, std::size_t size, RecordWriter writer, const void* data);
+
+    /**
+     * \brief Queue a formatted message, truncated to LOG_MAX_MESSAGE_SIZE.
+     */
+    void pushText(spdlog::level::level_enum level, spdlog::string_view_t text);
+
+    /**
+     * \brief Decode the arguments of a deferred message, and format it.
+     */
+    template <typename... Args>
+    static void formatDeferred(std::string_view format, [[maybe_unused]] const unsigned char* arguments, spdlog::memory_buf_t& out) {
+        // the elements of a braced list are evaluated in order
+        std::tuple<decltype(LogArg<Args>::decode(arguments))...> values{LogArg<Args>::decode(arguments)...};
+        std::apply([format, &out](const auto&... values) {
+            fmt::vformat_to(fmt::appender(out), fmt::string_view(format.data(), format.size()), fmt::make_format_args(values...));
+        }, values);
+    }
+
+    /**
+     * \brief The ring of the calling thread, created on its first message.
+     *
+     * \param threadId: The id of the calling thread, written with its messages.
+     */
+    LogRing& localRing(std::size_t threadId);
+
+    /**
+     * \brief Wake the background thread, unless it's already woken.
+     */
+    void wake();
+
+    /**
+     * \brief Write the messages of all the rings to the sinks.
+     *
+     * \return Whether any message was written.
+     */
+    bool drainRings();
+
+    /**
+     * \brief The function run by the background thread.
+     */
+    void drain_thread();
+
+/**/
+private:
+    const std::uint64_t                   m_id;            ///< Tells the sinks apart in the thread-local rings
+    const std::string                     m_loggerName;
+    const LogOverflowPolicy               m_policy;
+    std::vector<spdlog::sink_ptr>         m_sinks;
+    Mutex                                 m_sinksMutex{HTTP_MUTEX_NAME("log_sinks")};    ///< Held by the background thread while writing
+    Mutex                                 m_ringsMutex{HTTP_MUTEX_NAME("log_rings")};
+    std::vector<std::shared_ptr<LogRing>> m_rings;
+    std::vector<spdlog::details::log_msg> m_batch;         ///< Messages of a pass, only used by the background thread
+    std::vector<std::pair<std::size_t, std::size_t>> m_formattedRanges;   ///< Offset and size of the text of each message in m_formatted
+    spdlog::memory_buf_t                  m_formatted;     ///< Text of the deferred messages of a pass
+    std::atomic<std::size_t>              m_dropped;
+    std::size_t                           m_reportedDropped;
+    std::atomic_bool                      m_wakePending;
+    bool                                  m_done;
+    std::uint64_t                         m_passStarted;
+    std::uint64_t                         m_passCompleted;
+    Mutex                                 m_mutex{HTTP_MUTEX_NAME("log_queue")};
+    ConditionVariable                     m_wakeCond;
+    ConditionVariable                     m_flushedCond;
+    std::thread                           m_thread;
+};
+
+
+/**
+ * \brief A console sink which buffers the formatted messages until it's flushed,
+ *        and writes them with one system call.
+ *
+ * Only meant to be used by the background thread of an AsyncLogSink, the color
+ * console sinks of spdlog flush each message.
+ */
+class BatchedConsoleSink : public spdlog::sinks::base_sink<spdlog::details::null_mutex> {
+public:
+    /**
+     * \brief Construct a BatchedConsoleSink writing to the standard output.
+     */
+    BatchedConsoleSink();
+
+protected:
+    void sink_it_(const spdlog::details::log_msg& msg) override;
+    void flush_() override;
+
+private:
+    bool                  m_useColors;
+    spdlog::memory_buf_t  m_buffer;
+};
+
+
+} // namespace http::
+
+#endif // ASYNC_LOG_H_
@@ -8,26 +8,78 @@
 #define CACHE_H_
 
 #include <string>
-#include <list>
+#include <string_view>
+#include <cstdint>
+#include <limits>
+#include <deque>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 #include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <exception>
+
+#include "profiling.h"
 
 
 namespace http {
 
+/**
+ * \brief The state of a cache entry.
+ */
+enum class CacheEntryState {
+    Fresh,       ///< The entry is younger than the expiry duration.
+    Stale,       ///< The entry has expired and waits for a refresh.
+    Refreshing,  ///< The entry is being revalidated or reloaded.
+};
+
+
+/**
+ * \brief How the response to a request was found in the cache.
+ */
+enum class CacheStatus : std::uint8_t {
+    None,   ///< The response doesn't come from the cache, like a streamed file.
+    Hit,
+    Miss
+};
+
+
 /**
  * \brief A Least-Recently-Used (LRU) cache.
  *
- * By default, the cache entries will expire 1 minute after creation or update 
- * if accessed by using `getOrDeleteExpired`
+ * By default, the cache entries will expire 1 minute after creation or update.
+ * If accessed by using `getOrDeleteExpired`, expired entries are deleted. If 
+ * accessed by using `getOrMarkStale`, expired entries keep being served while 
+ * they are refreshed in the background.
+ *
+ * The entries are stored in a contiguous slab allocated once for the whole 
+ * capacity, and linked into the LRU order by indices stored in the entries.
+ * They are looked up through an open addressing (linear probing) hash table 
+ * of entry indices and precomputed hashes, whose keys are the paths stored in 
+ * the entries, so each path is stored once and no node is allocated per entry.
  */
 class LRUCache {
 private:
+    using Index = std::uint32_t;
+    static constexpr Index s_npos = std::numeric_limits<Index>::max();
+
     struct CacheEntry {
         std::string path;
+        std::uint32_t hash;
+        Index prev;   ///< The more recently used entry, or s_npos for the head.
+        Index next;   ///< The less recently used entry, or s_npos for the tail.
         std::vector<unsigned char> body;
         std::chrono::time_point<std::chrono::system_clock> createAt;
+        std::filesystem::file_time_type lastWriteTime;
+        CacheEntryState state;
+    };
+
+    struct Slot {
+        std::uint32_t hash;
+        Index entry;   ///< s_npos for an empty slot.
     };
 
 private:
@@ -39,15 +91,17 @@ public:
      *
      * If the capacity is less than 1, it defaults to 10.
      */
-    explicit LRUCache(std::size_t capacity) : m_capacity(capacity > 0 ? capacity : 10) {}
+    explicit LRUCache(std::size_t capacity);
 
     /**
      * \brief Put file content in cache.
      *
      * \param path: The path of the file.
      * \param body: The content of the file.
+     * \param lastWriteTime: The modification time of the file when it was loaded.
      */
-    void put(const std::string& path, const std::vector<unsigned char>& body);
+    void put(std::string_view path, const std::vector<unsigned char>& body, 
+             std::filesystem::file_time_type lastWriteTime = {});
 
     /**
      * \brief Get the content of a file from the cache.
@@ -55,7 +109,7 @@ public:
      * \param path: The path of the file.
      * \return The content of the file, or an empty vector if not found.
      */
-    std::vector<unsigned char> get(const std::string& path);
+    std::vector<unsigned char> get(std::string_view path);
 
     /**
      * \brief Get the content of a file from the cache. If it's expired, delete it
@@ -67,13 +121,250 @@ public:
      * \param path: The path of the file.
      * \return The content of the file, or an empty vector if not found.
      */
-    std::vector<unsigned char> getOrDeleteExpired(const std::string& path);
+    std::vector<unsigned char> getOrDeleteExpired(std::string_view path);
+
+    /**
+     * \brief Get the content of a file from the cache. If it's expired, mark it stale.
+     *
+     * Expired entries are still returned. The first lookup that finds an entry 
+     * expired marks it stale and sets `needsRefresh`, the caller is then 
+     * responsible for scheduling a refresh of the entry.
+     *
+     * \param path: The path of the file.
+     * \param needsRefresh: Set to true if the entry has just been marked stale.
+     * \return The content of the file, or an empty vector if not found.
+     */
+    std::vector<unsigned char> getOrMarkStale(std::string_view path, bool& needsRefresh);
+
+    /**
+     * \brief Start refreshing a stale entry.
+     *
+     * \param path: The path of the file.
+     * \param lastWriteTime: Set to the modification time of the cached content.
+     * \return True if the entry was stale and is now refreshing, false otherwise.
+     */
+    bool beginRefresh(std::string_view path, std::filesystem::file_time_type& lastWriteTime);
+
+    /**
+     * \brief Mark a refreshing entry fresh again without changing its content.
+     *
+     * \param path: The path of the file.
+     */
+    void revalidate(std::string_view path);
+
+    /**
+     * \brief Replace the content of an entry and mark it fresh.
+     *
+     * Unlike `put`, nothing is inserted if the entry has been evicted meanwhile.
+     *
+     * \param path: The path of the file.
+     * \param body: The new content of the file.
+     * \param lastWriteTime: The modification time of the new content.
+     */
+    void update(std::string_view path, const std::vector<unsigned char>& body, 
+                std::filesystem::file_time_type lastWriteTime);
+
+    /**
+     * \brief Remove an entry from the cache.
+     *
+     * \param path: The path of the file.
+     */
+    void erase(std::string_view path);
+
+    /**
+     * \brief Whether a file is cached, fresh or not, without touching its entry.
+     */
+    bool contains(std::string_view path) const { return find(path) != s_npos; }
+
+    /**
+     * \brief Get the paths of all entries.
+     *
+     * \return The paths, from the most to the least recently used.
+     */
+    std::vector<std::string> keys() const;
+
+    /**
+     * \brief Get the maximum number of entries.
+     */
+    std::size_t capacity() const { return m_capacity; }
+
+    /**
+     * \brief Get the number of entries.
+     */
+    std::size_t size() const { return m_entries.size(); }
+
+
+private:
+    /**
+     * \brief Hash a path, truncated to the width stored in the table.
+     */
+    static std::uint32_t hashPath(std::string_view path);
+
+    /**
+     * \brief Find the table slot of a path.
+     *
+     * \return The slot holding the path, or the empty slot ending its probe sequence.
+     */
+    std::size_t findSlot(std::string_view path, std::uint32_t hash) const;
+
+    /**
+     * \brief Find the entry of a path.
+     *
+     * \return The index of the entry, or s_npos if not found.
+     */
+    Index find(std::string_view path) const;
+
+    /**
+     * \brief Empty a table slot, shifting back the following slots of the cluster.
+     */
+    void eraseSlot(std::size_t slot);
+
+    /**
+     * \brief Remove an entry from the table, the LRU list and the slab.
+     */
+    void removeEntry(Index entry);
+
+    /**
+     * \brief Unlink an entry from the LRU list.
+     */
+    void unlink(Index entry);
+
+    /**
+     * \brief Link an entry at the front (most recently used) of the LRU list.
+     */
+    void pushFront(Index entry);
+
+    /**
+     * \brief Move an entry to the front (most recently used) of the LRU list.
+     */
+    void moveToFront(Index entry);
+
+private:
+    std::size_t             m_capacity;
+    std::size_t             m_mask;      ///< The size of the table minus 1 (a power of 2).
+    std::vector<CacheEntry> m_entries;   ///< The slab of entries.
+    std::vector<Slot>       m_table;
+    Index                   m_head;      ///< The most recently used entry.
+    Index                   m_tail;      ///< The least recently used entry.
+};
+
+
+/**
+ * \brief A bounded cache of paths known to be missing.
+ *
+ * Entries expire after a short time-to-live, so a file that appears is served 
+ * after at most that long, or immediately if its path is invalidated. Unlike 
+ * LRUCache, it is guarded by its own mutex.
+ */
+class NegativeCache {
+public:
+    /**
+     * \brief Initialize NegativeCache with given capacity and time-to-live.
+     *
+     * If the capacity is less than 1, it defaults to 1024.
+     */
+    NegativeCache(std::size_t capacity, std::chrono::milliseconds ttl)
+        : m_capacity(capacity > 0 ? capacity : 1024), m_ttl(ttl) {}
+
+    /**
+     * \brief Check whether a path is known to be missing.
+     *
+     * \param path: The path to check.
+     * \return True if the path has been put and hasn't expired nor been invalidated.
+     */
+    bool contains(const std::string& path);
+
+    /**
+     * \brief Remember a missing path.
+     *
+     * When the cache is full, the oldest entries are removed: all the paths
+     * have the same time-to-live, so they expire in the order they are put.
+     *
+     * \param path: The missing path.
+     */
+    void put(const std::string& path);
 
+    /**
+     * \brief Forget a path, e.g. because the file has been created.
+     *
+     * \param path: The path to forget.
+     */
+    void invalidate(const std::string& path);
+
+    /**
+     * \brief Forget all paths.
+     */
+    void clear();
 
 private:
+    Mutex m_mtx{HTTP_MUTEX_NAME("negative_cache")};
     std::size_t m_capacity;
-    std::list<CacheEntry> m_list;
-    std::unordered_map<std::string, std::list<CacheEntry>::iterator> m_lookup;
+    std::chrono::milliseconds m_ttl;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> m_expireAt;
+    std::deque<std::pair<std::string, std::chrono::steady_clock::time_point>> m_order;   ///< In expiry order, may hold forgotten paths
+};
+
+
+/**
+ * \brief Coalesces concurrent loads of the same key into a single load.
+ *
+ * The first caller of `load` for a key becomes the leader and runs the loader,
+ * callers arriving while it is still running wait for and share its result.
+ * `join` and `complete` do the same without blocking: the waiters are called 
+ * back by whoever completes the load.
+ */
+class SingleFlight {
+public:
+    using Result = std::vector<unsigned char>;
+    using Loader = std::function<Result()>;
+    using Callback = std::function<void(const Result& result, std::exception_ptr error)>;
+
+public:
+    /**
+     * \brief Load the value of a key, or wait for the in-flight load of it.
+     *
+     * \param key: The key to load. (e.g. the path of a file)
+     * \param loader: The function to run if no load of the key is in flight.
+     * \return The loaded value.
+     * \throws Any exception thrown by the loader of the in-flight load.
+     */
+    Result load(const std::string& key, const Loader& loader);
+
+    /**
+     * \brief Wait for the load of a key without blocking, starting it if none is in flight.
+     *
+     * \param key: The key to load.
+     * \param callback: Called with the result, by the thread completing the load.
+     * \return True if the caller became the leader, and must `complete` the load.
+     */
+    bool join(const std::string& key, Callback callback);
+
+    /**
+     * \brief Hand the result of a load started by `join` to its waiters.
+     *
+     * \param key: The key loaded.
+     * \param result: The loaded value, ignored on error.
+     * \param error: The exception thrown by the load, or nullptr on success.
+     */
+    void complete(const std::string& key, const Result& result, std::exception_ptr error);
+
+private:
+    struct Flight {
+        std::promise<Result>       promise;
+        std::shared_future<Result> future;      ///< Waited for by `load`
+        std::vector<Callback>      callbacks;   ///< Registered by `join`
+    };
+
+    /**
+     * \brief Start the flight of a key, or find the one in flight.
+     *
+     * \return True if the flight was started.
+     */
+    bool startFlight(const std::string& key, Flight*& flight);
+
+private:
+    Mutex m_mtx{HTTP_MUTEX_NAME("single_flight")};
+    std::unordered_map<std::string, Flight> m_inFlight;
 };
 
 
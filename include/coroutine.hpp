@@ -0,0 +1,168 @@
+/**
+ * \file include/coroutine.hpp
+ */
+
+#pragma once
+
+#ifndef COROUTINE_HPP_
+#define COROUTINE_HPP_
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+
+namespace http {
+
+
+template <typename T>
+class CoTask;
+
+
+namespace detail {
+
+/**
+ * \brief The state shared by the promises of all CoTask: who awaits the task,
+ *        and what it threw.
+ */
+class CoTaskPromiseBase {
+public:
+    /**
+     * \brief Resume the awaiting coroutine, if any, without growing the stack.
+     */
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) const noexcept {
+            std::coroutine_handle<> continuation = handle.promise().m_continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+public:
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { m_error = std::current_exception(); }
+
+    void setContinuation(std::coroutine_handle<> continuation) noexcept { m_continuation = continuation; }
+
+protected:
+    void rethrowIfFailed() const {
+        if (m_error)
+            std::rethrow_exception(m_error);
+    }
+
+private:
+    std::coroutine_handle<> m_continuation;
+    std::exception_ptr      m_error;
+};
+
+
+template <typename T>
+class CoTaskPromise : public CoTaskPromiseBase {
+public:
+    CoTask<T> get_return_object() noexcept;
+
+    template <typename U>
+    void return_value(U&& value) { m_value.emplace(std::forward<U>(value)); }
+
+    T result() {
+        rethrowIfFailed();
+        return std::move(*m_value);
+    }
+
+private:
+    std::optional<T> m_value;
+};
+
+
+template <>
+class CoTaskPromise<void> : public CoTaskPromiseBase {
+public:
+    CoTask<void> get_return_object() noexcept;
+
+    void return_void() const noexcept {}
+
+    void result() const { rethrowIfFailed(); }
+};
+
+} // namespace detail
+
+
+/**
+ * \brief A lazy coroutine returning a T, which runs when awaited.
+ *
+ * Awaiting it starts it on the awaiting thread, and the awaiting coroutine is
+ * resumed, by symmetric transfer, when it returns; what it threw is rethrown
+ * by the `co_await`. The task owns its frame, so destroying a suspended chain
+ * of tasks destroys their locals, e.g. closes their sockets.
+ *
+ * The top-level tasks are started by `EventLoop::spawn`.
+ */
+template <typename T = void>
+class [[nodiscard]] CoTask {
+public:
+    using promise_type = detail::CoTaskPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+/* Constructor, Destructor and Operators */
+public:
+    explicit CoTask(Handle handle) noexcept : m_handle(handle) {}
+
+    ~CoTask() {
+        if (m_handle)
+            m_handle.destroy();
+    }
+
+    CoTask(CoTask&& other) noexcept : m_handle(std::exchange(other.m_handle, {})) {}
+
+    CoTask& operator=(CoTask&& other) noexcept {
+        if (this != &other) {
+            if (m_handle)
+                m_handle.destroy();
+            m_handle = std::exchange(other.m_handle, {});
+        }
+        return *this;
+    }
+
+    CoTask(const CoTask& other) = delete;
+    CoTask& operator=(const CoTask& other) = delete;
+
+/**/
+public:
+    bool await_ready() const noexcept { return !m_handle || m_handle.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        m_handle.promise().setContinuation(awaiting);
+        return m_handle;
+    }
+
+    T await_resume() { return m_handle.promise().result(); }
+
+private:
+    Handle m_handle;
+};
+
+
+namespace detail {
+
+template <typename T>
+CoTask<T> CoTaskPromise<T>::get_return_object() noexcept {
+    return CoTask<T>(std::coroutine_handle<CoTaskPromise<T>>::from_promise(*this));
+}
+
+inline CoTask<void> CoTaskPromise<void>::get_return_object() noexcept {
+    return CoTask<void>(std::coroutine_handle<CoTaskPromise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+
+} // namespace http::
+
+#endif // COROUTINE_HPP_
@@ -0,0 +1,145 @@
+/**
+ * \file include/disk_io.h
+ */
+
+#pragma once
+
+#ifndef DISK_IO_H_
+#define DISK_IO_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+
+#include "profiling.h"
+
+
+namespace http {
+
+/**
+ * \brief The error of a read which couldn't be queued without waiting.
+ */
+class DiskQueueFull : public std::runtime_error {
+public:
+    DiskQueueFull() : std::runtime_error("The queue of the disk threads is full") {}
+};
+
+
+/**
+ * \brief A bounded pool of threads dedicated to blocking disk reads.
+ *
+ * Keeps disk-bound work off the ThreadPool which serves the sockets, and bounds 
+ * both the number of concurrent reads and the number of queued ones. When the 
+ * queue is full, submitting blocks until a read completes, or fails for the 
+ * callers which must not block, like the event loops.
+ */
+class DiskIoPool {
+public:
+    /**
+     * \brief Called on a disk thread when a read completes.
+     *
+     * \param body: The content of the file, empty on error.
+     * \param error: The exception thrown by the read, or nullptr on success.
+     */
+    using Callback = std::function<void(std::vector<unsigned char> body, std::exception_ptr error)>;
+
+/* Constructor, Destructor and Operators */
+public:
+    /**
+     * \brief Construct a DiskIoPool and start its threads.
+     *
+     * \param threadCount: The number of disk threads, at least 1.
+     * \param maxQueued: The maximum number of queued reads, at least 1.
+     */
+    DiskIoPool(std::size_t threadCount, std::size_t maxQueued);
+
+    /**
+     * \brief Destructor
+     *
+     * Completes the queued reads, then joins the threads.
+     */
+    ~DiskIoPool() { shutdown(); }
+
+    /**
+     * \brief Delete the copy constructor.
+     */
+    DiskIoPool(const DiskIoPool& other) = delete;
+
+    /**
+     * \brief Delete the copy assignment operator.
+     */
+    DiskIoPool& operator=(const DiskIoPool& other) = delete;
+
+/**/
+public:
+    /**
+     * \brief Queue the read of a whole file.
+     *
+     * \param filepath: The path of the file.
+     * \param callback: Called with the content of the file, or the error.
+     */
+    void submitRead(const std::string& filepath, Callback callback);
+
+    /**
+     * \brief Queue the read of a whole file, unless the queue is full.
+     *
+     * \param filepath: The path of the file.
+     * \param callback: Called with the content of the file, or the error.
+     * \return false if the read wasn't queued, the callback is then never called.
+     */
+    bool trySubmitRead(const std::string& filepath, Callback callback);
+
+    /**
+     * \brief Read a whole file on a disk thread, and wait for it.
+     *
+     * Blocks the caller, the server only uses it on the rare misses which 
+     * aren't read ahead of the handler.
+     *
+     * \param filepath: The path of the file.
+     * \return The content of the file.
+     * \throws std::runtime_error if the file can't be opened or read.
+     */
+    std::vector<unsigned char> read(const std::string& filepath);
+
+    /**
+     * \brief Complete the queued reads, then join the threads, before the 
+     *        objects their callbacks use are destroyed.
+     *
+     * No read can be submitted afterwards.
+     */
+    void shutdown();
+
+/**/
+private:
+    /**
+     * \brief The function run by each disk thread.
+     */
+    void worker_thread();
+
+/**/
+private:
+    struct ReadRequest {
+        std::string filepath;
+        Callback callback;
+    };
+
+private:
+    std::size_t              m_maxQueued;
+    bool                     m_done;
+    Mutex                    m_mutex{HTTP_MUTEX_NAME("disk_io_queue")};
+    ConditionVariable        m_notEmpty;
+    ConditionVariable        m_notFull;
+    std::deque<ReadRequest>  m_queue;
+    std::vector<std::thread> m_threads;
+};
+
+
+} // namespace http::
+
+#endif // DISK_IO_H_
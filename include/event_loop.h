@@ -0,0 +1,362 @@
+/**
+ * \file include/event_loop.h
+ */
+
+#pragma once
+
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <sys/types.h>   // ssize_t
+
+#include "coroutine.hpp"
+#include "cache.h"
+#include "disk_io.h"
+#include "profiling.h"
+
+
+#define EVENT_LOOP_MAX_EVENTS 64   // events taken by each epoll_wait
+
+namespace http {
+
+
+/**
+ * \brief Runs coroutines on one thread, resuming them when their socket is
+ *        ready, their timer expires or their disk read completes.
+ *
+ * A coroutine awaiting one of the primitives below is suspended instead of
+ * blocking the thread, which serves the other coroutines meanwhile, so a few
+ * loops can hold many slow connections. The sockets are watched by epoll, one
+ * shot at a time; the timers are kept in deadline order, the nearest one being
+ * the timeout of epoll_wait; the disk reads run on a DiskIoPool, which posts
+ * the coroutine back to its loop through an eventfd.
+ *
+ * The loop isn't thread-safe except for `spawn`, `post` and `stop`: the
+ * coroutines of a loop only run on its thread.
+ */
+class EventLoop {
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimePoint = Clock::time_point;
+
+private:
+    struct Waiter;
+    using Timers = std::multimap<TimePoint, Waiter*>;
+
+    /**
+     * \brief A coroutine suspended until an fd is ready or a deadline passes.
+     */
+    struct Waiter {
+        std::coroutine_handle<> handle;
+        int                     fd = -1;   ///< -1 for a timer alone
+        bool                    timedOut = false;
+        bool                    hasTimer = false;
+        Timers::iterator        timer;
+    };
+
+    /**
+     * \brief A coroutine to resume on the loop, handed over by another thread.
+     */
+    struct Posted {
+        std::coroutine_handle<> handle;
+        bool                    spawned;    ///< Started by `spawn`, owned by the loop from now on
+        bool                    external;   ///< Completes an operation counted by m_externalOps
+    };
+
+    /**
+     * \brief The top-level coroutine of `spawn`, destroyed when it returns.
+     */
+    struct DetachedTask {
+        struct promise_type {
+            EventLoop* loop = nullptr;
+
+            ~promise_type();
+
+            DetachedTask get_return_object() noexcept {
+                return DetachedTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+            std::suspend_never final_suspend() const noexcept { return {}; }
+            void return_void() const noexcept {}
+            void unhandled_exception() const noexcept { std::terminate(); }
+        };
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+public:
+    /**
+     * \brief Resumes when an fd is ready for reading or writing.
+     *
+     * `co_await` returns false if the deadline passed first, or the fd can't
+     * be watched.
+     */
+    class IoAwaiter : private Waiter {
+    public:
+        IoAwaiter(EventLoop& loop, int fd, std::uint32_t events, TimePoint deadline)
+            : r_loop(loop), m_events(events), m_deadline(deadline), m_failed(false) { this->fd = fd; }
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> awaiting);
+        bool await_resume() const noexcept { return !m_failed && !timedOut; }
+
+    private:
+        EventLoop&    r_loop;
+        std::uint32_t m_events;
+        TimePoint     m_deadline;
+        bool          m_failed;
+    };
+
+    /**
+     * \brief Resumes once a duration has passed.
+     */
+    class SleepAwaiter : private Waiter {
+    public:
+        SleepAwaiter(EventLoop& loop, TimePoint deadline) : r_loop(loop), m_deadline(deadline) {}
+
+        bool await_ready() const noexcept { return m_deadline <= Clock::now(); }
+        void await_suspend(std::coroutine_handle<> awaiting);
+        void await_resume() const noexcept {}
+
+    private:
+        EventLoop& r_loop;
+        TimePoint  m_deadline;
+    };
+
+    /**
+     * \brief Resumes with the content of a file read on a disk thread.
+     *
+     * `co_await` rethrows the error of the read, DiskQueueFull without 
+     * suspending if the queue of the disk threads is full.
+     */
+    class ReadFileAwaiter {
+    public:
+        ReadFileAwaiter(EventLoop& loop, DiskIoPool& diskIo, const std::string& filepath)
+            : r_loop(loop), r_diskIo(diskIo), r_filepath(filepath) {}
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> awaiting);
+        std::vector<unsigned char> await_resume();
+
+    private:
+        EventLoop&                 r_loop;
+        DiskIoPool&                r_diskIo;
+        const std::string&         r_filepath;
+        std::vector<unsigned char> m_body;
+        std::exception_ptr         m_error;
+    };
+
+    /**
+     * \brief Resumes with the result of the load of a key, shared by its 
+     *        concurrent loads, from any loop or worker.
+     *
+     * The first to await a key starts the load with `start`, which must lead 
+     * to SingleFlight::complete on any thread, even on failure; the others 
+     * only wait for it. `co_await` rethrows the error of the load.
+     */
+    class FlightAwaiter {
+    public:
+        using Start = std::function<void()>;
+
+        FlightAwaiter(EventLoop& loop, SingleFlight& flights, const std::string& key, Start start)
+            : r_loop(loop), r_flights(flights), r_key(key), m_start(std::move(start)) {}
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> awaiting);
+        SingleFlight::Result await_resume();
+
+    private:
+        EventLoop&           r_loop;
+        SingleFlight&        r_flights;
+        const std::string&   r_key;
+        Start                m_start;
+        SingleFlight::Result m_result;
+        std::exception_ptr   m_error;
+    };
+
+/* Constructor, Destructor and Operators */
+public:
+    /**
+     * \brief Create the epoll instance and the eventfd of the posts.
+     *
+     * \throws std::runtime_error if either can't be created.
+     */
+    EventLoop();
+
+    /**
+     * \brief Destructor
+     *
+     * Destroys the coroutines still suspended, and those never started.
+     */
+    ~EventLoop();
+
+    EventLoop(const EventLoop& other) = delete;
+    EventLoop& operator=(const EventLoop& other) = delete;
+
+/**/
+public:
+    /**
+     * \brief Run the coroutines until `stop`, and their disk reads completed.
+     *
+     * The coroutines still waiting for a socket or a timer are then destroyed.
+     */
+    void run();
+
+    /**
+     * \brief Make `run` return, from any thread.
+     */
+    void stop();
+
+    /**
+     * \brief Start a coroutine on the loop, from any thread.
+     *
+     * The loop owns it from then on, what it throws is logged.
+     */
+    void spawn(CoTask<void> task);
+
+    /**
+     * \brief Resume a suspended coroutine of this loop on its thread, from any thread.
+     */
+    void post(std::coroutine_handle<> handle);
+
+    /**
+     * \brief The coroutines started by `spawn` and not returned yet, from any thread.
+     */
+    std::size_t taskCount() const { return m_taskCount.load(std::memory_order_relaxed); }
+
+    /**
+     * \brief The coroutines started by `spawn` and still waiting for the loop to run them, from any thread.
+     */
+    std::size_t queuedTasks() const { return m_queuedTasks.load(std::memory_order_relaxed); }
+
+/**/
+public:
+    IoAwaiter readable(int fd, TimePoint deadline = TimePoint::max()) {
+        return IoAwaiter(*this, fd, READABLE_EVENTS, deadline);
+    }
+
+    IoAwaiter writable(int fd, TimePoint deadline = TimePoint::max()) {
+        return IoAwaiter(*this, fd, WRITABLE_EVENTS, deadline);
+    }
+
+    SleepAwaiter sleepFor(Clock::duration duration) { return SleepAwaiter(*this, Clock::now() + duration); }
+
+    SleepAwaiter sleepUntil(TimePoint deadline) { return SleepAwaiter(*this, deadline); }
+
+    /**
+     * \brief Read a whole file on a disk thread, the loop never waits for room in its queue.
+     *
+     * \param filepath: The path of the file, which must outlive the `co_await`.
+     */
+    ReadFileAwaiter readFile(DiskIoPool& diskIo, const std::string& filepath) {
+        return ReadFileAwaiter(*this, diskIo, filepath);
+    }
+
+    /**
+     * \brief Join the load of a key, or start it, see FlightAwaiter.
+     *
+     * \param key: The key to load, which must outlive the `co_await`.
+     */
+    FlightAwaiter joinFlight(SingleFlight& flights, const std::string& key, FlightAwaiter::Start start) {
+        return FlightAwaiter(*this, flights, key, std::move(start));
+    }
+
+    /**
+     * \brief Receive what's available from a socket, waiting for it if nothing is.
+     *
+     * \return The number of bytes received, 0 at the end of the stream, or -1
+     *         on error. (errno is set, ETIMEDOUT if the deadline passed)
+     */
+    CoTask<ssize_t> recv(int sockfd, void* buffer, std::size_t size, TimePoint deadline = TimePoint::max());
+
+    /**
+     * \brief Send a whole buffer, waiting for the socket to drain when it's full.
+     *
+     * \param timeout: The longest wait for the socket to drain, like SO_SNDTIMEO, 
+     *                 so a large response isn't cut while the client reads it.
+     * \return True if everything was sent, false on error or if a wait timed 
+     *         out. (errno is set, ETIMEDOUT for a timeout)
+     */
+    CoTask<bool> sendAll(int sockfd, const void* data, std::size_t size, Clock::duration timeout = Clock::duration::max());
+
+    /**
+     * \brief Stream a file to a socket with `sendfile`, see http::sendFile.
+     *
+     * The socket must be non-blocking, or `sendfile` blocks the loop.
+     *
+     * \param timeout: The longest wait for the socket to drain, see `sendAll`.
+     * \return True if `size` bytes were sent, false on error, if a wait timed 
+     *         out or if the file was truncated.
+     */
+    CoTask<bool> sendFile(int sockfd, int fd, std::uintmax_t size, Clock::duration timeout = Clock::duration::max());
+
+/**/
+private:
+    static const std::uint32_t READABLE_EVENTS;
+    static const std::uint32_t WRITABLE_EVENTS;
+
+    /**
+     * \brief Watch the fd of a waiter for one event, and arm its timer.
+     *
+     * \return false if the fd can't be watched.
+     */
+    bool watch(Waiter& waiter, std::uint32_t events, TimePoint deadline);
+
+    void armTimer(Waiter& waiter, TimePoint deadline);
+
+    /**
+     * \brief The deadline of a wait starting now, none for Clock::duration::max().
+     */
+    static TimePoint deadlineAfter(Clock::duration timeout);
+
+    /**
+     * \brief Queue a coroutine for the loop thread, and wake it if it was idle.
+     */
+    void enqueue(const Posted& posted);
+
+    /**
+     * \brief Resume the posted coroutines, and start the spawned ones.
+     */
+    void runPosted();
+
+    /**
+     * \brief Resume the waiters whose deadline passed.
+     */
+    void expireTimers();
+
+    /**
+     * \brief The timeout of epoll_wait, until the nearest deadline.
+     */
+    int nextTimeoutMs() const;
+
+    static DetachedTask runDetached(CoTask<void> task);
+
+/**/
+private:
+    int                          m_epollfd;
+    int                          m_wakefd;          ///< eventfd, readable while posts are pending
+    std::atomic_bool             m_stopRequested;
+    Timers                       m_timers;
+    std::size_t                  m_externalOps;     ///< Disk reads and flights in flight, only used by the loop thread
+    std::unordered_set<void*>    m_tasks;           ///< Frames of the started spawned coroutines
+    std::atomic<std::size_t>     m_taskCount;
+    std::atomic<std::size_t>     m_queuedTasks;     ///< Spawned, not started yet
+    Mutex                        m_postedMutex{HTTP_MUTEX_NAME("event_loop_posted")};
+    std::vector<Posted>          m_posted;
+    std::vector<Posted>          m_running;         ///< The posts being resumed, only used by the loop thread
+};
+
+
+} // namespace http::
+
+#endif // EVENT_LOOP_H_
@@ -10,10 +10,15 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <filesystem>
 
 #define BASE_DIRECTORY    std::string("../files")
 #define DEFAULT_MIME_TYPE std::string("application/octet-stream")
 
+// Files larger than this are streamed from disk instead of being cached.
+#define STREAMING_THRESHOLD (1024 * 1024)
+
 namespace http {
 
 
@@ -22,13 +27,115 @@ namespace http {
  *
  * \param urlPath: The URL path to be mapped.
  * \return The corresponding filesystem path.
+ * \throws std::runtime_error if the URL path doesn't resolve to a regular file in BASE_DIRECTORY.
  */
 std::string mapUrlToFilePath(const std::string& urlPath);
 
+/**
+ * \brief Maps a URL path to a filesystem path, without throwing.
+ *
+ * The URL path must resolve to a regular file inside BASE_DIRECTORY, so paths 
+ * escaping it (e.g. "/../secret") are rejected as well as missing files.
+ *
+ * \param urlPath: The URL path to be mapped.
+ * \param filepath: Set to the corresponding canonical filesystem path on success.
+ * \return True on success, false if the path is missing or invalid.
+ */
+bool resolveUrlPath(const std::string& urlPath, std::string& filepath) noexcept;
+
+/**
+ * \brief Maps a canonical filesystem path back to a URL path.
+ *
+ * \param filepath: The canonical filesystem path, as returned by `resolveUrlPath`.
+ * \return The URL path, or an empty string if the file is not in BASE_DIRECTORY.
+ */
+std::string mapFilePathToUrl(const std::string& filepath);
+
+/**
+ * \brief Lists the regular files in BASE_DIRECTORY and its subdirectories.
+ *
+ * \return The URL paths of the files.
+ */
+std::vector<std::string> listBaseDirectory();
+
+/**
+ * \brief Reads a list of paths, one per line. Empty lines are skipped.
+ *
+ * \param listPath: The path of the list file.
+ * \return The paths, or an empty vector if the list file can't be opened.
+ */
+std::vector<std::string> readPathList(const std::string& listPath);
+
+/**
+ * \brief Writes a list of paths, one per line.
+ *
+ * The list is written to a temporary file which is then renamed, so an 
+ * interrupted write never leaves a truncated list behind.
+ *
+ * \param listPath: The path of the list file.
+ * \param paths: The paths to write.
+ * \throws std::runtime_error if the list file can't be written.
+ */
+void writePathList(const std::string& listPath, const std::vector<std::string>& paths);
+
+
+/**
+ * \brief An open file descriptor, closed when destroyed.
+ */
+class FileDescriptor {
+/* Constructor, Destructor and Operators */
+public:
+    explicit FileDescriptor(int fd = -1) : m_fd(fd) {}
+
+    ~FileDescriptor() { reset(); }
+
+    FileDescriptor(FileDescriptor&& other) noexcept : m_fd(other.m_fd) { other.m_fd = -1; }
+
+    FileDescriptor& operator=(FileDescriptor&& other) noexcept {
+        if (this != &other) {
+            reset(other.m_fd);
+            other.m_fd = -1;
+        }
+        return *this;
+    }
+
+    FileDescriptor(const FileDescriptor& other) = delete;
+    FileDescriptor& operator=(const FileDescriptor& other) = delete;
+
+/**/
+public:
+    int get() const { return m_fd; }
+
+    /**
+     * \brief Close the file, and own another one.
+     */
+    void reset(int fd = -1);
+
+private:
+    int m_fd;
+};
+
+/**
+ * \brief Opens a regular file, and gets the size and modification time of 
+ *        what was opened.
+ *
+ * The file may be replaced or modified after it was indexed, so what is sent 
+ * from the descriptor must be described by these, not by the index.
+ *
+ * \param filepath: The path of the file.
+ * \param size: Set to the size of the file.
+ * \param lastWriteTime: Set to the modification time of the file.
+ * \return The open file, without a descriptor if it can't be opened or isn't a regular file.
+ */
+FileDescriptor openFile(const std::string& filepath, std::uintmax_t& size, 
+                        std::filesystem::file_time_type& lastWriteTime);
 
 /**
  * \brief Loads the contents of a file into a vector of unsigned char.
  *
+ * The file is read with `pread` into a buffer presized to the file size, with 
+ * sequential access hints. This blocks, so it should run on a disk thread.
+ *
  * \param filepath: The path of the file to be loaded.
  * \return A vector of unsigned char containing the file's contents.
  * \throws std::runtime_error if the file can't be opened or read.
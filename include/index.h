@@ -0,0 +1,107 @@
+/**
+ * \file include/index.h
+ */
+
+#pragma once
+
+#ifndef INDEX_H_
+#define INDEX_H_
+
+#include <string>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <filesystem>
+#include <unordered_map>
+
+
+namespace http {
+
+/**
+ * \brief The metadata of a file served from BASE_DIRECTORY.
+ */
+struct FileInfo {
+    std::string filepath;   ///< The canonical filesystem path, also the cache key.
+    std::uintmax_t size;
+    std::filesystem::file_time_type lastWriteTime;
+    std::string mimeType;
+    std::string etag;
+};
+
+
+/**
+ * \brief Make a strong ETag from the size and the modification time of a file.
+ */
+std::string makeETag(std::uintmax_t size, std::filesystem::file_time_type lastWriteTime);
+
+
+/**
+ * \brief An immutable index of the files in BASE_DIRECTORY.
+ *
+ * Maps the URL path of every regular file to its metadata, so serving a file 
+ * takes a single hash lookup instead of resolving the path on the filesystem.
+ * Files whose canonical path escapes BASE_DIRECTORY (e.g. through a symbolic 
+ * link) are left out when the index is built.
+ */
+class FileIndex {
+public:
+    /**
+     * \brief Build an index by scanning BASE_DIRECTORY.
+     *
+     * \return The new index.
+     */
+    static std::shared_ptr<const FileIndex> build();
+
+    /**
+     * \brief Find the metadata of a file.
+     *
+     * \param urlPath: The URL path of the file.
+     * \return The metadata, or nullptr if the file isn't indexed.
+     */
+    const FileInfo* find(const std::string& urlPath) const;
+
+    /**
+     * \brief Get the number of indexed files.
+     */
+    std::size_t size() const { return m_files.size(); }
+
+    /**
+     * \brief Get the metadata of all the indexed files, by URL path.
+     */
+    const std::unordered_map<std::string, FileInfo>& files() const { return m_files; }
+
+private:
+    std::unordered_map<std::string, FileInfo> m_files;
+};
+
+
+/**
+ * \brief A FileIndex which can be replaced while being read by other threads.
+ *
+ * Readers keep using the index they loaded until they release it.
+ */
+class AtomicFileIndex {
+public:
+    /**
+     * \brief Initialize with an empty index.
+     */
+    AtomicFileIndex() : m_index(std::make_shared<const FileIndex>()) {}
+
+    /**
+     * \brief Get the current index.
+     */
+    std::shared_ptr<const FileIndex> load() const { return m_index.load(); }
+
+    /**
+     * \brief Replace the current index.
+     */
+    void store(std::shared_ptr<const FileIndex> index) { m_index.store(std::move(index)); }
+
+private:
+    std::atomic<std::shared_ptr<const FileIndex>> m_index;
+};
+
+
+} // namespace http::
+
+#endif // INDEX_H_
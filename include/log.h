@@ -7,10 +7,33 @@
 #ifndef LOG_H_
 #define LOG_H_
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <memory>
 #include <spdlog/spdlog.h>
 
-#define HTTP_LOG_LEVEL trace
+#include "async_log.h"
+
+#define HTTP_LOG_LEVEL trace   // initial runtime level, see Log::setLevel
+
+// the levels of spdlog, usable in #if
+#define HTTP_LOG_LEVEL_TRACE    0
+#define HTTP_LOG_LEVEL_DEBUG    1
+#define HTTP_LOG_LEVEL_INFO     2
+#define HTTP_LOG_LEVEL_WARN     3
+#define HTTP_LOG_LEVEL_ERROR    4
+#define HTTP_LOG_LEVEL_CRITICAL 5
+#define HTTP_LOG_LEVEL_OFF      6
+
+// the logging sites below this level are compiled out, can be set with -DHTTP_ACTIVE_LOG_LEVEL=...
+#ifndef HTTP_ACTIVE_LOG_LEVEL
+#ifdef NDEBUG
+#define HTTP_ACTIVE_LOG_LEVEL HTTP_LOG_LEVEL_WARN
+#else
+#define HTTP_ACTIVE_LOG_LEVEL HTTP_LOG_LEVEL_TRACE
+#endif
+#endif
 
 
 namespace http {
@@ -42,13 +65,17 @@ public:
      *
      * Setup the sinks, the patttern and the log level of the logger.
      * This function should use at the start of the application.
+     * The messages are written by a background thread, see AsyncLogSink.
+     *
+     * \param policy: What to do with the messages of a thread which logs faster
+     *                than they're written.
      */
-    static void init();
+    static void init(LogOverflowPolicy policy = LogOverflowPolicy::Drop);
 
     /**
      * \brief Shutdown the logger.
      *
-     * This method should use at the end of the application.
+     * Writes the pending messages. This method should use at the end of the application.
      */
     static void shutdown();
 
@@ -59,29 +86,128 @@ public:
      */
     static std::shared_ptr<spdlog::logger>& getLogger() { return s_logger; }
 
+    /**
+     * \brief Set the runtime level, the messages below are ignored.
+     *
+     * The sites below HTTP_ACTIVE_LOG_LEVEL are compiled out whatever the level.
+     */
+    static void setLevel(spdlog::level::level_enum level);
+
+    /**
+     * \brief Whether a message of a level is logged, checked by the macros
+     *        before their arguments are evaluated.
+     */
+    static bool shouldLog(spdlog::level::level_enum level) {
+        return level >= s_level.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief Log a message, used by the macros.
+     *
+     * When all the arguments are numbers or strings, they're copied in binary
+     * form and the message is formatted by the background thread of the logger,
+     * else it's formatted by the calling thread.
+     *
+     * \param format: The format string, which must be a literal.
+     */
+    template <typename... Args>
+    static void write(spdlog::level::level_enum level, spdlog::format_string_t<Args...> format, Args&&... args) {
+        if (s_asyncSink == nullptr)
+            return;
+        if constexpr ((LogArg<std::decay_t<Args>>::isDeferred && ...)) {
+            fmt::string_view view = format;
+            s_asyncSink->logDeferred(level, std::string_view(view.data(), view.size()), static_cast<std::decay_t<Args>>(args)...);
+        }
+        else {
+            s_logger->log(level, format, std::forward<Args>(args)...);
+        }
+    }
+
 /**/
 private:
     static std::shared_ptr<spdlog::logger> s_logger;
+    static std::shared_ptr<AsyncLogSink>   s_asyncSink;
+    static inline std::atomic<int>         s_level{spdlog::level::HTTP_LOG_LEVEL};
 };
 
 
-#ifndef NDEBUG
-#define HTTP_TRACE(...)  ::http::Log::getLogger()->trace(__VA_ARGS__)
-#define HTTP_DEBUG(...)  ::http::Log::getLogger()->debug(__VA_ARGS__)
-#define HTTP_INFO(...)   ::http::Log::getLogger()->info(__VA_ARGS__)
-#define HTTP_WARN(...)   ::http::Log::getLogger()->warn(__VA_ARGS__)
-#define HTTP_ERROR(...)  ::http::Log::getLogger()->error(__VA_ARGS__)
-#define HTTP_FATAL(...)  ::http::Log::getLogger()->fatal(__VA_ARGS__)
+/**
+ * \brief The state of a sampled or rate-limited logging site.
+ *
+ * Used through HTTP_EVERY_N and HTTP_PER_SECOND, which keep one per call site,
+ * to keep a message on the hot path from flooding the log.
+ */
+class LogSite {
+public:
+    LogSite() : m_count(0), m_second(0), m_secondCount(0) {}
 
-#else
-#define HTTP_TRACE(...)  (void)0
-#define HTTP_DEBUG(...)  (void)0
-#define HTTP_INFO(...)   (void)0
-#define HTTP_WARN(...)   (void)0
-#define HTTP_ERROR(...)  (void)0
-#define HTTP_FATAL(...)  (void)0
-
-#endif // NDEBUG
+    /**
+     * \brief Whether to log this time, for the 1st, the (n+1)th, ... calls.
+     */
+    bool every(std::uint64_t n) {
+        return m_count.fetch_add(1, std::memory_order_relaxed) % n == 0;
+    }
+
+    /**
+     * \brief Whether to log this time, for the first n calls of each second.
+     */
+    bool perSecond(std::uint32_t n) {
+        //
+        std::int64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+                                  std::chrono::steady_clock::now().time_since_epoch()).count();
+        std::int64_t last = m_second.load(std::memory_order_relaxed);
+        if (second != last && m_second.compare_exchange_strong(last, second, std::memory_order_relaxed))
+            m_secondCount.store(0, std::memory_order_relaxed);
+        return m_secondCount.fetch_add(1, std::memory_order_relaxed) < n;
+    }
+
+private:
+    std::atomic<std::uint64_t> m_count;
+    std::atomic<std::int64_t>  m_second;
+    std::atomic<std::uint32_t> m_secondCount;
+};
+
+
+// log a message if its level is above HTTP_ACTIVE_LOG_LEVEL at compile time, and
+// the level of Log at runtime, the arguments are only evaluated if it's logged
+#define HTTP_LOG(level, ...) \
+    do { \
+        if constexpr (static_cast<int>(level) >= HTTP_ACTIVE_LOG_LEVEL) { \
+            if (::http::Log::shouldLog(level)) \
+                ::http::Log::write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define HTTP_TRACE(...)  HTTP_LOG(::spdlog::level::trace, __VA_ARGS__)
+#define HTTP_DEBUG(...)  HTTP_LOG(::spdlog::level::debug, __VA_ARGS__)
+#define HTTP_INFO(...)   HTTP_LOG(::spdlog::level::info, __VA_ARGS__)
+#define HTTP_WARN(...)   HTTP_LOG(::spdlog::level::warn, __VA_ARGS__)
+#define HTTP_ERROR(...)  HTTP_LOG(::spdlog::level::err, __VA_ARGS__)
+#define HTTP_FATAL(...)  HTTP_LOG(::spdlog::level::critical, __VA_ARGS__)
+
+// the levels of the macros, for the sampled sites
+#define HTTP_LEVEL_OF_HTTP_TRACE ::spdlog::level::trace
+#define HTTP_LEVEL_OF_HTTP_DEBUG ::spdlog::level::debug
+#define HTTP_LEVEL_OF_HTTP_INFO  ::spdlog::level::info
+#define HTTP_LEVEL_OF_HTTP_WARN  ::spdlog::level::warn
+#define HTTP_LEVEL_OF_HTTP_ERROR ::spdlog::level::err
+#define HTTP_LEVEL_OF_HTTP_FATAL ::spdlog::level::critical
+
+// log if the site of a sampled message is picked, which is only checked for the logged levels
+#define HTTP_LOG_SAMPLED_(level, pick, ...) \
+    do { \
+        if constexpr (static_cast<int>(level) >= HTTP_ACTIVE_LOG_LEVEL) { \
+            static ::http::LogSite httpLogSite_; \
+            if (::http::Log::shouldLog(level) && httpLogSite_.pick) \
+                ::http::Log::write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+// log with LOG_MACRO only one call in n, e.g. HTTP_EVERY_N(100, HTTP_INFO, "Parsed {}", x)
+#define HTTP_EVERY_N(n, LOG_MACRO, ...) HTTP_LOG_SAMPLED_(HTTP_LEVEL_OF_##LOG_MACRO, every(n), __VA_ARGS__)
+
+// log with LOG_MACRO at most n times per second
+#define HTTP_PER_SECOND(n, LOG_MACRO, ...) HTTP_LOG_SAMPLED_(HTTP_LEVEL_OF_##LOG_MACRO, perSecond(n), __VA_ARGS__)
 
 
 } // namespace http::
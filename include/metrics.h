@@ -0,0 +1,317 @@
+/**
+ * \file include/metrics.h
+ */
+
+#pragma once
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+
+#define METRICS_MAX_SERIES       256   // counters and gauges
+#define METRICS_MAX_HISTOGRAMS   32
+#define METRICS_SUB_BUCKET_BITS  3     // 8 buckets per power of two, at most 12.5% of error
+#define METRICS_MAX_VALUE_BITS   40    // larger values are counted in the last bucket, ~18 min in ns
+
+namespace http {
+
+
+/**
+ * \brief The buckets of a histogram, log-linear like HdrHistogram.
+ *
+ * The values below 2 * 2^METRICS_SUB_BUCKET_BITS have a bucket each, every
+ * larger power of two is split into 2^METRICS_SUB_BUCKET_BITS buckets. A value
+ * v is counted in the bucket of v - 1, so that each power of two is the upper
+ * bound, inclusive, of a bucket.
+ */
+struct HistogramBuckets {
+    static constexpr std::size_t SUB_BUCKETS = std::size_t(1) << METRICS_SUB_BUCKET_BITS;
+    static constexpr std::size_t COUNT = 2 * SUB_BUCKETS + (METRICS_MAX_VALUE_BITS - METRICS_SUB_BUCKET_BITS - 1) * SUB_BUCKETS;
+
+    /**
+     * \brief The bucket of a value.
+     */
+    static std::size_t indexOf(std::uint64_t value) {
+        std::uint64_t v = value > 0 ? value - 1 : 0;
+        if (v < 2 * SUB_BUCKETS)
+            return static_cast<std::size_t>(v);
+        unsigned magnitude = 63u - static_cast<unsigned>(__builtin_clzll(v));   // >= METRICS_SUB_BUCKET_BITS + 1
+        std::size_t shift = magnitude - METRICS_SUB_BUCKET_BITS;
+        std::size_t index = 2 * SUB_BUCKETS + (magnitude - METRICS_SUB_BUCKET_BITS - 1) * SUB_BUCKETS
+                          + ((v >> shift) & (SUB_BUCKETS - 1));
+        return index < COUNT ? index : COUNT - 1;
+    }
+
+    /**
+     * \brief The largest value of a bucket.
+     */
+    static std::uint64_t upperBound(std::size_t index) {
+        if (index < 2 * SUB_BUCKETS)
+            return index + 1;
+        std::size_t magnitude = (index - 2 * SUB_BUCKETS) / SUB_BUCKETS + METRICS_SUB_BUCKET_BITS + 1;
+        std::size_t subBucket = (index - 2 * SUB_BUCKETS) % SUB_BUCKETS;
+        std::size_t shift = magnitude - METRICS_SUB_BUCKET_BITS;
+        return ((SUB_BUCKETS + subBucket + 1) << shift);
+    }
+};
+
+
+/**
+ * \brief The cells of a histogram in a shard, only written by its thread.
+ */
+struct HistogramCells {
+    std::atomic<std::uint64_t> buckets[HistogramBuckets::COUNT];
+    std::atomic<std::uint64_t> sum;
+};
+
+
+/**
+ * \brief The metrics recorded by one thread.
+ *
+ * Each cell is only written by the thread owning the shard, with a plain load
+ * and store, and read by the scrapes, so recording a metric never writes a
+ * cache line shared with another thread. The shard is merged into the totals
+ * when its thread exits.
+ */
+struct alignas(64) MetricsShard {
+    std::atomic<std::int64_t>    values[METRICS_MAX_SERIES];
+    std::atomic<HistogramCells*> histograms[METRICS_MAX_HISTOGRAMS];   ///< Allocated on the first record
+};
+
+
+/**
+ * \brief The merged buckets of a histogram.
+ */
+struct HistogramSnapshot {
+    std::vector<std::uint64_t> buckets;   ///< HistogramBuckets::COUNT counts
+    std::uint64_t count = 0;
+    std::uint64_t sum = 0;
+
+    /**
+     * \brief The upper bound of the bucket of a quantile, 0 if empty.
+     *
+     * \param q: The quantile, between 0 and 1.
+     */
+    std::uint64_t quantile(double q) const;
+};
+
+
+/**
+ * \brief The registry of the metrics, and the shards of the threads.
+ *
+ * The metrics are registered once, by name and labels, usually into static
+ * handles, then recorded from any thread without lock.
+ */
+class Metrics {
+public:
+    /**
+     * \brief The kind of a series, as named in the Prometheus text format.
+     */
+    enum class Type { Counter, Gauge, Histogram };
+
+    /**
+     * \brief The shard of the calling thread, created on its first record.
+     *
+     * The records of a thread after its shard was merged, by the destructors
+     * of the thread-local variables, are discarded.
+     */
+    static MetricsShard& localShard() {
+        MetricsShard* shard = s_localShard;
+        return shard != nullptr ? *shard : createLocalShard();
+    }
+
+    /**
+     * \brief Register a series, or get the one with the same name and labels.
+     *
+     * \param type: Counter, Gauge or Histogram.
+     * \param name: The name of the family, e.g. `http_requests_total`.
+     * \param help: The description of the family.
+     * \param labels: The labels of the series, e.g. `code="2xx"`, or empty.
+     * \return The id of the series, among the series or the histograms.
+     * \throws std::runtime_error if there is no room for another series, or the
+     *         name is registered with another type.
+     */
+    static std::size_t registerSeries(Type type, const std::string& name, const std::string& help,
+                                      const std::string& labels);
+
+    /**
+     * \brief Register a gauge read by a function on each scrape.
+     *
+     * \return The id to unregister the function with.
+     */
+    static std::size_t registerFunction(const std::string& name, const std::string& help, const std::string& labels,
+                                        std::function<double()> read);
+
+    /**
+     * \brief Stop calling a function registered by registerFunction.
+     */
+    static void unregisterFunction(std::size_t id);
+
+    /**
+     * \brief The sum of a counter or gauge over all the threads.
+     */
+    static std::int64_t value(std::size_t id);
+
+    /**
+     * \brief The merged buckets of a histogram over all the threads.
+     */
+    static HistogramSnapshot snapshot(std::size_t id);
+
+    /**
+     * \brief All the series, in the Prometheus text format (version 0.0.4).
+     *
+     * The histograms are exported in seconds, with a bucket per power of two
+     * nanoseconds.
+     */
+    static std::string scrape();
+
+private:
+    /**
+     * \brief Create the shard of the calling thread, merged into the totals
+     *        when the thread exits.
+     */
+    static MetricsShard& createLocalShard();
+
+    /**
+     * \brief Merges the shard of a thread into the totals when it exits.
+     */
+    struct ShardOwner;
+
+    static inline thread_local MetricsShard* s_localShard = nullptr;
+};
+
+
+/**
+ * \brief A monotonic counter.
+ */
+class Counter {
+public:
+    Counter(const std::string& name, const std::string& help, const std::string& labels = "")
+        : m_id(Metrics::registerSeries(Metrics::Type::Counter, name, help, labels)) {}
+
+    void inc(std::int64_t n = 1) const {
+        std::atomic<std::int64_t>& cell = Metrics::localShard().values[m_id];
+        cell.store(cell.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::int64_t value() const { return Metrics::value(m_id); }
+
+private:
+    std::size_t m_id;
+};
+
+
+/**
+ * \brief A gauge moved up and down by any thread, the sum of the moves.
+ */
+class Gauge {
+public:
+    Gauge(const std::string& name, const std::string& help, const std::string& labels = "")
+        : m_id(Metrics::registerSeries(Metrics::Type::Gauge, name, help, labels)) {}
+
+    void add(std::int64_t n) const {
+        std::atomic<std::int64_t>& cell = Metrics::localShard().values[m_id];
+        cell.store(cell.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void sub(std::int64_t n) const { add(-n); }
+
+    std::int64_t value() const { return Metrics::value(m_id); }
+
+private:
+    std::size_t m_id;
+};
+
+
+/**
+ * \brief A distribution of durations, in nanoseconds.
+ */
+class Histogram {
+public:
+    Histogram(const std::string& name, const std::string& help, const std::string& labels = "")
+        : m_id(Metrics::registerSeries(Metrics::Type::Histogram, name, help, labels)) {}
+
+    void record(std::uint64_t nanoseconds) const {
+        MetricsShard& shard = Metrics::localShard();
+        HistogramCells* cells = shard.histograms[m_id].load(std::memory_order_relaxed);
+        if (cells == nullptr)
+            cells = allocateCells(shard);
+        std::atomic<std::uint64_t>& bucket = cells->buckets[HistogramBuckets::indexOf(nanoseconds)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        cells->sum.store(cells->sum.load(std::memory_order_relaxed) + nanoseconds, std::memory_order_relaxed);
+    }
+
+    template <typename Rep, typename Period>
+    void record(std::chrono::duration<Rep, Period> duration) const {
+        auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        record(static_cast<std::uint64_t>(nanoseconds > 0 ? nanoseconds : 0));
+    }
+
+    HistogramSnapshot snapshot() const { return Metrics::snapshot(m_id); }
+
+private:
+    HistogramCells* allocateCells(MetricsShard& shard) const;
+
+    std::size_t m_id;
+};
+
+
+/**
+ * \brief A gauge read by a function on each scrape, until destroyed.
+ *
+ * For the values already maintained elsewhere, like the size of a queue,
+ * which then cost nothing between the scrapes.
+ */
+class GaugeFunction {
+/* Constructor, Destructor and Operators */
+public:
+    GaugeFunction() : m_id(s_npos) {}
+
+    GaugeFunction(const std::string& name, const std::string& help, const std::string& labels,
+                  std::function<double()> read)
+        : m_id(Metrics::registerFunction(name, help, labels, std::move(read))) {}
+
+    ~GaugeFunction() { reset(); }
+
+    GaugeFunction(GaugeFunction&& other) noexcept : m_id(other.m_id) { other.m_id = s_npos; }
+
+    GaugeFunction& operator=(GaugeFunction&& other) noexcept {
+        if (this != &other) {
+            reset();
+            m_id = other.m_id;
+            other.m_id = s_npos;
+        }
+        return *this;
+    }
+
+    GaugeFunction(const GaugeFunction& other) = delete;
+    GaugeFunction& operator=(const GaugeFunction& other) = delete;
+
+/**/
+public:
+    /**
+     * \brief Stop calling the function.
+     */
+    void reset() {
+        if (m_id != s_npos)
+            Metrics::unregisterFunction(m_id);
+        m_id = s_npos;
+    }
+
+private:
+    static constexpr std::size_t s_npos = static_cast<std::size_t>(-1);
+    std::size_t m_id;
+};
+
+
+} // namespace http::
+
+#endif // METRICS_H_
@@ -0,0 +1,167 @@
+/**
+ * \file include/multipart.h
+ */
+
+#pragma once
+
+#ifndef MULTIPART_H_
+#define MULTIPART_H_
+
+#include <string>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <array>
+#include <cstddef>
+
+
+namespace http {
+
+
+/**
+ * \brief The headers of a part of a multipart/form-data body.
+ */
+struct MultipartPart {
+    std::unordered_map<std::string, std::string> headers;   ///< Header names are lowercase.
+    std::string name;          ///< The `name` of the Content-Disposition.
+    std::string filename;      ///< The `filename` of the Content-Disposition, empty for fields.
+    std::string contentType;   ///< The Content-Type of the part, "text/plain" if absent.
+};
+
+
+/**
+ * \brief Receives the body of one part, as it's parsed.
+ */
+class MultipartSink {
+public:
+    virtual ~MultipartSink() = default;
+
+    /**
+     * \brief Write the next bytes of the part body.
+     *
+     * \return false to abort the parsing.
+     */
+    virtual bool write(const char* data, std::size_t size) = 0;
+
+    /**
+     * \brief Called after the last byte of the part body.
+     *
+     * \return false to abort the parsing.
+     */
+    virtual bool finish() = 0;
+};
+
+
+/**
+ * \brief An incremental parser of multipart/form-data bodies (RFC 7578).
+ *
+ * The body is fed in chunks of any size, the delimiters are searched with
+ * Boyer-Moore-Horspool and may straddle two chunks. Only the bytes which may
+ * start a delimiter and the headers of the current part are kept, so the
+ * memory use doesn't depend on the size of the parts.
+ */
+class MultipartParser {
+public:
+    /**
+     * \brief Called with the headers of each part.
+     *
+     * \return The sink of the part body, or nullptr to discard it.
+     */
+    using SinkFactory = std::function<std::unique_ptr<MultipartSink>(const MultipartPart& part)>;
+
+/* Constructor, Destructor and Operators */
+public:
+    /**
+     * \brief Construct a MultipartParser.
+     *
+     * \param boundary: The boundary parameter of the Content-Type.
+     * \param sinkFactory: Creates the sink of each part.
+     */
+    MultipartParser(const std::string& boundary, SinkFactory sinkFactory);
+
+/**/
+public:
+    /**
+     * \brief Parse the next chunk of the body.
+     *
+     * \return false if the body is malformed or a sink failed, the parser must
+     *         not be fed anymore.
+     */
+    bool feed(const char* data, std::size_t size);
+
+    /**
+     * \brief Whether the close delimiter was parsed.
+     */
+    bool isDone() const;
+
+    /**
+     * \brief Extract the boundary of a multipart/form-data Content-Type.
+     *
+     * \param contentType: The value of the Content-Type header.
+     * \param boundary: Set to the boundary, without quotes.
+     * \return false if it's not multipart/form-data or the boundary is missing or invalid.
+     */
+    static bool parseBoundary(const std::string& contentType, std::string& boundary);
+
+/**/
+private:
+    enum class State {
+        Body,             ///< In a part body, or in the preamble before the first part.
+        AfterDelimiter,   ///< After a delimiter, waiting for "--" or CRLF.
+        Headers,          ///< In the headers of a part.
+        Done,             ///< After the close delimiter, the epilogue is ignored.
+        Error
+    };
+
+    /**
+     * \brief Find the delimiter in [begin, end) with Boyer-Moore-Horspool.
+     *
+     * \return The position of the delimiter, or end.
+     */
+    const char* findDelimiter(const char* begin, const char* end) const;
+
+    /**
+     * \brief Consume bytes of a part body, up to and including the next delimiter.
+     *
+     * \return The number of bytes consumed, or -1 on error.
+     */
+    std::ptrdiff_t parseBody(const char* data, std::size_t size);
+
+    /**
+     * \brief Consume bytes of the headers of a part, up to and including the empty line.
+     *
+     * \return The number of bytes consumed, or -1 on error.
+     */
+    std::ptrdiff_t parseHeaders(const char* data, std::size_t size);
+
+    /**
+     * \brief Parse the buffered headers and create the sink of the part.
+     */
+    bool beginPart();
+
+    /**
+     * \brief Finish the current part, if any.
+     */
+    bool endPart();
+
+    /**
+     * \brief Pass body bytes to the sink of the current part, if any.
+     */
+    bool emit(const char* data, std::size_t size);
+
+/**/
+private:
+    State                          m_state;
+    std::string                    m_delimiter;     ///< CRLF "--" boundary
+    std::array<std::size_t, 256>   m_skip;          ///< Horspool bad character shifts
+    std::string                    m_pending;       ///< Possible start of a delimiter at the end of the last chunk
+    std::string                    m_headers;
+    bool                           m_inPart;
+    SinkFactory                    m_sinkFactory;
+    std::unique_ptr<MultipartSink> m_sink;
+};
+
+
+} // namespace http::
+
+#endif // MULTIPART_H_
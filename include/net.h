@@ -8,10 +8,15 @@
 #define NET_H_
 
 #define DEFAULT_BACKLOG 10
+#define SEND_FILE_CHUNK_SIZE (256 * 1024)
 
 
 #include <sys/socket.h>   // socket
+#include <netinet/in.h>   // sockaddr_in
 #include <unistd.h>       // close
+#include <cstddef>        // std::size_t
+#include <cstdint>        // std::uintmax_t
+#include <string>
 
 
 namespace http {
@@ -143,10 +148,18 @@ public:
     /**
      * \brief Accepts an incoming client connection.
      *
-     * \return client fd
+     * \param clientAddr: Set to the address of the client, if not null.
+     * \return client fd, or -1 if interrupted by a signal or the socket has been shut down.
      * \throw std::runtime_error if the accept if the accept failed.
      */
-    int acceptConnection();
+    int acceptConnection(sockaddr_in* clientAddr = nullptr);
+
+    /**
+     * \brief Get the fd of the server socket.
+     *
+     * \return sockfd
+     */
+    int get() const;
 
 private:
     int        m_port;
@@ -154,6 +167,34 @@ private:
 };
 
 
+
+/**
+ * \brief Sends a whole buffer, retrying on partial sends.
+ *
+ * \param sockfd: The socket to send to.
+ * \param data: The data to send.
+ * \param size: The size of the data.
+ * \return True if everything was sent, false on error. (errno is set)
+ */
+bool sendAll(int sockfd, const void* data, std::size_t size);
+
+/**
+ * \brief Streams a file to a socket in fixed-size chunks.
+ *
+ * Uses `sendfile`, so the content isn't copied to user space, and asks the 
+ * kernel to read ahead the next chunk while the current one is sent. Falls 
+ * back to `pread` into a buffer of SEND_FILE_CHUNK_SIZE bytes if the file 
+ * can't be used with `sendfile`. Either way, memory use doesn't depend on 
+ * the size of the file.
+ *
+ * \param sockfd: The socket to send to.
+ * \param fd: The open file, left open.
+ * \param size: The number of bytes to send from the start of the file.
+ * \return True if `size` bytes were sent, false on error or if the file was truncated.
+ */
+bool sendFile(int sockfd, int fd, std::uintmax_t size);
+
+
 } // namespace http::
 
 #endif // NET_H_
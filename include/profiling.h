@@ -0,0 +1,129 @@
+/**
+ * \file include/profiling.h
+ */
+
+#pragma once
+
+#ifndef PROFILING_H_
+#define PROFILING_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "metrics.h"
+
+#define PROFILING_SITE_SAMPLE   64     // one allocation in 64 is attributed to its call site
+#define PROFILING_SITE_FRAMES   4      // callers kept per site, from the caller of operator new
+#define PROFILING_MAX_SITES     4096   // a power of 2
+#define PROFILING_REPORT_SITES  30
+#define PROFILING_SYMBOL_WIDTH  80     // characters of the demangled names in the report
+
+namespace http {
+
+
+/**
+ * \brief Allocations made through the global operator new.
+ */
+struct AllocationCounts {
+    std::uint64_t calls = 0;
+    std::uint64_t bytes = 0;
+
+    AllocationCounts& operator+=(const AllocationCounts& other) {
+        calls += other.calls;
+        bytes += other.bytes;
+        return *this;
+    }
+
+    AllocationCounts operator-(const AllocationCounts& other) const {
+        return AllocationCounts{calls - other.calls, bytes - other.bytes};
+    }
+};
+
+
+/**
+ * \brief The allocations of the calling thread since it started, always
+ *        zero without HTTP_PROFILING.
+ */
+AllocationCounts threadAllocations();
+
+
+/**
+ * \brief Count the allocations of a served request, for the averages of the report.
+ */
+void recordRequestAllocations(const AllocationCounts& counts);
+
+
+/**
+ * \brief A std::mutex which counts its acquisitions, and records how long
+ *        the contended ones waited.
+ *
+ * An uncontended lock costs a try_lock and a sharded counter increment, a
+ * contended one two clock reads more. The metrics are labelled with the name
+ * of the mutex, shared by the mutexes of the same name:
+ * `mutex_acquisitions_total`, `mutex_contended_total` and `mutex_wait_seconds`.
+ */
+class ProfiledMutex {
+/* Constructor, Destructor and Operators */
+public:
+    explicit ProfiledMutex(const char* name = "unnamed");
+
+    ProfiledMutex(const ProfiledMutex& other) = delete;
+    ProfiledMutex& operator=(const ProfiledMutex& other) = delete;
+
+/**/
+public:
+    void lock() {
+        if (!m_mutex.try_lock())
+            lockContended();
+        m_acquisitions.inc();
+    }
+
+    bool try_lock() {
+        if (!m_mutex.try_lock())
+            return false;
+        m_acquisitions.inc();
+        return true;
+    }
+
+    void unlock() { m_mutex.unlock(); }
+
+private:
+    void lockContended();
+
+private:
+    std::mutex m_mutex;
+    Counter    m_acquisitions;
+    Counter    m_contended;
+    Histogram  m_wait;
+};
+
+
+// the mutexes worth profiling, and their condition variables, plain unless
+// built with HTTP_SERVER_PROFILING; HTTP_MUTEX_NAME names them only then
+#ifdef HTTP_PROFILING
+using Mutex = ProfiledMutex;
+using ConditionVariable = std::condition_variable_any;
+#define HTTP_MUTEX_NAME(name) name
+#else
+using Mutex = std::mutex;
+using ConditionVariable = std::condition_variable;
+#define HTTP_MUTEX_NAME(name)
+#endif
+
+
+/**
+ * \brief The allocations, by request and by call site, and the contention of
+ *        the profiled mutexes, as text.
+ *
+ * The call sites are symbolized with dladdr, the executables export their
+ * symbols in the profiling build; the others are printed as module+offset for
+ * addr2line.
+ */
+std::string profilingReport();
+
+
+} // namespace http::
+
+#endif // PROFILING_H_
@@ -0,0 +1,116 @@
+/**
+ * \file include/refresher.h
+ */
+
+#pragma once
+
+#ifndef REFRESHER_H_
+#define REFRESHER_H_
+
+#include <string>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+#include "cache.h"
+#include "index.h"
+#include "thread_pool.hpp"
+
+
+namespace http {
+
+/**
+ * \brief Refreshes stale cache entries and the file index in the background.
+ *
+ * Stale entries are queued by `schedule` and processed by a dedicated, low 
+ * priority worker thread, which re-stats each file and only reloads it if it 
+ * has been modified since it was cached. Meanwhile, requests keep being served 
+ * the stale content, so they never wait for a disk read of a cached file.
+ *
+ * The same thread rebuilds the file index when a change of BASE_DIRECTORY is 
+ * noticed, either by a refresh or by `scheduleIndexRebuild`.
+ */
+class CacheRefresher {
+/* Constructor, Destructor and Operators */
+public:
+    /**
+     * \brief Construct a CacheRefresher and start its worker thread.
+     *
+     * \param cache: The cache whose entries are refreshed.
+     * \param cacheMtx: The mutex guarding `cache`.
+     * \param fileIndex: The file index to rebuild on changes.
+     * \param missing: The missing paths to forget when the index is rebuilt.
+     */
+    CacheRefresher(LRUCache& cache, Mutex& cacheMtx, AtomicFileIndex& fileIndex, NegativeCache& missing);
+
+    /**
+     * \brief Destructor
+     *
+     * Stop the worker thread, pending refreshes are dropped.
+     */
+    ~CacheRefresher();
+
+    /**
+     * \brief Delete the copy constructor.
+     */
+    CacheRefresher(const CacheRefresher& other) = delete;
+
+    /**
+     * \brief Delete the copy assignment operator.
+     */
+    CacheRefresher& operator=(const CacheRefresher& other) = delete;
+
+/**/
+public:
+    /**
+     * \brief Queue a stale cache entry for refresh.
+     *
+     * \param filepath: The path of the stale file.
+     */
+    void schedule(const std::string& filepath);
+
+    /**
+     * \brief Request a rebuild of the file index.
+     *
+     * Requests made before the rebuild starts are coalesced into one rebuild.
+     */
+    void scheduleIndexRebuild();
+
+/**/
+private:
+    /**
+     * \brief The function run by the worker thread.
+     *
+     * Lowers the priority of the thread, then processes the refresh queue 
+     * until the refresher is destroyed.
+     */
+    void worker_thread();
+
+    /**
+     * \brief Revalidate, reload or drop a stale cache entry.
+     *
+     * \param filepath: The path of the stale file.
+     */
+    void refresh(const std::string& filepath);
+
+    /**
+     * \brief Rebuild the file index and forget the missing paths.
+     */
+    void rebuildIndex();
+
+/**/
+private:
+    LRUCache&                    r_cache;
+    Mutex&                       r_cacheMtx;
+    AtomicFileIndex&             r_fileIndex;
+    NegativeCache&               r_missing;
+    std::atomic_bool             m_done;
+    std::atomic_bool             m_rebuildPending;
+    ThreadsafeQueue<std::string> m_queue;
+    std::thread                  m_thread;
+};
+
+
+} // namespace http::
+
+#endif // REFRESHER_H_
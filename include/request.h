@@ -10,24 +10,60 @@
 #include <string>
 #include <unordered_map>
 #include <mutex>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>   // ssize_t
 
+#include "coroutine.hpp"
 #include "response.h"
 #include "cache.h"
+#include "refresher.h"
+#include "index.h"
+#include "disk_io.h"
+#include "multipart.h"
+#include "request_timing.h"
 
 
+#define MAX_UPLOAD_SIZE (1024ull * 1024 * 1024)   // default limit of an upload body, 1 GiB
+
 namespace http {
 
 
+class EventLoop;
+
+
 /**
  */
 struct HttpRequest {
     /**
-     * \brief Parses the raw HTTP request string.
+     * \brief Parses the request line and the headers of a raw HTTP request string.
+     *
+     * Parsing stops at the empty line ending the headers, the body is read 
+     * separately through a BodyReader.
      *
      * \param request: The raw request string.
      */
     void parse(const std::string& request);
 
+    /**
+     * \brief Finds a header, ignoring the case of its name.
+     *
+     * \param name: The header name.
+     * \return The header value, or nullptr if the header is absent.
+     */
+    const std::string* findHeader(const std::string& name) const;
+
+    /**
+     * \brief Gets the length of the body, from the Content-Length header.
+     *
+     * Chunked bodies aren't supported, so a Transfer-Encoding can't be framed.
+     *
+     * \param length: Set to the length of the body, 0 without Content-Length.
+     * \return false if the request has a Transfer-Encoding or an invalid Content-Length.
+     */
+    bool contentLength(std::size_t& length) const;
+
     std::string method;
     std::string path;
     std::string version;
@@ -36,16 +72,208 @@ struct HttpRequest {
 };
 
 
+/**
+ * \brief Reads the body of a request, from the bytes read along with the head 
+ *        and then from the client socket.
+ *
+ * The body is never held in memory as a whole: it's either streamed to a file 
+ * descriptor, or read up to a given size.
+ */
+class BodyReader {
+public:
+    /**
+     * \brief Construct a BodyReader.
+     *
+     * \param sockfd: The client socket, or -1 if `buffered` is the whole body.
+     * \param buffered: The bytes read past the end of the head.
+     */
+    BodyReader(int sockfd, std::string buffered)
+        : m_sockfd(sockfd), m_buffered(std::move(buffered)), m_bufferedPos(0), m_remaining(0) {}
+
+    /**
+     * \brief Set the length of the body, from the Content-Length header.
+     */
+    void setContentLength(std::size_t contentLength) { m_remaining = contentLength; }
+
+    /**
+     * \brief Get the number of bytes of the body not read yet.
+     */
+    std::size_t remaining() const { return m_remaining; }
+
+    /**
+     * \brief Read the rest of the body, up to a maximum size.
+     *
+     * \param maxSize: The maximum number of bytes to read.
+     * \return The bytes read, possibly less than `maxSize` if the client stopped sending.
+     */
+    std::string read(std::size_t maxSize);
+
+    /**
+     * \brief Read the next part of the body into a buffer.
+     *
+     * \param buffer: The buffer to read into.
+     * \param size: The size of the buffer.
+     * \return The number of bytes read, 0 at the end of the body, or -1 on error.
+     */
+    ssize_t readSome(char* buffer, std::size_t size);
+
+    /**
+     * \brief Write the rest of the body to a file descriptor.
+     *
+     * \param fd: The file descriptor to write to.
+     * \param useSplice: Move the bytes from the socket with `splice`, through 
+     *                   a pipe, instead of copying them through user space.
+     * \return True if the whole body was written, false on error or if the 
+     *         client stopped sending.
+     */
+    bool writeTo(int fd, bool useSplice);
+
+private:
+    int         m_sockfd;
+    std::string m_buffered;
+    std::size_t m_bufferedPos;
+    std::size_t m_remaining;
+};
+
+
+/**
+ * \brief How uploaded files are flushed to stable storage before being renamed.
+ */
+enum class UploadFsyncPolicy {
+    None,   ///< Leave it to the kernel.
+    Data,   ///< `fdatasync` the file.
+    Full,   ///< `fsync` the file, and the upload directory after the rename.
+};
+
+
+/**
+ * \brief The options of the upload endpoint.
+ */
+struct UploadOptions {
+    std::string directory = "uploads";
+    UploadFsyncPolicy fsyncPolicy = UploadFsyncPolicy::None;
+    bool useSplice = true;   ///< Move the body from the socket to the file with `splice`.
+    std::uint64_t maxSize = MAX_UPLOAD_SIZE;   ///< Larger bodies are refused with 413, before any space is reserved.
+};
+
+
+/**
+ * \brief An uploaded file, written to a hidden temporary file of the upload 
+ *        directory and renamed to a unique name once complete.
+ *
+ * The temporary file is removed if the upload isn't committed.
+ */
+class UploadFile {
+/* Constructor, Destructor and Operators */
+public:
+    /**
+     * \brief Create the temporary file.
+     *
+     * \param uploadOptions: The directory and fsync policy of uploads.
+     * \throws std::runtime_error if the file can't be created.
+     */
+    explicit UploadFile(const UploadOptions& uploadOptions);
+
+    /**
+     * \brief Destructor
+     *
+     * Closes the file, and removes it unless it was committed.
+     */
+    ~UploadFile();
+
+    /**
+     * \brief Delete the copy constructor.
+     */
+    UploadFile(const UploadFile& other) = delete;
+
+    /**
+     * \brief Delete the copy assignment operator.
+     */
+    UploadFile& operator=(const UploadFile& other) = delete;
+
+/**/
+public:
+    /**
+     * \brief The file descriptor of the temporary file, until `finish`.
+     */
+    int fd() const { return m_fd; }
+
+    /**
+     * \brief Reserve the blocks of the file. Only running out of space is an error.
+     */
+    void preallocate(std::size_t size);
+
+    /**
+     * \brief Append to the file.
+     */
+    void write(const char* data, std::size_t size);
+
+    /**
+     * \brief Flush the file as set by the fsync policy, and close it.
+     */
+    void finish();
+
+    /**
+     * \brief Rename the file to a unique name.
+     *
+     * \return The path of the saved file.
+     */
+    const std::string& commit();
+
+    /**
+     * \brief The path of the saved file, empty until `commit`.
+     */
+    const std::string& filename() const;
+
+/**/
+private:
+    const UploadOptions& r_uploadOptions;
+    int                  m_fd;
+    bool                 m_committed;
+    std::string          m_tmpFilename;
+    std::string          m_filename;
+};
+
+
+/**
+ * \brief Writes the body of a multipart part to an UploadFile.
+ */
+class UploadFileSink : public MultipartSink {
+public:
+    explicit UploadFileSink(UploadFile& file) : r_file(file) {}
+
+    bool write(const char* data, std::size_t size) override;
+    bool finish() override;
+
+private:
+    UploadFile& r_file;
+};
+
+
 /**
  */
 class HttpRequestHandler {
 /* Constructor, Destructor and Operators */
 public:
     /**
-     * \brief Default constructor
+     * \brief Constructor
+     *
+     * \param cache: The cache of file contents shared by all handlers.
+     * \param cacheMtx: The mutex guarding `cache`.
+     * \param inFlight: The in-flight loads of cache misses shared by all handlers.
+     * \param refresher: The background refresher of stale cache entries.
+     * \param missing: The URL paths known to be missing, shared by all handlers.
+     * \param fileIndex: The file index used for the whole request.
+     * \param diskIo: The disk threads which load the cache misses.
+     * \param uploadOptions: The options of the upload endpoint.
+     * \param timings: Receives the waits for the cache mutex and the loads of the request, or nullptr.
      */
-    HttpRequestHandler(LRUCache& cache, std::mutex& cacheMtx)
-        : r_cache(cache), r_cacheMtx(cacheMtx) {}
+    HttpRequestHandler(LRUCache& cache, Mutex& cacheMtx, SingleFlight& inFlight, CacheRefresher& refresher, 
+                       NegativeCache& missing, std::shared_ptr<const FileIndex> fileIndex, DiskIoPool& diskIo, 
+                       const UploadOptions& uploadOptions, RequestTimings* timings = nullptr)
+        : r_cache(cache), r_cacheMtx(cacheMtx), r_inFlight(inFlight), r_refresher(refresher), r_missing(missing), 
+          m_fileIndex(std::move(fileIndex)), r_diskIo(diskIo), r_uploadOptions(uploadOptions), 
+          m_cacheStatus(CacheStatus::None), m_timings(timings) {}
 
     /**
      * \brief Default destructor
@@ -60,10 +288,48 @@ public:
      * Parses the provided raw HTTP request string, process it, and generate 
      * HTTP response.
      *
-     * \param request: The raw HTTP request string.
-     * \return A string containing the generated HTTP response.
+     * \param head: The raw HTTP request string, up to the end of the headers.
+     * \param body: The reader of the request body.
+     * \return The builder of the generated HTTP response. Its body may be a 
+     *         file to be streamed after the head, see `HttpResponseBuilder::hasBodyFile`.
+     */
+    HttpResponseBuilder handleRequest(const std::string& head, BodyReader& body);
+
+    /**
+     * \brief Handles an HTTP request whose head was already parsed.
+     *
+     * \param httpRequest: The parsed request line and headers.
+     * \param body: The reader of the request body.
+     * \return The builder of the generated HTTP response.
      */
-    std::string handleRequest(const std::string& request);
+    HttpResponseBuilder handleRequest(HttpRequest& httpRequest, BodyReader& body);
+
+    /**
+     * \brief Handles a complete HTTP request held in memory.
+     *
+     * \param request: The raw HTTP request string, including the body.
+     * \return The builder of the generated HTTP response.
+     */
+    HttpResponseBuilder handleRequest(const std::string& request);
+
+    /**
+     * \brief Handles a request without a body, suspended instead of blocked 
+     *        while its file is read from disk.
+     *
+     * For the GET requests served by the coroutines of an event loop; those 
+     * with a body are handled by `handleRequest`, reading it blocks.
+     *
+     * \param httpRequest: The parsed request line and headers, with an empty method if the head was invalid.
+     * \param loop: The event loop running the coroutine.
+     * \return The builder of the generated HTTP response.
+     */
+    CoTask<HttpResponseBuilder> handleRequestAsync(HttpRequest& httpRequest, EventLoop& loop);
+
+    /**
+     * \brief Whether the body of the last response was found in the cache, 
+     *        None if it wasn't a cacheable file.
+     */
+    CacheStatus cacheStatus() const { return m_cacheStatus; }
 
 /**/
 private:
@@ -85,9 +351,10 @@ private:
      * response using the provided HttpResponse object.
      *
      * \param httpRequest: The HTTP request containing the uploaded file data.
+     * \param body: The reader of the request body.
      * \param responseBuilder: The HttpResponse object to build the response.
      */
-    void handlePostRequest(HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder);
+    void handlePostRequest(HttpRequest& httpRequest, BodyReader& body, HttpResponseBuilder& responseBuilder);
 
 /**/
 private:
@@ -104,12 +371,29 @@ private:
     /**
      * \brief Handles HTTP POST requests for uploading files.
      *
-     * Stores the upload content to the txt file in predefined directory.
+     * Streams the body from the socket to a uniquely named temporary file in 
+     * the upload directory, preallocated from Content-Length, flushed as set by 
+     * the fsync policy, then atomically renamed to a unique final name. A 
+     * multipart/form-data body is parsed as it arrives instead, and each part 
+     * with a filename is saved the same way. Memory use doesn't depend on the 
+     * size of the body.
      *
      * \param httpRequest: The HTTP request containing the uploaded file data.
+     * \param body: The reader of the request body.
      * \param responseBuilder The HttpResponse object to build the response.
      */
-    void handleUpload(HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder);
+    void handleUpload(HttpRequest& httpRequest, BodyReader& body, HttpResponseBuilder& responseBuilder);
+
+    /**
+     * \brief Streams a multipart/form-data body to one UploadFile per file part.
+     *
+     * \param body: The reader of the request body.
+     * \param boundary: The boundary of the Content-Type.
+     * \param files: Receives the finished files, not yet committed.
+     * \return false if the body is malformed.
+     * \throws std::runtime_error if the body can't be received or a file can't be written.
+     */
+    bool receiveMultipart(BodyReader& body, const std::string& boundary, std::vector<std::unique_ptr<UploadFile>>& files);
 
 
 /**/
@@ -117,11 +401,48 @@ private:
     /**
      * \brief Serves a static file based on the request path.
      *
+     * The path is looked up in the file index. Paths that aren't indexed are 
+     * resolved on the filesystem, those that are missing or escape the base 
+     * directory are answered with 404, and remembered for a short time to skip 
+     * resolving them again.
+     *
+     * Files larger than STREAMING_THRESHOLD bypass the cache, they are set as 
+     * the body file of the response to be streamed by the server.
+     *
      * \param httpRequest: The HTTP request containing the uploaded file data.
      * \param responseBuilder: The HttpResponse object to build the response.
      */
     void serveStaticFile(HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder);
 
+    /**
+     * \brief Serves a static file like `serveStaticFile`, awaiting the read of a cache miss.
+     */
+    CoTask<void> serveStaticFileAsync(HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder, EventLoop& loop);
+
+    /**
+     * \brief What `lookupStaticFile` found.
+     */
+    enum class StaticFileLookup {
+        Load,       ///< The file is to be loaded, through the cache.
+        NotFound,   ///< The response is to be a 404.
+        Streamed,   ///< The response is complete, the file is its body file.
+    };
+
+    /**
+     * \brief Find the file of a request, and build the response of a streamed file.
+     *
+     * \param unindexed: Receives the file if it isn't indexed.
+     * \param info: Set to the file, unless not found.
+     */
+    StaticFileLookup lookupStaticFile(HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder, 
+                                      FileInfo& unindexed, const FileInfo*& info);
+
+    /**
+     * \brief Build the response of a loaded file.
+     */
+    void setFileResponse(HttpResponseBuilder& responseBuilder, const FileInfo& info, 
+                         std::vector<unsigned char> fileContent, bool fromCache);
+
 /**/
 private:
     /**
@@ -135,9 +456,73 @@ private:
      */
     void serveStatusCodeImage(HttpResponseBuilder& responseBuilder, const HttpStatusCode& statusCode);
 
+    /**
+     * \brief Serves a status code image like `serveStatusCodeImage`, awaiting the read of a cache miss.
+     */
+    CoTask<void> serveStatusCodeImageAsync(HttpResponseBuilder& responseBuilder, HttpStatusCode statusCode, 
+                                           EventLoop& loop);
+
+    static std::string statusCodeImagePath(HttpStatusCode statusCode);
+
+    void setStatusCodeImage(HttpResponseBuilder& responseBuilder, HttpStatusCode statusCode, 
+                            std::vector<unsigned char> fileContent, bool fromCache);
+
+    /**
+     * \brief The plain text response, when the image can't be loaded.
+     */
+    static void setStatusCodeText(HttpResponseBuilder& responseBuilder, HttpStatusCode statusCode);
+
+/**/
+private:
+    /**
+     * \brief Get the content of a file, from the cache if possible.
+     *
+     * On a cache miss, concurrent requests for the same file share a single 
+     * load on a disk thread, which is put into the cache by the request waiting 
+     * for it.
+     * Expired entries are served stale while being refreshed in the background.
+     *
+     * \param filepath: The path of the file.
+     * \param fromCache: Set to true if the content was found in the cache.
+     * \return The content of the file.
+     * \throws std::runtime_error if the file can't be opened or read.
+     */
+    std::vector<unsigned char> getFileContent(const std::string& filepath, bool& fromCache);
+
+    /**
+     * \brief Get the content of a file like `getFileContent`, suspended while 
+     *        a cache miss is read on a disk thread.
+     *
+     * The concurrent misses of a file join the same SingleFlight without 
+     * blocking the loop.
+     *
+     * \throws DiskQueueFull if the read of a miss can't be queued.
+     */
+    CoTask<std::vector<unsigned char>> getFileContentAsync(const std::string& filepath, bool& fromCache, EventLoop& loop);
+
+    /**
+     * \brief Look a file up in the cache, and schedule the refresh of a stale entry.
+     *
+     * \return The content of the file, empty on a cache miss.
+     */
+    std::vector<unsigned char> getCachedContent(const std::string& filepath);
+
+    /**
+     * \brief Lock the cache mutex, the wait added to the timings of the request.
+     */
+    std::unique_lock<Mutex> lockCache();
+
 private:
-    LRUCache&   r_cache;
-    std::mutex& r_cacheMtx;
+    LRUCache&       r_cache;
+    Mutex&          r_cacheMtx;
+    SingleFlight&   r_inFlight;
+    CacheRefresher& r_refresher;
+    NegativeCache&  r_missing;
+    std::shared_ptr<const FileIndex> m_fileIndex;
+    DiskIoPool&     r_diskIo;
+    const UploadOptions& r_uploadOptions;
+    CacheStatus     m_cacheStatus;
+    RequestTimings* m_timings;
 };
 
 
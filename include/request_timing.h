@@ -0,0 +1,142 @@
+/**
+ * \file include/request_timing.h
+ */
+
+#pragma once
+
+#ifndef REQUEST_TIMING_H_
+#define REQUEST_TIMING_H_
+
+#include <chrono>
+#include <cstdint>
+#include <time.h>    // clock_gettime
+
+#include "profiling.h"
+
+// CLOCK_MONOTONIC is read from the vDSO in ~20 ns, CLOCK_MONOTONIC_COARSE is
+// cheaper but only ticks every 1 to 4 ms, longer than most stages
+#define REQUEST_TIMING_CLOCK CLOCK_MONOTONIC
+
+// USDT probes of the `http_server` provider, a nop until a tracer attaches,
+// e.g. `bpftrace -e 'usdt:./http-server:http_server:mark { @[arg1] = count(); }'`
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(HTTP_NO_USDT)
+#include <sys/sdt.h>
+#define HTTP_PROBE2(name, a, b)    DTRACE_PROBE2(http_server, name, a, b)
+#define HTTP_PROBE3(name, a, b, c) DTRACE_PROBE3(http_server, name, a, b, c)
+#endif
+#endif
+#ifndef HTTP_PROBE2
+#define HTTP_PROBE2(name, a, b)    do {} while (0)
+#define HTTP_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+namespace http {
+
+
+/**
+ * \brief The points a request passes, in order.
+ */
+enum class RequestMark : std::uint8_t {
+    Accepted,     ///< `accept` returned the connection
+    Started,      ///< A worker took the connection
+    HeadRead,     ///< The head was received
+    Parsed,       ///< The head was parsed
+    Dispatched,   ///< The request is served, after waiting for its class when requeued
+    Handled,      ///< The handler returned the response
+    Built,        ///< The response, or its head for a streamed file, was serialized
+    Sent,         ///< The last byte was sent
+    Count
+};
+
+
+/**
+ * \brief The stages of a request, between two marks or measured by the handler.
+ */
+enum class RequestStage : std::uint8_t {
+    Queue,        ///< Accepted to Started
+    Read,         ///< Started to HeadRead
+    Parse,        ///< HeadRead to Parsed
+    Schedule,     ///< Parsed to Dispatched
+    Handle,       ///< Dispatched to Handled, including LockWait and Load
+    LockWait,     ///< Waiting for the cache mutex
+    Load,         ///< Loading a cache miss from disk, or waiting for the request loading it
+    Build,        ///< Handled to Built
+    Send,         ///< Built to Sent
+    Count
+};
+
+
+/**
+ * \brief The name of a stage, as in the metrics and the access log.
+ */
+const char* requestStageName(RequestStage stage);
+
+
+/**
+ * \brief Nanoseconds on REQUEST_TIMING_CLOCK.
+ */
+inline std::uint64_t monotonicNanoseconds() {
+    struct timespec ts;
+    clock_gettime(REQUEST_TIMING_CLOCK, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000u + static_cast<std::uint64_t>(ts.tv_nsec);
+}
+
+
+/**
+ * \brief The timestamps of a request, carried from the accept to the send.
+ *
+ * Each mark costs a clock read, and fires the `http_server:mark` probe with
+ * the id of the request, the mark and the timestamp.
+ */
+struct RequestTimings {
+    std::uint64_t id = 0;                                                    ///< Number of the connection
+    std::uint64_t marks[static_cast<std::size_t>(RequestMark::Count)] = {};  ///< ns, 0 if not reached
+    std::uint64_t lockWaitNs = 0;
+    std::uint64_t loadNs = 0;
+    std::uint32_t lockCount = 0;    ///< Acquisitions of the cache mutex
+    std::uint32_t loadCount = 0;    ///< Cache misses loaded or waited for
+    AllocationCounts allocations;   ///< Made while serving, only counted by the profiling build
+
+    RequestTimings() = default;
+
+    /**
+     * \brief Start with the accept, std::chrono::steady_clock being CLOCK_MONOTONIC.
+     */
+    RequestTimings(std::uint64_t requestId, std::chrono::steady_clock::time_point acceptedAt) : id(requestId) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(acceptedAt.time_since_epoch()).count();
+        marks[static_cast<std::size_t>(RequestMark::Accepted)] = static_cast<std::uint64_t>(ns);
+    }
+
+    void mark(RequestMark mark) {
+        std::uint64_t now = monotonicNanoseconds();
+        marks[static_cast<std::size_t>(mark)] = now;
+        HTTP_PROBE3(mark, id, static_cast<int>(mark), now);
+    }
+
+    void addLockWait(std::uint64_t since) {
+        std::uint64_t waited = monotonicNanoseconds() - since;
+        lockWaitNs += waited;
+        ++lockCount;
+        HTTP_PROBE2(lock_wait, id, waited);
+    }
+
+    void addLoad(std::uint64_t since) {
+        std::uint64_t loaded = monotonicNanoseconds() - since;
+        loadNs += loaded;
+        ++loadCount;
+        HTTP_PROBE2(load, id, loaded);
+    }
+
+    /**
+     * \brief The duration of a stage.
+     *
+     * \return false if the request didn't go through the stage.
+     */
+    bool duration(RequestStage stage, std::uint64_t& ns) const;
+};
+
+
+} // namespace http::
+
+#endif // REQUEST_TIMING_H_
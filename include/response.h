@@ -9,8 +9,11 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
 #include <unordered_map>
 
+#include "file.h"
+
 
 namespace http {
 
@@ -23,7 +26,9 @@ enum class HttpStatusCode {
     OK                  = 200,
     NotFound            = 404,
     BadRequest          = 400,
+    PayloadTooLarge     = 413,
     InternalServerError = 500,
+    ServiceUnavailable  = 503,
 };
 
 
@@ -52,6 +57,14 @@ public:
      */
     ~HttpResponseBuilder() = default;
 
+    /**
+     * \brief Move-only, it owns the body and the file to be streamed.
+     */
+    HttpResponseBuilder(HttpResponseBuilder&& other) = default;
+    HttpResponseBuilder& operator=(HttpResponseBuilder&& other) = default;
+    HttpResponseBuilder(const HttpResponseBuilder& other) = delete;
+    HttpResponseBuilder& operator=(const HttpResponseBuilder& other) = delete;
+
 /**/
 public:
     /**
@@ -76,11 +89,53 @@ public:
      */
     void setBody(const std::string& body);
     void setBody(const std::vector<unsigned char>& body);
+    void setBody(std::vector<unsigned char>&& body);
+
+    /**
+     * \brief Sets an open file as the body of the HTTP response, to be streamed.
+     *
+     * The file isn't read by the builder. The response head is built by 
+     * `buildHead`, and the file is sent after it by the caller, from the same 
+     * descriptor, so the Content-Length matches what is sent even if the file 
+     * is replaced meanwhile.
+     *
+     * \param file: The open file, owned by the builder.
+     * \param size: The size of the file, from `fstat` of the descriptor.
+     */
+    void setBodyFile(FileDescriptor file, std::uintmax_t size);
+
+    /**
+     * \brief Get the status code of the response.
+     */
+    HttpStatusCode getStatusCode() const { return m_statusCode; }
+
+    /**
+     * \brief Check whether the body is a file to be streamed.
+     */
+    bool hasBodyFile() const { return m_bodyFile.get() >= 0; }
+
+    /**
+     * \brief Get the descriptor of the file set by `setBodyFile`.
+     */
+    int getBodyFile() const { return m_bodyFile.get(); }
+
+    /**
+     * \brief Get the size of the body, or of the file set by `setBodyFile`.
+     */
+    std::uintmax_t getBodySize() const { return hasBodyFile() ? m_bodyFileSize : m_body.size(); }
+
+    /**
+     * \brief Builds the status line and the headers of the http response message.
+     *
+     * \return A string containing the HTTP response message up to the body.
+     */
+    std::string buildHead();
 
     /**
      * \brief Builds the http response message.
      *
-     * \return A string containing the complete HTTP response message.
+     * \return A string containing the complete HTTP response message, without 
+     *         the body if it is a file.
      */
     std::string build();
 
@@ -89,6 +144,8 @@ public:
 private:
     HttpStatusCode m_statusCode;
     std::vector<unsigned char> m_body;
+    FileDescriptor m_bodyFile;
+    std::uintmax_t m_bodyFileSize = 0;
     std::unordered_map<std::string, std::string> m_headers;
 };
 
@@ -7,14 +7,41 @@
 #ifndef SERVER_H_
 #define SERVER_H_
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "net.h"
+#include "coroutine.hpp"
+#include "event_loop.h"
 #include "thread_pool.hpp"
 #include "cache.h"
+#include "refresher.h"
+#include "index.h"
+#include "disk_io.h"
+#include "request.h"
+#include "access_log.h"
+#include "metrics.h"
+#include "request_timing.h"
 
 namespace http {
 
+
+/**
+ * \brief The client of a connection, and when it was accepted.
+ */
+struct ClientInfo {
+    sockaddr_in address;
+    std::chrono::steady_clock::time_point acceptedAt;
+    std::uint64_t id;   ///< Number of the connection, to match the probes of a request
+};
+
+
 /**
  * \brief 
  */
@@ -42,34 +69,235 @@ public:
     /**
      * \brief Start the http server
      *
-     * Setup server socket, bind port to server socket, start listening connections, 
-     * and handle incoming request
+     * Warm up the cache, setup server socket, bind port to server socket, start 
+     * listening connections, and handle incoming request until SIGINT or SIGTERM.
      */
     void start();
 
     /**
      * \brief Stop the http server
+     *
+     * Save the cache snapshot if enabled.
      */
     void stop();
 
+    /**
+     * \brief Preload files into the cache when the server starts.
+     *
+     * The files are read in parallel on the disk threads, up to the capacity of the cache.
+     *
+     * \param manifestPath: A list of URL paths to preload, one per line. If empty, 
+     *                      the files of BASE_DIRECTORY are preloaded.
+     */
+    void enablePreload(const std::string& manifestPath = "");
+
+    /**
+     * \brief Save the hot cache keys when the server stops, and restore them when it starts.
+     *
+     * A restored snapshot takes precedence over the preload.
+     *
+     * \param snapshotPath: The path of the snapshot file.
+     */
+    void enableCacheSnapshot(const std::string& snapshotPath);
+
+    /**
+     * \brief Set the options of the upload endpoint, before the server starts.
+     *
+     * \param uploadOptions: The directory, fsync policy and copy method of uploads.
+     */
+    void setUploadOptions(const UploadOptions& uploadOptions);
+
+    /**
+     * \brief Write a record of each request to a binary access log.
+     *
+     * \param options: The path and the rotation of the access log.
+     * \throws std::runtime_error if the access log can't be opened.
+     */
+    void enableAccessLog(const AccessLogOptions& options);
+
+    /**
+     * \brief Serve the metrics in the Prometheus text format on a route.
+     *
+     * \param route: The path of the GET requests answered with the metrics, e.g. "/metrics".
+     */
+    void enableMetrics(const std::string& route);
+
+    /**
+     * \brief Serve the report of the profiling build on a route.
+     *
+     * \param route: The path of the GET requests answered with `profilingReport()`, e.g. "/debug/profile".
+     */
+    void enableProfilingReport(const std::string& route);
+
+    /**
+     * \brief Serve the connections on event loops instead of the thread pool, before the server starts.
+     *
+     * Each connection is a coroutine, suspended while it waits for its client 
+     * or for a disk read instead of blocking a worker, so a few threads hold 
+     * many slow connections. The requests with a body are handed over to the 
+     * thread pool, reading it blocks.
+     *
+     * \param count: The number of event loops, each on its own thread.
+     */
+    void enableEventLoops(std::size_t count);
+
 /**/
 private:
     /**
      * \brief Handles the connection from a client.
      *
-     * Read request from server socket, and send back the corresponding http response.
+     * Read and parse the request head from client socket, then serve the 
+     * request at once if it's latency-critical, or else requeue it with the 
+     * priority of its class. The stages of the request are timed from here.
      *
      * \param clientfd: The sockfd of client socket.
+     * \param client: The address of the client, and when it was accepted.
+     */
+    void handleConnection(int clientfd, const ClientInfo& client);
+
+    /**
+     * \brief The scheduling class of a request, from its route, method and Content-Length.
+     *
+     * Small indexed files are latency-critical, uploads, large bodies and 
+     * large files are bulk, the rest is normal.
+     */
+    TaskPriority classifyRequest(const HttpRequest& httpRequest) const;
+
+    /**
+     * \brief Read the small file a request misses in the cache on a disk 
+     *        thread, and requeue the request once the file is cached.
+     *
+     * The worker serves other connections meanwhile instead of waiting for the 
+     * disk. Concurrent misses of a file share its read.
+     *
+     * \return false if the request doesn't need a read, and was left to the caller.
+     */
+    bool loadThenServe(SocketRAII& clientSocket, HttpRequest& httpRequest, std::string& leftover, 
+                       const ClientInfo& client, RequestTimings& timings, TaskPriority priority);
+
+    /**
+     * \brief Handles a parsed request, and send back the corresponding http response.
+     *
+     * The body is streamed from the socket by the request handler.
+     *
+     * \param clientSocket: The client socket.
+     * \param httpRequest: The parsed request head, with an empty method if the head was invalid.
+     * \param leftover: The bytes of the body read along with the head.
+     * \param client: The address of the client, and when it was accepted.
+     * \param timings: The marks of the request so far, recorded into the 
+     *                 metrics and the access log once the response is sent.
+     */
+    void serveRequest(SocketRAII& clientSocket, HttpRequest& httpRequest, std::string& leftover, 
+                      const ClientInfo& client, RequestTimings& timings);
+
+    /**
+     * \brief Handles the connection from a client on an event loop, like `handleConnection`.
+     *
+     * The requests with a body are handed over to the thread pool.
+     *
+     * \param loop: The event loop running the coroutine.
+     * \param clientfd: The sockfd of client socket, owned by the coroutine.
+     * \param client: The address of the client, and when it was accepted.
+     */
+    CoTask<void> handleConnectionAsync(EventLoop& loop, int clientfd, ClientInfo client);
+
+    /**
+     * \brief Handles a parsed request without a body, like `serveRequest`, suspended 
+     *        instead of blocked by the disk reads and the sends.
+     */
+    CoTask<void> serveRequestAsync(EventLoop& loop, SocketRAII& clientSocket, HttpRequest& httpRequest, 
+                                   const ClientInfo& client, RequestTimings& timings);
+
+    /**
+     * \brief Build the response of the metrics and profiling routes, if enabled.
+     *
+     * \return false if the request isn't for one of them.
+     */
+    bool serveAdminRoute(const HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder) const;
+
+    /**
+     * \brief Record a response into the metrics and the access log.
+     *
+     * \param sent: Whether the whole response was sent.
+     * \param responseSize: The size of the response, head and body.
+     */
+    void recordResponse(const HttpRequest& httpRequest, const ClientInfo& client, const RequestTimings& timings, 
+                        int statusCode, bool sent, std::uint64_t responseSize, CacheStatus cacheStatus);
+
+    /**
+     * \brief Start the threads of the event loops, if enabled.
+     */
+    void startEventLoops();
+
+    /**
+     * \brief Stop the event loops, and destroy the connections they still hold.
+     */
+    void stopEventLoops();
+
+    /**
+     * \brief Whether new connections should be shed.
+     *
+     * True while connections are queued, for a worker or for their event loop, 
+     * and the last one started waited longer than QUEUE_DELAY_TARGET.
+     */
+    bool isOverloaded() const;
+
+    /**
+     * \brief Answer a connection with the prebuilt 503 and close it, without blocking.
+     *
+     * Also sheds the requests whose head was read, when they can't be queued.
+     *
+     * \param clientSocket: The client socket, closed on return.
+     * \param client: The address of the client, and when it was accepted.
+     */
+    void rejectConnection(SocketRAII clientSocket, const ClientInfo& client);
+
+    /**
+     * \brief Fill the cache from the snapshot, or else preload it, if enabled.
+     */
+    void warmUpCache();
+
+    /**
+     * \brief Load files into the cache in parallel.
+     *
+     * \param urlPaths: The URL paths of the files, from the most to the least 
+     *                  recently used. Missing or invalid paths are skipped.
+     */
+    void preloadCache(const std::vector<std::string>& urlPaths);
+
+    /**
+     * \brief Save the URL paths of the cached files to the snapshot file.
      */
-    void handleConnection(int clientfd);
+    void saveCacheSnapshot();
 
 /**/
 private:
-    bool         m_isRunning;
-    ServerSocket m_serverSocket;
-    ThreadPool   m_threadPool;
-    LRUCache     m_cache;
-    std::mutex   m_cacheMtx;
+    std::atomic_bool m_isRunning;
+    ServerSocket     m_serverSocket;
+    LRUCache         m_cache;
+    Mutex            m_cacheMtx{HTTP_MUTEX_NAME("cache")};
+    SingleFlight     m_inFlight;
+    NegativeCache    m_missing;
+    AtomicFileIndex  m_fileIndex;
+    CacheRefresher   m_refresher;
+    DiskIoPool       m_diskIo;
+    bool             m_preload;
+    std::string      m_preloadManifest;
+    std::string      m_snapshotPath;
+    UploadOptions    m_uploadOptions;
+    std::string      m_overloadResponse;   ///< The prebuilt 503 response.
+    std::atomic<std::int64_t> m_queueDelayUs;   ///< The queueing delay of the last connection taken by a worker or a loop.
+    std::uint64_t             m_connectionCount;   ///< Connections accepted, only used by the accept loop.
+    std::unique_ptr<AccessLog> m_accessLog;     ///< Null unless enabled.
+    std::string      m_metricsRoute;             ///< Empty unless enabled.
+    std::string      m_profilingRoute;           ///< Empty unless enabled.
+    std::vector<GaugeFunction> m_gauges;         ///< The gauges read from the members on each scrape.
+    std::size_t      m_eventLoopCount;           ///< 0 unless enabled.
+    std::vector<std::unique_ptr<EventLoop>> m_eventLoops;   ///< Only while the server runs.
+    std::vector<std::thread> m_eventLoopThreads;
+    std::size_t      m_nextEventLoop;            ///< Round robin of the accept loop.
+    // Declared last so that it's destroyed first, the workers use the members above.
+    ThreadPool       m_threadPool;
 };
 
 } // namespace http::
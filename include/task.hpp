@@ -0,0 +1,219 @@
+/**
+ * \file include/task.hpp
+ */
+
+#pragma once
+
+#ifndef TASK_HPP_
+#define TASK_HPP_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+
+#define TASK_INLINE_SIZE 48   // bytes of captures stored without allocating, sizeof(Task) is 64
+
+namespace http {
+
+
+/**
+ * \brief A move-only type-erased `void()` callable, with inline storage.
+ *
+ * Unlike std::function, it holds move-only callables like std::packaged_task,
+ * and stores the callables up to TASK_INLINE_SIZE bytes without allocating,
+ * which covers the usual lambdas capturing a few pointers and integers.
+ *
+ * \ref c++ concurrency in action by Anthony Williams, function_wrapper
+ */
+class Task {
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* dst, void* src) noexcept;   ///< Move-construct into dst, and destroy src.
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template <typename F>
+    static constexpr bool isInline = sizeof(F) <= TASK_INLINE_SIZE
+                                  && alignof(F) <= alignof(std::max_align_t)
+                                  && std::is_nothrow_move_constructible_v<F>;
+
+    template <typename F>
+    struct InlineOps {
+        static void invoke(void* storage) { (*static_cast<F*>(storage))(); }
+        static void move(void* dst, void* src) noexcept {
+            ::new (dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+        static void destroy(void* storage) noexcept { static_cast<F*>(storage)->~F(); }
+        static constexpr Ops ops = {invoke, move, destroy};
+    };
+
+    template <typename F>
+    struct HeapOps {
+        static F*& target(void* storage) { return *static_cast<F**>(storage); }
+        static void invoke(void* storage) { (*target(storage))(); }
+        static void move(void* dst, void* src) noexcept { ::new (dst) F*(target(src)); }
+        static void destroy(void* storage) noexcept { delete target(storage); }
+        static constexpr Ops ops = {invoke, move, destroy};
+    };
+
+public:
+    /**
+     * \brief Construct an empty task.
+     */
+    Task() noexcept : m_ops(nullptr) {}
+
+    /**
+     * \brief Construct a task from a callable, moved in.
+     */
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f) {
+        using Callable = std::decay_t<F>;
+        if constexpr (isInline<Callable>) {
+            ::new (static_cast<void*>(m_storage)) Callable(std::forward<F>(f));
+            m_ops = &InlineOps<Callable>::ops;
+        }
+        else {
+            ::new (static_cast<void*>(m_storage)) Callable*(new Callable(std::forward<F>(f)));
+            m_ops = &HeapOps<Callable>::ops;
+        }
+    }
+
+    /**
+     * \brief Move constructor.
+     */
+    Task(Task&& other) noexcept : m_ops(other.m_ops) {
+        if (m_ops) {
+            m_ops->move(m_storage, other.m_storage);
+            other.m_ops = nullptr;
+        }
+    }
+
+    /**
+     * \brief Move assignment operator.
+     */
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            m_ops = other.m_ops;
+            if (m_ops) {
+                m_ops->move(m_storage, other.m_storage);
+                other.m_ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task& other) = delete;
+    Task& operator=(const Task& other) = delete;
+
+    /**
+     * \brief Destructor
+     */
+    ~Task() {
+        reset();
+    }
+
+public:
+    /**
+     * \brief Run the task. It must not be empty.
+     */
+    void operator()() {
+        m_ops->invoke(m_storage);
+    }
+
+    /**
+     * \brief Whether the task holds a callable.
+     */
+    explicit operator bool() const noexcept {
+        return m_ops != nullptr;
+    }
+
+private:
+    void reset() noexcept {
+        if (m_ops) {
+            m_ops->destroy(m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+private:
+    alignas(std::max_align_t) unsigned char m_storage[TASK_INLINE_SIZE];
+    const Ops* m_ops;
+};
+
+
+/**
+ * \brief Counts the pending tasks of a group, to wait for all of them.
+ *
+ * Lighter than a std::future per task: one counter, and a lock only taken
+ * by the last task and by the waiter. The last task decrements the counter 
+ * under the lock, and `wait` takes it before returning, so a token on the 
+ * stack of the waiter outlives the notification of the last task.
+ */
+class CompletionToken {
+public:
+    CompletionToken() : m_pending(0) {}
+
+    CompletionToken(const CompletionToken& other) = delete;
+    CompletionToken& operator=(const CompletionToken& other) = delete;
+
+    /**
+     * \brief Count more pending tasks. Called before they're submitted.
+     */
+    void add(std::size_t count = 1) {
+        m_pending.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief Mark a task as completed.
+     */
+    void done() {
+        // not the last task, nobody waits for this one
+        std::size_t pending = m_pending.load(std::memory_order_relaxed);
+        while (pending > 1) {
+            if (m_pending.compare_exchange_weak(pending, pending - 1, std::memory_order_acq_rel))
+                return;
+        }
+
+        // the waiter can't see zero and return before the lock is released
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            m_cond.notify_all();
+    }
+
+    /**
+     * \brief Whether all the tasks are completed.
+     *
+     * Only a hint: the last task may still be notifying, `wait` must be called 
+     * before the token is destroyed.
+     */
+    bool isDone() const {
+        return m_pending.load(std::memory_order_acquire) == 0;
+    }
+
+    /**
+     * \brief Block until all the tasks are completed, and the last one has 
+     *        returned from `done`.
+     */
+    void wait() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this] { return isDone(); });
+    }
+
+private:
+    std::atomic<std::size_t> m_pending;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+};
+
+
+} // namespace http::
+
+#endif // TASK_HPP_
@@ -15,6 +15,27 @@
 #include <thread>
 #include <condition_variable>
 #include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <future>
+#include <type_traits>
+#include <iterator>
+#include <optional>
+
+#include "task.hpp"
+#include "metrics.h"
+#include "profiling.h"
+
+
+#define THREAD_POOL_SPIN_BUDGET     2048   // rounds of looking for work before an idle worker parks
+#define THREAD_POOL_SPINS_PER_YIELD 64
+#define THREAD_POOL_QUEUE_CAPACITY  1024   // tasks of each priority submitted from outside the pool, a power of 2
+
+// shares of the dequeues of each priority, while they all have work
+#define THREAD_POOL_WEIGHT_LATENCY_CRITICAL 8
+#define THREAD_POOL_WEIGHT_NORMAL           4
+#define THREAD_POOL_WEIGHT_BULK             1
 
 namespace http {
 
@@ -70,7 +91,7 @@ public:
      * \param other: The other queue to copy from.
      */
     ThreadsafeQueue(const ThreadsafeQueue& other) {
-        std::lock_guard<std::mutex> lock(other.m_mutex);
+        std::lock_guard<Mutex> lock(other.m_mutex);
         m_data_queue = other.m_data_queue;
     }
 
@@ -80,7 +101,7 @@ public:
      * \param other: The other queue to copy from.
      */
     ThreadsafeQueue& operator=(const ThreadsafeQueue& other) {
-        std::lock_guard<std::mutex> lock(other.m_mutex);
+        std::lock_guard<Mutex> lock(other.m_mutex);
         m_data_queue = other.m_data_queue;
         return *this;
     }
@@ -91,8 +112,8 @@ public:
      * \param new_val: The value to be pushed into the queue.
      */
     void push(T new_val) {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        m_data_queue.push(new_val);
+        std::lock_guard<Mutex> lock(m_mutex);
+        m_data_queue.push(std::move(new_val));
         m_data_cond.notify_one();
     }
 
@@ -102,9 +123,9 @@ public:
      * \param value: The popped value is stored in this parameter.
      */
     void wait_and_pop(T& value) {
-        std::unique_lock<std::mutex> lock(m_mutex);
+        std::unique_lock<Mutex> lock(m_mutex);
         m_data_cond.wait(lock, [this]{ return !m_data_queue.empty(); });
-        value = m_data_queue.front();
+        value = std::move(m_data_queue.front());
         m_data_queue.pop();
     }
 
@@ -114,9 +135,9 @@ public:
      * \return A shared pointer to the popped value.
      */
     std::shared_ptr<T> wait_and_pop() {
-        std::unique_lock<std::mutex> lock(m_mutex);
+        std::unique_lock<Mutex> lock(m_mutex);
         m_data_cond.wait(lock, [this]{ return !m_data_queue.empty(); });
-        std::shared_ptr<T> res(std::make_shared<T>(m_data_queue.front()));
+        std::shared_ptr<T> res(std::make_shared<T>(std::move(m_data_queue.front())));
         m_data_queue.pop();
         return res;
     }
@@ -128,10 +149,10 @@ public:
      * \return True if the pop operation was successful, false otherwise.
      */
     bool try_pop(T& value) {
-        std::lock_guard<std::mutex> lock(m_mutex);
+        std::lock_guard<Mutex> lock(m_mutex);
         if (m_data_queue.empty())
             return false;
-        value = m_data_queue.front();
+        value = std::move(m_data_queue.front());
         m_data_queue.pop();
         return true;
     }
@@ -142,10 +163,10 @@ public:
      * \return A shared pointer to the popped value if successful, or an empty shared pointer if the queue is empty.
      */
     std::shared_ptr<T> try_pop() {
-        std::lock_guard<std::mutex> lock(m_mutex);
+        std::lock_guard<Mutex> lock(m_mutex);
         if (m_data_queue.empty())
             return std::shared_ptr<T>();
-        std::shared_ptr<T> res(std::make_shared<T>(m_data_queue.front()));
+        std::shared_ptr<T> res(std::make_shared<T>(std::move(m_data_queue.front())));
         m_data_queue.pop();
         return res;
     }
@@ -156,19 +177,408 @@ public:
      * \return True if the queue is empty, false otherwise.
      */
     bool empty() const {
-        std::lock_guard<std::mutex> lock(m_mutex);
+        std::lock_guard<Mutex> lock(m_mutex);
         return m_data_queue.empty();
     }
 
 private:
-    mutable std::mutex m_mutex; ///< Mutex to protect the queue.
+    mutable Mutex m_mutex{HTTP_MUTEX_NAME("threadsafe_queue")}; ///< Mutex to protect the queue.
     std::queue<T> m_data_queue; ///< Underlying queue to store data.
-    std::condition_variable m_data_cond; ///< Condition variable for blocking operations.
+    ConditionVariable m_data_cond; ///< Condition variable for blocking operations.
+};
+
+
+/**
+ * \brief A lock-free work-stealing deque of pointers (Chase-Lev).
+ *
+ * The owner thread pushes and pops at the bottom, in LIFO order, and any 
+ * other thread steals from the top, in FIFO order. Only the owner and a 
+ * thief racing for the last element contend, on a single CAS. The buffer 
+ * grows when full; the old buffers are kept until destruction since thieves 
+ * may still be reading them.
+ *
+ * \ref N.M. Le et al., Correct and Efficient Work-Stealing for Weak Memory Models, PPoPP 2013
+ */
+template <typename T>
+class WorkStealingDeque {
+private:
+    struct Buffer {
+        explicit Buffer(std::int64_t capacity) 
+            : m_mask(capacity - 1), m_slots(new std::atomic<T*>[capacity]) {}
+
+        std::int64_t capacity() const { return m_mask + 1; }
+        T* get(std::int64_t i) const { return m_slots[i & m_mask].load(std::memory_order_relaxed); }
+        void put(std::int64_t i, T* item) { m_slots[i & m_mask].store(item, std::memory_order_relaxed); }
+
+        std::int64_t m_mask;
+        std::unique_ptr<std::atomic<T*>[]> m_slots;
+    };
+
+public:
+    /**
+     * \brief Constructor
+     *
+     * \param capacity: The initial capacity, a power of 2.
+     */
+    explicit WorkStealingDeque(std::int64_t capacity = 1024) 
+        : m_top(0), m_bottom(0)
+    {
+        m_buffers.push_back(std::make_unique<Buffer>(capacity));
+        m_buffer.store(m_buffers.back().get(), std::memory_order_relaxed);
+    }
+
+    WorkStealingDeque(const WorkStealingDeque& other) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque& other) = delete;
+
+    /**
+     * \brief Pushes an item at the bottom. Owner thread only.
+     */
+    void push(T* item) {
+        std::int64_t b = m_bottom.load(std::memory_order_relaxed);
+        std::int64_t t = m_top.load(std::memory_order_acquire);
+        Buffer* buffer = m_buffer.load(std::memory_order_relaxed);
+        if (b - t > buffer->capacity() - 1) {
+            buffer = grow(buffer, b, t);
+        }
+        buffer->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief Pops the item at the bottom. Owner thread only.
+     *
+     * \return The item, or nullptr if the deque is empty.
+     */
+    T* pop() {
+        std::int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        Buffer* buffer = m_buffer.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t t = m_top.load(std::memory_order_relaxed);
+
+        // empty
+        if (t > b) {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        // the last item, race with the thieves for it
+        T* item = buffer->get(b);
+        if (t == b) {
+            if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                item = nullptr;
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    /**
+     * \brief Steals the item at the top. Any thread.
+     *
+     * \return The item, or nullptr if the deque is empty or another thread won the race.
+     */
+    T* steal() {
+        std::int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t b = m_bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return nullptr;
+
+        // 
+        T* item = m_buffer.load(std::memory_order_acquire)->get(t);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return item;
+    }
+
+    /**
+     * \brief Whether the deque looks empty. Only a hint while other threads use it.
+     */
+    bool empty() const {
+        return m_bottom.load(std::memory_order_relaxed) <= m_top.load(std::memory_order_relaxed);
+    }
+
+private:
+    /**
+     * \brief Doubles the buffer. Owner thread only.
+     */
+    Buffer* grow(Buffer* buffer, std::int64_t b, std::int64_t t) {
+        m_buffers.push_back(std::make_unique<Buffer>(buffer->capacity() * 2));
+        Buffer* bigger = m_buffers.back().get();
+        for (std::int64_t i = t; i < b; ++i) {
+            bigger->put(i, buffer->get(i));
+        }
+        m_buffer.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+private:
+    alignas(64) std::atomic<std::int64_t> m_top;
+    alignas(64) std::atomic<std::int64_t> m_bottom;
+    std::atomic<Buffer*> m_buffer;
+    std::vector<std::unique_ptr<Buffer>> m_buffers;   ///< The current buffer and the outgrown ones.
+};
+
+
+/**
+ * \brief A bounded lock-free multi-producer multi-consumer queue (Vyukov).
+ *
+ * A ring of cells, each with a sequence number telling whether it's free for 
+ * the producer of a given turn or full for the consumer of that turn. 
+ * Producers and consumers only contend on their own position, with a CAS, 
+ * and a full queue is reported instead of growing.
+ *
+ * \ref D. Vyukov, Bounded MPMC queue, 1024cores.net
+ */
+template <typename T>
+class BoundedMpmcQueue {
+private:
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T data;
+    };
+
+public:
+    /**
+     * \brief Constructor
+     *
+     * \param capacity: The maximum number of elements, a power of 2.
+     */
+    explicit BoundedMpmcQueue(std::size_t capacity) 
+        : m_mask(capacity - 1), m_cells(new Cell[capacity]), m_enqueuePos(0), m_dequeuePos(0)
+    {
+        for (std::size_t i = 0; i < capacity; ++i) {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedMpmcQueue(const BoundedMpmcQueue& other) = delete;
+    BoundedMpmcQueue& operator=(const BoundedMpmcQueue& other) = delete;
+
+    /**
+     * \brief Pushes an element, unless the queue is full.
+     *
+     * \param value: Moved from only if it's pushed.
+     * \return false if the queue is full.
+     */
+    bool tryPush(T&& value) {
+        // claim the cell of the next turn
+        Cell* cell;
+        std::size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &m_cells[pos & m_mask];
+            std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            std::intptr_t diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+            if (diff == 0) {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        // publish it to the consumer of this turn
+        cell->data = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * \brief Pops the oldest element, unless the queue is empty.
+     *
+     * \return false if the queue is empty.
+     */
+    bool tryPop(T& value) {
+        // claim the cell of the next turn
+        Cell* cell;
+        std::size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &m_cells[pos & m_mask];
+            std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            std::intptr_t diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = m_dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        // free it for the producer of the next round
+        value = std::move(cell->data);
+        cell->data = T();
+        cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * \brief The number of elements. Only a hint while other threads use the queue.
+     */
+    std::size_t sizeApprox() const {
+        std::size_t dequeuePos = m_dequeuePos.load(std::memory_order_relaxed);
+        std::size_t enqueuePos = m_enqueuePos.load(std::memory_order_relaxed);
+        return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+    }
+
+    /**
+     * \brief The maximum number of elements.
+     */
+    std::size_t capacity() const {
+        return m_mask + 1;
+    }
+
+private:
+    const std::size_t m_mask;
+    std::unique_ptr<Cell[]> m_cells;
+    alignas(64) std::atomic<std::size_t> m_enqueuePos;
+    alignas(64) std::atomic<std::size_t> m_dequeuePos;
 };
 
 
 /**
- * \brief A thread pool class that manages a pool of worker thread
+ * \brief Hints the CPU that the thread is spin-waiting.
+ */
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+
+/**
+ * \brief An eventcount, to park threads waiting for a condition without 
+ *        slowing down the threads which make it true.
+ *
+ * A waiter announces itself with `prepareWait`, checks the condition again, 
+ * then either `cancelWait`s or `commitWait`s. `notify` only costs an atomic 
+ * load when nobody waits, and can't be lost between the check of the waiter 
+ * and its sleep, since it bumps the epoch read by `prepareWait`.
+ */
+class EventCount {
+public:
+    EventCount() : m_state(0) {}
+
+    EventCount(const EventCount& other) = delete;
+    EventCount& operator=(const EventCount& other) = delete;
+
+    /**
+     * \brief Announce a waiter.
+     *
+     * \return The key to pass to `commitWait`.
+     */
+    std::uint32_t prepareWait() {
+        std::uint64_t state = m_state.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return static_cast<std::uint32_t>(state >> 32);
+    }
+
+    /**
+     * \brief Withdraw a waiter announced by `prepareWait`, the condition became true.
+     */
+    void cancelWait() {
+        m_state.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    /**
+     * \brief Sleep until a notification posted after `prepareWait`.
+     */
+    void commitWait(std::uint32_t key) {
+        {
+            std::unique_lock<Mutex> lock(m_mutex);
+            m_cond.wait(lock, [this, key] { 
+                return static_cast<std::uint32_t>(m_state.load(std::memory_order_seq_cst) >> 32) != key; 
+            });
+        }
+        m_state.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    /**
+     * \brief Wake a waiter, if any.
+     */
+    void notify() {
+        notify(false);
+    }
+
+    /**
+     * \brief Wake all the waiters.
+     */
+    void notifyAll() {
+        notify(true);
+    }
+
+private:
+    void notify(bool all) {
+        // orders the publication of the work before the check for waiters
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::uint64_t state = m_state.load(std::memory_order_seq_cst);
+        if ((state & WAITER_MASK) == 0)
+            return;
+
+        // bump the epoch under the lock, so a waiter is either before its check or already asleep
+        {
+            std::lock_guard<Mutex> lock(m_mutex);
+            m_state.fetch_add(EPOCH_INCREMENT, std::memory_order_seq_cst);
+        }
+        if (all)
+            m_cond.notify_all();
+        else
+            m_cond.notify_one();
+    }
+
+private:
+    static constexpr std::uint64_t WAITER_MASK = 0xFFFFFFFFu;
+    static constexpr std::uint64_t EPOCH_INCREMENT = std::uint64_t(1) << 32;
+
+    std::atomic<std::uint64_t> m_state;   ///< The epoch in the high half, the count of waiters in the low half.
+    Mutex m_mutex{HTTP_MUTEX_NAME("thread_pool_park")};
+    ConditionVariable m_cond;
+};
+
+
+/**
+ * \brief The scheduling classes of the tasks of a ThreadPool.
+ */
+enum class TaskPriority {
+    LatencyCritical = 0,   ///< Short tasks waited for by a client, like serving a cached file.
+    Normal          = 1,
+    Bulk            = 2,   ///< Long tasks which can wait, like uploads and large files.
+};
+
+
+/**
+ * \brief A work-stealing thread pool.
+ *
+ * Each worker owns a WorkStealingDeque: the tasks it submits go to its own 
+ * deque, and it runs them newest first, while they're still hot in its cache. 
+ * The tasks submitted from other threads, like the accept loop of the server, 
+ * go to a bounded lock-free global injection queue, so an overloaded pool 
+ * pushes back instead of piling up work. A worker without local work takes from the 
+ * global queue, then steals the oldest task of another worker, starting from 
+ * a random one so that thieves don't all hit the same victim.
+ *
+ * There is a global queue per TaskPriority. The workers take from them by 
+ * smooth weighted round robin, so a burst of bulk tasks only gets a small 
+ * share of the workers while latency-critical tasks are waiting, and no 
+ * class starves. Only the untagged tasks of a worker, its fork/join work, go 
+ * to its own deque; a task tagged with a priority always goes to the global 
+ * queue of its class, so that it's scheduled by the weights.
+ *
+ * An idle worker keeps looking for work for a bounded number of rounds, 
+ * which keeps the wake-up latency low under load, then parks on an 
+ * eventcount until a task is submitted, so an idle pool doesn't burn CPU.
  *
  * \ref c++ concurrency in action by Anthony Williams
  */
@@ -176,64 +586,467 @@ class ThreadPool {
 public:
     /**
      * \brief Constructs a thread pool and starts the worker threads.
+     *
+     * \param spinBudget: The rounds of looking for work before an idle worker parks. 
+     *                    0 parks at once, saving the most CPU at the cost of latency.
+     * \param queueCapacity: The maximum number of tasks queued from outside the pool, a power of 2.
      */
-    ThreadPool() 
-        : m_done(false), m_joiner(m_threads)
+    explicit ThreadPool(std::size_t spinBudget = THREAD_POOL_SPIN_BUDGET, 
+                        std::size_t queueCapacity = THREAD_POOL_QUEUE_CAPACITY) 
+        : m_done(false), m_spinBudget(spinBudget), m_searching(0), m_joiner(m_threads)
     {
         // 
-        std::size_t threadCount = std::thread::hardware_concurrency();
+        for (std::size_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+            m_globalQueues.push_back(std::make_unique<BoundedMpmcQueue<Task>>(queueCapacity));
+        }
+
+        // interleave the priorities by their weights (nginx smooth weighted round robin)
+        const int weights[TASK_PRIORITY_COUNT] = {
+            THREAD_POOL_WEIGHT_LATENCY_CRITICAL, THREAD_POOL_WEIGHT_NORMAL, THREAD_POOL_WEIGHT_BULK
+        };
+        int totalWeight = 0;
+        int current[TASK_PRIORITY_COUNT] = {};
+        for (int weight : weights)
+            totalWeight += weight;
+        for (int turn = 0; turn < totalWeight; ++turn) {
+            std::size_t best = 0;
+            for (std::size_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+                current[i] += weights[i];
+                if (current[i] > current[best])
+                    best = i;
+            }
+            current[best] -= totalWeight;
+            m_schedule.push_back(static_cast<std::uint8_t>(best));
+        }
+
+        // 
+        std::size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+        for (std::size_t i = 0; i < threadCount; ++i) {
+            m_localQueues.push_back(std::make_unique<WorkStealingDeque<Task>>());
+        }
 
         // 
         try {
             for (std::size_t i = 0; i < threadCount; ++i) {
-                m_threads.push_back(std::thread(&ThreadPool::worker_thread, this));
+                m_threads.push_back(std::thread(&ThreadPool::worker_thread, this, i));
             }
         }
         catch (...) {
             m_done = true;
+            m_idle.notifyAll();
             throw;
         }
     }
 
     /**
      * \brief Destroys the thread pool and signals all worker threads to stop.
+     *
+     * The tasks not started yet are dropped.
      */
     ~ThreadPool() {
-        m_done = true;
+        shutdown();
+
+        // 
+        for (auto& queue : m_localQueues) {
+            while (Task* task = queue->steal())
+                delete task;
+        }
     }
 
+    ThreadPool(const ThreadPool& other) = delete;
+    ThreadPool& operator=(const ThreadPool& other) = delete;
+
 public:
     /**
-     * \brief Submits a task to the thread pool.
+     * \brief Stops and joins the workers, before the objects their tasks use are destroyed.
+     *
+     * The tasks not started yet, or submitted afterwards, never run.
+     */
+    void shutdown() {
+        m_done = true;
+        m_idle.notifyAll();
+        for (auto& thread : m_threads) {
+            if (thread.joinable())
+                thread.join();
+        }
+    }
+
+    /**
+     * \brief Submits an untagged task to the thread pool.
+     *
+     * From a worker of this pool, the task goes to the worker's own deque, 
+     * otherwise to the global queue of normal priority.
+     *
      * \param f: The task to be executed by the thread pool.
      */
     template <typename FunctionType>
     void submit(FunctionType f) {
-        m_workQueue.push(std::function<void()>(f));
+        submitTask(Task(std::move(f)), std::nullopt);
+    }
+
+    /**
+     * \brief Submits a task to the global queue of its priority, even from a worker.
+     *
+     * \param f: The task to be executed by the thread pool.
+     * \param priority: The scheduling class of the task.
+     */
+    template <typename FunctionType>
+    void submit(FunctionType f, TaskPriority priority) {
+        submitTask(Task(std::move(f)), priority);
+    }
+
+    /**
+     * \brief Submits a task, counted by a completion token.
+     *
+     * \param f: The task to be executed by the thread pool.
+     * \param token: Marked done when the task returns or throws.
+     */
+    template <typename FunctionType>
+    void submit(FunctionType f, CompletionToken& token) {
+        token.add();
+        submit([f = std::move(f), &token]() mutable {
+            CompletionGuard guard{token};
+            f();
+        });
+    }
+
+    /**
+     * \brief Submits a task, and gets its result back.
+     *
+     * \param f: The task to be executed by the thread pool.
+     * \return The future of the result, or of the exception thrown by the task.
+     */
+    template <typename FunctionType>
+    std::future<std::invoke_result_t<FunctionType>> submitWithFuture(FunctionType f) {
+        std::packaged_task<std::invoke_result_t<FunctionType>()> task(std::move(f));
+        auto result = task.get_future();
+        submit(std::move(task));
+        return result;
+    }
+
+    /**
+     * \brief Submits a range of tasks, waking the workers once.
+     *
+     * \param first, last: The tasks, moved from.
+     * \param token: If not nullptr, counts the tasks.
+     */
+    template <typename Iterator>
+    void submitBatch(Iterator first, Iterator last, CompletionToken* token = nullptr) {
+        // 
+        std::size_t count = 0;
+        for (; first != last; ++first, ++count) {
+            Task task;
+            if (token != nullptr) {
+                token->add();
+                task = Task([f = std::move(*first), token]() mutable {
+                    CompletionGuard guard{*token};
+                    f();
+                });
+            }
+            else {
+                task = Task(std::move(*first));
+            }
+            while (!pushTask(task)) {
+                wakeWorker(count);
+                std::this_thread::yield();
+            }
+        }
+        wakeWorker(count);
+    }
+
+    /**
+     * \brief Waits for the tasks of a completion token.
+     *
+     * On a worker of this pool, runs the pending tasks meanwhile, since the 
+     * awaited tasks may be queued on the own deque of the worker.
+     *
+     * \param token: The token the tasks were submitted with.
+     */
+    void wait(CompletionToken& token) {
+        if (s_localPool != this) {
+            token.wait();
+            return;
+        }
+        bool searching = false;
+        while (!token.isDone()) {
+            if (!runPendingTask(searching))
+                std::this_thread::yield();
+        }
+
+        // the last task may still hold the lock of the token
+        token.wait();
+    }
+
+    /**
+     * \brief Submits a task to the thread pool, unless the global queue of its priority is full.
+     *
+     * The task is tagged, so it goes to the global queue even from a worker.
+     *
+     * \param f: The task to be executed by the thread pool.
+     * \param priority: The scheduling class of the task.
+     * \return false if the task was rejected.
+     */
+    template <typename FunctionType>
+    bool trySubmit(FunctionType f, TaskPriority priority = TaskPriority::Normal) {
+        Task task(std::move(f));
+        if (!pushTask(task, priority)) {
+            s_tasksRejected.inc();
+            return false;
+        }
+        wakeWorker();
+        return true;
+    }
+
+    /**
+     * \brief The number of tasks waiting in the global queues. Only a hint.
+     */
+    std::size_t queuedTasks() const {
+        std::size_t count = 0;
+        for (const auto& queue : m_globalQueues)
+            count += queue->sizeApprox();
+        return count;
     }
 
 public:
     /**
      * \brief The function run by each worker thread.
      * 
-     * Continuously fetches tasks from the work queue and executes them.
-     * If no tasks are available, the thread yields.
+     * Continuously fetches tasks, from its own deque, the global queue, or 
+     * another worker, and executes them. If no tasks are available, the thread 
+     * spins up to the spin budget, then parks until a task is submitted.
+     *
+     * \param index: The index of the worker, and of its deque.
      */
-    void worker_thread() {
+    void worker_thread(std::size_t index) {
+        // 
+        s_localPool = this;
+        s_localIndex = index;
+
+        // 
+        std::size_t spins = 0;
+        bool searching = false;
         while (m_done == false) {
-            std::function<void()> task;
-            if (m_workQueue.try_pop(task)) {
+            // 
+            if (runPendingTask(searching)) {
+                spins = 0;
+                continue;
+            }
+            if (!searching) {
+                searching = true;
+                m_searching.fetch_add(1, std::memory_order_seq_cst);
+            }
+            if (spins < m_spinBudget) {
+                // yield now and then, so a single core can run the thread submitting the work
+                if (++spins % THREAD_POOL_SPINS_PER_YIELD == 0)
+                    std::this_thread::yield();
+                else
+                    cpuRelax();
+                continue;
+            }
+
+            // a task submitted after `prepareWait` either is seen by `hasWork`, or wakes us up
+            searching = false;
+            m_searching.fetch_sub(1, std::memory_order_seq_cst);
+            std::uint32_t key = m_idle.prepareWait();
+            if (m_done || hasWork()) {
+                m_idle.cancelWait();
+                continue;
+            }
+            s_parks.inc();
+            m_idle.commitWait(key);
+            spins = 0;
+        }
+        if (searching)
+            m_searching.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+private:
+    /**
+     * \brief Runs a task from the own deque, the global queue, or another worker.
+     *
+     * A searching worker which finds a task stops searching, and if it was the 
+     * last one, wakes a parked worker to search in its place, since the tasks 
+     * submitted meanwhile didn't wake anyone.
+     *
+     * \param searching: Whether the worker is searching, cleared if a task is found.
+     * \return false if there was no task.
+     */
+    bool runPendingTask(bool& searching) {
+        // 
+        Task globalTask;
+        std::unique_ptr<Task> task{popLocal()};
+        bool fromLocal = task != nullptr;
+        if (!task && !popGlobal(globalTask))
+            task.reset(steal());
+        if (!task && !globalTask)
+            return false;
+
+        // 
+        if (searching) {
+            searching = false;
+            if (m_searching.fetch_sub(1, std::memory_order_seq_cst) == 1)
+                m_idle.notify();
+        }
+
+        // 
+        if (task) {
+            (fromLocal ? s_tasksLocal : s_tasksStolen).inc();
+            (*task)();
+        }
+        else {
+            s_tasksGlobal.inc();
+            globalTask();
+        }
+        return true;
+    }
+
+    /**
+     * \brief Whether any queue looks non-empty.
+     */
+    bool hasWork() const {
+        if (queuedTasks() != 0)
+            return true;
+        for (const auto& queue : m_localQueues) {
+            if (!queue->empty())
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     */
+    Task* popLocal() {
+        return m_localQueues[s_localIndex]->pop();
+    }
+
+    /**
+     * \brief Marks a task of a CompletionToken done, even if it throws.
+     */
+    struct CompletionGuard {
+        CompletionToken& token;
+        ~CompletionGuard() { token.done(); }
+    };
+
+    /**
+     * \brief Queues a task, waiting for room if the global queue is full.
+     *
+     * A worker can't wait for itself, so it runs the task at once instead.
+     * After `shutdown`, a task which doesn't fit is dropped.
+     *
+     * \param task: The task.
+     * \param priority: The scheduling class of the task, or none if it's untagged.
+     */
+    void submitTask(Task task, std::optional<TaskPriority> priority) {
+        while (!pushTask(task, priority)) {
+            if (s_localPool == this) {
                 task();
+                return;
             }
-            else {
-                std::this_thread::yield();
+            if (m_done)
+                return;
+            std::this_thread::yield();
+        }
+        wakeWorker();
+    }
+
+    /**
+     * \brief Queues a task, to the own deque of a worker if it's untagged, or 
+     *        else the global queue of its priority.
+     *
+     * \param task: Moved from only if it's queued.
+     * \param priority: The scheduling class of the task, or none if it's untagged.
+     * \return false if the global queue is full.
+     */
+    bool pushTask(Task& task, std::optional<TaskPriority> priority = std::nullopt) {
+        if (s_localPool == this && !priority) {
+            m_localQueues[s_localIndex]->push(new Task(std::move(task)));
+            return true;
+        }
+        auto index = static_cast<std::size_t>(priority.value_or(TaskPriority::Normal));
+        return m_globalQueues[index]->tryPush(std::move(task));
+    }
+
+    /**
+     * \brief Wakes parked workers for new tasks, unless a worker is searching.
+     *
+     * A searching worker will find the task, or wake another one when it finds 
+     * something else.
+     *
+     * \param count: The number of new tasks.
+     */
+    void wakeWorker(std::size_t count = 1) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (count == 0 || m_searching.load(std::memory_order_seq_cst) != 0)
+            return;
+        if (count == 1)
+            m_idle.notify();
+        else
+            m_idle.notifyAll();
+    }
+
+    /**
+     * \brief Pops the oldest task of the global queue whose turn it is, or of 
+     *        the highest priority with tasks if that one is empty.
+     */
+    bool popGlobal(Task& task) {
+        // the turns only advance when a task is taken, so the weights hold under load
+        static thread_local std::size_t s_turn = 0;
+        std::size_t preferred = m_schedule[s_turn % m_schedule.size()];
+        if (m_globalQueues[preferred]->tryPop(task)) {
+            ++s_turn;
+            return true;
+        }
+        for (std::size_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+            if (i != preferred && m_globalQueues[i]->tryPop(task)) {
+                ++s_turn;
+                return true;
             }
         }
+        return false;
     }
 
+    /**
+     * \brief Steals a task from the other workers, starting from a random one.
+     */
+    Task* steal() {
+        // xorshift, cheap and good enough to spread the thieves
+        static thread_local std::uint32_t s_seed = static_cast<std::uint32_t>(s_localIndex * 2654435761u + 1);
+        s_seed ^= s_seed << 13;
+        s_seed ^= s_seed >> 17;
+        s_seed ^= s_seed << 5;
+
+        // 
+        std::size_t count = m_localQueues.size();
+        std::size_t start = s_seed % count;
+        for (std::size_t i = 0; i < count; ++i) {
+            std::size_t victim = (start + i) % count;
+            if (victim == s_localIndex)
+                continue;
+            if (Task* task = m_localQueues[victim]->steal())
+                return task;
+        }
+        return nullptr;
+    }
+
+private:
+    static constexpr std::size_t TASK_PRIORITY_COUNT = 3;
+
+    static inline thread_local ThreadPool* s_localPool = nullptr;   ///< The pool of the current worker thread.
+    static inline thread_local std::size_t s_localIndex = 0;        ///< The index of the current worker thread.
+    static inline const Counter s_tasksLocal{"thread_pool_tasks_total", "Tasks run by the workers, by where they were found.", "source=\"local\""};
+    static inline const Counter s_tasksGlobal{"thread_pool_tasks_total", "Tasks run by the workers, by where they were found.", "source=\"global\""};
+    static inline const Counter s_tasksStolen{"thread_pool_tasks_total", "Tasks run by the workers, by where they were found.", "source=\"stolen\""};
+    static inline const Counter s_tasksRejected{"thread_pool_tasks_rejected_total", "Tasks rejected because their global queue was full."};
+    static inline const Counter s_parks{"thread_pool_parks_total", "Times an idle worker parked after spinning."};
+
 private:
     std::atomic_bool m_done;
-    ThreadsafeQueue<std::function<void()>> m_workQueue;
+    std::size_t m_spinBudget;
+    EventCount m_idle;   ///< Where the idle workers park.
+    std::atomic<std::size_t> m_searching;   ///< The workers spinning for work.
+    std::vector<std::unique_ptr<WorkStealingDeque<Task>>> m_localQueues;
+    std::vector<std::unique_ptr<BoundedMpmcQueue<Task>>> m_globalQueues;   ///< One per TaskPriority.
+    std::vector<std::uint8_t> m_schedule;   ///< The priority of each turn of the weighted round robin.
     std::vector<std::thread> m_threads;
     JoinThreads m_joiner;
 };
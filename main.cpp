@@ -1,16 +1,52 @@
 /**
  */
 
+#include <cstdlib>
+#include <fstream>
+
 #include "server.h"
 
 #define PORT_NUM 8080
+#define CACHE_SNAPSHOT_PATH "cache.snapshot"
+#define ACCESS_LOG_PATH     "access.log"
+#define METRICS_ROUTE       "/metrics"
+#define PROFILING_ROUTE     "/debug/profile"
+#define PROFILING_REPORT    "profile.txt"
 
-int main() {
-    // 
+int main(int argc, char* argv[]) {
+    // http-server [port [event-loops]], the load generator starts it on an ephemeral port
+    int port = argc > 1 ? std::atoi(argv[1]) : PORT_NUM;
+    int eventLoops = argc > 2 ? std::atoi(argv[2]) : 0;
     std::size_t cacheSize = 10;
-    http::HttpServer server(PORT_NUM, cacheSize);
+    http::HttpServer server(port, cacheSize);
+
+    // coroutines on event loops instead of a worker per connection
+    if (eventLoops > 0)
+        server.enableEventLoops(static_cast<std::size_t>(eventLoops));
+
+    // warm up the cache with the hot set of the previous run, or else the files directory
+    server.enableCacheSnapshot(CACHE_SNAPSHOT_PATH);
+    server.enablePreload();
+
+    // rotated daily or at 64 MiB, see the http-server-access-log tool to read it
+    http::AccessLogOptions accessLogOptions;
+    accessLogOptions.path = ACCESS_LOG_PATH;
+    server.enableAccessLog(accessLogOptions);
+
+    // Prometheus text format
+    server.enableMetrics(METRICS_ROUTE);
+
+#ifdef HTTP_PROFILING
+    // allocations and lock contention, also written on exit
+    server.enableProfilingReport(PROFILING_ROUTE);
+#endif
+
     server.start();
     server.stop();
 
+#ifdef HTTP_PROFILING
+    std::ofstream(PROFILING_REPORT) << http::profilingReport();
+#endif
+
     return 0;
 }
@@ -0,0 +1,291 @@
+/**
+ * \file src/access_log.cpp
+ */
+
+#include <algorithm>    // std::min
+#include <cerrno>
+#include <cstring>      // std::memcpy, strerror
+#include <ctime>        // gmtime_r, strftime
+#include <stdexcept>    // std::runtime_error
+#include <fcntl.h>      // open
+#include <sys/stat.h>   // fstat
+#include <unistd.h>     // write, close
+
+#include "access_log.h"
+#include "log.h"
+#include "metrics.h"
+
+
+namespace http {
+
+
+namespace {
+
+const Counter s_dropped("access_log_dropped_total", "Records dropped because the buffer of the access log was full.");
+
+const char* const METHOD_NAMES[] = {"-", "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH"};
+
+AccessLogFileHeader makeFileHeader() {
+    AccessLogFileHeader header = {};
+    std::memcpy(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic));
+    header.version = ACCESS_LOG_VERSION;
+    header.recordSize = sizeof(AccessLogRecord);
+    return header;
+}
+
+bool writeAll(int fd, const char* data, std::size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        size -= static_cast<std::size_t>(written);
+    }
+    return true;
+}
+
+} // namespace
+
+
+AccessMethod toAccessMethod(std::string_view method) {
+    for (std::size_t i = 1; i < sizeof(METHOD_NAMES) / sizeof(METHOD_NAMES[0]); ++i) {
+        if (method == METHOD_NAMES[i])
+            return static_cast<AccessMethod>(i);
+    }
+    return AccessMethod::Unknown;
+}
+
+
+const char* accessMethodName(AccessMethod method) {
+    std::size_t index = static_cast<std::size_t>(method);
+    return index < sizeof(METHOD_NAMES) / sizeof(METHOD_NAMES[0]) ? METHOD_NAMES[index] : METHOD_NAMES[0];
+}
+
+
+AccessLog::AccessLog(const AccessLogOptions& options)
+    : m_options(options), m_fd(-1), m_fileSize(0), m_done(false), m_dropped(0)
+{
+    if (!openFile())
+        throw std::runtime_error("Failed to open access log: " + m_options.path);
+    m_buffer.reserve(ACCESS_LOG_BUFFER_SIZE);
+    m_writing.reserve(ACCESS_LOG_BUFFER_SIZE);
+    m_thread = std::thread(&AccessLog::writer_thread, this);
+}
+
+
+AccessLog::~AccessLog() {
+    {
+        std::lock_guard<Mutex> lock(m_mutex);
+        m_done = true;
+    }
+    m_notEmpty.notify_one();
+    m_thread.join();
+    closeFile();
+}
+
+
+void AccessLog::append(const AccessLogEntry& entry) {
+    // the wall clock time of the accept, from the duration measured on the steady clock
+    auto duration = std::chrono::steady_clock::now() - entry.acceptedAt;
+    auto acceptedTime = std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(duration);
+
+    //
+    AccessLogRecord record = {};
+    record.timeUs = std::chrono::duration_cast<std::chrono::microseconds>(acceptedTime.time_since_epoch()).count();
+    record.bytesSent = entry.bytesSent;
+    record.durationUs = static_cast<std::uint32_t>(std::min<std::int64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(duration).count(), UINT32_MAX));
+    record.clientAddress = entry.client.sin_addr.s_addr;
+    record.clientPort = ntohs(entry.client.sin_port);
+    record.status = static_cast<std::uint16_t>(entry.status);
+    record.pathLength = static_cast<std::uint16_t>(std::min<std::size_t>(entry.path.size(), ACCESS_LOG_MAX_PATH));
+    record.method = static_cast<std::uint8_t>(toAccessMethod(entry.method));
+    record.cacheStatus = static_cast<std::uint8_t>(entry.cacheStatus);
+    record.httpVersion = entry.version == "HTTP/1.1" ? 11 : entry.version == "HTTP/1.0" ? 10 : 0;
+    for (std::size_t i = 0; entry.timings != nullptr && i < static_cast<std::size_t>(RequestStage::Count); ++i) {
+        std::uint64_t ns = 0;
+        if (entry.timings->duration(static_cast<RequestStage>(i), ns))
+            record.stageUs[i] = static_cast<std::uint32_t>(std::min<std::uint64_t>(ns / 1000, UINT32_MAX));
+    }
+
+    // the writer fell behind, the record is dropped rather than block the accept thread or an event loop
+    bool halfFull = false;
+    {
+        std::lock_guard<Mutex> lock(m_mutex);
+        if (m_buffer.size() >= ACCESS_LOG_BUFFER_SIZE) {
+            ++m_dropped;
+            s_dropped.inc();
+            return;
+        }
+        m_buffer.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        m_buffer.append(entry.path.data(), record.pathLength);
+        halfFull = m_buffer.size() >= ACCESS_LOG_BUFFER_SIZE / 2;
+    }
+    if (halfFull)
+        m_notEmpty.notify_one();
+}
+
+
+bool AccessLog::openFile() {
+    //
+    m_fd = ::open(m_options.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (m_fd < 0 || fstat(m_fd, &st) != 0) {
+        HTTP_ERROR("Failed to open access log '{}': {}", m_options.path, strerror(errno));
+        closeFile();
+        return false;
+    }
+    m_fileSize = static_cast<std::uint64_t>(st.st_size);
+    m_fileOpenedAt = std::chrono::system_clock::now();
+
+    // a new file starts with the header, an existing one of another format is set aside
+    AccessLogFileHeader expected = makeFileHeader();
+    if (m_fileSize == 0) {
+        if (!writeAll(m_fd, reinterpret_cast<const char*>(&expected), sizeof(expected))) {
+            HTTP_ERROR("Failed to write access log '{}': {}", m_options.path, strerror(errno));
+            closeFile();
+            return false;
+        }
+        m_fileSize = sizeof(expected);
+        return true;
+    }
+    AccessLogFileHeader header;
+    if (pread(m_fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))
+        || std::memcmp(&header, &expected, sizeof(header)) != 0) {
+        closeFile();
+        std::string asidePath = rotatedPath();
+        if (::rename(m_options.path.c_str(), asidePath.c_str()) != 0) {
+            HTTP_ERROR("'{}' isn't an access log of version {}", m_options.path, ACCESS_LOG_VERSION);
+            return false;
+        }
+        HTTP_WARN("'{}' isn't an access log of version {}, renamed to '{}'", m_options.path, ACCESS_LOG_VERSION, asidePath);
+        return openFile();
+    }
+    return true;
+}
+
+
+void AccessLog::closeFile() {
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+}
+
+
+void AccessLog::rotate() {
+    //
+    closeFile();
+    std::string rotatedPath = this->rotatedPath();
+
+    //
+    if (::rename(m_options.path.c_str(), rotatedPath.c_str()) != 0)
+        HTTP_ERROR("Failed to rotate access log '{}': {}", m_options.path, strerror(errno));
+    else
+        HTTP_INFO("Rotated access log to '{}'", rotatedPath);
+    openFile();
+}
+
+
+std::string AccessLog::rotatedPath() const {
+    // suffixed with the rotation time, and a counter if several happen in the same second
+    std::time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    std::tm tm;
+    gmtime_r(&now, &tm);
+    char suffix[32];
+    std::strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &tm);
+    std::string path = m_options.path + suffix;
+    struct stat st;
+    for (int i = 1; ::stat(path.c_str(), &st) == 0; ++i)
+        path = m_options.path + suffix + "-" + std::to_string(i);
+    return path;
+}
+
+
+void AccessLog::writeRecords(const std::string& records) {
+    //
+    bool tooLarge = m_options.maxFileSize > 0 && m_fileSize > sizeof(AccessLogFileHeader)
+                 && m_fileSize + records.size() > m_options.maxFileSize;
+    bool tooOld = m_options.rotateInterval.count() > 0
+               && std::chrono::system_clock::now() - m_fileOpenedAt >= m_options.rotateInterval;
+    if (tooLarge || tooOld)
+        rotate();
+
+    //
+    if (m_fd < 0 || !writeAll(m_fd, records.data(), records.size())) {
+        HTTP_PER_SECOND(1, HTTP_ERROR, "Failed to write {} bytes of access log: {}", records.size(), strerror(errno));
+        return;
+    }
+    m_fileSize += records.size();
+}
+
+
+void AccessLog::writer_thread() {
+    while (true) {
+        //
+        bool done;
+        std::size_t dropped;
+        {
+            std::unique_lock<Mutex> lock(m_mutex);
+            m_notEmpty.wait_for(lock, ACCESS_LOG_FLUSH_INTERVAL, [this] {
+                return m_done || m_buffer.size() >= ACCESS_LOG_BUFFER_SIZE / 2;
+            });
+            m_buffer.swap(m_writing);
+            done = m_done;
+            dropped = m_dropped;
+            m_dropped = 0;
+        }
+        if (dropped > 0)
+            HTTP_WARN("Dropped {} access log records, the buffer was full", dropped);
+
+        //
+        if (!m_writing.empty()) {
+            writeRecords(m_writing);
+            m_writing.clear();
+        }
+        if (done)
+            return;
+    }
+}
+
+
+AccessLogReader::AccessLogReader(const std::string& path) 
+    : m_file(std::fopen(path.c_str(), "rb")), m_recordSize(sizeof(AccessLogRecord)) 
+{
+    //
+    if (m_file == nullptr)
+        throw std::runtime_error("Failed to open access log: " + path);
+
+    //
+    AccessLogFileHeader header;
+    AccessLogFileHeader expected = makeFileHeader();
+    AccessLogFileHeader expectedV1 = expected;
+    expectedV1.version = 1;
+    expectedV1.recordSize = ACCESS_LOG_V1_RECORD_SIZE;
+    bool valid = std::fread(&header, sizeof(header), 1, m_file) == 1;
+    if (valid && std::memcmp(&header, &expectedV1, sizeof(header)) == 0)
+        m_recordSize = ACCESS_LOG_V1_RECORD_SIZE;
+    else if (!valid || std::memcmp(&header, &expected, sizeof(header)) != 0) {
+        std::fclose(m_file);
+        throw std::runtime_error("Not an access log of version " + std::to_string(ACCESS_LOG_VERSION) + ": " + path);
+    }
+}
+
+
+AccessLogReader::~AccessLogReader() {
+    std::fclose(m_file);
+}
+
+
+bool AccessLogReader::next(AccessLogRecord& record, std::string& path) {
+    // the fields missing from the older versions are zero
+    record = {};
+    if (std::fread(&record, m_recordSize, 1, m_file) != 1)
+        return false;
+    path.resize(record.pathLength);
+    return record.pathLength == 0 || std::fread(&path[0], record.pathLength, 1, m_file) == 1;
+}
+
+
+} // namespace http::
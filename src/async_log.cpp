@@ -0,0 +1,476 @@
+/**
+ * \file src/async_log.cpp
+ */
+
+#include <algorithm>   // std::min
+#include <cerrno>
+#include <chrono>
+#include <cstring>     // std::memcpy
+#include <unistd.h>    // write, isatty
+#include <spdlog/details/os.h>
+
+#include "async_log.h"
+
+
+namespace http {
+
+
+namespace {
+
+std::atomic<std::uint64_t> s_nextSinkId{1};
+
+const char* const LEVEL_COLORS[] = {
+    "\033[37m",            // trace
+    "\033[36m",            // debug
+    "\033[32m",            // info
+    "\033[33m\033[1m",     // warn
+    "\033[31m\033[1m",     // error
+    "\033[1m\033[41m",     // critical
+    ""                     // off
+};
+const char* const RESET_COLOR = "\033[m";
+
+void append(spdlog::memory_buf_t& buffer, const char* str) {
+    buffer.append(str, str + std::strlen(str));
+}
+
+/**
+ * \brief Format a deferred message from its record.
+ */
+void formatRecord(const unsigned char* record, spdlog::memory_buf_t& out) {
+    //
+    DeferredFormat format;
+    std::memcpy(&format, record, sizeof(DeferredFormat));
+    std::size_t size = out.size();
+    try {
+        format.format(std::string_view(format.formatData, format.formatSize), record + sizeof(DeferredFormat), out);
+        if (out.size() - size > LOG_MAX_MESSAGE_SIZE)
+            out.resize(size + LOG_MAX_MESSAGE_SIZE);
+    }
+    catch (const std::exception& e) {
+        out.resize(size);
+        append(out, "Failed to format log message '");
+        out.append(format.formatData, format.formatData + format.formatSize);
+        append(out, "': ");
+        append(out, e.what());
+    }
+}
+
+} // namespace
+
+
+/**
+ * \brief A lock-free ring of the messages of one thread, with a single producer
+ *        (the thread) and a single consumer (the background thread).
+ *
+ * The messages are stored as variable-length records, a Header followed by the
+ * text or the DeferredFormat and the arguments, aligned on the size of the
+ * Header. A record never wraps around, the end of the ring is skipped with a
+ * padding record instead.
+ */
+class LogRing {
+public:
+    struct Header {
+        std::uint32_t size;     ///< Size of the record after the header, or of the skipped bytes for padding
+        std::uint8_t  level;
+        LogRecordKind kind;
+        std::int64_t  time;     ///< Ticks of the log clock
+    };
+
+public:
+    LogRing(std::size_t capacity, std::size_t threadId)
+        : m_capacity(capacity), m_buffer(new unsigned char[capacity]), m_threadId(threadId),
+          m_closed(false), m_head(0), m_cachedTail(0), m_tail(0) {}
+
+public:
+    /**
+     * \brief Add a record to the ring. Only called by the owner thread.
+     *
+     * \param size: The size of the record after the header.
+     * \param writer: Called with the space of the record.
+     * \return false if the ring is full.
+     */
+    template <typename Writer>
+    bool tryPush(spdlog::level::level_enum level, LogRecordKind kind, std::size_t size, Writer&& writer) {
+        //
+        std::size_t recordSize = align(sizeof(Header) + size);
+        std::uint64_t head = m_head.load(std::memory_order_relaxed);
+        std::size_t offset = head & (m_capacity - 1);
+        std::size_t padding = offset + recordSize > m_capacity ? m_capacity - offset : 0;
+
+        // the consumer only frees space, reload its position when the cached one isn't enough
+        if (head + padding + recordSize - m_cachedTail > m_capacity) {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (head + padding + recordSize - m_cachedTail > m_capacity)
+                return false;
+        }
+
+        //
+        if (padding > 0) {
+            Header header{static_cast<std::uint32_t>(padding), 0, LogRecordKind::Padding, 0};
+            std::memcpy(m_buffer.get() + offset, &header, sizeof(Header));
+            offset = 0;
+        }
+        Header header{static_cast<std::uint32_t>(size), static_cast<std::uint8_t>(level), kind,
+                      spdlog::log_clock::now().time_since_epoch().count()};
+        std::memcpy(m_buffer.get() + offset, &header, sizeof(Header));
+        writer(m_buffer.get() + offset + sizeof(Header));
+        m_head.store(head + padding + recordSize, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * \brief Pass all the queued records to a function. Only called by the
+     *        background thread.
+     *
+     * The records stay in the ring until they're released.
+     *
+     * \return The position after the last record, to release them.
+     */
+    template <typename Function>
+    std::uint64_t peek(Function&& function) const {
+        //
+        std::uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        std::uint64_t head = m_head.load(std::memory_order_acquire);
+        while (tail < head) {
+            Header header;
+            std::size_t offset = tail & (m_capacity - 1);
+            std::memcpy(&header, m_buffer.get() + offset, sizeof(Header));
+            if (header.kind == LogRecordKind::Padding) {
+                tail += header.size;
+                continue;
+            }
+            function(header, m_buffer.get() + offset + sizeof(Header));
+            tail += align(sizeof(Header) + header.size);
+        }
+        return tail;
+    }
+
+    /**
+     * \brief Free the space of the messages before a position returned by peek.
+     */
+    void release(std::uint64_t position) {
+        m_tail.store(position, std::memory_order_release);
+    }
+
+    /**
+     * \brief Whether more than half of the ring is used. Only called by the owner thread.
+     */
+    bool isHalfFull() const {
+        return m_head.load(std::memory_order_relaxed) - m_cachedTail > m_capacity / 2;
+    }
+
+    std::size_t threadId() const { return m_threadId; }
+
+    /**
+     * \brief Called when the owner thread exits, the ring is removed once drained.
+     */
+    void close() { m_closed.store(true, std::memory_order_release); }
+
+    bool isClosed() const { return m_closed.load(std::memory_order_acquire); }
+
+private:
+    static std::size_t align(std::size_t size) {
+        return (size + sizeof(Header) - 1) & ~(sizeof(Header) - 1);
+    }
+
+private:
+    const std::size_t                m_capacity;
+    std::unique_ptr<unsigned char[]> m_buffer;
+    const std::size_t                m_threadId;
+    std::atomic_bool                 m_closed;
+
+    // producer and consumer positions on separate cache lines
+    alignas(64) std::atomic<std::uint64_t> m_head;
+    std::uint64_t                          m_cachedTail;   ///< Last known m_tail, only used by the producer
+    alignas(64) std::atomic<std::uint64_t> m_tail;
+};
+
+
+namespace {
+
+/**
+ * \brief The ring of a thread, closed when the thread exits.
+ */
+struct LocalRing {
+    std::uint64_t sinkId = 0;
+    std::shared_ptr<LogRing> ring;
+
+    ~LocalRing() {
+        if (ring)
+            ring->close();
+    }
+};
+
+thread_local LocalRing t_localRing;
+
+} // namespace
+
+
+AsyncLogSink::AsyncLogSink(const std::string& loggerName, std::vector<spdlog::sink_ptr> sinks, LogOverflowPolicy policy)
+    : m_id(s_nextSinkId.fetch_add(1)), m_loggerName(loggerName), m_policy(policy), m_sinks(std::move(sinks)),
+      m_dropped(0), m_reportedDropped(0), m_wakePending(false), m_done(false), m_passStarted(0), m_passCompleted(0)
+{
+    m_thread = std::thread(&AsyncLogSink::drain_thread, this);
+}
+
+
+AsyncLogSink::~AsyncLogSink() {
+    {
+        std::lock_guard<Mutex> lock(m_mutex);
+        m_done = true;
+    }
+    m_wakeCond.notify_one();
+    m_thread.join();
+}
+
+
+void AsyncLogSink::log(const spdlog::details::log_msg& msg) {
+    pushText(msg.level, msg.payload);
+}
+
+
+void AsyncLogSink::flush() {
+    std::unique_lock<Mutex> lock(m_mutex);
+    std::uint64_t target = m_passStarted + 1;
+    m_wakePending.store(true, std::memory_order_relaxed);
+    m_wakeCond.notify_one();
+    m_flushedCond.wait(lock, [this, target] { return m_passCompleted >= target || m_done; });
+}
+
+
+void AsyncLogSink::set_pattern(const std::string& pattern) {
+    std::lock_guard<Mutex> lock(m_sinksMutex);
+    for (auto& sink : m_sinks)
+        sink->set_pattern(pattern);
+}
+
+
+void AsyncLogSink::set_formatter(std::unique_ptr<spdlog::formatter> sinkFormatter) {
+    std::lock_guard<Mutex> lock(m_sinksMutex);
+    for (auto& sink : m_sinks)
+        sink->set_formatter(sinkFormatter->clone());
+}
+
+
+std::size_t AsyncLogSink::droppedCount() const {
+    return m_dropped.load(std::memory_order_relaxed);
+}
+
+
+void AsyncLogSink::push(spdlog::level::level_enum level, LogRecordKind kind, std::size_t size, RecordWriter writer, const void* data) {
+    //
+    LogRing& ring = localRing(spdlog::details::os::thread_id());
+    auto write = [writer, data](unsigned char* destination) { writer(destination, data); };
+    bool pushed = ring.tryPush(level, kind, size, write);
+    if (!pushed && m_policy == LogOverflowPolicy::Drop && level < spdlog::level::warn) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // wait for room
+    while (!pushed) {
+        wake();
+        std::this_thread::yield();
+        pushed = ring.tryPush(level, kind, size, write);
+    }
+
+    // warnings and errors are written right away
+    if (level >= spdlog::level::warn || ring.isHalfFull())
+        wake();
+}
+
+
+void AsyncLogSink::pushText(spdlog::level::level_enum level, spdlog::string_view_t text) {
+    text = spdlog::string_view_t(text.data(), std::min<std::size_t>(text.size(), LOG_MAX_MESSAGE_SIZE));
+    push(level, LogRecordKind::Text, text.size(), [](unsigned char* destination, const void* data) {
+        const spdlog::string_view_t& text = *static_cast<const spdlog::string_view_t*>(data);
+        std::memcpy(destination, text.data(), text.size());
+    }, &text);
+}
+
+
+LogRing& AsyncLogSink::localRing(std::size_t threadId) {
+    //
+    LocalRing& local = t_localRing;
+    if (local.sinkId == m_id)
+        return *local.ring;
+
+    // first message of the thread, or of this sink
+    if (local.ring)
+        local.ring->close();
+    local.ring = std::make_shared<LogRing>(LOG_RING_SIZE, threadId);
+    local.sinkId = m_id;
+    {
+        std::lock_guard<Mutex> lock(m_ringsMutex);
+        m_rings.push_back(local.ring);
+    }
+    return *local.ring;
+}
+
+
+void AsyncLogSink::wake() {
+    if (!m_wakePending.exchange(true, std::memory_order_acq_rel)) {
+        std::lock_guard<Mutex> lock(m_mutex);
+        m_wakeCond.notify_one();
+    }
+}
+
+
+bool AsyncLogSink::drainRings() {
+    //
+    std::vector<std::shared_ptr<LogRing>> rings;
+    {
+        std::lock_guard<Mutex> lock(m_ringsMutex);
+        rings = m_rings;
+    }
+
+    // collect the messages of all the threads, the text stays in the rings
+    std::vector<std::uint64_t> ends(rings.size());
+    std::vector<bool> closed(rings.size());
+    m_batch.clear();
+    m_formattedRanges.clear();
+    m_formatted.clear();
+    for (std::size_t i = 0; i < rings.size(); ++i) {
+        // a closed ring gets no more messages once drained
+        closed[i] = rings[i]->isClosed();
+        std::size_t threadId = rings[i]->threadId();
+        ends[i] = rings[i]->peek([this, threadId](const LogRing::Header& header, const unsigned char* record) {
+            //
+            spdlog::log_clock::time_point time{spdlog::log_clock::duration(header.time)};
+            spdlog::string_view_t text(reinterpret_cast<const char*>(record), header.size);
+            std::pair<std::size_t, std::size_t> formattedRange{0, 0};
+            if (header.kind == LogRecordKind::Deferred) {
+                formattedRange.first = m_formatted.size();
+                formatRecord(record, m_formatted);
+                formattedRange.second = m_formatted.size() - formattedRange.first;
+                text = spdlog::string_view_t();
+            }
+
+            //
+            m_batch.emplace_back(time, spdlog::source_loc{}, m_loggerName, static_cast<spdlog::level::level_enum>(header.level), text);
+            m_batch.back().thread_id = threadId;
+            m_formattedRanges.push_back(formattedRange);
+        });
+    }
+
+    // point the deferred messages to their text, once it doesn't move anymore
+    for (std::size_t i = 0; i < m_batch.size(); ++i) {
+        if (m_batch[i].payload.data() == nullptr)
+            m_batch[i].payload = spdlog::string_view_t(m_formatted.data() + m_formattedRanges[i].first, m_formattedRanges[i].second);
+    }
+
+    // interleave the threads in time order
+    std::stable_sort(m_batch.begin(), m_batch.end(), [](const spdlog::details::log_msg& a, const spdlog::details::log_msg& b) {
+        return a.time < b.time;
+    });
+    std::lock_guard<Mutex> lock(m_sinksMutex);
+    for (const auto& msg : m_batch) {
+        for (auto& sink : m_sinks) {
+            if (sink->should_log(msg.level))
+                sink->log(msg);
+        }
+    }
+    std::size_t written = m_batch.size();
+
+    //
+    for (std::size_t i = 0; i < rings.size(); ++i) {
+        rings[i]->release(ends[i]);
+        if (closed[i]) {
+            std::lock_guard<Mutex> ringsLock(m_ringsMutex);
+            m_rings.erase(std::find(m_rings.begin(), m_rings.end(), rings[i]));
+        }
+    }
+
+    // report the drops since the last pass
+    std::size_t dropped = m_dropped.load(std::memory_order_relaxed);
+    if (dropped != m_reportedDropped) {
+        std::string text = "Dropped " + std::to_string(dropped - m_reportedDropped) + " log messages, the log ring was full";
+        spdlog::details::log_msg msg(spdlog::log_clock::now(), spdlog::source_loc{}, m_loggerName, spdlog::level::warn, text);
+        for (auto& sink : m_sinks) {
+            if (sink->should_log(spdlog::level::warn))
+                sink->log(msg);
+        }
+        m_reportedDropped = dropped;
+        ++written;
+    }
+
+    // one write per sink for the whole pass
+    if (written > 0) {
+        for (auto& sink : m_sinks)
+            sink->flush();
+    }
+    return written > 0;
+}
+
+
+void AsyncLogSink::drain_thread() {
+    while (true) {
+        //
+        std::uint64_t pass;
+        bool done;
+        {
+            std::unique_lock<Mutex> lock(m_mutex);
+            m_wakeCond.wait_for(lock, std::chrono::milliseconds(LOG_DRAIN_INTERVAL_MS), [this] {
+                return m_done || m_wakePending.load(std::memory_order_relaxed);
+            });
+            m_wakePending.store(false, std::memory_order_relaxed);
+            pass = ++m_passStarted;
+            done = m_done;
+        }
+
+        //
+        drainRings();
+
+        //
+        {
+            std::lock_guard<Mutex> lock(m_mutex);
+            m_passCompleted = pass;
+        }
+        m_flushedCond.notify_all();
+        if (done)
+            return;
+    }
+}
+
+
+BatchedConsoleSink::BatchedConsoleSink() : m_useColors(::isatty(STDOUT_FILENO) != 0) {}
+
+
+void BatchedConsoleSink::sink_it_(const spdlog::details::log_msg& msg) {
+    //
+    msg.color_range_start = 0;
+    msg.color_range_end = 0;
+    spdlog::memory_buf_t formatted;
+    formatter_->format(msg, formatted);
+    if (!m_useColors || msg.color_range_end <= msg.color_range_start) {
+        m_buffer.append(formatted.data(), formatted.data() + formatted.size());
+        return;
+    }
+
+    //
+    const char* data = formatted.data();
+    m_buffer.append(data, data + msg.color_range_start);
+    append(m_buffer, LEVEL_COLORS[static_cast<std::size_t>(msg.level)]);
+    m_buffer.append(data + msg.color_range_start, data + msg.color_range_end);
+    append(m_buffer, RESET_COLOR);
+    m_buffer.append(data + msg.color_range_end, data + formatted.size());
+}
+
+
+void BatchedConsoleSink::flush_() {
+    //
+    std::size_t written = 0;
+    while (written < m_buffer.size()) {
+        ssize_t result = ::write(STDOUT_FILENO, m_buffer.data() + written, m_buffer.size() - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            break;
+        written += static_cast<std::size_t>(result);
+    }
+    m_buffer.clear();
+}
+
+
+} // namespace http::
@@ -3,81 +3,411 @@
  */
 
 #include <chrono>
+#include <exception>
+#include <functional>
 
 #include "cache.h"
+#include "metrics.h"
 
 
 namespace http {
 
 
-void LRUCache::put(const std::string& path, const std::vector<unsigned char>& body) {
+namespace {
+
+const Counter s_hits("cache_hits_total", "Lookups of the file cache which found the file.");
+const Counter s_misses("cache_misses_total", "Lookups of the file cache which didn't find the file, or found it expired.");
+const Counter s_evictions("cache_evictions_total", "Least recently used entries evicted to make room.");
+const Counter s_stale("cache_stale_total", "Expired entries kept being served until refreshed.");
+
+} // namespace
+
+
+LRUCache::LRUCache(std::size_t capacity)
+    : m_capacity(capacity > 0 ? capacity : 10), m_head(s_npos), m_tail(s_npos)
+{
+    // keep the load factor of the table at most 0.5
+    std::size_t tableSize = 1;
+    while (tableSize < 2 * m_capacity)
+        tableSize <<= 1;
+    m_mask = tableSize - 1;
+
+    // 
+    m_entries.reserve(m_capacity);
+    m_table.assign(tableSize, Slot{0, s_npos});
+}
+
+
+void LRUCache::put(std::string_view path, const std::vector<unsigned char>& body, 
+                   std::filesystem::file_time_type lastWriteTime) {
     // 
-    auto it = m_lookup.find(path);
+    std::uint32_t hash = hashPath(path);
+    std::size_t slot = findSlot(path, hash);
+    Index entry = m_table[slot].entry;
 
     // found, update body and move to front
-    if (it != m_lookup.end()) {
-        it->second->body = body;
-        it->second->createAt = std::chrono::system_clock::now();   // update timestamp of createAt
-        m_list.splice(m_list.begin(), m_list, it->second);
-    }
-    // not found, insert path and body
-    else {
-        // remove least recently used when capacity exceeds limit
-        if (m_list.size() >= m_capacity) {
-            auto leastRecentlyUsedIt = m_lookup.find(m_list.back().path);
-            m_lookup.erase(leastRecentlyUsedIt);
-            m_list.pop_back();
-        }
+    if (entry != s_npos) {
+        m_entries[entry].body = body;
+        m_entries[entry].createAt = std::chrono::system_clock::now();   // update timestamp of createAt
+        m_entries[entry].lastWriteTime = lastWriteTime;
+        m_entries[entry].state = CacheEntryState::Fresh;
+        moveToFront(entry);
+        return;
+    }
 
-        // insert to recently used
-        m_list.push_front({path, body, std::chrono::system_clock::now()});
-        m_lookup[path] = m_list.begin();
+    // not found, remove least recently used when capacity exceeds limit
+    if (m_entries.size() >= m_capacity) {
+        removeEntry(m_tail);
+        s_evictions.inc();
+        slot = findSlot(path, hash);
     }
+
+    // insert to recently used
+    entry = static_cast<Index>(m_entries.size());
+    m_entries.push_back({std::string(path), hash, s_npos, s_npos, body, 
+                         std::chrono::system_clock::now(), lastWriteTime, CacheEntryState::Fresh});
+    m_table[slot] = Slot{hash, entry};
+    pushFront(entry);
 }
 
 
-std::vector<unsigned char> LRUCache::get(const std::string& path) {
+std::vector<unsigned char> LRUCache::get(std::string_view path) {
     // 
-    auto it = m_lookup.find(path);
+    Index entry = find(path);
 
     // not found
-    if (it == m_lookup.end()) {
+    if (entry == s_npos) {
+        s_misses.inc();
         return {};
     }
 
     // move to recently used
-    m_list.splice(m_list.begin(), m_list, it->second);
+    moveToFront(entry);
+    s_hits.inc();
 
     // return the body
-    return it->second->body;
+    return m_entries[entry].body;
 }
 
 
-std::vector<unsigned char> LRUCache::getOrDeleteExpired(const std::string& path) {
+std::vector<unsigned char> LRUCache::getOrDeleteExpired(std::string_view path) {
     // 
-    auto it = m_lookup.find(path);
+    Index entry = find(path);
 
     // not found
-    if (it == m_lookup.end()) {
+    if (entry == s_npos) {
+        s_misses.inc();
         return {};
     }
 
     // 
-    auto duration = std::chrono::system_clock::now() - it->second->createAt;
+    auto duration = std::chrono::system_clock::now() - m_entries[entry].createAt;
     if (duration >= m_durationThreshInMin) {
-        auto itList = it->second;
-        m_lookup.erase(it);
-        m_list.erase(itList);
-        // HTTP_DEBUG("Delete expired cache content.");
+        removeEntry(entry);
+        s_misses.inc();
+        return {};
+    }
+
+    // move to recently used
+    moveToFront(entry);
+    s_hits.inc();
+
+    // return the body
+    return m_entries[entry].body;
+}
+
+
+std::vector<unsigned char> LRUCache::getOrMarkStale(std::string_view path, bool& needsRefresh) {
+    // 
+    needsRefresh = false;
+    Index entry = find(path);
+
+    // not found
+    if (entry == s_npos) {
+        s_misses.inc();
         return {};
     }
-    // HTTP_DEBUG("Not expired");
+
+    // expired, keep serving it until the refresh is done
+    CacheEntry& cacheEntry = m_entries[entry];
+    auto duration = std::chrono::system_clock::now() - cacheEntry.createAt;
+    if (cacheEntry.state == CacheEntryState::Fresh && duration >= m_durationThreshInMin) {
+        cacheEntry.state = CacheEntryState::Stale;
+        needsRefresh = true;
+        s_stale.inc();
+    }
 
     // move to recently used
-    m_list.splice(m_list.begin(), m_list, it->second);
+    moveToFront(entry);
+    s_hits.inc();
 
     // return the body
-    return it->second->body;
+    return cacheEntry.body;
+}
+
+
+bool LRUCache::beginRefresh(std::string_view path, std::filesystem::file_time_type& lastWriteTime) {
+    // 
+    Index entry = find(path);
+    if (entry == s_npos || m_entries[entry].state != CacheEntryState::Stale) {
+        return false;
+    }
+
+    // 
+    m_entries[entry].state = CacheEntryState::Refreshing;
+    lastWriteTime = m_entries[entry].lastWriteTime;
+    return true;
+}
+
+
+void LRUCache::revalidate(std::string_view path) {
+    // 
+    Index entry = find(path);
+    if (entry == s_npos) {
+        return;
+    }
+
+    // 
+    m_entries[entry].createAt = std::chrono::system_clock::now();
+    m_entries[entry].state = CacheEntryState::Fresh;
+}
+
+
+void LRUCache::update(std::string_view path, const std::vector<unsigned char>& body, 
+                      std::filesystem::file_time_type lastWriteTime) {
+    // 
+    Index entry = find(path);
+    if (entry == s_npos) {
+        return;
+    }
+
+    // 
+    m_entries[entry].body = body;
+    m_entries[entry].createAt = std::chrono::system_clock::now();
+    m_entries[entry].lastWriteTime = lastWriteTime;
+    m_entries[entry].state = CacheEntryState::Fresh;
+}
+
+
+void LRUCache::erase(std::string_view path) {
+    // 
+    Index entry = find(path);
+    if (entry != s_npos) {
+        removeEntry(entry);
+    }
+}
+
+
+std::vector<std::string> LRUCache::keys() const {
+    std::vector<std::string> paths;
+    paths.reserve(m_entries.size());
+    for (Index entry = m_head; entry != s_npos; entry = m_entries[entry].next)
+        paths.push_back(m_entries[entry].path);
+    return paths;
+}
+
+
+std::uint32_t LRUCache::hashPath(std::string_view path) {
+    return static_cast<std::uint32_t>(std::hash<std::string_view>{}(path));
+}
+
+
+std::size_t LRUCache::findSlot(std::string_view path, std::uint32_t hash) const {
+    // linear probing, the table is never full
+    std::size_t slot = hash & m_mask;
+    while (m_table[slot].entry != s_npos) {
+        if (m_table[slot].hash == hash && m_entries[m_table[slot].entry].path == path)
+            break;
+        slot = (slot + 1) & m_mask;
+    }
+    return slot;
+}
+
+
+LRUCache::Index LRUCache::find(std::string_view path) const {
+    return m_table[findSlot(path, hashPath(path))].entry;
+}
+
+
+void LRUCache::eraseSlot(std::size_t slot) {
+    // Backward shift deletion: move back every following slot of the cluster 
+    // whose home slot is not in (slot, next], so no tombstone is needed.
+    std::size_t next = (slot + 1) & m_mask;
+    while (m_table[next].entry != s_npos) {
+        std::size_t home = m_table[next].hash & m_mask;
+        bool inRange = (slot <= next) ? (slot < home && home <= next) 
+                                      : (slot < home || home <= next);
+        if (!inRange) {
+            m_table[slot] = m_table[next];
+            slot = next;
+        }
+        next = (next + 1) & m_mask;
+    }
+    m_table[slot].entry = s_npos;
+}
+
+
+void LRUCache::removeEntry(Index entry) {
+    // 
+    eraseSlot(findSlot(m_entries[entry].path, m_entries[entry].hash));
+    unlink(entry);
+
+    // keep the slab contiguous by moving the last entry into the hole
+    Index last = static_cast<Index>(m_entries.size() - 1);
+    if (entry != last) {
+        CacheEntry& moved = m_entries[last];
+        m_table[findSlot(moved.path, moved.hash)].entry = entry;
+        if (moved.prev != s_npos) m_entries[moved.prev].next = entry; else m_head = entry;
+        if (moved.next != s_npos) m_entries[moved.next].prev = entry; else m_tail = entry;
+        m_entries[entry] = std::move(moved);
+    }
+    m_entries.pop_back();
+}
+
+
+void LRUCache::unlink(Index entry) {
+    CacheEntry& cacheEntry = m_entries[entry];
+    if (cacheEntry.prev != s_npos) m_entries[cacheEntry.prev].next = cacheEntry.next; else m_head = cacheEntry.next;
+    if (cacheEntry.next != s_npos) m_entries[cacheEntry.next].prev = cacheEntry.prev; else m_tail = cacheEntry.prev;
+    cacheEntry.prev = s_npos;
+    cacheEntry.next = s_npos;
+}
+
+
+void LRUCache::pushFront(Index entry) {
+    m_entries[entry].prev = s_npos;
+    m_entries[entry].next = m_head;
+    if (m_head != s_npos) m_entries[m_head].prev = entry; else m_tail = entry;
+    m_head = entry;
+}
+
+
+void LRUCache::moveToFront(Index entry) {
+    if (entry == m_head)
+        return;
+    unlink(entry);
+    pushFront(entry);
+}
+
+
+bool NegativeCache::contains(const std::string& path) {
+    // 
+    std::lock_guard<Mutex> lock(m_mtx);
+    auto it = m_expireAt.find(path);
+
+    // not found
+    if (it == m_expireAt.end()) {
+        return false;
+    }
+
+    // expired
+    if (std::chrono::steady_clock::now() >= it->second) {
+        m_expireAt.erase(it);
+        return false;
+    }
+    return true;
+}
+
+
+void NegativeCache::put(const std::string& path) {
+    // 
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<Mutex> lock(m_mtx);
+
+    // drop the expired entries, then the oldest ones to make room
+    while (!m_order.empty()) {
+        bool expired = now >= m_order.front().second;
+        bool full = m_expireAt.size() >= m_capacity || m_order.size() >= 2 * m_capacity;
+        if (!expired && !full)
+            break;
+        auto it = m_expireAt.find(m_order.front().first);
+        if (it != m_expireAt.end() && it->second == m_order.front().second)
+            m_expireAt.erase(it);
+        m_order.pop_front();
+    }
+
+    // a path put again is queued again, its older position is skipped when dropped
+    auto expireAt = now + m_ttl;
+    m_expireAt[path] = expireAt;
+    m_order.emplace_back(path, expireAt);
+}
+
+
+void NegativeCache::invalidate(const std::string& path) {
+    std::lock_guard<Mutex> lock(m_mtx);
+    m_expireAt.erase(path);
+}
+
+
+void NegativeCache::clear() {
+    std::lock_guard<Mutex> lock(m_mtx);
+    m_expireAt.clear();
+    m_order.clear();
+}
+
+
+SingleFlight::Result SingleFlight::load(const std::string& key, const Loader& loader) {
+    // join the in-flight load if there is one, otherwise become the leader
+    std::unique_lock<Mutex> lock(m_mtx);
+    Flight* flight = nullptr;
+    if (!startFlight(key, flight)) {
+        std::shared_future<Result> future = flight->future;
+        lock.unlock();
+        return future.get();
+    }
+    lock.unlock();
+
+    // leader, run the loader and hand the result (or the error) to the waiters
+    Result result;
+    std::exception_ptr error;
+    try {
+        result = loader();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    complete(key, result, error);
+
+    // 
+    if (error)
+        std::rethrow_exception(error);
+    return result;
+}
+
+
+bool SingleFlight::join(const std::string& key, Callback callback) {
+    std::lock_guard<Mutex> lock(m_mtx);
+    Flight* flight = nullptr;
+    bool started = startFlight(key, flight);
+    flight->callbacks.push_back(std::move(callback));
+    return started;
+}
+
+
+void SingleFlight::complete(const std::string& key, const Result& result, std::exception_ptr error) {
+    // 
+    std::unique_lock<Mutex> lock(m_mtx);
+    auto node = m_inFlight.extract(key);
+    lock.unlock();
+    if (node.empty())
+        return;
+
+    // 
+    Flight& flight = node.mapped();
+    if (error)
+        flight.promise.set_exception(error);
+    else
+        flight.promise.set_value(result);
+    for (Callback& callback : flight.callbacks)
+        callback(result, error);
+}
+
+
+bool SingleFlight::startFlight(const std::string& key, Flight*& flight) {
+    auto [it, started] = m_inFlight.try_emplace(key);
+    flight = &it->second;
+    if (started)
+        flight->future = flight->promise.get_future().share();
+    return started;
 }
 
 
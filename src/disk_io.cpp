@@ -0,0 +1,119 @@
+/**
+ * \file src/disk_io.cpp
+ */
+
+#include <chrono>
+#include <future>
+
+#include "disk_io.h"
+#include "file.h"
+#include "metrics.h"
+
+
+namespace http {
+
+
+namespace {
+
+const Counter s_reads("disk_reads_total", "Files read by the disk threads.");
+const Counter s_readErrors("disk_read_errors_total", "Files the disk threads failed to read.");
+const Counter s_readBytes("disk_read_bytes_total", "Bytes read by the disk threads.");
+const Histogram s_readDuration("disk_read_duration_seconds", "Time to read a file on a disk thread.");
+
+} // namespace
+
+
+DiskIoPool::DiskIoPool(std::size_t threadCount, std::size_t maxQueued)
+    : m_maxQueued(maxQueued > 0 ? maxQueued : 1), m_done(false)
+{
+    for (std::size_t i = 0; i < (threadCount > 0 ? threadCount : 1); ++i) {
+        m_threads.emplace_back(&DiskIoPool::worker_thread, this);
+    }
+}
+
+
+void DiskIoPool::shutdown() {
+    {
+        std::lock_guard<Mutex> lock(m_mutex);
+        m_done = true;
+    }
+    m_notEmpty.notify_all();
+    for (auto& thread : m_threads) {
+        if (thread.joinable())
+            thread.join();
+    }
+}
+
+
+void DiskIoPool::submitRead(const std::string& filepath, Callback callback) {
+    {
+        std::unique_lock<Mutex> lock(m_mutex);
+        m_notFull.wait(lock, [this]{ return m_queue.size() < m_maxQueued; });
+        m_queue.push_back({filepath, std::move(callback)});
+    }
+    m_notEmpty.notify_one();
+}
+
+
+bool DiskIoPool::trySubmitRead(const std::string& filepath, Callback callback) {
+    {
+        std::lock_guard<Mutex> lock(m_mutex);
+        if (m_done || m_queue.size() >= m_maxQueued)
+            return false;
+        m_queue.push_back({filepath, std::move(callback)});
+    }
+    m_notEmpty.notify_one();
+    return true;
+}
+
+
+std::vector<unsigned char> DiskIoPool::read(const std::string& filepath) {
+    // 
+    std::promise<std::vector<unsigned char>> promise;
+    std::future<std::vector<unsigned char>> future = promise.get_future();
+
+    // 
+    submitRead(filepath, [&promise](std::vector<unsigned char> body, std::exception_ptr error) {
+        if (error)
+            promise.set_exception(error);
+        else
+            promise.set_value(std::move(body));
+    });
+    return future.get();
+}
+
+
+void DiskIoPool::worker_thread() {
+    while (true) {
+        // 
+        ReadRequest request;
+        {
+            std::unique_lock<Mutex> lock(m_mutex);
+            m_notEmpty.wait(lock, [this]{ return m_done || !m_queue.empty(); });
+            if (m_queue.empty())
+                return;
+            request = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        m_notFull.notify_one();
+
+        // 
+        std::vector<unsigned char> body;
+        std::exception_ptr error;
+        auto startedAt = std::chrono::steady_clock::now();
+        try {
+            body = loadFile(request.filepath);
+            s_reads.inc();
+            s_readBytes.inc(static_cast<std::int64_t>(body.size()));
+        }
+        catch (...) {
+            error = std::current_exception();
+            s_readErrors.inc();
+        }
+        s_readDuration.record(std::chrono::steady_clock::now() - startedAt);
+        request.callback(std::move(body), error);
+    }
+}
+
+
+} // namespace http::
@@ -0,0 +1,405 @@
+/**
+ * \file src/event_loop.cpp
+ */
+
+#include <algorithm>      // std::min
+#include <cerrno>         // errno
+#include <cstring>        // strerror
+#include <stdexcept>      // std::runtime_error
+#include <fcntl.h>        // open, posix_fadvise
+#include <sys/epoll.h>    // epoll_create1, epoll_ctl, epoll_wait
+#include <sys/eventfd.h>  // eventfd
+#include <sys/sendfile.h> // sendfile
+#include <sys/socket.h>   // recv, send
+#include <unistd.h>       // close, read, write
+
+#include "event_loop.h"
+#include "net.h"
+#include "log.h"
+#include "metrics.h"
+
+namespace http {
+
+
+namespace {
+
+// the series of http::sendAll and http::sendFile
+const Counter s_sentBytes("net_sent_bytes_total", "Bytes sent to the clients, by system call.", "call=\"send\"");
+const Counter s_sentFileBytes("net_sent_bytes_total", "Bytes sent to the clients, by system call.", "call=\"sendfile\"");
+const Counter s_sendErrors("net_send_errors_total", "Responses which failed to be sent.");
+
+const Counter s_wakeups("event_loop_wakeups_total", "Returns of epoll_wait in the event loops.");
+const Counter s_suspensions("event_loop_suspensions_total", "Coroutines suspended by the event loops, by what they wait for.", "wait=\"io\"");
+const Counter s_sleeps("event_loop_suspensions_total", "Coroutines suspended by the event loops, by what they wait for.", "wait=\"timer\"");
+const Counter s_diskReads("event_loop_suspensions_total", "Coroutines suspended by the event loops, by what they wait for.", "wait=\"disk\"");
+const Counter s_flights("event_loop_suspensions_total", "Coroutines suspended by the event loops, by what they wait for.", "wait=\"flight\"");
+const Counter s_timeouts("event_loop_timeouts_total", "Waits for a socket which reached their deadline.");
+
+int wakeTag;   ///< Its address is the epoll data of the eventfd
+
+} // namespace
+
+
+const std::uint32_t EventLoop::READABLE_EVENTS = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+const std::uint32_t EventLoop::WRITABLE_EVENTS = EPOLLOUT | EPOLLONESHOT;
+
+
+EventLoop::DetachedTask::promise_type::~promise_type() {
+    if (loop == nullptr)
+        return;
+    loop->m_tasks.erase(std::coroutine_handle<promise_type>::from_promise(*this).address());
+    loop->m_taskCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+
+EventLoop::DetachedTask EventLoop::runDetached(CoTask<void> task) {
+    try {
+        co_await task;
+    }
+    catch (const std::exception& e) {
+        HTTP_ERROR("Uncaught exception in a coroutine of the event loop: {}", e.what());
+    }
+    catch (...) {
+        HTTP_ERROR("Uncaught exception in a coroutine of the event loop");
+    }
+}
+
+
+bool EventLoop::IoAwaiter::await_suspend(std::coroutine_handle<> awaiting) {
+    handle = awaiting;
+    m_failed = !r_loop.watch(*this, m_events, m_deadline);
+    if (!m_failed)
+        s_suspensions.inc();
+    return !m_failed;
+}
+
+
+void EventLoop::SleepAwaiter::await_suspend(std::coroutine_handle<> awaiting) {
+    handle = awaiting;
+    r_loop.armTimer(*this, m_deadline);
+    s_sleeps.inc();
+}
+
+
+bool EventLoop::ReadFileAwaiter::await_suspend(std::coroutine_handle<> awaiting) {
+    // run on a disk thread, posted back to this loop
+    bool queued = r_diskIo.trySubmitRead(r_filepath, [this, awaiting](std::vector<unsigned char> body, 
+                                                                      std::exception_ptr error) {
+        m_body = std::move(body);
+        m_error = error;
+        r_loop.enqueue(Posted{awaiting, false, true});
+    });
+    if (!queued) {
+        m_error = std::make_exception_ptr(DiskQueueFull());
+        return false;
+    }
+    ++r_loop.m_externalOps;
+    s_diskReads.inc();
+    return true;
+}
+
+
+std::vector<unsigned char> EventLoop::ReadFileAwaiter::await_resume() {
+    if (m_error)
+        std::rethrow_exception(m_error);
+    return std::move(m_body);
+}
+
+
+void EventLoop::FlightAwaiter::await_suspend(std::coroutine_handle<> awaiting) {
+    // posted back to this loop by whoever completes the load, maybe `start` itself
+    ++r_loop.m_externalOps;
+    s_flights.inc();
+    bool leader = r_flights.join(r_key, [this, awaiting](const SingleFlight::Result& result, std::exception_ptr error) {
+        m_result = result;
+        m_error = error;
+        r_loop.enqueue(Posted{awaiting, false, true});
+    });
+    if (leader)
+        m_start();
+}
+
+
+SingleFlight::Result EventLoop::FlightAwaiter::await_resume() {
+    if (m_error)
+        std::rethrow_exception(m_error);
+    return std::move(m_result);
+}
+
+
+EventLoop::EventLoop() : m_stopRequested(false), m_externalOps(0), m_taskCount(0), m_queuedTasks(0) {
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollfd < 0)
+        throw std::runtime_error(std::string("Failed to create the epoll instance: ") + strerror(errno));
+
+    m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakefd < 0) {
+        close(m_epollfd);
+        throw std::runtime_error(std::string("Failed to create the eventfd: ") + strerror(errno));
+    }
+
+    // level-triggered, drained before the posts are taken
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = &wakeTag;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_wakefd, &event);
+}
+
+
+EventLoop::~EventLoop() {
+    // the frames of the spawned coroutines own those they await
+    std::vector<void*> tasks(m_tasks.begin(), m_tasks.end());
+    for (void* task : tasks)
+        std::coroutine_handle<>::from_address(task).destroy();
+
+    // spawned but never started
+    for (const Posted& posted : m_posted) {
+        if (posted.spawned)
+            posted.handle.destroy();
+    }
+
+    close(m_wakefd);
+    close(m_epollfd);
+}
+
+
+void EventLoop::run() {
+    //
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    while (!m_stopRequested.load(std::memory_order_acquire) || m_externalOps > 0) {
+        int count = epoll_wait(m_epollfd, events, EVENT_LOOP_MAX_EVENTS, nextTimeoutMs());
+        if (count < 0 && errno != EINTR)
+            throw std::runtime_error(std::string("epoll_wait failed: ") + strerror(errno));
+        s_wakeups.inc();
+
+        // each waiter is in the events at most once, its coroutine waits for nothing else
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == &wakeTag) {
+                runPosted();
+                continue;
+            }
+            Waiter* waiter = static_cast<Waiter*>(events[i].data.ptr);
+            if (waiter->hasTimer) {
+                m_timers.erase(waiter->timer);
+                waiter->hasTimer = false;
+            }
+            waiter->handle.resume();
+        }
+        expireTimers();
+    }
+
+    // the remaining ones wait for their client, and are destroyed with the loop
+    HTTP_INFO("Event loop stopped with {} coroutines left", m_tasks.size());
+}
+
+
+void EventLoop::stop() {
+    m_stopRequested.store(true, std::memory_order_release);
+    std::uint64_t one = 1;
+    ssize_t written = write(m_wakefd, &one, sizeof(one));
+    (void)written;
+}
+
+
+void EventLoop::spawn(CoTask<void> task) {
+    DetachedTask detached = runDetached(std::move(task));
+    detached.handle.promise().loop = this;
+    m_taskCount.fetch_add(1, std::memory_order_relaxed);
+    m_queuedTasks.fetch_add(1, std::memory_order_relaxed);
+    enqueue(Posted{detached.handle, true, false});
+}
+
+
+void EventLoop::post(std::coroutine_handle<> handle) {
+    enqueue(Posted{handle, false, false});
+}
+
+
+CoTask<ssize_t> EventLoop::recv(int sockfd, void* buffer, std::size_t size, TimePoint deadline) {
+    // try first, the data is often there already
+    while (true) {
+        ssize_t bytesRead = ::recv(sockfd, buffer, size, MSG_DONTWAIT);
+        if (bytesRead >= 0)
+            co_return bytesRead;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            co_return -1;
+        if (!co_await readable(sockfd, deadline)) {
+            s_timeouts.inc();
+            errno = ETIMEDOUT;
+            co_return -1;
+        }
+    }
+}
+
+
+CoTask<bool> EventLoop::sendAll(int sockfd, const void* data, std::size_t size, Clock::duration timeout) {
+    //
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t bytesSent = ::send(sockfd, bytes, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytesSent < 0 && errno == EINTR)
+            continue;
+        if (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (co_await writable(sockfd, deadlineAfter(timeout)))
+                continue;
+            s_timeouts.inc();
+            errno = ETIMEDOUT;
+        }
+        if (bytesSent < 0) {
+            s_sendErrors.inc();
+            co_return false;
+        }
+        s_sentBytes.inc(bytesSent);
+        bytes += bytesSent;
+        size  -= static_cast<std::size_t>(bytesSent);
+    }
+    co_return true;
+}
+
+
+CoTask<bool> EventLoop::sendFile(int sockfd, int fd, std::uintmax_t size, Clock::duration timeout) {
+    //
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // zero-copy, as much as the socket buffer takes
+    off_t offset = 0;
+    off_t end = static_cast<off_t>(size);
+    bool useSendfile = true;
+    bool sent = true;
+    while (useSendfile && offset < end) {
+        std::size_t chunk = static_cast<std::size_t>(std::min<off_t>(end - offset, SEND_FILE_CHUNK_SIZE));
+        ssize_t bytesSent = sendfile(sockfd, fd, &offset, chunk);
+        if (bytesSent < 0 && errno == EINTR)
+            continue;
+        if (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (co_await writable(sockfd, deadlineAfter(timeout)))
+                continue;
+            s_timeouts.inc();
+            errno = ETIMEDOUT;
+        }
+        if (bytesSent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            useSendfile = false;
+            break;
+        }
+        if (bytesSent <= 0) {
+            s_sendErrors.inc();
+            sent = false;
+            break;
+        }
+        s_sentFileBytes.inc(bytesSent);
+    }
+
+    // fallback, one buffer of a chunk
+    if (sent && !useSendfile) {
+        std::vector<char> buffer(SEND_FILE_CHUNK_SIZE);
+        while (sent && offset < end) {
+            std::size_t chunk = static_cast<std::size_t>(std::min<off_t>(end - offset, SEND_FILE_CHUNK_SIZE));
+            ssize_t bytesRead = pread(fd, buffer.data(), chunk, offset);
+            if (bytesRead < 0 && errno == EINTR)
+                continue;
+            sent = bytesRead > 0 && co_await sendAll(sockfd, buffer.data(), static_cast<std::size_t>(bytesRead), timeout);
+            offset += bytesRead;
+        }
+    }
+
+    co_return sent;
+}
+
+
+bool EventLoop::watch(Waiter& waiter, std::uint32_t events, TimePoint deadline) {
+    // one shot, rearmed by the next wait; a closed fd left the epoll set, so is added again
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.ptr = &waiter;
+    if (epoll_ctl(m_epollfd, EPOLL_CTL_MOD, waiter.fd, &event) < 0
+            && (errno != ENOENT || epoll_ctl(m_epollfd, EPOLL_CTL_ADD, waiter.fd, &event) < 0)) {
+        HTTP_ERROR("Failed to watch fd #{}. Error: {}", waiter.fd, strerror(errno));
+        return false;
+    }
+    if (deadline != TimePoint::max())
+        armTimer(waiter, deadline);
+    return true;
+}
+
+
+void EventLoop::armTimer(Waiter& waiter, TimePoint deadline) {
+    waiter.timer = m_timers.emplace(deadline, &waiter);
+    waiter.hasTimer = true;
+}
+
+
+void EventLoop::enqueue(const Posted& posted) {
+    // only the first post wakes the loop, the others find the eventfd readable
+    bool wasEmpty = false;
+    {
+        std::lock_guard<Mutex> lock(m_postedMutex);
+        wasEmpty = m_posted.empty();
+        m_posted.push_back(posted);
+    }
+    if (wasEmpty) {
+        std::uint64_t one = 1;
+        ssize_t written = write(m_wakefd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+
+void EventLoop::runPosted() {
+    // drained before taking the posts, so a later post wakes the loop again
+    std::uint64_t value = 0;
+    ssize_t bytesRead = read(m_wakefd, &value, sizeof(value));
+    (void)bytesRead;
+    {
+        std::lock_guard<Mutex> lock(m_postedMutex);
+        m_running.swap(m_posted);
+    }
+
+    //
+    for (const Posted& posted : m_running) {
+        if (posted.spawned) {
+            m_tasks.insert(posted.handle.address());
+            m_queuedTasks.fetch_sub(1, std::memory_order_relaxed);
+        }
+        if (posted.external)
+            --m_externalOps;
+        posted.handle.resume();
+    }
+    m_running.clear();
+}
+
+
+void EventLoop::expireTimers() {
+    //
+    TimePoint now = Clock::now();
+    while (!m_timers.empty() && m_timers.begin()->first <= now) {
+        Waiter* waiter = m_timers.begin()->second;
+        m_timers.erase(m_timers.begin());
+        waiter->hasTimer = false;
+        waiter->timedOut = true;
+        if (waiter->fd >= 0)
+            epoll_ctl(m_epollfd, EPOLL_CTL_DEL, waiter->fd, nullptr);
+        waiter->handle.resume();
+    }
+}
+
+
+EventLoop::TimePoint EventLoop::deadlineAfter(Clock::duration timeout) {
+    return timeout == Clock::duration::max() ? TimePoint::max() : Clock::now() + timeout;
+}
+
+
+int EventLoop::nextTimeoutMs() const {
+    // rounded up, so the timer has expired when epoll_wait returns
+    if (m_timers.empty())
+        return -1;
+    auto remaining = m_timers.begin()->first - Clock::now();
+    if (remaining <= Clock::duration::zero())
+        return 0;
+    auto ms = std::chrono::ceil<std::chrono::milliseconds>(remaining).count();
+    return static_cast<int>(std::min<decltype(ms)>(ms, 60 * 1000));
+}
+
+
+} // namespace http::
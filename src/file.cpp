@@ -3,6 +3,12 @@
 
 #include <fstream>
 #include <filesystem>
+#include <stdexcept>
+#include <chrono>
+#include <cerrno>        // errno
+#include <fcntl.h>       // open, posix_fadvise
+#include <sys/stat.h>    // fstat
+#include <unistd.h>      // pread, close
 
 #include "file.h"
 #include "log.h"
@@ -12,24 +18,192 @@ namespace http {
 
 
 std::string mapUrlToFilePath(const std::string& urlPath) {
-    std::string baseDir = BASE_DIRECTORY;
-    std::filesystem::path filePath = std::filesystem::canonical(baseDir + urlPath);
-    return filePath.string();
+    std::string filepath;
+    if (!resolveUrlPath(urlPath, filepath)) {
+        throw std::runtime_error("Invalid or missing path: " + urlPath);
+    }
+    return filepath;
 }
 
 
-std::vector<unsigned char> loadFile(std::string const& filepath) {
+/**
+ * \brief The canonical path of BASE_DIRECTORY, with a trailing separator.
+ */
+static const std::string& canonicalBaseDirectory() {
+    static const std::string baseDir = std::filesystem::weakly_canonical(BASE_DIRECTORY).string() + "/";
+    return baseDir;
+}
+
+
+bool resolveUrlPath(const std::string& urlPath, std::string& filepath) noexcept {
+    try {
+        // 
+        std::error_code ec;
+        const std::string& baseDir = canonicalBaseDirectory();
+
+        // 
+        std::filesystem::path filePath = std::filesystem::canonical(BASE_DIRECTORY + urlPath, ec);
+        if (ec || !std::filesystem::is_regular_file(filePath, ec)) {
+            return false;
+        }
+
+        // must not escape the base directory
+        std::string resolved = filePath.string();
+        if (resolved.compare(0, baseDir.size(), baseDir) != 0) {
+            return false;
+        }
+
+        // 
+        filepath = std::move(resolved);
+        return true;
+    }
+    catch (const std::exception&) {
+        // allocation failure
+        return false;
+    }
+}
+
+
+std::string mapFilePathToUrl(const std::string& filepath) {
+    // keep the separator, it starts the URL path
+    const std::string& baseDir = canonicalBaseDirectory();
+    if (filepath.compare(0, baseDir.size(), baseDir) != 0) {
+        return std::string();
+    }
+    return filepath.substr(baseDir.size() - 1);
+}
+
+
+std::vector<std::string> listBaseDirectory() {
+    // 
+    std::vector<std::string> urlPaths;
+    std::error_code ec;
+    std::filesystem::recursive_directory_iterator it(BASE_DIRECTORY, ec), end;
+
     // 
-    std::ifstream file(filepath, std::ios::binary);
+    for (; !ec && it != end; it.increment(ec)) {
+        if (it->is_regular_file(ec)) {
+            std::string relative = it->path().lexically_relative(BASE_DIRECTORY).generic_string();
+            urlPaths.push_back("/" + relative);
+        }
+    }
+    if (ec) {
+        HTTP_ERROR("Failed to list '{}': {}", BASE_DIRECTORY, ec.message());
+    }
+    return urlPaths;
+}
+
 
+std::vector<std::string> readPathList(const std::string& listPath) {
     // 
+    std::vector<std::string> paths;
+    std::ifstream file(listPath);
     if (!file) {
+        return paths;
+    }
+
+    // 
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            paths.push_back(line);
+    }
+    return paths;
+}
+
+
+void writePathList(const std::string& listPath, const std::vector<std::string>& paths) {
+    // 
+    std::string tmpPath = listPath + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::trunc);
+        if (!file) {
+            HTTP_ERROR("Failed to open file for writing: {}", tmpPath);
+            throw std::runtime_error("Failed to open file for writing: " + tmpPath);
+        }
+        for (const auto& path : paths)
+            file << path << '\n';
+        if (!file.flush()) {
+            throw std::runtime_error("Failed to write file: " + tmpPath);
+        }
+    }
+
+    // 
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, listPath, ec);
+    if (ec) {
+        HTTP_ERROR("Failed to rename '{}' to '{}': {}", tmpPath, listPath, ec.message());
+        throw std::runtime_error("Failed to write file: " + listPath);
+    }
+}
+
+
+void FileDescriptor::reset(int fd) {
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = fd;
+}
+
+
+FileDescriptor openFile(const std::string& filepath, std::uintmax_t& size, 
+                        std::filesystem::file_time_type& lastWriteTime) {
+    // 
+    FileDescriptor file(open(filepath.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (file.get() < 0 || fstat(file.get(), &st) < 0 || !S_ISREG(st.st_mode)) {
+        HTTP_ERROR("Failed to open file: {}", filepath);
+        return FileDescriptor();
+    }
+
+    // the clock of std::filesystem::last_write_time, so the ETags match those of the index
+    auto sinceEpoch = std::chrono::seconds(st.st_mtim.tv_sec) + std::chrono::nanoseconds(st.st_mtim.tv_nsec);
+    std::chrono::system_clock::time_point modified(std::chrono::duration_cast<std::chrono::system_clock::duration>(sinceEpoch));
+    size = static_cast<std::uintmax_t>(st.st_size);
+    lastWriteTime = std::chrono::file_clock::from_sys(modified);
+    return file;
+}
+
+
+std::vector<unsigned char> loadFile(std::string const& filepath) {
+    // 
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         HTTP_ERROR("Failed to open file: {}", filepath);
         throw std::runtime_error("Failed to open file: " + filepath);
     }
 
-    std::vector<unsigned char> result((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-    file.close();
+    // 
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        HTTP_ERROR("Failed to stat file: {}", filepath);
+        throw std::runtime_error("Failed to stat file: " + filepath);
+    }
+
+    // the whole file is read once, from start to end
+    posix_fadvise(fd, 0, st.st_size, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+
+    // read into a buffer presized to the file size, it is shrunk if the file was truncated meanwhile
+    std::vector<unsigned char> result(static_cast<std::size_t>(st.st_size));
+    std::size_t offset = 0;
+    while (offset < result.size()) {
+        ssize_t bytesRead = pread(fd, result.data() + offset, result.size() - offset, static_cast<off_t>(offset));
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+        if (bytesRead < 0) {
+            close(fd);
+            HTTP_ERROR("Failed to read file: {}", filepath);
+            throw std::runtime_error("Failed to read file: " + filepath);
+        }
+        if (bytesRead == 0)
+            break;
+        offset += static_cast<std::size_t>(bytesRead);
+    }
+    result.resize(offset);
+    close(fd);
 
     // 
     return result;
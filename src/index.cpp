@@ -0,0 +1,72 @@
+/**
+ * \file src/index.cpp
+ */
+
+#include <cstdio>   // snprintf
+
+#include "index.h"
+#include "file.h"
+#include "log.h"
+
+
+namespace http {
+
+
+std::string makeETag(std::uintmax_t size, std::filesystem::file_time_type lastWriteTime) {
+    char etag[64];
+    auto ticks = lastWriteTime.time_since_epoch().count();
+    std::snprintf(etag, sizeof(etag), "\"%jx-%llx\"", size, static_cast<unsigned long long>(ticks));
+    return etag;
+}
+
+
+std::shared_ptr<const FileIndex> FileIndex::build() {
+    // 
+    auto index = std::make_shared<FileIndex>();
+    std::error_code ec;
+    std::filesystem::recursive_directory_iterator it(BASE_DIRECTORY, ec), end;
+
+    // 
+    for (; !ec && it != end; it.increment(ec)) {
+        // 
+        std::error_code fileEc;
+        if (!it->is_regular_file(fileEc))
+            continue;
+
+        // the canonical path must stay in the base directory
+        std::string urlPath = "/";
+        urlPath += it->path().lexically_relative(BASE_DIRECTORY).generic_string();
+        std::string filepath;
+        if (!resolveUrlPath(urlPath, filepath)) {
+            HTTP_WARN("File '{}' is outside of '{}', not indexed", urlPath, BASE_DIRECTORY);
+            continue;
+        }
+
+        // 
+        FileInfo info;
+        info.size = std::filesystem::file_size(filepath, fileEc);
+        info.lastWriteTime = std::filesystem::last_write_time(filepath, fileEc);
+        if (fileEc)
+            continue;
+        info.filepath = std::move(filepath);
+        info.mimeType = getMimeType(std::filesystem::path(urlPath).extension().string());
+        info.etag = makeETag(info.size, info.lastWriteTime);
+        index->m_files.emplace(std::move(urlPath), std::move(info));
+    }
+    if (ec) {
+        HTTP_ERROR("Failed to index '{}': {}", BASE_DIRECTORY, ec.message());
+    }
+
+    // 
+    HTTP_INFO("Indexed {} files in '{}'", index->m_files.size(), BASE_DIRECTORY);
+    return index;
+}
+
+
+const FileInfo* FileIndex::find(const std::string& urlPath) const {
+    auto it = m_files.find(urlPath);
+    return it != m_files.end() ? &it->second : nullptr;
+}
+
+
+} // namespace http::
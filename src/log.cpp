@@ -4,7 +4,6 @@
 
 
 #include <vector>
-#include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/sinks/basic_file_sink.h>
 
 #include "log.h"
@@ -14,31 +13,41 @@ namespace http {
 
 
 std::shared_ptr<spdlog::logger> Log::s_logger;
+std::shared_ptr<AsyncLogSink>   Log::s_asyncSink;
 
 
-void Log::init() {
-    // 
+void Log::init(LogOverflowPolicy policy) {
+    // only used by the background thread of the AsyncLogSink
     std::vector<spdlog::sink_ptr> logSinks;
 
     // Console sink
-    auto consoleSink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+    auto consoleSink = std::make_shared<BatchedConsoleSink>();
     consoleSink->set_pattern("%^[%n][%H:%M:%S][%t]: %v%$");
     logSinks.emplace_back(consoleSink);
 
     // File sink
-    auto fileSink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("server.log", true);
+    auto fileSink = std::make_shared<spdlog::sinks::basic_file_sink_st>("server.log", true);
     fileSink->set_pattern("[%n][%H:%M:%S][%t][%l]: %v");
     logSinks.emplace_back(fileSink);
 
-    // 
-    s_logger = std::make_shared<spdlog::logger>("SERVER", logSinks.begin(), logSinks.end());
+    // the async sink flushes by batches, and writes the warnings and errors right away
+    s_asyncSink = std::make_shared<AsyncLogSink>("SERVER", std::move(logSinks), policy);
+    s_logger = std::make_shared<spdlog::logger>("SERVER", s_asyncSink);
     spdlog::register_logger(s_logger);
-    s_logger->set_level(spdlog::level::HTTP_LOG_LEVEL);
-    s_logger->flush_on(spdlog::level::HTTP_LOG_LEVEL);
+    setLevel(spdlog::level::HTTP_LOG_LEVEL);
+}
+
+
+void Log::setLevel(spdlog::level::level_enum level) {
+    s_level.store(level, std::memory_order_relaxed);
+    if (s_logger)
+        s_logger->set_level(level);
 }
 
 
 void Log::shutdown() {
+    if (s_logger)
+        s_logger->flush();
     spdlog::shutdown();
 }
 
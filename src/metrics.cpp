@@ -0,0 +1,358 @@
+/**
+ * \file src/metrics.cpp
+ */
+
+#include <algorithm>   // std::find
+#include <cstdio>      // std::snprintf
+#include <memory>
+#include <mutex>
+#include <stdexcept>   // std::runtime_error
+#include <unordered_map>
+
+#include "metrics.h"
+
+
+#define METRICS_EXPORT_MIN_BITS 10   // the first bucket exported is 2^10 ns, ~1 us
+#define METRICS_EXPORT_MAX_BITS 35   // the last bucket exported is 2^35 ns, ~34 s
+
+namespace http {
+
+
+namespace {
+
+/**
+ * \brief A series of a family.
+ */
+struct Series {
+    std::string labels;
+    std::size_t id;                   ///< Among the values or the histograms
+    std::function<double()> read;     ///< Only for the gauge functions, empty once unregistered
+};
+
+/**
+ * \brief The series sharing a name.
+ */
+struct Family {
+    std::string name;
+    std::string help;
+    Metrics::Type type;
+    bool isFunction;
+    std::vector<Series> series;
+};
+
+/**
+ * \brief The families, the live shards, and the totals of the exited threads.
+ */
+struct Registry {
+    std::mutex mutex;
+    std::vector<Family> families;
+    std::size_t valueCount = 0;
+    std::size_t histogramCount = 0;
+    std::size_t functionCount = 0;
+    std::unordered_map<std::size_t, std::pair<std::size_t, std::size_t>> functions;   ///< Id to family and series
+    std::vector<MetricsShard*> shards;
+    std::int64_t retiredValues[METRICS_MAX_SERIES] = {};
+    std::vector<std::vector<std::uint64_t>> retiredHistograms;   ///< The buckets, then the sum
+};
+
+/**
+ * \brief Never destroyed, the threads may exit after the static destructors.
+ */
+Registry& registry() {
+    static Registry* s_registry = new Registry();
+    return *s_registry;
+}
+
+/**
+ * \brief The merged buckets of a histogram, the registry being locked.
+ */
+HistogramSnapshot snapshotLocked(Registry& r, std::size_t id) {
+    HistogramSnapshot snapshot;
+    const std::vector<std::uint64_t>& retired = r.retiredHistograms[id];
+    snapshot.buckets.assign(retired.begin(), retired.begin() + HistogramBuckets::COUNT);
+    snapshot.sum = retired[HistogramBuckets::COUNT];
+    for (MetricsShard* shard : r.shards) {
+        HistogramCells* cells = shard->histograms[id].load(std::memory_order_acquire);
+        if (cells == nullptr)
+            continue;
+        for (std::size_t b = 0; b < HistogramBuckets::COUNT; ++b)
+            snapshot.buckets[b] += cells->buckets[b].load(std::memory_order_relaxed);
+        snapshot.sum += cells->sum.load(std::memory_order_relaxed);
+    }
+    for (std::uint64_t count : snapshot.buckets)
+        snapshot.count += count;
+    return snapshot;
+}
+
+std::int64_t valueLocked(Registry& r, std::size_t id) {
+    std::int64_t value = r.retiredValues[id];
+    for (MetricsShard* shard : r.shards)
+        value += shard->values[id].load(std::memory_order_relaxed);
+    return value;
+}
+
+/**
+ * \brief The name with the labels, `name{labels}` or `name`.
+ */
+std::string seriesName(const std::string& name, const std::string& labels, const std::string& extraLabel = "") {
+    std::string all = labels;
+    if (!extraLabel.empty())
+        all += (all.empty() ? "" : ",") + extraLabel;
+    return all.empty() ? name : name + "{" + all + "}";
+}
+
+std::string formatDouble(double value) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+    return buffer;
+}
+
+const char* typeName(Metrics::Type type) {
+    switch (type) {
+        case Metrics::Type::Counter:   return "counter";
+        case Metrics::Type::Gauge:     return "gauge";
+        case Metrics::Type::Histogram: return "histogram";
+    }
+    return "untyped";
+}
+
+/**
+ * \brief The family of a name, created if new.
+ */
+Family& familyOf(Registry& r, Metrics::Type type, bool isFunction, const std::string& name, const std::string& help) {
+    for (Family& family : r.families) {
+        if (family.name != name)
+            continue;
+        if (family.type != type || family.isFunction != isFunction)
+            throw std::runtime_error("Metric '" + name + "' is already registered with another type");
+        return family;
+    }
+    r.families.push_back(Family{name, help, type, isFunction, {}});
+    return r.families.back();
+}
+
+} // namespace
+
+
+struct Metrics::ShardOwner {
+    MetricsShard* shard = nullptr;
+
+    ~ShardOwner() {
+        //
+        if (shard == nullptr)
+            return;
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (std::size_t i = 0; i < METRICS_MAX_SERIES; ++i)
+            r.retiredValues[i] += shard->values[i].load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < METRICS_MAX_HISTOGRAMS; ++i) {
+            std::unique_ptr<HistogramCells> cells(shard->histograms[i].load(std::memory_order_acquire));
+            if (!cells)
+                continue;
+            std::vector<std::uint64_t>& retired = r.retiredHistograms[i];
+            for (std::size_t b = 0; b < HistogramBuckets::COUNT; ++b)
+                retired[b] += cells->buckets[b].load(std::memory_order_relaxed);
+            retired[HistogramBuckets::COUNT] += cells->sum.load(std::memory_order_relaxed);
+        }
+        r.shards.erase(std::find(r.shards.begin(), r.shards.end(), shard));
+        delete shard;
+
+        // never read, shared by the exited threads
+        static MetricsShard* s_discarded = new MetricsShard();
+        s_localShard = s_discarded;
+    }
+};
+
+
+std::uint64_t HistogramSnapshot::quantile(double q) const {
+    if (count == 0)
+        return 0;
+    std::uint64_t rank = static_cast<std::uint64_t>(q * static_cast<double>(count));
+    rank = std::min(std::max<std::uint64_t>(rank, 1), count);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return HistogramBuckets::upperBound(i);
+    }
+    return HistogramBuckets::upperBound(buckets.size() - 1);
+}
+
+
+MetricsShard& Metrics::createLocalShard() {
+    //
+    MetricsShard* shard = new MetricsShard();
+    for (auto& value : shard->values)
+        value.store(0, std::memory_order_relaxed);
+    for (auto& cells : shard->histograms)
+        cells.store(nullptr, std::memory_order_relaxed);
+
+    //
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.shards.push_back(shard);
+    }
+    static thread_local ShardOwner s_owner;
+    s_owner.shard = shard;
+    s_localShard = shard;
+    return *shard;
+}
+
+
+std::size_t Metrics::registerSeries(Type type, const std::string& name, const std::string& help,
+                                    const std::string& labels) {
+    //
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    Family& family = familyOf(r, type, false, name, help);
+    for (const Series& series : family.series) {
+        if (series.labels == labels)
+            return series.id;
+    }
+
+    //
+    std::size_t id;
+    if (type == Type::Histogram) {
+        if (r.histogramCount >= METRICS_MAX_HISTOGRAMS)
+            throw std::runtime_error("Too many histograms, raise METRICS_MAX_HISTOGRAMS");
+        id = r.histogramCount++;
+        r.retiredHistograms.emplace_back(HistogramBuckets::COUNT + 1, 0);
+    }
+    else {
+        if (r.valueCount >= METRICS_MAX_SERIES)
+            throw std::runtime_error("Too many series, raise METRICS_MAX_SERIES");
+        id = r.valueCount++;
+    }
+    family.series.push_back(Series{labels, id, {}});
+    return id;
+}
+
+
+std::size_t Metrics::registerFunction(const std::string& name, const std::string& help, const std::string& labels,
+                                      std::function<double()> read) {
+    //
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    Family& family = familyOf(r, Type::Gauge, true, name, help);
+    std::size_t familyIndex = static_cast<std::size_t>(&family - r.families.data());
+
+    // a new function for the same labels replaces the previous one
+    std::size_t id = r.functionCount++;
+    std::size_t seriesIndex = family.series.size();
+    for (std::size_t i = 0; i < family.series.size(); ++i) {
+        if (family.series[i].labels == labels) {
+            r.functions.erase(family.series[i].id);
+            seriesIndex = i;
+        }
+    }
+    if (seriesIndex == family.series.size())
+        family.series.push_back(Series{labels, id, std::move(read)});
+    else
+        family.series[seriesIndex] = Series{labels, id, std::move(read)};
+    r.functions[id] = {familyIndex, seriesIndex};
+    return id;
+}
+
+
+void Metrics::unregisterFunction(std::size_t id) {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    auto it = r.functions.find(id);
+    if (it == r.functions.end())
+        return;
+    r.families[it->second.first].series[it->second.second].read = nullptr;
+    r.functions.erase(it);
+}
+
+
+std::int64_t Metrics::value(std::size_t id) {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return valueLocked(r, id);
+}
+
+
+HistogramSnapshot Metrics::snapshot(std::size_t id) {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return snapshotLocked(r, id);
+}
+
+
+std::string Metrics::scrape() {
+    // the functions are called without the lock, they may take locks held
+    // while a thread creates its shard
+    std::vector<Family> families;
+    std::vector<std::vector<std::int64_t>> values;
+    std::vector<std::vector<HistogramSnapshot>> histograms;
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        families = r.families;
+        for (const Family& family : families) {
+            values.emplace_back();
+            histograms.emplace_back();
+            for (const Series& series : family.series) {
+                if (family.isFunction)
+                    continue;
+                if (family.type == Type::Histogram)
+                    histograms.back().push_back(snapshotLocked(r, series.id));
+                else
+                    values.back().push_back(valueLocked(r, series.id));
+            }
+        }
+    }
+
+    //
+    std::string text;
+    for (std::size_t f = 0; f < families.size(); ++f) {
+        const Family& family = families[f];
+        std::string lines;
+        for (std::size_t s = 0; s < family.series.size(); ++s) {
+            const Series& series = family.series[s];
+            if (family.isFunction) {
+                if (series.read)
+                    lines += seriesName(family.name, series.labels) + " " + formatDouble(series.read()) + "\n";
+            }
+            else if (family.type != Type::Histogram) {
+                lines += seriesName(family.name, series.labels) + " " + std::to_string(values[f][s]) + "\n";
+            }
+            else {
+                // cumulative, a bucket per power of two nanoseconds
+                const HistogramSnapshot& snapshot = histograms[f][s];
+                std::uint64_t cumulative = 0;
+                std::size_t b = 0;
+                for (unsigned bits = METRICS_EXPORT_MIN_BITS; bits <= METRICS_EXPORT_MAX_BITS; ++bits) {
+                    std::uint64_t bound = std::uint64_t(1) << bits;
+                    for (; b < HistogramBuckets::COUNT && HistogramBuckets::upperBound(b) <= bound; ++b)
+                        cumulative += snapshot.buckets[b];
+                    std::string le = "le=\"" + formatDouble(static_cast<double>(bound) * 1e-9) + "\"";
+                    lines += seriesName(family.name + "_bucket", series.labels, le) + " " + std::to_string(cumulative) + "\n";
+                }
+                lines += seriesName(family.name + "_bucket", series.labels, "le=\"+Inf\"") + " " + std::to_string(snapshot.count) + "\n";
+                lines += seriesName(family.name + "_sum", series.labels) + " " + formatDouble(static_cast<double>(snapshot.sum) * 1e-9) + "\n";
+                lines += seriesName(family.name + "_count", series.labels) + " " + std::to_string(snapshot.count) + "\n";
+            }
+        }
+        if (lines.empty())
+            continue;
+        text += "# HELP " + family.name + " " + family.help + "\n";
+        text += "# TYPE " + family.name + " " + typeName(family.type) + "\n";
+        text += lines;
+    }
+    return text;
+}
+
+
+HistogramCells* Histogram::allocateCells(MetricsShard& shard) const {
+    HistogramCells* cells = new HistogramCells();
+    for (auto& bucket : cells->buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    cells->sum.store(0, std::memory_order_relaxed);
+    shard.histograms[m_id].store(cells, std::memory_order_release);
+    return cells;
+}
+
+
+} // namespace http::
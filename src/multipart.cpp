@@ -0,0 +1,279 @@
+/**
+ * \file src/multipart.cpp
+ */
+
+#include <algorithm>   // std::min
+#include <cctype>      // std::tolower
+#include <cstring>     // std::memcmp
+
+#include "multipart.h"
+
+
+#define MAX_PART_HEADERS_SIZE (8 * 1024)
+#define MAX_BOUNDARY_SIZE     70
+
+namespace http {
+
+
+namespace {
+
+std::string toLower(std::string str) {
+    std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return std::tolower(c); });
+    return str;
+}
+
+std::string trim(const std::string& str) {
+    std::size_t begin = str.find_first_not_of(" \t");
+    if (begin == std::string::npos)
+        return "";
+    std::size_t end = str.find_last_not_of(" \t");
+    return str.substr(begin, end - begin + 1);
+}
+
+std::string unquote(const std::string& str) {
+    if (str.size() >= 2 && str.front() == '"' && str.back() == '"')
+        return str.substr(1, str.size() - 2);
+    return str;
+}
+
+/**
+ * \brief Find a parameter of a header value like `form-data; name="a"; filename="b"`.
+ */
+std::string findParameter(const std::string& value, const std::string& name) {
+    //
+    std::size_t pos = value.find(';');
+    while (pos != std::string::npos) {
+        std::size_t next = value.find(';', pos + 1);
+        std::string param = value.substr(pos + 1, next == std::string::npos ? std::string::npos : next - pos - 1);
+        pos = next;
+
+        //
+        std::size_t equalPos = param.find('=');
+        if (equalPos != std::string::npos && toLower(trim(param.substr(0, equalPos))) == name)
+            return unquote(trim(param.substr(equalPos + 1)));
+    }
+    return "";
+}
+
+} // namespace
+
+
+MultipartParser::MultipartParser(const std::string& boundary, SinkFactory sinkFactory)
+    : m_state(State::Body), m_delimiter("\r\n--" + boundary), m_pending("\r\n"), m_inPart(false),
+      m_sinkFactory(std::move(sinkFactory)) {
+    // bad character shifts of Horspool
+    std::size_t length = m_delimiter.size();
+    m_skip.fill(length);
+    for (std::size_t i = 0; i + 1 < length; ++i)
+        m_skip[static_cast<unsigned char>(m_delimiter[i])] = length - 1 - i;
+
+    // the first delimiter may start the body without the CRLF, which is pending
+    // from the start, and the preamble is discarded
+}
+
+
+bool MultipartParser::feed(const char* data, std::size_t size) {
+    //
+    while (size > 0 && m_state != State::Done && m_state != State::Error) {
+        std::ptrdiff_t consumed = 0;
+        switch (m_state) {
+        case State::Body:
+            consumed = parseBody(data, size);
+            break;
+        case State::AfterDelimiter:
+            // "--" closes the body, CRLF starts the headers of the next part
+            consumed = 1;
+            if (m_headers.empty() && (*data == ' ' || *data == '\t'))
+                break;
+            m_headers.push_back(*data);
+            if (m_headers.size() < 2)
+                break;
+            if (m_headers == "--") {
+                m_state = State::Done;
+            }
+            else if (m_headers == "\r\n") {
+                m_state = State::Headers;
+            }
+            else {
+                consumed = -1;
+            }
+            break;
+        case State::Headers:
+            consumed = parseHeaders(data, size);
+            break;
+        default:
+            break;
+        }
+
+        //
+        if (consumed < 0) {
+            m_state = State::Error;
+            break;
+        }
+        data += consumed;
+        size -= static_cast<std::size_t>(consumed);
+    }
+    return m_state != State::Error;
+}
+
+
+bool MultipartParser::isDone() const {
+    return m_state == State::Done;
+}
+
+
+bool MultipartParser::parseBoundary(const std::string& contentType, std::string& boundary) {
+    //
+    std::size_t semicolonPos = contentType.find(';');
+    if (toLower(trim(contentType.substr(0, semicolonPos))) != "multipart/form-data")
+        return false;
+
+    //
+    boundary = findParameter(contentType, "boundary");
+    return !boundary.empty() && boundary.size() <= MAX_BOUNDARY_SIZE
+        && boundary.find_first_of("\r\n") == std::string::npos;
+}
+
+
+const char* MultipartParser::findDelimiter(const char* begin, const char* end) const {
+    //
+    const std::size_t length = m_delimiter.size();
+    const char* delimiter = m_delimiter.data();
+    if (static_cast<std::size_t>(end - begin) < length)
+        return end;
+
+    // compare from the last character, and shift by the character under it
+    const char* last = end - length;
+    for (const char* pos = begin; pos <= last; pos += m_skip[static_cast<unsigned char>(pos[length - 1])]) {
+        if (pos[length - 1] == delimiter[length - 1] && std::memcmp(pos, delimiter, length - 1) == 0)
+            return pos;
+    }
+    return end;
+}
+
+
+std::ptrdiff_t MultipartParser::parseBody(const char* data, std::size_t size) {
+    // continue a delimiter which may have started at the end of the last chunk
+    while (!m_pending.empty()) {
+        //
+        std::size_t needed = m_delimiter.size() - m_pending.size();
+        std::size_t count = std::min(needed, size);
+        if (std::memcmp(data, m_delimiter.data() + m_pending.size(), count) == 0) {
+            if (count < needed) {
+                m_pending.append(data, count);
+                return static_cast<std::ptrdiff_t>(count);
+            }
+            m_pending.clear();
+            if (!endPart())
+                return -1;
+            m_state = State::AfterDelimiter;
+            return static_cast<std::ptrdiff_t>(count);
+        }
+
+        // not a delimiter, keep the longest rest which may still start one
+        std::size_t drop = 1;
+        while (drop < m_pending.size()
+               && m_pending.compare(drop, std::string::npos, m_delimiter, 0, m_pending.size() - drop) != 0)
+            ++drop;
+        if (!emit(m_pending.data(), drop))
+            return -1;
+        m_pending.erase(0, drop);
+    }
+
+    // a whole delimiter in the chunk
+    const char* end = data + size;
+    const char* match = findDelimiter(data, end);
+    if (match != end) {
+        if (!emit(data, static_cast<std::size_t>(match - data)) || !endPart())
+            return -1;
+        m_state = State::AfterDelimiter;
+        return (match - data) + static_cast<std::ptrdiff_t>(m_delimiter.size());
+    }
+
+    // keep the end of the chunk which may start a delimiter
+    std::size_t keep = std::min(m_delimiter.size() - 1, size);
+    while (keep > 0 && std::memcmp(end - keep, m_delimiter.data(), keep) != 0)
+        --keep;
+    if (!emit(data, size - keep))
+        return -1;
+    m_pending.assign(end - keep, keep);
+    return static_cast<std::ptrdiff_t>(size);
+}
+
+
+std::ptrdiff_t MultipartParser::parseHeaders(const char* data, std::size_t size) {
+    // the headers start with the CRLF after the delimiter, so an empty header
+    // section also ends with CRLF CRLF
+    std::size_t oldSize = m_headers.size();
+    std::size_t count = std::min(size, MAX_PART_HEADERS_SIZE + 4 - std::min<std::size_t>(oldSize, MAX_PART_HEADERS_SIZE));
+    m_headers.append(data, count);
+
+    //
+    std::size_t endPos = m_headers.find("\r\n\r\n", oldSize < 3 ? 0 : oldSize - 3);
+    if (endPos == std::string::npos) {
+        return m_headers.size() > MAX_PART_HEADERS_SIZE ? -1 : static_cast<std::ptrdiff_t>(count);
+    }
+
+    //
+    std::size_t consumed = endPos + 4 - oldSize;
+    m_headers.resize(endPos + 2);
+    if (!beginPart())
+        return -1;
+    m_state = State::Body;
+    return static_cast<std::ptrdiff_t>(consumed);
+}
+
+
+bool MultipartParser::beginPart() {
+    //
+    MultipartPart part;
+    std::size_t pos = 2;
+    while (pos < m_headers.size()) {
+        std::size_t lineEnd = m_headers.find("\r\n", pos);
+        std::string line = m_headers.substr(pos, lineEnd - pos);
+        pos = lineEnd + 2;
+
+        //
+        std::size_t colonPos = line.find(':');
+        if (colonPos == std::string::npos)
+            return false;
+        part.headers[toLower(trim(line.substr(0, colonPos)))] = trim(line.substr(colonPos + 1));
+    }
+    m_headers.clear();
+
+    //
+    auto disposition = part.headers.find("content-disposition");
+    if (disposition != part.headers.end()) {
+        part.name     = findParameter(disposition->second, "name");
+        part.filename = findParameter(disposition->second, "filename");
+    }
+    auto contentType = part.headers.find("content-type");
+    part.contentType = contentType != part.headers.end() ? contentType->second : "text/plain";
+
+    //
+    m_sink = m_sinkFactory ? m_sinkFactory(part) : nullptr;
+    m_inPart = true;
+    return true;
+}
+
+
+bool MultipartParser::endPart() {
+    // the preamble isn't a part
+    if (!m_inPart)
+        return true;
+    m_inPart = false;
+
+    //
+    std::unique_ptr<MultipartSink> sink = std::move(m_sink);
+    return sink == nullptr || sink->finish();
+}
+
+
+bool MultipartParser::emit(const char* data, std::size_t size) {
+    if (!m_inPart || m_sink == nullptr || size == 0)
+        return true;
+    return m_sink->write(data, size);
+}
+
+
+} // namespace http::
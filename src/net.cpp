@@ -2,16 +2,31 @@
  * \file src/net.cpp
  */
 
+#include <algorithm>      // std::min
+#include <cerrno>         // errno
 #include <stdexcept>      // std::runtime_error
 #include <sys/socket.h>   // socket
 #include <netinet/in.h>   // sockaddr_in
+#include <fcntl.h>        // open, posix_fadvise
+#include <sys/sendfile.h> // sendfile
+#include <vector>
 
 #include "net.h"
 #include "log.h"
+#include "metrics.h"
 
 namespace http {
 
 
+namespace {
+
+const Counter s_sentBytes("net_sent_bytes_total", "Bytes sent to the clients, by system call.", "call=\"send\"");
+const Counter s_sentFileBytes("net_sent_bytes_total", "Bytes sent to the clients, by system call.", "call=\"sendfile\"");
+const Counter s_sendErrors("net_send_errors_total", "Responses which failed to be sent.");
+
+} // namespace
+
+
 SocketRAII::SocketRAII(int sockfd)
     : m_sockfd(sockfd)
 {
@@ -115,17 +130,93 @@ void ServerSocket::startListening(int backlog) {
 }
 
 
-int ServerSocket::acceptConnection() {
-    sockaddr_in clientAddr;
+int ServerSocket::acceptConnection(sockaddr_in* clientAddr) {
+    sockaddr_in address;
     int addrLen = sizeof(sockaddr_in);
-    int clientSocket = accept(m_sock.get(), reinterpret_cast<struct sockaddr*>(&clientAddr), reinterpret_cast<socklen_t*>(&addrLen));
+    int clientSocket = accept(m_sock.get(), reinterpret_cast<struct sockaddr*>(&address), reinterpret_cast<socklen_t*>(&addrLen));
+    if (clientSocket < 0 && (errno == EINTR || errno == EINVAL)) {
+        HTTP_TRACE("Accepting client connection interrupted");
+        return -1;
+    }
     if (clientSocket < 0) {
         HTTP_ERROR("Failed to accept client connection");
         throw std::runtime_error("Failed to accept client connection");
     }
     HTTP_TRACE("Accepted client connection");
+    if (clientAddr != nullptr)
+        *clientAddr = address;
     return clientSocket;
 }
 
 
+int ServerSocket::get() const {
+    return m_sock.get();
+}
+
+
+bool sendAll(int sockfd, const void* data, std::size_t size) {
+    // 
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t bytesSent = send(sockfd, bytes, size, MSG_NOSIGNAL);
+        if (bytesSent < 0 && errno == EINTR)
+            continue;
+        if (bytesSent < 0) {
+            s_sendErrors.inc();
+            return false;
+        }
+        s_sentBytes.inc(bytesSent);
+        bytes += bytesSent;
+        size  -= static_cast<std::size_t>(bytesSent);
+    }
+    return true;
+}
+
+
+bool sendFile(int sockfd, int fd, std::uintmax_t size) {
+    // 
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // zero-copy, one chunk at a time
+    off_t offset = 0;
+    off_t end = static_cast<off_t>(size);
+    bool useSendfile = true;
+    while (useSendfile && offset < end) {
+        // read ahead the next chunk while this one is sent
+        std::size_t chunk = static_cast<std::size_t>(std::min<off_t>(end - offset, SEND_FILE_CHUNK_SIZE));
+        posix_fadvise(fd, offset + static_cast<off_t>(chunk), SEND_FILE_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+
+        // 
+        ssize_t bytesSent = sendfile(sockfd, fd, &offset, chunk);
+        if (bytesSent < 0 && errno == EINTR)
+            continue;
+        if (bytesSent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            useSendfile = false;
+            break;
+        }
+        if (bytesSent <= 0) {
+            s_sendErrors.inc();
+            return false;
+        }
+        s_sentFileBytes.inc(bytesSent);
+    }
+
+    // fallback, one buffer of a chunk
+    if (!useSendfile) {
+        std::vector<char> buffer(SEND_FILE_CHUNK_SIZE);
+        while (offset < end) {
+            std::size_t chunk = static_cast<std::size_t>(std::min<off_t>(end - offset, SEND_FILE_CHUNK_SIZE));
+            ssize_t bytesRead = pread(fd, buffer.data(), chunk, offset);
+            if (bytesRead < 0 && errno == EINTR)
+                continue;
+            if (bytesRead <= 0 || !sendAll(sockfd, buffer.data(), static_cast<std::size_t>(bytesRead)))
+                return false;
+            offset += bytesRead;
+        }
+    }
+
+    return true;
+}
+
+
 } // namespece http::
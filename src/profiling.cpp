@@ -0,0 +1,433 @@
+/**
+ * \file src/profiling.cpp
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>       // std::snprintf
+#include <cstdlib>      // std::malloc, std::free
+#include <cstring>      // std::strrchr
+#include <new>
+#include <vector>
+#include <cxxabi.h>     // abi::__cxa_demangle
+#include <dlfcn.h>      // dladdr
+#include <execinfo.h>   // backtrace
+
+#include "profiling.h"
+
+
+namespace http {
+
+
+#ifdef HTTP_PROFILING
+
+namespace {
+
+/**
+ * \brief A call site of operator new, by its callers.
+ *
+ * The slots are claimed by a CAS of their key, the frames are readable once
+ * `ready` is set.
+ */
+struct AllocationSite {
+    std::atomic<std::uint64_t> key;
+    std::atomic<bool>          ready;
+    void*                      frames[PROFILING_SITE_FRAMES];
+    std::atomic<std::uint64_t> count;
+    std::atomic<std::uint64_t> bytes;
+};
+
+// zero-initialized, usable by the allocations made before main
+AllocationSite s_sites[PROFILING_MAX_SITES];
+std::atomic<std::uint64_t> s_droppedSamples;
+
+/**
+ * \brief The allocations of a thread, summed over the threads by the gauges.
+ *
+ * Taken from malloc and never freed, the block of an exited thread is reused
+ * by the next one, so the sums only grow.
+ */
+struct ThreadBlock {
+    std::atomic<std::uint64_t> calls;
+    std::atomic<std::uint64_t> bytes;
+    std::atomic<std::uint64_t> frees;
+    std::atomic<bool>          live;
+    ThreadBlock*               next;
+};
+
+std::atomic<ThreadBlock*> s_blocks;
+
+thread_local bool          t_inHook;       ///< Set while recording, the allocations it makes aren't
+thread_local std::uint64_t t_calls;
+thread_local std::uint64_t t_bytes;
+thread_local std::uint32_t t_untilSample = PROFILING_SITE_SAMPLE;
+thread_local ThreadBlock*  t_block;
+
+ThreadBlock* claimBlock() {
+    for (ThreadBlock* block = s_blocks.load(std::memory_order_acquire); block != nullptr; block = block->next) {
+        bool live = false;
+        if (!block->live.load(std::memory_order_relaxed) && block->live.compare_exchange_strong(live, true))
+            return block;
+    }
+    ThreadBlock* block = static_cast<ThreadBlock*>(std::calloc(1, sizeof(ThreadBlock)));
+    if (block == nullptr)
+        return nullptr;
+    block->live.store(true, std::memory_order_relaxed);
+    block->next = s_blocks.load(std::memory_order_relaxed);
+    while (!s_blocks.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed)) {}
+    return block;
+}
+
+/**
+ * \brief Releases the block of the thread on exit.
+ */
+struct ThreadBlockOwner {
+    ~ThreadBlockOwner() {
+        if (t_block != nullptr)
+            t_block->live.store(false, std::memory_order_release);
+        t_block = nullptr;
+    }
+};
+
+thread_local ThreadBlockOwner t_blockOwner;
+
+/**
+ * \brief The block of the calling thread, claimed on its first allocation.
+ */
+inline ThreadBlock* threadBlock() {
+    if (t_block == nullptr) {
+        t_block = claimBlock();
+        (void)&t_blockOwner;   // registers the destructor
+    }
+    return t_block;
+}
+
+enum class BlockField { Calls, Bytes, Frees };
+
+double sumBlocks(BlockField field) {
+    std::uint64_t sum = 0;
+    for (ThreadBlock* block = s_blocks.load(std::memory_order_acquire); block != nullptr; block = block->next) {
+        const std::atomic<std::uint64_t>& value = field == BlockField::Calls ? block->calls 
+                                                : field == BlockField::Bytes ? block->bytes : block->frees;
+        sum += value.load(std::memory_order_relaxed);
+    }
+    return static_cast<double>(sum);
+}
+
+// backtrace loads libgcc_s on its first call, not from inside an allocation
+const bool s_backtraceLoaded = [] {
+    void* frame;
+    return backtrace(&frame, 1) > 0;
+}();
+
+// read on each scrape, the hook itself never enters the registry, whose lock
+// may be held by the allocating thread
+const GaugeFunction s_allocationCalls("alloc_calls", "Calls to the global operator new since the start.", "",
+                                      [] { return sumBlocks(BlockField::Calls); });
+const GaugeFunction s_allocationBytes("alloc_bytes", "Bytes requested from the global operator new since the start.", "",
+                                      [] { return sumBlocks(BlockField::Bytes); });
+const GaugeFunction s_deallocationCalls("alloc_frees", "Calls to the global operator delete since the start.", "",
+                                        [] { return sumBlocks(BlockField::Frees); });
+
+/**
+ * \brief Count a sampled allocation in the site of its callers.
+ *
+ * \param caller: The return address of operator new, where the stack of
+ *                the site starts, whatever the frames of the hook inlined.
+ */
+void recordSite(std::size_t size, void* caller) {
+    // the frames from the caller of operator new, or else the caller alone
+    void* stack[PROFILING_SITE_FRAMES + 8];
+    int stackDepth = backtrace(stack, PROFILING_SITE_FRAMES + 8);
+    int first = 0;
+    while (first < stackDepth && stack[first] != caller)
+        ++first;
+    void** frames = stack + first;
+    int depth = std::min(stackDepth - first, PROFILING_SITE_FRAMES);
+    if (depth <= 0) {
+        frames = &caller;
+        depth = 1;
+    }
+
+    std::uint64_t key = 0xcbf29ce484222325ull;
+    for (int i = 0; i < depth; ++i)
+        key = (key ^ reinterpret_cast<std::uintptr_t>(frames[i])) * 0x100000001b3ull;
+    key |= 1;   // 0 is a free slot
+
+    // linear probing, a bounded number of slots
+    for (std::size_t probe = 0; probe < 16; ++probe) {
+        AllocationSite& site = s_sites[(key + probe) & (PROFILING_MAX_SITES - 1)];
+        std::uint64_t current = site.key.load(std::memory_order_acquire);
+        if (current == 0 && site.key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+            for (int i = 0; i < PROFILING_SITE_FRAMES; ++i)
+                site.frames[i] = i < depth ? frames[i] : nullptr;
+            site.ready.store(true, std::memory_order_release);
+            current = key;
+        }
+        if (current == key) {
+            site.count.fetch_add(1, std::memory_order_relaxed);
+            site.bytes.fetch_add(size, std::memory_order_relaxed);
+            return;
+        }
+    }
+    s_droppedSamples.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void recordAllocation(std::size_t size, void* caller) {
+    ++t_calls;
+    t_bytes += size;
+    if (t_inHook)
+        return;
+    t_inHook = true;
+    if (ThreadBlock* block = threadBlock()) {
+        block->calls.fetch_add(1, std::memory_order_relaxed);
+        block->bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    if (--t_untilSample == 0) {
+        t_untilSample = PROFILING_SITE_SAMPLE;
+        recordSite(size, caller);
+    }
+    t_inHook = false;
+}
+
+inline void recordDeallocation() {
+    if (t_inHook)
+        return;
+    t_inHook = true;
+    if (ThreadBlock* block = threadBlock())
+        block->frees.fetch_add(1, std::memory_order_relaxed);
+    t_inHook = false;
+}
+
+void* allocate(std::size_t size, void* caller) {
+    void* p = std::malloc(size > 0 ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    recordAllocation(size, caller);
+    return p;
+}
+
+void* allocateAligned(std::size_t size, std::align_val_t alignment, void* caller) {
+    void* p = nullptr;
+    std::size_t align = std::max(static_cast<std::size_t>(alignment), sizeof(void*));
+    if (posix_memalign(&p, align, size > 0 ? size : 1) != 0)
+        throw std::bad_alloc();
+    recordAllocation(size, caller);
+    return p;
+}
+
+void deallocate(void* p) {
+    if (p == nullptr)
+        return;
+    recordDeallocation();
+    std::free(p);
+}
+
+const Counter s_requests("alloc_requests_total", "Requests whose allocations were counted.");
+const Counter s_requestCalls("alloc_request_calls_total", "Calls to operator new made while serving the requests.");
+const Counter s_requestBytes("alloc_request_bytes_total", "Bytes requested from operator new while serving the requests.");
+
+/**
+ * \brief The names of the profiled mutexes, for the report.
+ */
+struct MutexNames {
+    std::mutex mutex;
+    std::vector<std::string> names;
+};
+
+MutexNames& mutexNames() {
+    static MutexNames s_names;
+    return s_names;
+}
+
+std::string symbolize(void* frame) {
+    Dl_info info;
+    if (dladdr(frame, &info) == 0)
+        return "?";
+
+    char text[512];
+    if (info.dli_sname != nullptr) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        std::snprintf(text, sizeof(text), "%.*s+0x%zx", PROFILING_SYMBOL_WIDTH, 
+                      status == 0 && demangled ? demangled : info.dli_sname,
+                      static_cast<std::size_t>(static_cast<char*>(frame) - static_cast<char*>(info.dli_saddr)));
+        std::free(demangled);
+    }
+    else {
+        const char* module = info.dli_fname ? info.dli_fname : "?";
+        const char* slash = std::strrchr(module, '/');
+        std::snprintf(text, sizeof(text), "%s+0x%zx", slash ? slash + 1 : module,
+                      static_cast<std::size_t>(static_cast<char*>(frame) - static_cast<char*>(info.dli_fbase)));
+    }
+    return text;
+}
+
+} // namespace
+
+
+AllocationCounts threadAllocations() {
+    return AllocationCounts{t_calls, t_bytes};
+}
+
+
+void recordRequestAllocations(const AllocationCounts& counts) {
+    s_requests.inc();
+    s_requestCalls.inc(static_cast<std::int64_t>(counts.calls));
+    s_requestBytes.inc(static_cast<std::int64_t>(counts.bytes));
+}
+
+
+ProfiledMutex::ProfiledMutex(const char* name)
+    : m_acquisitions("mutex_acquisitions_total", "Acquisitions of the profiled mutexes.", std::string("mutex=\"") + name + "\""),
+      m_contended("mutex_contended_total", "Acquisitions of the profiled mutexes which had to wait.", std::string("mutex=\"") + name + "\""),
+      m_wait("mutex_wait_seconds", "Time the contended acquisitions of the profiled mutexes waited.", std::string("mutex=\"") + name + "\"")
+{
+    MutexNames& names = mutexNames();
+    std::lock_guard<std::mutex> lock(names.mutex);
+    if (std::find(names.names.begin(), names.names.end(), name) == names.names.end())
+        names.names.emplace_back(name);
+}
+
+
+void ProfiledMutex::lockContended() {
+    auto start = std::chrono::steady_clock::now();
+    m_mutex.lock();
+    m_wait.record(std::chrono::steady_clock::now() - start);
+    m_contended.inc();
+}
+
+
+std::string profilingReport() {
+    //
+    std::string report;
+    char line[1024];
+    auto kib = [](std::int64_t bytes) { return static_cast<double>(bytes) / 1024.0; };
+
+    std::int64_t requests = s_requests.value();
+    std::snprintf(line, sizeof(line), "== allocations\ncalls %.0f, %.1f KiB, frees %.0f\n",
+                  sumBlocks(BlockField::Calls), sumBlocks(BlockField::Bytes) / 1024.0, sumBlocks(BlockField::Frees));
+    report += line;
+    if (requests > 0) {
+        std::snprintf(line, sizeof(line), "per request: %.1f calls, %.2f KiB, over %lld requests\n",
+                      static_cast<double>(s_requestCalls.value()) / static_cast<double>(requests),
+                      kib(s_requestBytes.value()) / static_cast<double>(requests), static_cast<long long>(requests));
+        report += line;
+    }
+
+    // the sites with the most bytes, their counts scaled back from the sample
+    std::vector<const AllocationSite*> sites;
+    for (const AllocationSite& site : s_sites) {
+        if (site.ready.load(std::memory_order_acquire))
+            sites.push_back(&site);
+    }
+    std::size_t shown = std::min<std::size_t>(sites.size(), PROFILING_REPORT_SITES);
+    std::partial_sort(sites.begin(), sites.begin() + static_cast<std::ptrdiff_t>(shown), sites.end(),
+                      [](const AllocationSite* a, const AllocationSite* b) {
+        return a->bytes.load(std::memory_order_relaxed) > b->bytes.load(std::memory_order_relaxed);
+    });
+    std::snprintf(line, sizeof(line), "\n== allocation sites, top %zu of %zu by bytes, sampled 1 in %d (%llu samples dropped)\n"
+                  "%12s %12s  callers\n", shown, sites.size(), PROFILING_SITE_SAMPLE,
+                  static_cast<unsigned long long>(s_droppedSamples.load(std::memory_order_relaxed)), "calls", "KiB");
+    report += line;
+    for (std::size_t i = 0; i < shown; ++i) {
+        const AllocationSite& site = *sites[i];
+        std::snprintf(line, sizeof(line), "%12llu %12.1f  ",
+                      static_cast<unsigned long long>(site.count.load(std::memory_order_relaxed) * PROFILING_SITE_SAMPLE),
+                      kib(static_cast<std::int64_t>(site.bytes.load(std::memory_order_relaxed) * PROFILING_SITE_SAMPLE)));
+        report += line;
+        for (int f = 0; f < PROFILING_SITE_FRAMES && site.frames[f] != nullptr; ++f)
+            report += (f == 0 ? "" : " < ") + symbolize(site.frames[f]);
+        report += "\n";
+    }
+
+    //
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> lock(mutexNames().mutex);
+        names = mutexNames().names;
+    }
+    std::snprintf(line, sizeof(line), "\n== mutexes\n%-20s %14s %12s %9s %12s %12s %12s %14s\n", "name", "acquisitions",
+                  "contended", "%", "wait p50 us", "wait p99 us", "wait max us", "total wait ms");
+    report += line;
+    for (const std::string& name : names) {
+        // the handles of an existing series, registration is idempotent
+        std::string labels = "mutex=\"" + name + "\"";
+        std::int64_t acquisitions = Counter("mutex_acquisitions_total", "", labels).value();
+        std::int64_t contended = Counter("mutex_contended_total", "", labels).value();
+        HistogramSnapshot wait = Histogram("mutex_wait_seconds", "", labels).snapshot();
+        std::uint64_t max = 0;
+        for (std::size_t i = 0; i < wait.buckets.size(); ++i) {
+            if (wait.buckets[i] > 0)
+                max = HistogramBuckets::upperBound(i);
+        }
+        std::snprintf(line, sizeof(line), "%-20s %14lld %12lld %8.2f%% %12.1f %12.1f %12.1f %14.3f\n", name.c_str(),
+                      static_cast<long long>(acquisitions), static_cast<long long>(contended),
+                      acquisitions > 0 ? 100.0 * static_cast<double>(contended) / static_cast<double>(acquisitions) : 0.0,
+                      static_cast<double>(wait.quantile(0.5)) / 1e3, static_cast<double>(wait.quantile(0.99)) / 1e3,
+                      static_cast<double>(max) / 1e3, static_cast<double>(wait.sum) / 1e6);
+        report += line;
+    }
+    return report;
+}
+
+#else
+
+AllocationCounts threadAllocations() {
+    return AllocationCounts{};
+}
+
+
+void recordRequestAllocations(const AllocationCounts&) {}
+
+
+std::string profilingReport() {
+    return "Built without HTTP_SERVER_PROFILING.\n";
+}
+
+#endif
+
+
+} // namespace http::
+
+
+#ifdef HTTP_PROFILING
+
+// the replacements of the global operator new and delete, every form of them
+void* operator new(std::size_t size) { return http::allocate(size, __builtin_return_address(0)); }
+void* operator new[](std::size_t size) { return http::allocate(size, __builtin_return_address(0)); }
+void* operator new(std::size_t size, std::align_val_t alignment) { return http::allocateAligned(size, alignment, __builtin_return_address(0)); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return http::allocateAligned(size, alignment, __builtin_return_address(0)); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try { return http::allocate(size, __builtin_return_address(0)); } catch (...) { return nullptr; }
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    try { return http::allocate(size, __builtin_return_address(0)); } catch (...) { return nullptr; }
+}
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try { return http::allocateAligned(size, alignment, __builtin_return_address(0)); } catch (...) { return nullptr; }
+}
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try { return http::allocateAligned(size, alignment, __builtin_return_address(0)); } catch (...) { return nullptr; }
+}
+
+// GCC can't tell that these replace the operator new above
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { http::deallocate(p); }
+void operator delete[](void* p) noexcept { http::deallocate(p); }
+void operator delete(void* p, std::size_t) noexcept { http::deallocate(p); }
+void operator delete[](void* p, std::size_t) noexcept { http::deallocate(p); }
+void operator delete(void* p, std::align_val_t) noexcept { http::deallocate(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { http::deallocate(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { http::deallocate(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { http::deallocate(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { http::deallocate(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { http::deallocate(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { http::deallocate(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { http::deallocate(p); }
+#pragma GCC diagnostic pop
+
+#endif
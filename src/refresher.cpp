@@ -0,0 +1,133 @@
+/**
+ * \file src/refresher.cpp
+ */
+
+#include <filesystem>
+#include <sys/resource.h>   // setpriority
+#include <sys/syscall.h>    // SYS_gettid
+#include <unistd.h>         // syscall
+
+#include "refresher.h"
+#include "file.h"
+#include "log.h"
+
+#define REFRESHER_NICE 19
+
+
+namespace http {
+
+
+CacheRefresher::CacheRefresher(LRUCache& cache, Mutex& cacheMtx, AtomicFileIndex& fileIndex, NegativeCache& missing)
+    : r_cache(cache), r_cacheMtx(cacheMtx), r_fileIndex(fileIndex), r_missing(missing), 
+      m_done(false), m_rebuildPending(false)
+{
+    m_thread = std::thread(&CacheRefresher::worker_thread, this);
+}
+
+
+CacheRefresher::~CacheRefresher() {
+    // wake up the worker with an empty path
+    m_done = true;
+    m_queue.push(std::string());
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+
+void CacheRefresher::schedule(const std::string& filepath) {
+    HTTP_TRACE("Scheduled refresh of stale cache entry '{}'", filepath);
+    m_queue.push(filepath);
+}
+
+
+void CacheRefresher::scheduleIndexRebuild() {
+    // an empty path wakes up the worker to check the pending rebuild
+    if (!m_rebuildPending.exchange(true)) {
+        HTTP_TRACE("Scheduled rebuild of the file index");
+        m_queue.push(std::string());
+    }
+}
+
+
+void CacheRefresher::worker_thread() {
+    // On Linux, the nice value is a per-thread attribute. Failing to lower it 
+    // is harmless, and the logger may not be initialized yet, so ignore errors.
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), REFRESHER_NICE);
+
+    // 
+    while (m_done == false) {
+        std::string filepath;
+        m_queue.wait_and_pop(filepath);
+        if (!filepath.empty())
+            refresh(filepath);
+        else if (m_rebuildPending.exchange(false))
+            rebuildIndex();
+    }
+}
+
+
+void CacheRefresher::refresh(const std::string& filepath) {
+    // 
+    std::filesystem::file_time_type cachedWriteTime;
+    {
+        std::lock_guard<Mutex> lock(r_cacheMtx);
+        if (!r_cache.beginRefresh(filepath, cachedWriteTime))
+            return;
+    }
+
+    // the file is gone, stop serving it
+    std::error_code ec;
+    std::filesystem::file_time_type lastWriteTime = std::filesystem::last_write_time(filepath, ec);
+    if (ec) {
+        HTTP_INFO("Dropped cache entry of removed file '{}'", filepath);
+        {
+            std::lock_guard<Mutex> lock(r_cacheMtx);
+            r_cache.erase(filepath);
+        }
+        scheduleIndexRebuild();
+        return;
+    }
+
+    // not modified, only the timestamp of the entry needs to be renewed
+    if (lastWriteTime == cachedWriteTime) {
+        HTTP_TRACE("Revalidated cache entry '{}'", filepath);
+        std::lock_guard<Mutex> lock(r_cacheMtx);
+        r_cache.revalidate(filepath);
+        return;
+    }
+
+    // modified, reload it and update its size and ETag in the index
+    scheduleIndexRebuild();
+    if (std::filesystem::file_size(filepath, ec) > STREAMING_THRESHOLD) {
+        HTTP_INFO("Dropped cache entry of file '{}' grown over the streaming threshold", filepath);
+        std::lock_guard<Mutex> lock(r_cacheMtx);
+        r_cache.erase(filepath);
+        return;
+    }
+    try {
+        std::vector<unsigned char> body = loadFile(filepath);
+        std::lock_guard<Mutex> lock(r_cacheMtx);
+        r_cache.update(filepath, body, lastWriteTime);
+        HTTP_INFO("Reloaded modified file '{}' into cache", filepath);
+    }
+    catch (const std::exception& e) {
+        HTTP_ERROR("Failed to reload cache entry: {}", e.what());
+        std::lock_guard<Mutex> lock(r_cacheMtx);
+        r_cache.erase(filepath);
+    }
+}
+
+
+void CacheRefresher::rebuildIndex() {
+    // files may have been created, don't keep answering 404 for them
+    std::shared_ptr<const FileIndex> previous = r_fileIndex.load();
+    std::shared_ptr<const FileIndex> index = FileIndex::build();
+    for (const auto& file : index->files()) {
+        if (previous->find(file.first) == nullptr)
+            r_missing.invalidate(file.first);
+    }
+    r_fileIndex.store(std::move(index));
+}
+
+
+} // namespace http::
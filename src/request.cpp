@@ -2,17 +2,33 @@
  * \file src/request.cpp
  */
 
+#include <algorithm>
 #include <exception>
 #include <filesystem>
 #include <fstream>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cerrno>         // errno
+#include <cstdlib>        // std::strtoull
+#include <limits>
+#include <strings.h>      // strcasecmp
+#include <fcntl.h>        // open, fallocate, splice
+#include <sys/socket.h>   // recv
+#include <sys/stat.h>     // fchmod
+#include <unistd.h>       // write, fsync, close
 
 #include "request.h"
 #include "response.h"
 #include "file.h"
+#include "multipart.h"
 #include "log.h"
+#include "event_loop.h"
 
 
+#define BODY_BUFFER_SIZE  (64 * 1024)
+#define MAX_ECHO_BODY     (64 * 1024)
+
 namespace http {
 
 
@@ -45,38 +61,301 @@ void HttpRequest::parse(const std::string& request) {
             headerValue = headerValue.substr(0, crPos);
             this->headers[headerName] = headerValue;
 
-            HTTP_INFO("Parsed header: {}: {}", headerName, headerValue);
+            HTTP_EVERY_N(64, HTTP_INFO, "Parsed header: {}: {}", headerName, headerValue);
         }
     }
+}
+
+
+const std::string* HttpRequest::findHeader(const std::string& name) const {
+    // exact match first, the common case
+    auto it = this->headers.find(name);
+    if (it != this->headers.end())
+        return &it->second;
+
+    // 
+    for (const auto& header : this->headers) {
+        if (strcasecmp(header.first.c_str(), name.c_str()) == 0)
+            return &header.second;
+    }
+    return nullptr;
+}
+
+
+bool HttpRequest::contentLength(std::size_t& length) const {
+    // 
+    length = 0;
+    if (findHeader("Transfer-Encoding") != nullptr)
+        return false;
+    const std::string* value = findHeader("Content-Length");
+    if (value == nullptr)
+        return true;
+
+    // digits only, strtoull would accept signs and spaces
+    if (value->empty() || value->find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    errno = 0;
+    unsigned long long parsed = std::strtoull(value->c_str(), nullptr, 10);
+    if (errno == ERANGE || parsed > std::numeric_limits<std::size_t>::max())
+        return false;
+    length = static_cast<std::size_t>(parsed);
+    return true;
+}
+
+
+/**
+ * \brief The URL path a saved upload is served at, empty if it's outside the base directory.
+ */
+static std::string uploadUrlPath(const std::string& filepath) {
+    std::error_code ec;
+    std::filesystem::path canonical = std::filesystem::canonical(filepath, ec);
+    return ec ? std::string() : mapFilePathToUrl(canonical.string());
+}
+
+
+/**
+ * \brief Writes a whole buffer to a file descriptor, retrying on partial writes.
+ */
+static bool writeAll(int fd, const char* data, std::size_t size) {
+    while (size > 0) {
+        ssize_t bytesWritten = write(fd, data, size);
+        if (bytesWritten < 0 && errno == EINTR)
+            continue;
+        if (bytesWritten <= 0)
+            return false;
+        data += bytesWritten;
+        size -= static_cast<std::size_t>(bytesWritten);
+    }
+    return true;
+}
+
+
+UploadFile::UploadFile(const UploadOptions& uploadOptions)
+    : r_uploadOptions(uploadOptions), m_fd(-1), m_committed(false) {
+    // unique temporary file, hidden until it is complete
+    m_tmpFilename = r_uploadOptions.directory + "/.upload-XXXXXX";
+    m_fd = mkostemp(&m_tmpFilename[0], O_CLOEXEC);
+    if (m_fd < 0) {
+        throw std::runtime_error("Failed to create temporary file in '" + r_uploadOptions.directory + "'");
+    }
+
+    // mkstemp creates the file private, uploads are readable like any other file
+    fchmod(m_fd, 0644);
+}
+
 
-    // GET request does not contain a body
-    if (this->method == "POST") {
-        while (std::getline(requestStream, line)) {
-            this->body += line;
+UploadFile::~UploadFile() {
+    if (m_fd >= 0)
+        close(m_fd);
+    if (!m_committed)
+        unlink(m_tmpFilename.c_str());
+}
+
+
+void UploadFile::preallocate(std::size_t size) {
+    if (size > 0 && fallocate(m_fd, 0, 0, static_cast<off_t>(size)) < 0 && errno == ENOSPC) {
+        throw std::runtime_error("No space left for the uploaded file");
+    }
+}
+
+
+void UploadFile::write(const char* data, std::size_t size) {
+    if (!writeAll(m_fd, data, size)) {
+        throw std::runtime_error("Failed to write the uploaded file");
+    }
+}
+
+
+void UploadFile::finish() {
+    // 
+    if (r_uploadOptions.fsyncPolicy == UploadFsyncPolicy::Data && fdatasync(m_fd) < 0) {
+        throw std::runtime_error("Failed to flush the uploaded file");
+    }
+    if (r_uploadOptions.fsyncPolicy == UploadFsyncPolicy::Full && fsync(m_fd) < 0) {
+        throw std::runtime_error("Failed to flush the uploaded file");
+    }
+    close(m_fd);
+    m_fd = -1;
+}
+
+
+const std::string& UploadFile::commit() {
+    // unique final name
+    static std::atomic<unsigned long> s_uploadCount{0};
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    m_filename = r_uploadOptions.directory + "/upload-" 
+               + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(now).count()) 
+               + "-" + std::to_string(s_uploadCount++);
+    if (rename(m_tmpFilename.c_str(), m_filename.c_str()) < 0) {
+        throw std::runtime_error("Failed to rename the uploaded file");
+    }
+    m_committed = true;
+
+    // make the rename durable
+    if (r_uploadOptions.fsyncPolicy == UploadFsyncPolicy::Full) {
+        int dirfd = open(r_uploadOptions.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd >= 0) {
+            fsync(dirfd);
+            close(dirfd);
         }
-        HTTP_INFO("Parsed body of length {}", this->body.size());
     }
+    HTTP_INFO("Saved uploaded file '{}'", m_filename);
+    return m_filename;
+}
+
+
+const std::string& UploadFile::filename() const {
+    return m_filename;
 }
 
 
-std::string HttpRequestHandler::handleRequest(const std::string& request) {
+bool UploadFileSink::write(const char* data, std::size_t size) {
+    r_file.write(data, size);
+    return true;
+}
+
+
+bool UploadFileSink::finish() {
+    r_file.finish();
+    return true;
+}
+
+
+std::string BodyReader::read(std::size_t maxSize) {
     // 
-    HTTP_TRACE("Handling HTTP request with length {}", request.length());
+    std::string result;
+    std::size_t size = std::min(maxSize, m_remaining);
+    result.resize(size);
+
+    // 
+    std::size_t offset = 0;
+    while (offset < size) {
+        ssize_t bytesRead = readSome(&result[offset], size - offset);
+        if (bytesRead <= 0)
+            break;
+        offset += static_cast<std::size_t>(bytesRead);
+    }
+    result.resize(offset);
+    return result;
+}
+
+
+ssize_t BodyReader::readSome(char* buffer, std::size_t size) {
+    // 
+    size = std::min(size, m_remaining);
+    if (size == 0)
+        return 0;
+
+    // the bytes read along with the head first
+    if (m_bufferedPos < m_buffered.size()) {
+        std::size_t count = std::min(size, m_buffered.size() - m_bufferedPos);
+        std::copy_n(m_buffered.data() + m_bufferedPos, count, buffer);
+        m_bufferedPos += count;
+        m_remaining   -= count;
+        return static_cast<ssize_t>(count);
+    }
+
+    // 
+    if (m_sockfd < 0)
+        return -1;
+    ssize_t bytesRead;
+    do {
+        bytesRead = recv(m_sockfd, buffer, size, 0);
+    } while (bytesRead < 0 && errno == EINTR);
+    if (bytesRead > 0)
+        m_remaining -= static_cast<std::size_t>(bytesRead);
+    return bytesRead > 0 ? bytesRead : -1;
+}
+
+
+bool BodyReader::writeTo(int fd, bool useSplice) {
+    // the bytes read along with the head first
+    if (m_bufferedPos < m_buffered.size() && m_remaining > 0) {
+        std::size_t count = std::min(m_remaining, m_buffered.size() - m_bufferedPos);
+        if (!writeAll(fd, m_buffered.data() + m_bufferedPos, count))
+            return false;
+        m_bufferedPos += count;
+        m_remaining   -= count;
+    }
+
+    // socket -> pipe -> file, without copying through user space
+    int pipefd[2];
+    if (useSplice && m_remaining > 0 && m_sockfd >= 0 && pipe2(pipefd, O_CLOEXEC) == 0) {
+        bool spliceUnsupported = false;
+        while (m_remaining > 0) {
+            // 
+            ssize_t bytesIn = splice(m_sockfd, nullptr, pipefd[1], nullptr, std::min<std::size_t>(m_remaining, BODY_BUFFER_SIZE), 
+                                     SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (bytesIn < 0 && errno == EINTR)
+                continue;
+            if (bytesIn < 0 && errno == EINVAL) {
+                spliceUnsupported = true;
+                break;
+            }
+            if (bytesIn <= 0)
+                break;
+
+            // drain the pipe
+            ssize_t pending = bytesIn;
+            while (pending > 0) {
+                ssize_t bytesOut = splice(pipefd[0], nullptr, fd, nullptr, static_cast<std::size_t>(pending), SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (bytesOut < 0 && errno == EINTR)
+                    continue;
+                if (bytesOut <= 0)
+                    break;
+                pending -= bytesOut;
+            }
+            if (pending > 0)
+                break;
+            m_remaining -= static_cast<std::size_t>(bytesIn);
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (!spliceUnsupported)
+            return m_remaining == 0;
+    }
+
+    // copy through a fixed-size buffer
+    std::vector<char> buffer(std::min<std::size_t>(m_remaining, BODY_BUFFER_SIZE));
+    while (m_remaining > 0) {
+        ssize_t bytesRead = readSome(buffer.data(), buffer.size());
+        if (bytesRead <= 0 || !writeAll(fd, buffer.data(), static_cast<std::size_t>(bytesRead)))
+            return false;
+    }
+    return true;
+}
+
+
+HttpResponseBuilder HttpRequestHandler::handleRequest(const std::string& head, BodyReader& body) {
+    // 
+    HTTP_TRACE("Handling HTTP request with head length {}", head.length());
 
     // 
     HttpRequest httpRequest;
-    httpRequest.parse(request);
+    httpRequest.parse(head);
+    return handleRequest(httpRequest, body);
+}
+
 
+HttpResponseBuilder HttpRequestHandler::handleRequest(HttpRequest& httpRequest, BodyReader& body) {
     // 
     HttpResponseBuilder responseBuilder;
 
     // 
     try {
+        // length of the body, chunked bodies aren't supported
+        std::size_t contentLength = 0;
+        if (!httpRequest.contentLength(contentLength)) {
+            throw std::runtime_error("Unsupported Transfer-Encoding or invalid Content-Length");
+        }
+        body.setContentLength(contentLength);
+
+        // 
         if (httpRequest.method == "GET") {
             handleGetRequest(httpRequest, responseBuilder);
         }
         else if (httpRequest.method == "POST") {
-            handlePostRequest(httpRequest, responseBuilder);
+            handlePostRequest(httpRequest, body, responseBuilder);
         }
         else {
             HTTP_ERROR("Unsupported HTTP method: {}", httpRequest.method);
@@ -88,9 +367,43 @@ std::string HttpRequestHandler::handleRequest(const std::string& request) {
     }
 
     // 
-    std::string response = responseBuilder.build();
-    HTTP_INFO("Handled request, response length: {}", response.size());
-    return response;
+    HTTP_INFO("Handled request, response body length: {}", responseBuilder.getBodySize());
+    return responseBuilder;
+}
+
+
+HttpResponseBuilder HttpRequestHandler::handleRequest(const std::string& request) {
+    // 
+    std::size_t headEnd = request.find("\r\n\r\n");
+    headEnd = (headEnd == std::string::npos) ? request.size() : headEnd + 4;
+
+    // 
+    BodyReader body(-1, request.substr(headEnd));
+    return handleRequest(request.substr(0, headEnd), body);
+}
+
+
+CoTask<HttpResponseBuilder> HttpRequestHandler::handleRequestAsync(HttpRequest& httpRequest, EventLoop& loop) {
+    // 
+    HttpResponseBuilder responseBuilder;
+
+    // only bodiless GETs, an empty method is an invalid head
+    if (httpRequest.method == "GET") {
+        if (httpRequest.path == "/")
+            httpRequest.path = "/home.html";
+        if (httpRequest.path == "/echo")
+            handleEcho(httpRequest, responseBuilder);
+        else
+            co_await serveStaticFileAsync(httpRequest, responseBuilder, loop);
+    }
+    else {
+        HTTP_ERROR("Unsupported HTTP method: {}", httpRequest.method);
+        co_await serveStatusCodeImageAsync(responseBuilder, HttpStatusCode::BadRequest, loop);
+    }
+
+    // 
+    HTTP_INFO("Handled request, response body length: {}", responseBuilder.getBodySize());
+    co_return responseBuilder;
 }
 
 
@@ -113,17 +426,18 @@ void HttpRequestHandler::handleGetRequest(HttpRequest& httpRequest, HttpResponse
 }
 
 
-void HttpRequestHandler::handlePostRequest(HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder) {
+void HttpRequestHandler::handlePostRequest(HttpRequest& httpRequest, BodyReader& body, HttpResponseBuilder& responseBuilder) {
     // 
-    HTTP_TRACE("Handling GET request for path '{}'", httpRequest.path);
+    HTTP_TRACE("Handling POST request for path '{}'", httpRequest.path);
 
     // 
     if (httpRequest.path == "/echo") {
+        httpRequest.body = body.read(MAX_ECHO_BODY);
         handleEcho(httpRequest, responseBuilder);
         HTTP_INFO("Responding to POST request for '/echo'");
     }
     else if (httpRequest.path == "/upload") {
-        handleUpload(httpRequest, responseBuilder);
+        handleUpload(httpRequest, body, responseBuilder);
         HTTP_INFO("Responding to POST request for '/upload'");
     }
 }
@@ -151,13 +465,22 @@ void HttpRequestHandler::handleEcho(HttpRequest& httpRequest, HttpResponseBuilde
 }
 
 
-void HttpRequestHandler::handleUpload(HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder) {
+void HttpRequestHandler::handleUpload(HttpRequest& httpRequest, BodyReader& body, HttpResponseBuilder& responseBuilder) {
     // 
+    HTTP_TRACE("Handling upload of {} bytes for path '{}'", body.remaining(), httpRequest.path);
     responseBuilder.setStatusCode(HttpStatusCode::OK);
 
+    // the Content-Length bounds what is read, and what is reserved on disk
+    if (body.remaining() > r_uploadOptions.maxSize) {
+        HTTP_ERROR("Refused upload of {} bytes, over the limit of {}", body.remaining(), r_uploadOptions.maxSize);
+        responseBuilder.setStatusCode(HttpStatusCode::PayloadTooLarge);
+        responseBuilder.setHeader("Content-Type", "text/plain");
+        responseBuilder.setBody("The uploaded file is too large.");
+        return;
+    }
+
     // 
-    std::string uploadFolder = "uploads";
-    std::string uploadFilename = uploadFolder + "/uploaded_file.txt";
+    const std::string& uploadFolder = r_uploadOptions.directory;
 
     // mkdir
     try {
@@ -178,21 +501,46 @@ void HttpRequestHandler::handleUpload(HttpRequest& httpRequest, HttpResponseBuil
     }
 
     // 
+    std::vector<std::unique_ptr<UploadFile>> files;
     try {
-        // 
-        std::ofstream ofs;
-        ofs.open(uploadFilename);
-        if (!ofs.is_open()) {
-            HTTP_ERROR("Failed to open file for writing: '{}'", uploadFilename);
-            throw std::runtime_error("Failed to open file for writing");
+        // a form of browser stores the files of its parts, anything else is stored verbatim
+        std::string boundary;
+        const std::string* contentType = httpRequest.findHeader("Content-Type");
+        if (contentType != nullptr && MultipartParser::parseBoundary(*contentType, boundary)) {
+            if (!receiveMultipart(body, boundary, files)) {
+                HTTP_ERROR("Malformed multipart body");
+                responseBuilder.setStatusCode(HttpStatusCode::BadRequest);
+                responseBuilder.setHeader("Content-Type", "text/plain");
+                responseBuilder.setBody("Malformed multipart body.");
+                return;
+            }
+        }
+        else {
+            // reserve the blocks up front, fewer extent allocations and early ENOSPC
+            files.push_back(std::make_unique<UploadFile>(r_uploadOptions));
+            UploadFile& file = *files.back();
+            file.preallocate(body.remaining());
+            if (!body.writeTo(file.fd(), r_uploadOptions.useSplice)) {
+                throw std::runtime_error("Failed to receive the uploaded file");
+            }
+            file.finish();
+        }
+
+        // the renames make the complete files appear atomically; only the uploads 
+        // under the served directory have a URL, which may be cached as missing
+        std::string urlPaths;
+        for (auto& file : files) {
+            std::string urlPath = uploadUrlPath(file->commit());
+            if (urlPath.empty())
+                continue;
+            r_missing.invalidate(urlPath);
+            urlPaths += urlPath + "\n";
         }
-        ofs << httpRequest.body;
-        ofs.close();
 
         // didn't use status code image, because i want to test POST method in terminal
         responseBuilder.setStatusCode(HttpStatusCode::OK);
         responseBuilder.setHeader("Content-Type", "text/plain");
-        responseBuilder.setBody("File uploaded successfully\n");
+        responseBuilder.setBody("File uploaded successfully\n" + urlPaths);
     } catch (const std::exception& e) {
         HTTP_ERROR("Error serving file: {}", e.what());
         responseBuilder.setStatusCode(HttpStatusCode::InternalServerError);
@@ -202,44 +550,51 @@ void HttpRequestHandler::handleUpload(HttpRequest& httpRequest, HttpResponseBuil
 }
 
 
-void HttpRequestHandler::serveStaticFile(HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder) {
-    // 
-    try {
-        // 
-        std::string filepath = mapUrlToFilePath(httpRequest.path);
-        std::string extension = std::filesystem::path(filepath).extension().string();
-
-        // 
-        std::vector<unsigned char> cacheContent;
-        std::vector<unsigned char> fileContent;
+bool HttpRequestHandler::receiveMultipart(BodyReader& body, const std::string& boundary, 
+                                          std::vector<std::unique_ptr<UploadFile>>& files) {
+    // the parts with a filename go to their own file, the form fields are dropped
+    MultipartParser parser(boundary, [&](const MultipartPart& part) -> std::unique_ptr<MultipartSink> {
+        if (part.filename.empty()) {
+            HTTP_INFO("Ignored form field '{}'", part.name);
+            return nullptr;
+        }
+        HTTP_INFO("Receiving file '{}' of form field '{}' ({})", part.filename, part.name, part.contentType);
+        files.push_back(std::make_unique<UploadFile>(r_uploadOptions));
+        return std::make_unique<UploadFileSink>(*files.back());
+    });
 
-        // minimize the critical section
-        {
-            std::lock_guard<std::mutex> lock(r_cacheMtx);
-            cacheContent = r_cache.getOrDeleteExpired(filepath);
+    // 
+    std::vector<char> buffer(std::min<std::size_t>(body.remaining(), BODY_BUFFER_SIZE));
+    while (body.remaining() > 0) {
+        ssize_t bytesRead = body.readSome(buffer.data(), buffer.size());
+        if (bytesRead <= 0) {
+            throw std::runtime_error("Failed to receive the uploaded file");
         }
+        if (!parser.feed(buffer.data(), static_cast<std::size_t>(bytesRead)))
+            return false;
+    }
+    return parser.isDone();
+}
 
-        // 
-        if (cacheContent.empty()) {
-            // 
-            fileContent = loadFile(filepath);
 
-            // minimize the critical section
-            {
-                std::lock_guard<std::mutex> lock(r_cacheMtx);
-                r_cache.put(filepath, fileContent);
-            }
-            HTTP_INFO("Served static file '{}'", filepath);
-        }
-        else {
-            fileContent = cacheContent;
-            HTTP_INFO("Served static file from cache");
-        }
+void HttpRequestHandler::serveStaticFile(HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder) {
+    //
+    FileInfo unindexed;
+    const FileInfo* info = nullptr;
+    StaticFileLookup lookup = lookupStaticFile(httpRequest, responseBuilder, unindexed, info);
+    if (lookup == StaticFileLookup::NotFound) {
+        serveStatusCodeImage(responseBuilder, HttpStatusCode::NotFound);
+        return;
+    }
+    if (lookup == StaticFileLookup::Streamed)
+        return;
 
+    // 
+    try {
         // 
-        responseBuilder.setStatusCode(HttpStatusCode::OK);
-        responseBuilder.setHeader("Content-Type", getMimeType(extension));
-        responseBuilder.setBody(fileContent);
+        bool fromCache = false;
+        std::vector<unsigned char> fileContent = getFileContent(info->filepath, fromCache);
+        setFileResponse(responseBuilder, *info, std::move(fileContent), fromCache);
     }
     catch (const std::runtime_error& e) {
         HTTP_ERROR("File not found: {}", e.what());
@@ -252,52 +607,270 @@ void HttpRequestHandler::serveStaticFile(HttpRequest& httpRequest, HttpResponseB
 }
 
 
-void HttpRequestHandler::serveStatusCodeImage(HttpResponseBuilder& responseBuilder, const HttpStatusCode& statusCode) {
+CoTask<void> HttpRequestHandler::serveStaticFileAsync(HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder, 
+                                                      EventLoop& loop) {
     //
+    FileInfo unindexed;
+    const FileInfo* info = nullptr;
+    StaticFileLookup lookup = lookupStaticFile(httpRequest, responseBuilder, unindexed, info);
+    if (lookup == StaticFileLookup::NotFound) {
+        co_await serveStatusCodeImageAsync(responseBuilder, HttpStatusCode::NotFound, loop);
+        co_return;
+    }
+    if (lookup == StaticFileLookup::Streamed)
+        co_return;
+
+    // the handlers can't co_await, the status image is served after them
+    HttpStatusCode failure = HttpStatusCode::OK;
     try {
-        // 
-        std::string filepath = BASE_DIRECTORY + "/status/" + std::to_string(static_cast<int>(statusCode)) + ".jpg";
-        std::string extension = std::filesystem::path(filepath).extension().string();
+        bool fromCache = false;
+        std::vector<unsigned char> fileContent = co_await getFileContentAsync(info->filepath, fromCache, loop);
+        setFileResponse(responseBuilder, *info, std::move(fileContent), fromCache);
+    }
+    catch (const DiskQueueFull& e) {
+        HTTP_PER_SECOND(10, HTTP_WARN, "Overloaded, not serving '{}': {}", info->filepath, e.what());
+        failure = HttpStatusCode::ServiceUnavailable;
+    }
+    catch (const std::runtime_error& e) {
+        HTTP_ERROR("File not found: {}", e.what());
+        failure = HttpStatusCode::NotFound;
+    }
+    catch (const std::exception& e) {
+        HTTP_ERROR("Error serving file: {}", e.what());
+        failure = HttpStatusCode::InternalServerError;
+    }
+    if (failure == HttpStatusCode::ServiceUnavailable)
+        setStatusCodeText(responseBuilder, failure);   // not another read for the image
+    else if (failure != HttpStatusCode::OK)
+        co_await serveStatusCodeImageAsync(responseBuilder, failure, loop);
+}
 
-        // 
-        std::vector<unsigned char> cacheContent;
-        std::vector<unsigned char> fileContent;
 
-        // minimize the critical section
-        {
-            std::lock_guard<std::mutex> lock(r_cacheMtx);
-            cacheContent = r_cache.getOrDeleteExpired(filepath);
+HttpRequestHandler::StaticFileLookup HttpRequestHandler::lookupStaticFile(HttpRequest& httpRequest, 
+                                                                          HttpResponseBuilder& responseBuilder, 
+                                                                          FileInfo& unindexed, const FileInfo*& info) {
+    // indexed files are served without touching the filesystem to resolve them
+    info = m_fileIndex->find(httpRequest.path);
+    if (info == nullptr) {
+        // known to be missing, don't resolve it again
+        if (r_missing.contains(httpRequest.path)) {
+            HTTP_TRACE("File not found (negative cache): {}", httpRequest.path);
+            return StaticFileLookup::NotFound;
         }
 
-        // 
-        if (cacheContent.empty()) {
-            // 
-            fileContent = loadFile(filepath);
-
-            // minimize the critical section
-            {
-                std::lock_guard<std::mutex> lock(r_cacheMtx);
-                r_cache.put(filepath, fileContent);
-            }
-            HTTP_INFO("Served status code image '{}'", filepath);
+        // missing or invalid path, without the cost of throwing
+        if (!resolveUrlPath(httpRequest.path, unindexed.filepath)) {
+            HTTP_ERROR("File not found: {}", httpRequest.path);
+            r_missing.put(httpRequest.path);
+            return StaticFileLookup::NotFound;
         }
-        else {
-            fileContent = cacheContent;
-            HTTP_INFO("Served status code image from cache");
+
+        // created after the index was built
+        HTTP_INFO("File '{}' is not indexed yet", httpRequest.path);
+        r_refresher.scheduleIndexRebuild();
+        std::error_code ec;
+        unindexed.size = std::filesystem::file_size(unindexed.filepath, ec);
+        if (ec) {
+            HTTP_ERROR("File not found: {}", httpRequest.path);
+            return StaticFileLookup::NotFound;
         }
+        unindexed.mimeType = getMimeType(std::filesystem::path(unindexed.filepath).extension().string());
+        info = &unindexed;
+    }
 
-        // 
-        responseBuilder.setStatusCode(statusCode);
-        responseBuilder.setHeader("Content-Type", getMimeType(extension));
-        responseBuilder.setBody(fileContent);
+    // large file, stream it instead of holding it in memory; streamed files 
+    // aren't cached nor refreshed, so the index may be out of date, the head 
+    // describes the file opened, which the body is sent from
+    if (info->size > STREAMING_THRESHOLD) {
+        std::uintmax_t size = 0;
+        std::filesystem::file_time_type lastWriteTime;
+        FileDescriptor file = openFile(info->filepath, size, lastWriteTime);
+        if (file.get() < 0)
+            return StaticFileLookup::NotFound;
+        HTTP_INFO("Streaming large file '{}' ({} bytes)", info->filepath, size);
+        responseBuilder.setStatusCode(HttpStatusCode::OK);
+        responseBuilder.setHeader("Content-Type", info->mimeType);
+        responseBuilder.setHeader("ETag", makeETag(size, lastWriteTime));
+        responseBuilder.setBodyFile(std::move(file), size);
+        return StaticFileLookup::Streamed;
+    }
+    return StaticFileLookup::Load;
+}
+
+
+void HttpRequestHandler::setFileResponse(HttpResponseBuilder& responseBuilder, const FileInfo& info, 
+                                         std::vector<unsigned char> fileContent, bool fromCache) {
+    //
+    m_cacheStatus = fromCache ? CacheStatus::Hit : CacheStatus::Miss;
+    if (fromCache)
+        HTTP_INFO("Served static file from cache");
+    else
+        HTTP_INFO("Served static file '{}'", info.filepath);
+
+    // 
+    responseBuilder.setStatusCode(HttpStatusCode::OK);
+    responseBuilder.setHeader("Content-Type", info.mimeType);
+    if (!info.etag.empty())
+        responseBuilder.setHeader("ETag", info.etag);
+    responseBuilder.setBody(std::move(fileContent));
+}
+
+
+void HttpRequestHandler::serveStatusCodeImage(HttpResponseBuilder& responseBuilder, const HttpStatusCode& statusCode) {
+    //
+    try {
+        bool fromCache = false;
+        std::vector<unsigned char> fileContent = getFileContent(statusCodeImagePath(statusCode), fromCache);
+        setStatusCodeImage(responseBuilder, statusCode, std::move(fileContent), fromCache);
     }
     catch (const std::exception& e) {
         // Image can't be loaded, use plain text message.
         HTTP_ERROR("Status code image not found: {}", e.what());
-        responseBuilder.setStatusCode(statusCode);
-        responseBuilder.setHeader("Content-Type", "text/plain");
-        responseBuilder.setBody(statusCode2str(statusCode));
+        setStatusCodeText(responseBuilder, statusCode);
+    }
+}
+
+
+CoTask<void> HttpRequestHandler::serveStatusCodeImageAsync(HttpResponseBuilder& responseBuilder, 
+                                                           HttpStatusCode statusCode, EventLoop& loop) {
+    //
+    try {
+        bool fromCache = false;
+        std::string filepath = statusCodeImagePath(statusCode);
+        std::vector<unsigned char> fileContent = co_await getFileContentAsync(filepath, fromCache, loop);
+        setStatusCodeImage(responseBuilder, statusCode, std::move(fileContent), fromCache);
+    }
+    catch (const std::exception& e) {
+        // Image can't be loaded, use plain text message.
+        HTTP_ERROR("Status code image not found: {}", e.what());
+        setStatusCodeText(responseBuilder, statusCode);
+    }
+}
+
+
+std::string HttpRequestHandler::statusCodeImagePath(HttpStatusCode statusCode) {
+    return BASE_DIRECTORY + "/status/" + std::to_string(static_cast<int>(statusCode)) + ".jpg";
+}
+
+
+void HttpRequestHandler::setStatusCodeImage(HttpResponseBuilder& responseBuilder, HttpStatusCode statusCode, 
+                                            std::vector<unsigned char> fileContent, bool fromCache) {
+    // 
+    m_cacheStatus = fromCache ? CacheStatus::Hit : CacheStatus::Miss;
+    if (fromCache)
+        HTTP_INFO("Served status code image from cache");
+    else
+        HTTP_INFO("Served status code image {}", static_cast<int>(statusCode));
+
+    // 
+    responseBuilder.setStatusCode(statusCode);
+    responseBuilder.setHeader("Content-Type", getMimeType(".jpg"));
+    responseBuilder.setBody(std::move(fileContent));
+}
+
+
+void HttpRequestHandler::setStatusCodeText(HttpResponseBuilder& responseBuilder, HttpStatusCode statusCode) {
+    responseBuilder.setStatusCode(statusCode);
+    responseBuilder.setHeader("Content-Type", "text/plain");
+    responseBuilder.setBody(statusCode2str(statusCode));
+}
+
+
+std::vector<unsigned char> HttpRequestHandler::getFileContent(const std::string& filepath, bool& fromCache) {
+    //
+    std::vector<unsigned char> content = getCachedContent(filepath);
+    fromCache = !content.empty();
+    if (fromCache)
+        return content;
+
+    // cache miss, only one request loads the file while the others wait for it
+    std::uint64_t loadStart = m_timings ? monotonicNanoseconds() : 0;
+    content = r_inFlight.load(filepath, [this, &filepath]() {
+        // another leader may have filled the cache since our lookup
+        std::vector<unsigned char> body;
+        {
+            std::unique_lock<Mutex> lock = lockCache();
+            body = r_cache.get(filepath);
+        }
+        if (!body.empty())
+            return body;
+
+        // stat before reading, so a write during the read is caught by the next refresh
+        std::error_code ec;
+        auto lastWriteTime = std::filesystem::last_write_time(filepath, ec);
+        body = r_diskIo.read(filepath);
+        {
+            std::unique_lock<Mutex> lock = lockCache();
+            r_cache.put(filepath, body, lastWriteTime);
+        }
+        return body;
+    });
+    if (m_timings)
+        m_timings->addLoad(loadStart);
+    return content;
+}
+
+
+CoTask<std::vector<unsigned char>> HttpRequestHandler::getFileContentAsync(const std::string& filepath, bool& fromCache, 
+                                                                           EventLoop& loop) {
+    //
+    std::vector<unsigned char> content = getCachedContent(filepath);
+    fromCache = !content.empty();
+    if (fromCache)
+        co_return content;
+
+    // cache miss, the loop serves its other connections meanwhile, and the 
+    // concurrent misses of a file, on any loop or worker, share one read
+    std::uint64_t loadStart = m_timings ? monotonicNanoseconds() : 0;
+    content = co_await loop.joinFlight(r_inFlight, filepath, [this, &filepath] {
+        // stat before reading, so a write during the read is caught by the next refresh
+        std::error_code ec;
+        auto lastWriteTime = std::filesystem::last_write_time(filepath, ec);
+
+        // the handler may be gone when the read completes, the server isn't
+        LRUCache& cache = r_cache;
+        Mutex& cacheMtx = r_cacheMtx;
+        SingleFlight& inFlight = r_inFlight;
+        bool queued = r_diskIo.trySubmitRead(filepath, [&cache, &cacheMtx, &inFlight, filepath, lastWriteTime](
+                                                 std::vector<unsigned char> body, std::exception_ptr error) {
+            if (!error) {
+                std::lock_guard<Mutex> lock(cacheMtx);
+                cache.put(filepath, body, lastWriteTime);
+            }
+            inFlight.complete(filepath, body, error);
+        });
+        if (!queued)
+            inFlight.complete(filepath, SingleFlight::Result(), std::make_exception_ptr(DiskQueueFull()));
+    });
+    if (m_timings)
+        m_timings->addLoad(loadStart);
+    co_return content;
+}
+
+
+std::vector<unsigned char> HttpRequestHandler::getCachedContent(const std::string& filepath) {
+    // minimize the critical section
+    std::vector<unsigned char> content;
+    bool needsRefresh = false;
+    {
+        std::unique_lock<Mutex> lock = lockCache();
+        content = r_cache.getOrMarkStale(filepath, needsRefresh);
     }
+
+    // serve the stale content, the refresher will reload it if it was modified
+    if (needsRefresh)
+        r_refresher.schedule(filepath);
+    return content;
+}
+
+
+std::unique_lock<Mutex> HttpRequestHandler::lockCache() {
+    if (m_timings == nullptr)
+        return std::unique_lock<Mutex>(r_cacheMtx);
+    std::uint64_t waitStart = monotonicNanoseconds();
+    std::unique_lock<Mutex> lock(r_cacheMtx);
+    m_timings->addLockWait(waitStart);
+    return lock;
 }
 
 
@@ -0,0 +1,70 @@
+/**
+ * \file src/request_timing.cpp
+ */
+
+#include "request_timing.h"
+
+
+namespace http {
+
+
+namespace {
+
+const char* const STAGE_NAMES[] = {
+    "queue", "read", "parse", "schedule", "handle", "lock_wait", "load", "build", "send"
+};
+static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) == static_cast<std::size_t>(RequestStage::Count),
+              "a name for each RequestStage");
+
+/**
+ * \brief The marks a stage is between, for the stages between two marks.
+ */
+struct StageBounds {
+    RequestMark from;
+    RequestMark to;
+};
+
+const StageBounds STAGE_BOUNDS[] = {
+    {RequestMark::Accepted,   RequestMark::Started},
+    {RequestMark::Started,    RequestMark::HeadRead},
+    {RequestMark::HeadRead,   RequestMark::Parsed},
+    {RequestMark::Parsed,     RequestMark::Dispatched},
+    {RequestMark::Dispatched, RequestMark::Handled},
+    {RequestMark::Count,      RequestMark::Count},        // LockWait
+    {RequestMark::Count,      RequestMark::Count},        // Load
+    {RequestMark::Handled,    RequestMark::Built},
+    {RequestMark::Built,      RequestMark::Sent}
+};
+
+} // namespace
+
+
+const char* requestStageName(RequestStage stage) {
+    std::size_t index = static_cast<std::size_t>(stage);
+    return index < static_cast<std::size_t>(RequestStage::Count) ? STAGE_NAMES[index] : "-";
+}
+
+
+bool RequestTimings::duration(RequestStage stage, std::uint64_t& ns) const {
+    //
+    if (stage == RequestStage::LockWait) {
+        ns = lockWaitNs;
+        return lockCount > 0;
+    }
+    if (stage == RequestStage::Load) {
+        ns = loadNs;
+        return loadCount > 0;
+    }
+
+    // a coarser clock may read the later mark a little earlier
+    const StageBounds& bounds = STAGE_BOUNDS[static_cast<std::size_t>(stage)];
+    std::uint64_t from = marks[static_cast<std::size_t>(bounds.from)];
+    std::uint64_t to = marks[static_cast<std::size_t>(bounds.to)];
+    if (from == 0 || to == 0)
+        return false;
+    ns = to > from ? to - from : 0;
+    return true;
+}
+
+
+} // namespace http::
@@ -2,6 +2,8 @@
  * \file src/response.cpp
  */
 
+#include <utility>   // std::move
+
 #include "response.h"
 #include "log.h"
 
@@ -16,8 +18,12 @@ std::string statusCode2str(HttpStatusCode code) {
             return "Bad Request";
         case HttpStatusCode::NotFound:
             return "Not Found";
+        case HttpStatusCode::PayloadTooLarge:
+            return "Payload Too Large";
         case HttpStatusCode::InternalServerError:
             return "Internal Server Error";
+        case HttpStatusCode::ServiceUnavailable:
+            return "Service Unavailable";
         default:
             return std::string();
     }
@@ -44,10 +50,19 @@ void HttpResponseBuilder::setBody(const std::vector<unsigned char>& body) {
 }
 
 
-std::string HttpResponseBuilder::build() {
-    // 
-    HTTP_TRACE("Building HTTP response with status code {}", static_cast<int>(m_statusCode));
+void HttpResponseBuilder::setBody(std::vector<unsigned char>&& body) {
+    m_body = std::move(body);
+}
 
+
+void HttpResponseBuilder::setBodyFile(FileDescriptor file, std::uintmax_t size) {
+    m_body.clear();
+    m_bodyFile = std::move(file);
+    m_bodyFileSize = size;
+}
+
+
+std::string HttpResponseBuilder::buildHead() {
     // 
     std::string response;
 
@@ -60,9 +75,23 @@ std::string HttpResponseBuilder::build() {
     for (const auto& header : m_headers) {
         response += header.first + ": " + header.second + "\r\n";
     }
+    response += "Content-Length: " + std::to_string(getBodySize()) + "\r\n";
     response += "\r\n";
 
+    // 
+    return response;
+}
+
+
+std::string HttpResponseBuilder::build() {
+    // 
+    HTTP_TRACE("Building HTTP response with status code {}", static_cast<int>(m_statusCode));
+
+    // 
+    std::string response = buildHead();
+
     // body
+    response.reserve(response.size() + m_body.size());
     response.insert(response.end(), m_body.begin(), m_body.end());
 
     // 
@@ -3,27 +3,147 @@
  */
 
 #include <stdexcept>   // std::runtime_error
+#include <algorithm>   // std::min, std::max
+#include <exception>
+#include <csignal>     // sigaction
+#include <filesystem>
+#include <future>      // std::promise
+#include <chrono>
+#include <cstring>     // strerror
+#include <fcntl.h>     // fcntl
+#include <sys/time.h>  // timeval
 
 #include "server.h"
 #include "log.h"
 #include "net.h"
+#include "file.h"
 #include "request.h"
+#include "metrics.h"
+#include "profiling.h"
 #include "thread_pool.hpp"
 
 
 #define BUFFER_SIZE 1024
+#define MAX_HEAD_SIZE       (8 * 1024)
+#define RECV_TIMEOUT_SEC    30
+#define SEND_TIMEOUT_SEC    30   // of each wait for the client to read, on the event loops
+#define NEGATIVE_CACHE_SIZE 4096
+#define NEGATIVE_CACHE_TTL  std::chrono::seconds(5)
+#define DISK_IO_THREADS     4
+#define DISK_IO_QUEUE_SIZE  256
+#define CONNECTION_QUEUE_CAPACITY 1024                          // a power of 2
+#define QUEUE_DELAY_TARGET  std::chrono::milliseconds(100)
+#define RETRY_AFTER_SECONDS 1
 
 namespace http {
 
+
+namespace {
+
+volatile std::sig_atomic_t s_stopRequested = 0;
+int s_listenfd = -1;
+
+const Counter s_accepted("http_connections_accepted_total", "Connections accepted.");
+const Counter s_shed("http_connections_shed_total", "Connections answered with the prebuilt 503, the server being overloaded.");
+const Counter s_responses[] = {
+    {"http_responses_total", "Responses sent, by class of status code.", "code=\"1xx\""},
+    {"http_responses_total", "Responses sent, by class of status code.", "code=\"2xx\""},
+    {"http_responses_total", "Responses sent, by class of status code.", "code=\"3xx\""},
+    {"http_responses_total", "Responses sent, by class of status code.", "code=\"4xx\""},
+    {"http_responses_total", "Responses sent, by class of status code.", "code=\"5xx\""}
+};
+const Counter s_responseBytes("http_response_bytes_total", "Bytes of the responses sent, head and body.");
+const Histogram s_requestDuration("http_request_duration_seconds", "Time from the accept of a connection to the last byte of its response.");
+const Histogram s_queueDelay("http_queue_delay_seconds", "Time the connections waited for a worker or an event loop to read their head.");
+
+#define STAGE_HELP "Time spent by the requests in each stage, see RequestStage."
+const Histogram s_stageDurations[] = {
+    {"http_request_stage_seconds", STAGE_HELP, "stage=\"queue\""},
+    {"http_request_stage_seconds", STAGE_HELP, "stage=\"read\""},
+    {"http_request_stage_seconds", STAGE_HELP, "stage=\"parse\""},
+    {"http_request_stage_seconds", STAGE_HELP, "stage=\"schedule\""},
+    {"http_request_stage_seconds", STAGE_HELP, "stage=\"handle\""},
+    {"http_request_stage_seconds", STAGE_HELP, "stage=\"lock_wait\""},
+    {"http_request_stage_seconds", STAGE_HELP, "stage=\"load\""},
+    {"http_request_stage_seconds", STAGE_HELP, "stage=\"build\""},
+    {"http_request_stage_seconds", STAGE_HELP, "stage=\"send\""}
+};
+#undef STAGE_HELP
+static_assert(sizeof(s_stageDurations) / sizeof(s_stageDurations[0]) == static_cast<std::size_t>(RequestStage::Count),
+              "a histogram for each RequestStage");
+
+/**
+ * \brief Handler of SIGINT and SIGTERM.
+ *
+ * The signal may be delivered to any thread, so shut the server socket down 
+ * to wake up the `accept` of the server loop.
+ */
+void onStopSignal(int) {
+    s_stopRequested = 1;
+    if (s_listenfd >= 0)
+        shutdown(s_listenfd, SHUT_RDWR);
+}
+
+/**
+ * \brief Whether a load failed because the queue of the disk threads was full.
+ */
+bool isDiskQueueFull(std::exception_ptr error) {
+    if (!error)
+        return false;
+    try {
+        std::rethrow_exception(error);
+    }
+    catch (const DiskQueueFull&) {
+        return true;
+    }
+    catch (...) {
+        return false;
+    }
+}
+
+} // namespace
+
+
 HttpServer::HttpServer(int port, std::size_t cacheSize) 
-    : m_isRunning(false), m_serverSocket(port), m_cache(cacheSize)
+    : m_isRunning(false), m_serverSocket(port), m_cache(cacheSize), m_missing(NEGATIVE_CACHE_SIZE, NEGATIVE_CACHE_TTL), 
+      m_refresher(m_cache, m_cacheMtx, m_fileIndex, m_missing), m_diskIo(DISK_IO_THREADS, DISK_IO_QUEUE_SIZE), 
+      m_preload(false), m_queueDelayUs(0), m_connectionCount(0), m_eventLoopCount(0), m_nextEventLoop(0), 
+      m_threadPool(THREAD_POOL_SPIN_BUDGET, CONNECTION_QUEUE_CAPACITY)
 {
     Log::init();
+
+    // built once, shedding must cost as little as possible
+    HttpResponseBuilder overload;
+    overload.setStatusCode(HttpStatusCode::ServiceUnavailable);
+    overload.setHeader("Content-Type", "text/plain");
+    overload.setHeader("Retry-After", std::to_string(RETRY_AFTER_SECONDS));
+    overload.setHeader("Connection", "close");
+    overload.setBody("Service Unavailable\n");
+    m_overloadResponse = overload.build();
+
+    // read on each scrape, nothing to maintain meanwhile
+    m_gauges.emplace_back("http_queued_tasks", "Connections and requests waiting in the global queues of the thread pool.", "", 
+                          [this] { return static_cast<double>(m_threadPool.queuedTasks()); });
+    m_gauges.emplace_back("cache_entries", "Files in the cache.", "", [this] {
+        std::lock_guard<Mutex> lock(m_cacheMtx);
+        return static_cast<double>(m_cache.size());
+    });
+    // the loops only change while no request is served
+    m_gauges.emplace_back("http_event_loop_connections", "Connections held by the coroutines of the event loops.", "", [this] {
+        std::size_t count = 0;
+        for (const auto& loop : m_eventLoops)
+            count += loop->taskCount();
+        return static_cast<double>(count);
+    });
+
     HTTP_TRACE("HttpSever created");
 }
 
 
 HttpServer::~HttpServer() {
+    // the disk reads requeue their requests, so the workers stop first, then the reads complete
+    m_threadPool.shutdown();
+    m_diskIo.shutdown();
     Log::shutdown();
 }
 
@@ -34,6 +154,8 @@ void HttpServer::start() {
 
     // 
     m_isRunning = true;
+    m_fileIndex.store(FileIndex::build());
+    warmUpCache();
 
     // Setup server sock
     m_serverSocket.createSocket();
@@ -41,14 +163,54 @@ void HttpServer::start() {
     m_serverSocket.bindToPort();
     m_serverSocket.startListening();
 
+    // stop on SIGINT and SIGTERM, without SA_RESTART so `accept` is interrupted
+    s_listenfd = m_serverSocket.get();
+    struct sigaction action = {};
+    action.sa_handler = onStopSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
     // 
-    while (m_isRunning) {
-        int clientfd = m_serverSocket.acceptConnection();
+    startEventLoops();
+    while (m_isRunning && !s_stopRequested) {
+        ClientInfo client;
+        int clientfd = m_serverSocket.acceptConnection(&client.address);
+        if (clientfd < 0)
+            continue;
+        client.acceptedAt = std::chrono::steady_clock::now();
+        client.id = ++m_connectionCount;
+        s_accepted.inc();
+
+        // shed the load while the workers can't keep up, a quick 503 beats a timeout
+        if (isOverloaded()) {
+            rejectConnection(SocketRAII(clientfd), client);
+            continue;
+        }
+
+        // the coroutine starts on its loop, which owns it from then on
+        if (!m_eventLoops.empty()) {
+            EventLoop& loop = *m_eventLoops[m_nextEventLoop++ % m_eventLoops.size()];
+            loop.spawn(handleConnectionAsync(loop, clientfd, client));
+            continue;
+        }
+
         // The `HttpRequestHandler` in ``handleConnection`` will access member variables
         // `m_cache` and `m_cacheMtx`, so the `handleConnection` can't be static.
         // Need to pass `this` into thread function.
-        m_threadPool.submit(std::bind(&HttpServer::handleConnection, this, clientfd));
+        // reading the head is short, and tells the class of the rest of the request
+        bool queued = m_threadPool.trySubmit([this, clientfd, client] {
+            auto queueDelay = std::chrono::steady_clock::now() - client.acceptedAt;
+            s_queueDelay.record(queueDelay);
+            m_queueDelayUs.store(std::chrono::duration_cast<std::chrono::microseconds>(queueDelay).count(), 
+                                 std::memory_order_relaxed);
+            handleConnection(clientfd, client);
+        }, TaskPriority::LatencyCritical);
+        if (!queued) {
+            rejectConnection(SocketRAII(clientfd), client);
+        }
     }
+    stopEventLoops();
 }
 
 
@@ -56,35 +218,623 @@ void HttpServer::stop() {
     // 
     HTTP_TRACE("HttpSever stop");
 
-    m_isRunning = false;
+    if (m_isRunning.exchange(false))
+        saveCacheSnapshot();
+}
+
+
+void HttpServer::enablePreload(const std::string& manifestPath) {
+    m_preload = true;
+    m_preloadManifest = manifestPath;
+}
+
+
+void HttpServer::enableCacheSnapshot(const std::string& snapshotPath) {
+    m_snapshotPath = snapshotPath;
+}
+
+
+void HttpServer::setUploadOptions(const UploadOptions& uploadOptions) {
+    m_uploadOptions = uploadOptions;
+}
+
+
+void HttpServer::enableAccessLog(const AccessLogOptions& options) {
+    m_accessLog = std::make_unique<AccessLog>(options);
+}
+
+
+void HttpServer::enableMetrics(const std::string& route) {
+    m_metricsRoute = route;
+}
+
+
+void HttpServer::enableProfilingReport(const std::string& route) {
+    m_profilingRoute = route;
 }
 
 
-void HttpServer::handleConnection(int clientfd) {
+void HttpServer::enableEventLoops(std::size_t count) {
+    m_eventLoopCount = count;
+}
+
+
+bool HttpServer::isOverloaded() const {
+    // the last queueing delay only matters while connections are still waiting, 
+    // otherwise the queues have drained
+    std::size_t queued = m_threadPool.queuedTasks();
+    for (const auto& loop : m_eventLoops)
+        queued += loop->queuedTasks();
+    if (queued == 0)
+        return false;
+    auto target = std::chrono::duration_cast<std::chrono::microseconds>(QUEUE_DELAY_TARGET).count();
+    return m_queueDelayUs.load(std::memory_order_relaxed) > target;
+}
+
+
+void HttpServer::rejectConnection(SocketRAII clientSocket, const ClientInfo& client) {
+    // 
+    int clientfd = clientSocket.get();
+    HTTP_PER_SECOND(10, HTTP_WARN, "Overloaded, rejecting client socket #{}", clientfd);
+
+    // consume what already arrived of the request, closing with unread data 
+    // would reset the connection before the client reads the 503
+    char buffer[BUFFER_SIZE];
+    while (recv(clientfd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+
+    // never block the accept loop nor a disk thread, the response fits in an empty socket buffer
+    ssize_t bytesSent = send(clientfd, m_overloadResponse.data(), m_overloadResponse.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(clientfd, SHUT_WR);
+    s_shed.inc();
+
+    // the request may not be parsed, only the shedding is recorded
+    if (m_accessLog) {
+        m_accessLog->append(AccessLogEntry{client.acceptedAt, client.address, {}, {}, {}, 
+                                           static_cast<int>(HttpStatusCode::ServiceUnavailable), 
+                                           bytesSent > 0 ? static_cast<std::uint64_t>(bytesSent) : 0, CacheStatus::None,
+                                           nullptr});
+    }
+}
+
+
+void HttpServer::handleConnection(int clientfd, const ClientInfo& client) {
     // Use SocketRAII to manage the lifecycle of the client socket
     SocketRAII clientSocket(clientfd);
+    RequestTimings timings(client.id, client.acceptedAt);
+    timings.mark(RequestMark::Started);
+    AllocationCounts allocatedBefore = threadAllocations();
+
+    // a stalled client must not hold a worker forever
+    struct timeval timeout = {RECV_TIMEOUT_SEC, 0};
+    setsockopt(clientSocket.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // read the head of request from client socket, the body is left for the handler
+    std::string request;
+    std::size_t headEnd = std::string::npos;
+    char buffer[BUFFER_SIZE];
+    while (headEnd == std::string::npos && request.size() < MAX_HEAD_SIZE) {
+        ssize_t bytesRead = recv(clientSocket.get(), buffer, sizeof(buffer), 0);
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+        if (bytesRead < 0) {
+            HTTP_ERROR("Failed to read from client socket #{}. Error: {}", clientSocket.get(), strerror(errno));
+            return;
+        }
+        if (bytesRead == 0)
+            break;
+        std::size_t searchFrom = request.size() < 3 ? 0 : request.size() - 3;
+        request.append(buffer, static_cast<std::size_t>(bytesRead));
+        headEnd = request.find("\r\n\r\n", searchFrom);
+    }
+    HTTP_INFO("Read {} bytes from client socket #{}", request.size(), clientSocket.get());
+    timings.mark(RequestMark::HeadRead);
+
+    // 
+    HttpRequest httpRequest;
+    std::string leftover;
+    if (headEnd == std::string::npos) {
+        HTTP_ERROR("Incomplete or oversized request head from client socket #{}", clientSocket.get());
+        timings.allocations += threadAllocations() - allocatedBefore;
+        serveRequest(clientSocket, httpRequest, leftover, client, timings);
+        return;
+    }
+    headEnd += 4;
+    leftover = request.substr(headEnd);
+    request.resize(headEnd);
+    httpRequest.parse(request);
+    timings.mark(RequestMark::Parsed);
+    timings.allocations += threadAllocations() - allocatedBefore;
+
+    // a body which can't be framed is refused at once, before any handler runs
+    std::size_t contentLength = 0;
+    if (!httpRequest.contentLength(contentLength)) {
+        serveRequest(clientSocket, httpRequest, leftover, client, timings);
+        return;
+    }
+
+    // a cache miss waits for its file without holding the worker
+    TaskPriority priority = classifyRequest(httpRequest);
+    if (loadThenServe(clientSocket, httpRequest, leftover, client, timings, priority))
+        return;
+
+    // cheap requests are served at once, the others wait for their turn in their class
+    if (priority == TaskPriority::LatencyCritical) {
+        serveRequest(clientSocket, httpRequest, leftover, client, timings);
+        return;
+    }
+    HTTP_TRACE("Requeued client socket #{} with priority {}", clientSocket.get(), static_cast<int>(priority));
+    m_threadPool.submit([this, clientSocket = std::move(clientSocket), httpRequest = std::move(httpRequest), 
+                         leftover = std::move(leftover), client, timings]() mutable {
+        serveRequest(clientSocket, httpRequest, leftover, client, timings);
+    }, priority);
+}
+
+
+TaskPriority HttpServer::classifyRequest(const HttpRequest& httpRequest) const {
+    // refused at once
+    std::size_t contentLength = 0;
+    if (!httpRequest.contentLength(contentLength))
+        return TaskPriority::LatencyCritical;
+
+    // uploads and large bodies
+    if (httpRequest.method == "POST") {
+        return (httpRequest.path == "/upload" || contentLength > STREAMING_THRESHOLD) ? TaskPriority::Bulk 
+                                                                                   : TaskPriority::Normal;
+    }
+    if (httpRequest.method != "GET" || httpRequest.path == m_metricsRoute || httpRequest.path == m_profilingRoute)
+        return TaskPriority::LatencyCritical;
+
+    // indexed files, small ones are likely cached, large ones are streamed
+    std::string urlPath = httpRequest.path == "/" ? "/home.html" : httpRequest.path;
+    std::shared_ptr<const FileIndex> fileIndex = m_fileIndex.load();
+    const FileInfo* fileInfo = fileIndex ? fileIndex->find(urlPath) : nullptr;
+    if (fileInfo != nullptr)
+        return fileInfo->size > STREAMING_THRESHOLD ? TaskPriority::Bulk : TaskPriority::LatencyCritical;
+
+    // echo, 404s and files not indexed yet
+    return TaskPriority::Normal;
+}
+
+
+bool HttpServer::loadThenServe(SocketRAII& clientSocket, HttpRequest& httpRequest, std::string& leftover, 
+                               const ClientInfo& client, RequestTimings& timings, TaskPriority priority) {
+    // small indexed files, the handler reads the others itself
+    if (httpRequest.method != "GET" || httpRequest.path == m_metricsRoute || httpRequest.path == m_profilingRoute)
+        return false;
+    std::string urlPath = httpRequest.path == "/" ? "/home.html" : httpRequest.path;
+    std::shared_ptr<const FileIndex> fileIndex = m_fileIndex.load();
+    const FileInfo* fileInfo = fileIndex->find(urlPath);
+    if (fileInfo == nullptr || fileInfo->size > STREAMING_THRESHOLD)
+        return false;
+    {
+        std::lock_guard<Mutex> lock(m_cacheMtx);
+        if (m_cache.contains(fileInfo->filepath))
+            return false;
+    }
+
+    // the request waits for the file off the worker
+    struct PendingRequest {
+        SocketRAII     clientSocket;
+        HttpRequest    httpRequest;
+        std::string    leftover;
+        ClientInfo     client;
+        RequestTimings timings;
+        std::uint64_t  loadStart;
+    };
+    auto pending = std::make_shared<PendingRequest>(PendingRequest{std::move(clientSocket), std::move(httpRequest), 
+                                                                   std::move(leftover), client, timings, 
+                                                                   monotonicNanoseconds()});
+    HTTP_TRACE("Client socket #{} waits for '{}' to be read", pending->clientSocket.get(), fileInfo->filepath);
+
+    // a failed read is retried, and answered, by the handler; run on a disk 
+    // thread, which must never wait for room in the pool, nor the pool for 
+    // room in the disk queue, so both shed instead
+    bool leader = m_inFlight.join(fileInfo->filepath, [this, pending, priority](const SingleFlight::Result&, 
+                                                                                std::exception_ptr error) {
+        pending->timings.addLoad(pending->loadStart);
+        bool queued = !isDiskQueueFull(error) && m_threadPool.trySubmit([this, pending] {
+            serveRequest(pending->clientSocket, pending->httpRequest, pending->leftover, pending->client, 
+                         pending->timings);
+        }, priority);
+        if (!queued)
+            rejectConnection(std::move(pending->clientSocket), pending->client);
+    });
+    if (!leader)
+        return true;
+
+    // stat before reading, so a write during the read is caught by the next refresh
+    std::string filepath = fileInfo->filepath;
+    std::error_code ec;
+    auto lastWriteTime = std::filesystem::last_write_time(filepath, ec);
+    bool queued = m_diskIo.trySubmitRead(filepath, [this, filepath, lastWriteTime](std::vector<unsigned char> body, 
+                                                                                   std::exception_ptr error) {
+        if (!error) {
+            std::lock_guard<Mutex> lock(m_cacheMtx);
+            m_cache.put(filepath, body, lastWriteTime);
+        }
+        m_inFlight.complete(filepath, body, error);
+    });
+    if (!queued)
+        m_inFlight.complete(filepath, SingleFlight::Result(), std::make_exception_ptr(DiskQueueFull()));
+    return true;
+}
+
+
+void HttpServer::serveRequest(SocketRAII& clientSocket, HttpRequest& httpRequest, std::string& leftover, 
+                              const ClientInfo& client, RequestTimings& timings) {
+    // process the request and get the response
+    timings.mark(RequestMark::Dispatched);
+    AllocationCounts allocatedBefore = threadAllocations();
+    HttpRequestHandler handler(m_cache, m_cacheMtx, m_inFlight, m_refresher, m_missing, m_fileIndex.load(), m_diskIo, 
+                               m_uploadOptions, &timings);
+    HttpResponseBuilder responseBuilder;
+    std::size_t contentLength = 0;
+    if (!httpRequest.method.empty() && !httpRequest.contentLength(contentLength)) {
+        HTTP_ERROR("Unsupported Transfer-Encoding or invalid Content-Length from client socket #{}", clientSocket.get());
+        responseBuilder.setStatusCode(HttpStatusCode::BadRequest);
+        responseBuilder.setHeader("Content-Type", "text/plain");
+        responseBuilder.setHeader("Connection", "close");
+        responseBuilder.setBody("Bad Request\n");
+    }
+    else if (serveAdminRoute(httpRequest, responseBuilder)) {
+        // answered by the server itself
+    }
+    else if (httpRequest.method.empty()) {
+        responseBuilder = handler.handleRequest(std::string());
+    }
+    else {
+        BodyReader body(clientSocket.get(), std::move(leftover));
+        responseBuilder = handler.handleRequest(httpRequest, body);
+    }
+    timings.mark(RequestMark::Handled);
+
+    // send response back to client, large files are streamed after the head
+    bool sent = false;
+    std::uint64_t responseSize = 0;
+    if (responseBuilder.hasBodyFile()) {
+        std::string head = responseBuilder.buildHead();
+        timings.mark(RequestMark::Built);
+        sent = sendAll(clientSocket.get(), head.data(), head.size()) 
+            && sendFile(clientSocket.get(), responseBuilder.getBodyFile(), responseBuilder.getBodySize());
+        responseSize = head.size() + responseBuilder.getBodySize();
+    }
+    else {
+        std::string response = responseBuilder.build();
+        timings.mark(RequestMark::Built);
+        sent = sendAll(clientSocket.get(), response.data(), response.size());
+        responseSize = response.size();
+    }
+    if (sent)
+        timings.mark(RequestMark::Sent);
+    timings.allocations += threadAllocations() - allocatedBefore;
+
+    // 
+    if (sent)
+        recordRequestAllocations(timings.allocations);
+    // a file read before the handler ran is a miss, though the handler found it cached
+    CacheStatus cacheStatus = handler.cacheStatus();
+    if (cacheStatus == CacheStatus::Hit && timings.loadCount > 0)
+        cacheStatus = CacheStatus::Miss;
+    recordResponse(httpRequest, client, timings, static_cast<int>(responseBuilder.getStatusCode()), sent, responseSize, 
+                   cacheStatus);
+    if (!sent) {
+        HTTP_ERROR("Failed to send response to client socket #{}. Error: {}", clientSocket.get(), strerror(errno));
+        return;
+    }
+    HTTP_INFO("Response sent to client socket #{}", clientSocket.get());
+}
+
+
+CoTask<void> HttpServer::handleConnectionAsync(EventLoop& loop, int clientfd, ClientInfo client) {
+    // 
+    SocketRAII clientSocket(clientfd);
+    RequestTimings timings(client.id, client.acceptedAt);
+    timings.mark(RequestMark::Started);
+    auto queueDelay = std::chrono::steady_clock::now() - client.acceptedAt;
+    s_queueDelay.record(queueDelay);
+    m_queueDelayUs.store(std::chrono::duration_cast<std::chrono::microseconds>(queueDelay).count(), 
+                         std::memory_order_relaxed);
 
-    // read raw data of request from client socket
+    // sendfile only returns instead of blocking on a non-blocking socket
+    fcntl(clientSocket.get(), F_SETFL, fcntl(clientSocket.get(), F_GETFL) | O_NONBLOCK);
+
+    // read the head, a stalled client only holds its coroutine until the deadline
+    auto deadline = EventLoop::Clock::now() + std::chrono::seconds(RECV_TIMEOUT_SEC);
+    std::string request;
+    std::size_t headEnd = std::string::npos;
     char buffer[BUFFER_SIZE];
-    int bytesRead = read(clientSocket.get(), buffer, sizeof(buffer));
-    if (bytesRead < 0) {
-        HTTP_ERROR("Failed to read from client socket #{}. Error: {}", clientSocket.get(), strerror(errno));
-        throw std::runtime_error("Failed to read");
+    while (headEnd == std::string::npos && request.size() < MAX_HEAD_SIZE) {
+        ssize_t bytesRead = co_await loop.recv(clientSocket.get(), buffer, sizeof(buffer), deadline);
+        if (bytesRead < 0) {
+            HTTP_ERROR("Failed to read from client socket #{}. Error: {}", clientSocket.get(), strerror(errno));
+            co_return;
+        }
+        if (bytesRead == 0)
+            break;
+        std::size_t searchFrom = request.size() < 3 ? 0 : request.size() - 3;
+        request.append(buffer, static_cast<std::size_t>(bytesRead));
+        headEnd = request.find("\r\n\r\n", searchFrom);
     }
-    HTTP_INFO("Read {} bytes from client socket #{}", bytesRead, clientSocket.get());
+    HTTP_INFO("Read {} bytes from client socket #{}", request.size(), clientSocket.get());
+    timings.mark(RequestMark::HeadRead);
 
+    // 
+    HttpRequest httpRequest;
+    if (headEnd == std::string::npos) {
+        HTTP_ERROR("Incomplete or oversized request head from client socket #{}", clientSocket.get());
+        co_await serveRequestAsync(loop, clientSocket, httpRequest, client, timings);
+        co_return;
+    }
+    headEnd += 4;
+    std::string leftover = request.substr(headEnd);
+    request.resize(headEnd);
+    httpRequest.parse(request);
+    timings.mark(RequestMark::Parsed);
+
+    // reading a body blocks, the worker gets the socket back in blocking mode
+    if (httpRequest.method != "GET" || httpRequest.findHeader("Content-Length") != nullptr 
+            || httpRequest.findHeader("Transfer-Encoding") != nullptr) {
+        fcntl(clientSocket.get(), F_SETFL, fcntl(clientSocket.get(), F_GETFL) & ~O_NONBLOCK);
+        struct timeval timeout = {RECV_TIMEOUT_SEC, 0};
+        setsockopt(clientSocket.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        TaskPriority priority = classifyRequest(httpRequest);
+        HTTP_TRACE("Handed client socket #{} over to the thread pool with priority {}", clientSocket.get(), 
+                   static_cast<int>(priority));
+
+        // the loop never waits for room in the pool, a full queue sheds the connection; 
+        // the socket outlives a rejected task, to be answered
+        struct HandedOver {
+            SocketRAII     clientSocket;
+            HttpRequest    httpRequest;
+            std::string    leftover;
+            RequestTimings timings;
+        };
+        auto handedOver = std::make_shared<HandedOver>(HandedOver{std::move(clientSocket), std::move(httpRequest), 
+                                                                  std::move(leftover), timings});
+        bool queued = m_threadPool.trySubmit([this, handedOver, client] {
+            serveRequest(handedOver->clientSocket, handedOver->httpRequest, handedOver->leftover, client, 
+                         handedOver->timings);
+        }, priority);
+        if (!queued)
+            rejectConnection(std::move(handedOver->clientSocket), client);
+        co_return;
+    }
+    co_await serveRequestAsync(loop, clientSocket, httpRequest, client, timings);
+}
+
+
+CoTask<void> HttpServer::serveRequestAsync(EventLoop& loop, SocketRAII& clientSocket, HttpRequest& httpRequest, 
+                                           const ClientInfo& client, RequestTimings& timings) {
     // process the request and get the response
-    HttpRequestHandler handler(m_cache, m_cacheMtx);
-    std::string response = handler.handleRequest(std::string(buffer));
+    timings.mark(RequestMark::Dispatched);
+    HttpRequestHandler handler(m_cache, m_cacheMtx, m_inFlight, m_refresher, m_missing, m_fileIndex.load(), m_diskIo, 
+                               m_uploadOptions, &timings);
+    HttpResponseBuilder responseBuilder;
+    if (!serveAdminRoute(httpRequest, responseBuilder))
+        responseBuilder = co_await handler.handleRequestAsync(httpRequest, loop);
+    timings.mark(RequestMark::Handled);
 
-    // send response back to client
-    int bytesSent = send(clientSocket.get(), response.c_str(), response.size(), 0);
-    if (bytesSent < 0) {
+    // send response back to client, large files are streamed after the head; 
+    // a client which stops reading only holds its coroutine until the timeout
+    auto timeout = std::chrono::seconds(SEND_TIMEOUT_SEC);
+    bool sent = false;
+    std::uint64_t responseSize = 0;
+    if (responseBuilder.hasBodyFile()) {
+        std::string head = responseBuilder.buildHead();
+        timings.mark(RequestMark::Built);
+        sent = co_await loop.sendAll(clientSocket.get(), head.data(), head.size(), timeout) 
+            && co_await loop.sendFile(clientSocket.get(), responseBuilder.getBodyFile(), responseBuilder.getBodySize(), 
+                                      timeout);
+        responseSize = head.size() + responseBuilder.getBodySize();
+    }
+    else {
+        std::string response = responseBuilder.build();
+        timings.mark(RequestMark::Built);
+        sent = co_await loop.sendAll(clientSocket.get(), response.data(), response.size(), timeout);
+        responseSize = response.size();
+    }
+    if (sent)
+        timings.mark(RequestMark::Sent);
+
+    // the allocations of the other coroutines of the thread would be counted, they aren't recorded
+    // a file read before the handler ran is a miss, though the handler found it cached
+    CacheStatus cacheStatus = handler.cacheStatus();
+    if (cacheStatus == CacheStatus::Hit && timings.loadCount > 0)
+        cacheStatus = CacheStatus::Miss;
+    recordResponse(httpRequest, client, timings, static_cast<int>(responseBuilder.getStatusCode()), sent, responseSize, 
+                   cacheStatus);
+    if (!sent) {
         HTTP_ERROR("Failed to send response to client socket #{}. Error: {}", clientSocket.get(), strerror(errno));
-        throw std::runtime_error("Failed to send response to client socket");
+        co_return;
     }
     HTTP_INFO("Response sent to client socket #{}", clientSocket.get());
 }
 
 
+bool HttpServer::serveAdminRoute(const HttpRequest& httpRequest, HttpResponseBuilder& responseBuilder) const {
+    // 
+    if (httpRequest.method != "GET")
+        return false;
+    if (!m_metricsRoute.empty() && httpRequest.path == m_metricsRoute) {
+        responseBuilder.setStatusCode(HttpStatusCode::OK);
+        responseBuilder.setHeader("Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+        responseBuilder.setBody(Metrics::scrape());
+        return true;
+    }
+    if (!m_profilingRoute.empty() && httpRequest.path == m_profilingRoute) {
+        responseBuilder.setStatusCode(HttpStatusCode::OK);
+        responseBuilder.setHeader("Content-Type", "text/plain; charset=utf-8");
+        responseBuilder.setBody(profilingReport());
+        return true;
+    }
+    return false;
+}
+
+
+void HttpServer::recordResponse(const HttpRequest& httpRequest, const ClientInfo& client, const RequestTimings& timings, 
+                                int statusCode, bool sent, std::uint64_t responseSize, CacheStatus cacheStatus) {
+    // 
+    if (sent) {
+        s_responses[std::min(std::max(statusCode / 100, 1), 5) - 1].inc();
+        s_responseBytes.inc(static_cast<std::int64_t>(responseSize));
+        s_requestDuration.record(std::chrono::steady_clock::now() - client.acceptedAt);
+        for (std::size_t i = 0; i < static_cast<std::size_t>(RequestStage::Count); ++i) {
+            std::uint64_t ns = 0;
+            if (timings.duration(static_cast<RequestStage>(i), ns))
+                s_stageDurations[i].record(ns);
+        }
+    }
+    HTTP_PROBE3(done, timings.id, statusCode, responseSize);
+    if (m_accessLog) {
+        m_accessLog->append(AccessLogEntry{client.acceptedAt, client.address, httpRequest.method, httpRequest.path, 
+                                           httpRequest.version, statusCode, 
+                                           sent ? responseSize : 0, cacheStatus, &timings});
+    }
+}
+
+
+void HttpServer::startEventLoops() {
+    //
+    for (std::size_t i = 0; i < m_eventLoopCount; ++i) {
+        m_eventLoops.push_back(std::make_unique<EventLoop>());
+        m_eventLoopThreads.emplace_back(&EventLoop::run, m_eventLoops.back().get());
+    }
+    if (m_eventLoopCount > 0)
+        HTTP_INFO("Serving the connections on {} event loops", m_eventLoopCount);
+}
+
+
+void HttpServer::stopEventLoops() {
+    // the loops finish their disk reads, then destroy the connections still waiting for their clients
+    for (auto& loop : m_eventLoops)
+        loop->stop();
+    for (auto& thread : m_eventLoopThreads)
+        thread.join();
+    m_eventLoopThreads.clear();
+    m_eventLoops.clear();
+}
+
+
+void HttpServer::warmUpCache() {
+    // restore the hot set of the previous run
+    if (!m_snapshotPath.empty()) {
+        std::vector<std::string> urlPaths = readPathList(m_snapshotPath);
+        if (!urlPaths.empty()) {
+            HTTP_INFO("Restoring {} cache keys from snapshot '{}'", urlPaths.size(), m_snapshotPath);
+            preloadCache(urlPaths);
+            return;
+        }
+    }
+
+    // 
+    if (m_preload) {
+        std::vector<std::string> urlPaths = m_preloadManifest.empty() ? listBaseDirectory() 
+                                                                      : readPathList(m_preloadManifest);
+        HTTP_INFO("Preloading up to {} of {} files into cache", m_cache.capacity(), urlPaths.size());
+        preloadCache(urlPaths);
+    }
+}
+
+
+void HttpServer::preloadCache(const std::vector<std::string>& urlPaths) {
+    // 
+    struct LoadedFile {
+        std::string filepath;
+        std::vector<unsigned char> body;
+        std::filesystem::file_time_type lastWriteTime;
+        bool loaded = false;
+    };
+
+    // the files which can be cached, in the order of `urlPaths`
+    std::vector<LoadedFile> files;
+    for (const std::string& urlPath : urlPaths) {
+        // more files than the capacity would only evict each other
+        if (files.size() == m_cache.capacity())
+            break;
+        LoadedFile file;
+        std::error_code ec;
+        bool found = resolveUrlPath(urlPath, file.filepath);
+        std::uintmax_t size = found ? std::filesystem::file_size(file.filepath, ec) : 0;
+        if (!found || ec) {
+            HTTP_WARN("Skipped preloading missing file '{}'", urlPath);
+            continue;
+        }
+        if (size > STREAMING_THRESHOLD) {
+            HTTP_INFO("Skipped preloading large file '{}'", urlPath);
+            continue;
+        }
+        file.lastWriteTime = std::filesystem::last_write_time(file.filepath, ec);
+        file.loaded = true;
+        files.push_back(std::move(file));
+    }
+
+    // read the files in parallel on the disk threads
+    std::size_t fileCount = files.size();
+    std::vector<std::promise<std::vector<unsigned char>>> reads(fileCount);
+    for (std::size_t i = 0; i < fileCount; ++i) {
+        m_diskIo.submitRead(files[i].filepath, [&read = reads[i]](std::vector<unsigned char> body, std::exception_ptr error) {
+            if (error)
+                read.set_exception(error);
+            else
+                read.set_value(std::move(body));
+        });
+    }
+
+    // 
+    for (std::size_t i = 0; i < fileCount; ++i) {
+        try {
+            files[i].body = reads[i].get_future().get();
+        }
+        catch (const std::exception& e) {
+            HTTP_WARN("Skipped preloading file: {}", e.what());
+            files[i].loaded = false;
+        }
+    }
+
+    // put the least recently used first, so the order of `urlPaths` is kept
+    std::size_t loadedCount = 0;
+    {
+        std::lock_guard<Mutex> lock(m_cacheMtx);
+        for (auto it = files.rbegin(); it != files.rend(); ++it) {
+            if (it->loaded) {
+                m_cache.put(it->filepath, it->body, it->lastWriteTime);
+                ++loadedCount;
+            }
+        }
+    }
+    HTTP_INFO("Preloaded {} files into cache", loadedCount);
+}
+
+
+void HttpServer::saveCacheSnapshot() {
+    // 
+    if (m_snapshotPath.empty())
+        return;
+
+    // 
+    std::vector<std::string> filepaths;
+    {
+        std::lock_guard<Mutex> lock(m_cacheMtx);
+        filepaths = m_cache.keys();
+    }
+
+    // 
+    std::vector<std::string> urlPaths;
+    for (const auto& filepath : filepaths) {
+        std::string urlPath = mapFilePathToUrl(filepath);
+        if (!urlPath.empty())
+            urlPaths.push_back(urlPath);
+    }
+
+    // 
+    try {
+        writePathList(m_snapshotPath, urlPaths);
+        HTTP_INFO("Saved {} cache keys to snapshot '{}'", urlPaths.size(), m_snapshotPath);
+    }
+    catch (const std::exception& e) {
+        HTTP_ERROR("Failed to save cache snapshot: {}", e.what());
+    }
+}
+
+
 } // namespace http::
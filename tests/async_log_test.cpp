@@ -0,0 +1,63 @@
+/**
+ * \file tests/async_log_test.cpp
+ *
+ * Deferred messages with string arguments larger than the ring of a thread,
+ * which must be truncated rather than wait forever for room.
+ */
+
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <gtest/gtest.h>
+#include <spdlog/sinks/ostream_sink.h>
+
+#include "async_log.h"
+
+
+/**
+ * \brief Log one deferred message through a sink with a given policy, and get what was written.
+ */
+static std::string logDeferred(http::LogOverflowPolicy policy, spdlog::level::level_enum level, const std::string& argument) {
+    std::ostringstream stream;
+    auto output = std::make_shared<spdlog::sinks::ostream_sink_st>(stream);
+    output->set_pattern("%v");
+    {
+        http::AsyncLogSink sink("test", {output}, policy);
+        sink.logDeferred(level, "[{}] [{}]", argument, argument.size());
+        sink.flush();
+    }
+    return stream.str();
+}
+
+
+// the whole string would be larger than the ring
+TEST(AsyncLogSink, HugeStringUnderDrop) {
+    std::string huge(2 * LOG_RING_SIZE, 'x');
+    std::string written = logDeferred(http::LogOverflowPolicy::Drop, spdlog::level::warn, huge);
+    EXPECT_EQ(written, "[" + std::string(LOG_MAX_MESSAGE_SIZE - 1, 'x') + "\n");
+}
+
+
+TEST(AsyncLogSink, HugeStringUnderBlock) {
+    std::string huge(2 * LOG_RING_SIZE, 'x');
+    std::string written = logDeferred(http::LogOverflowPolicy::Block, spdlog::level::info, huge);
+    EXPECT_EQ(written, "[" + std::string(LOG_MAX_MESSAGE_SIZE - 1, 'x') + "\n");
+}
+
+
+// each argument is below the limit, but not the record, formatted by the calling thread
+TEST(AsyncLogSink, ManyLargeArguments) {
+    std::ostringstream stream;
+    auto output = std::make_shared<spdlog::sinks::ostream_sink_st>(stream);
+    output->set_pattern("%v");
+    std::string large(LOG_MAX_MESSAGE_SIZE, 'y');
+    {
+        http::AsyncLogSink sink("test", {output}, http::LogOverflowPolicy::Block);
+        sink.logDeferred(spdlog::level::err, "{}{}{}{}{}{}{}{}{}{}{}{}{}{}{}{}{}{}{}{}",
+                         large, large, large, large, large, large, large, large, large, large,
+                         large, large, large, large, large, large, large, large, large, large);
+        sink.flush();
+    }
+    EXPECT_EQ(stream.str(), std::string(LOG_MAX_MESSAGE_SIZE, 'y') + "\n");
+}
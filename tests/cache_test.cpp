@@ -0,0 +1,237 @@
+/**
+ * \file tests/cache_test.cpp
+ *
+ * The slab and open addressing table of LRUCache against a plain list, the
+ * expiry and eviction order of NegativeCache, and the waiters of SingleFlight.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "cache.h"
+
+
+#define MODEL_CAPACITY 16
+#define MODEL_KEYS     64
+#define MODEL_ROUNDS   20000
+#define FLIGHT_WAITERS 8
+
+
+/**
+ * \brief The content stored for a key, distinct for each key and version.
+ */
+static std::vector<unsigned char> contentOf(const std::string& key, int version) {
+    std::string content = key + "#" + std::to_string(version);
+    return std::vector<unsigned char>(content.begin(), content.end());
+}
+
+
+TEST(LRUCache, EvictsTheLeastRecentlyUsed) {
+    http::LRUCache cache(3);
+    cache.put("/a", contentOf("/a", 0));
+    cache.put("/b", contentOf("/b", 0));
+    cache.put("/c", contentOf("/c", 0));
+    EXPECT_EQ(cache.get("/a"), contentOf("/a", 0));
+    cache.put("/d", contentOf("/d", 0));
+
+    EXPECT_FALSE(cache.contains("/b"));
+    EXPECT_EQ(cache.keys(), (std::vector<std::string>{"/d", "/a", "/c"}));
+    EXPECT_EQ(cache.size(), 3u);
+}
+
+
+TEST(LRUCache, PutUpdatesAndMovesToFront) {
+    http::LRUCache cache(2);
+    cache.put("/a", contentOf("/a", 0));
+    cache.put("/b", contentOf("/b", 0));
+    cache.put("/a", contentOf("/a", 1));
+    cache.put("/c", contentOf("/c", 0));
+
+    EXPECT_EQ(cache.get("/a"), contentOf("/a", 1));
+    EXPECT_FALSE(cache.contains("/b"));
+}
+
+
+// the erases of entries in the middle of probe clusters shift the following slots back
+TEST(LRUCache, RandomOperationsMatchAList) {
+    http::LRUCache cache(MODEL_CAPACITY);
+    std::list<std::string> order;   // most recently used first
+    std::unordered_map<std::string, int> versions;
+    std::mt19937 random(42);
+
+    for (int round = 0; round < MODEL_ROUNDS; ++round) {
+        std::string key = "/file" + std::to_string(random() % MODEL_KEYS);
+        bool present = versions.count(key) > 0;
+        switch (random() % 3) {
+        case 0:
+            if (present) {
+                order.remove(key);
+            }
+            else if (order.size() == MODEL_CAPACITY) {
+                versions.erase(order.back());
+                order.pop_back();
+            }
+            order.push_front(key);
+            versions[key] = round;
+            cache.put(key, contentOf(key, round));
+            break;
+        case 1:
+            if (present) {
+                order.remove(key);
+                order.push_front(key);
+                ASSERT_EQ(cache.get(key), contentOf(key, versions[key]));
+            }
+            else {
+                ASSERT_TRUE(cache.get(key).empty());
+            }
+            break;
+        default:
+            order.remove(key);
+            versions.erase(key);
+            cache.erase(key);
+            break;
+        }
+
+        // every key, present or not, must still be found where it is
+        ASSERT_EQ(cache.size(), order.size());
+        for (int i = 0; i < MODEL_KEYS; ++i) {
+            std::string other = "/file" + std::to_string(i);
+            ASSERT_EQ(cache.contains(other), versions.count(other) > 0) << other << " at round " << round;
+        }
+    }
+    EXPECT_EQ(cache.keys(), std::vector<std::string>(order.begin(), order.end()));
+}
+
+
+TEST(NegativeCache, ExpiresAfterTheTtl) {
+    http::NegativeCache missing(8, std::chrono::milliseconds(20));
+    missing.put("/a");
+    EXPECT_TRUE(missing.contains("/a"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    EXPECT_FALSE(missing.contains("/a"));
+}
+
+
+TEST(NegativeCache, Invalidate) {
+    http::NegativeCache missing(8, std::chrono::seconds(60));
+    missing.put("/a");
+    missing.put("/b");
+    missing.invalidate("/a");
+    EXPECT_FALSE(missing.contains("/a"));
+    EXPECT_TRUE(missing.contains("/b"));
+    missing.clear();
+    EXPECT_FALSE(missing.contains("/b"));
+}
+
+
+// full, the oldest paths go first
+TEST(NegativeCache, EvictsInPutOrder) {
+    http::NegativeCache missing(3, std::chrono::seconds(60));
+    for (const char* path : {"/a", "/b", "/c", "/d"})
+        missing.put(path);
+    EXPECT_FALSE(missing.contains("/a"));
+    EXPECT_TRUE(missing.contains("/b"));
+    EXPECT_TRUE(missing.contains("/c"));
+    EXPECT_TRUE(missing.contains("/d"));
+}
+
+
+// a path put again is as young as the last put, its older position is skipped
+TEST(NegativeCache, PutAgainMovesToTheBack) {
+    http::NegativeCache missing(3, std::chrono::seconds(60));
+    for (const char* path : {"/a", "/b", "/a", "/c", "/d"})
+        missing.put(path);
+    EXPECT_TRUE(missing.contains("/a"));
+    EXPECT_FALSE(missing.contains("/b"));
+    EXPECT_TRUE(missing.contains("/c"));
+    EXPECT_TRUE(missing.contains("/d"));
+}
+
+
+// an invalidated path doesn't take a place, nor is its stale position mistaken for a new put
+TEST(NegativeCache, InvalidatedThenPutAgain) {
+    http::NegativeCache missing(2, std::chrono::seconds(60));
+    missing.put("/a");
+    missing.invalidate("/a");
+    missing.put("/b");
+    missing.put("/a");
+    EXPECT_TRUE(missing.contains("/a"));
+    EXPECT_TRUE(missing.contains("/b"));
+}
+
+
+TEST(SingleFlight, JoinAndComplete) {
+    http::SingleFlight flights;
+    std::vector<std::string> calls;
+    auto callback = [&calls](const http::SingleFlight::Result& result, std::exception_ptr error) {
+        calls.push_back(error ? "error" : std::string(result.begin(), result.end()));
+    };
+
+    EXPECT_TRUE(flights.join("/a", callback));
+    EXPECT_FALSE(flights.join("/a", callback));
+    EXPECT_TRUE(flights.join("/b", callback));
+    flights.complete("/a", contentOf("/a", 0), nullptr);
+    EXPECT_EQ(calls, (std::vector<std::string>{"/a#0", "/a#0"}));
+
+    // done, the next join leads a new load
+    EXPECT_TRUE(flights.join("/a", callback));
+    flights.complete("/a", {}, std::make_exception_ptr(std::runtime_error("read failed")));
+    flights.complete("/b", contentOf("/b", 0), nullptr);
+    EXPECT_EQ(calls, (std::vector<std::string>{"/a#0", "/a#0", "error", "/b#0"}));
+
+    // no flight, nothing to call
+    flights.complete("/c", contentOf("/c", 0), nullptr);
+    EXPECT_EQ(calls.size(), 4u);
+}
+
+
+// the blocking waiters of `load` share the result of a flight started by `join`
+TEST(SingleFlight, LoadWaitsForJoin) {
+    http::SingleFlight flights;
+    ASSERT_TRUE(flights.join("/a", [](const http::SingleFlight::Result&, std::exception_ptr) {}));
+
+    std::atomic<int> arrived{0};
+    std::atomic<int> loads{0};
+    std::vector<http::SingleFlight::Result> results(FLIGHT_WAITERS);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < FLIGHT_WAITERS; ++i) {
+        threads.emplace_back([&, i] {
+            arrived.fetch_add(1);
+            results[i] = flights.load("/a", [&loads] {
+                loads.fetch_add(1);
+                return contentOf("/a", 1);
+            });
+        });
+    }
+
+    // the waiters can't finish before the flight completes
+    while (arrived.load() < FLIGHT_WAITERS)
+        std::this_thread::yield();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    flights.complete("/a", contentOf("/a", 0), nullptr);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(loads.load(), 0);
+    for (const auto& result : results) {
+        EXPECT_EQ(result, contentOf("/a", 0));
+    }
+}
+
+
+// the error of the leader is thrown to the waiters, and the next load runs again
+TEST(SingleFlight, LoadRethrows) {
+    http::SingleFlight flights;
+    EXPECT_THROW(flights.load("/a", []() -> http::SingleFlight::Result { throw std::runtime_error("read failed"); }),
+                 std::runtime_error);
+    EXPECT_EQ(flights.load("/a", [] { return contentOf("/a", 0); }), contentOf("/a", 0));
+}
@@ -0,0 +1,239 @@
+/**
+ * \file tests/multipart_test.cpp
+ *
+ * The state machine of MultipartParser, fed whole bodies and the same bodies
+ * split at every position, so that the delimiters and the headers straddle
+ * two reads.
+ */
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "multipart.h"
+
+
+#define BOUNDARY "----boundary42"
+
+
+/**
+ * \brief A part as seen by the sinks.
+ */
+struct ParsedPart {
+    http::MultipartPart part;
+    std::string body;
+    bool finished = false;
+};
+
+
+/**
+ * \brief Appends the body of a part to its ParsedPart.
+ */
+class RecordingSink : public http::MultipartSink {
+public:
+    explicit RecordingSink(ParsedPart& parsed) : r_parsed(parsed) {}
+
+    bool write(const char* data, std::size_t size) override {
+        r_parsed.body.append(data, size);
+        return true;
+    }
+
+    bool finish() override {
+        r_parsed.finished = true;
+        return true;
+    }
+
+private:
+    ParsedPart& r_parsed;
+};
+
+
+/**
+ * \brief Parse a body in chunks of at most `chunkSize` bytes, or in two chunks split at `split`.
+ */
+static bool parse(const std::string& body, std::vector<ParsedPart>& parts, bool& done,
+                  std::size_t chunkSize = std::string::npos, std::size_t split = std::string::npos) {
+    parts.clear();
+    parts.reserve(16);
+    http::MultipartParser parser(BOUNDARY, [&parts](const http::MultipartPart& part) {
+        parts.push_back(ParsedPart{part, {}, false});
+        return std::make_unique<RecordingSink>(parts.back());
+    });
+
+    bool ok = true;
+    if (split != std::string::npos) {
+        ok = parser.feed(body.data(), split) && parser.feed(body.data() + split, body.size() - split);
+    }
+    else {
+        for (std::size_t pos = 0; ok && pos < body.size(); pos += chunkSize) {
+            ok = parser.feed(body.data() + pos, std::min(chunkSize, body.size() - pos));
+        }
+    }
+    done = parser.isDone();
+    return ok;
+}
+
+
+/**
+ * \brief A form with a field and a file, a preamble and an epilogue.
+ */
+static std::string formBody(const std::string& fileContent) {
+    return "preamble, ignored\r\n"
+           "--" BOUNDARY "\r\n"
+           "Content-Disposition: form-data; name=\"field\"\r\n"
+           "\r\n"
+           "value\r\n"
+           "--" BOUNDARY "\r\n"
+           "content-disposition: form-data; name=\"file\"; filename=\"a.bin\"\r\n"
+           "Content-Type:  application/octet-stream \r\n"
+           "\r\n"
+           + fileContent + "\r\n"
+           "--" BOUNDARY "--\r\n"
+           "epilogue, ignored";
+}
+
+
+// the content looks like the start of a delimiter, in several ways
+static const std::string s_trickyContent = "\r\n-\r\n--\r\n--" "----bound" "\r\n------boundary43" "\r\r\n--";
+
+
+static void expectForm(const std::vector<ParsedPart>& parts, const std::string& fileContent) {
+    ASSERT_EQ(parts.size(), 2u);
+    EXPECT_EQ(parts[0].part.name, "field");
+    EXPECT_EQ(parts[0].part.filename, "");
+    EXPECT_EQ(parts[0].part.contentType, "text/plain");
+    EXPECT_EQ(parts[0].body, "value");
+    EXPECT_TRUE(parts[0].finished);
+
+    EXPECT_EQ(parts[1].part.name, "file");
+    EXPECT_EQ(parts[1].part.filename, "a.bin");
+    EXPECT_EQ(parts[1].part.contentType, "application/octet-stream");
+    EXPECT_EQ(parts[1].part.headers.count("content-disposition"), 1u);
+    EXPECT_EQ(parts[1].body, fileContent);
+    EXPECT_TRUE(parts[1].finished);
+}
+
+
+TEST(MultipartParser, WholeBody) {
+    std::vector<ParsedPart> parts;
+    bool done = false;
+    ASSERT_TRUE(parse(formBody("hello"), parts, done));
+    EXPECT_TRUE(done);
+    expectForm(parts, "hello");
+}
+
+
+// every delimiter and header line is split between reads
+TEST(MultipartParser, OneByteReads) {
+    std::vector<ParsedPart> parts;
+    bool done = false;
+    ASSERT_TRUE(parse(formBody(s_trickyContent), parts, done, 1));
+    EXPECT_TRUE(done);
+    expectForm(parts, s_trickyContent);
+}
+
+
+// the bytes kept as a possible delimiter at the end of a read turn out not to be one
+TEST(MultipartParser, SplitAtEveryPosition) {
+    std::string body = formBody(s_trickyContent);
+    for (std::size_t split = 0; split <= body.size(); ++split) {
+        std::vector<ParsedPart> parts;
+        bool done = false;
+        ASSERT_TRUE(parse(body, parts, done, std::string::npos, split)) << "split at " << split;
+        EXPECT_TRUE(done) << "split at " << split;
+        expectForm(parts, s_trickyContent);
+    }
+}
+
+
+// the first delimiter may start the body, without a CRLF before it
+TEST(MultipartParser, NoPreamble) {
+    std::string body = "--" BOUNDARY "\r\n"
+                       "Content-Disposition: form-data; name=\"a\"\r\n"
+                       "\r\n"
+                       "1\r\n"
+                       "--" BOUNDARY "--";
+    std::vector<ParsedPart> parts;
+    bool done = false;
+    ASSERT_TRUE(parse(body, parts, done));
+    EXPECT_TRUE(done);
+    ASSERT_EQ(parts.size(), 1u);
+    EXPECT_EQ(parts[0].body, "1");
+}
+
+
+// not closed yet, the parser waits for more
+TEST(MultipartParser, Truncated) {
+    std::string body = formBody("hello");
+    body.resize(body.find("hello") + 3);
+    std::vector<ParsedPart> parts;
+    bool done = false;
+    ASSERT_TRUE(parse(body, parts, done));
+    EXPECT_FALSE(done);
+    ASSERT_EQ(parts.size(), 2u);
+    EXPECT_FALSE(parts[1].finished);
+}
+
+
+TEST(MultipartParser, HeaderWithoutColon) {
+    std::string body = "--" BOUNDARY "\r\n"
+                       "Content-Disposition form-data\r\n"
+                       "\r\n"
+                       "1\r\n"
+                       "--" BOUNDARY "--";
+    std::vector<ParsedPart> parts;
+    bool done = false;
+    EXPECT_FALSE(parse(body, parts, done));
+}
+
+
+// a delimiter must be followed by CRLF or "--"
+TEST(MultipartParser, GarbageAfterDelimiter) {
+    std::string body = "--" BOUNDARY "xx\r\n"
+                       "\r\n"
+                       "--" BOUNDARY "--";
+    std::vector<ParsedPart> parts;
+    bool done = false;
+    EXPECT_FALSE(parse(body, parts, done));
+}
+
+
+TEST(MultipartParser, HeadersTooLarge) {
+    std::string body = "--" BOUNDARY "\r\n"
+                       "X-Large: " + std::string(16 * 1024, 'a') + "\r\n"
+                       "\r\n"
+                       "--" BOUNDARY "--";
+    std::vector<ParsedPart> parts;
+    bool done = false;
+    EXPECT_FALSE(parse(body, parts, done, 1024));
+}
+
+
+// a sink refusing the bytes aborts the parsing
+TEST(MultipartParser, SinkFailure) {
+    class FailingSink : public http::MultipartSink {
+    public:
+        bool write(const char*, std::size_t) override { return false; }
+        bool finish() override { return true; }
+    };
+    http::MultipartParser parser(BOUNDARY, [](const http::MultipartPart&) { return std::make_unique<FailingSink>(); });
+    std::string body = formBody("hello");
+    EXPECT_FALSE(parser.feed(body.data(), body.size()));
+    EXPECT_FALSE(parser.isDone());
+}
+
+
+TEST(MultipartParser, ParseBoundary) {
+    std::string boundary;
+    EXPECT_TRUE(http::MultipartParser::parseBoundary("multipart/form-data; boundary=abc", boundary));
+    EXPECT_EQ(boundary, "abc");
+    EXPECT_TRUE(http::MultipartParser::parseBoundary("Multipart/Form-Data ; charset=utf-8; Boundary=\"a b\"", boundary));
+    EXPECT_EQ(boundary, "a b");
+
+    EXPECT_FALSE(http::MultipartParser::parseBoundary("text/plain; boundary=abc", boundary));
+    EXPECT_FALSE(http::MultipartParser::parseBoundary("multipart/form-data", boundary));
+    EXPECT_FALSE(http::MultipartParser::parseBoundary("multipart/form-data; boundary=\"\"", boundary));
+    EXPECT_FALSE(http::MultipartParser::parseBoundary("multipart/form-data; boundary=" + std::string(71, 'a'), boundary));
+}
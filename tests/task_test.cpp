@@ -0,0 +1,72 @@
+/**
+ * \file tests/task_test.cpp
+ *
+ * Tokens on the stack of the waiter, destroyed as soon as the wait returns,
+ * while the last task may still be notifying. Meant to be run under
+ * -DHTTP_SERVER_SANITIZE=thread and -DHTTP_SERVER_SANITIZE=address.
+ */
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "thread_pool.hpp"
+
+
+#define TOKEN_ROUNDS 2000
+#define TOKEN_TASKS  4
+
+
+/**
+ * \brief Submit a group of tasks with a token on the stack, and wait for them.
+ */
+static void submitAndWait(http::ThreadPool& pool) {
+    std::atomic<int> ran{0};
+    http::CompletionToken token;
+    for (int i = 0; i < TOKEN_TASKS; ++i) {
+        pool.submit([&ran] { ran.fetch_add(1, std::memory_order_relaxed); }, token);
+    }
+    pool.wait(token);
+    ASSERT_EQ(ran.load(std::memory_order_relaxed), TOKEN_TASKS);
+}
+
+
+// blocks on the condition variable of the token
+TEST(CompletionToken, WaitOutsideThePool) {
+    http::ThreadPool pool;
+    for (int round = 0; round < TOKEN_ROUNDS; ++round) {
+        submitAndWait(pool);
+    }
+}
+
+
+// runs the pending tasks until the token looks done
+TEST(CompletionToken, WaitOnAWorker) {
+    http::ThreadPool pool;
+    pool.submitWithFuture([&pool] {
+        for (int round = 0; round < TOKEN_ROUNDS; ++round) {
+            submitAndWait(pool);
+        }
+    }).get();
+}
+
+
+// the token is freed before the threads which completed it are joined
+TEST(CompletionToken, DestroyedAfterWait) {
+    for (int round = 0; round < TOKEN_ROUNDS; ++round) {
+        auto token = std::make_unique<http::CompletionToken>();
+        token->add(TOKEN_TASKS);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < TOKEN_TASKS; ++i) {
+            threads.emplace_back([token = token.get()] { token->done(); });
+        }
+        token->wait();
+        EXPECT_TRUE(token->isDone());
+        token.reset();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+}
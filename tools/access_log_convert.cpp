@@ -0,0 +1,154 @@
+/**
+ * \file tools/access_log_convert.cpp
+ *
+ * Converts binary access log files to Common Log Format or to JSON lines, on
+ * the standard output. The JSON lines have the time spent in each stage of the
+ * request, in microseconds, zero in the files of version 1.
+ *
+ *     http-server-access-log [--clf | --json] FILE...
+ */
+
+#include <cstdio>
+#include <cstring>     // std::strcmp
+#include <ctime>       // gmtime_r, strftime
+#include <exception>
+#include <string>
+#include <arpa/inet.h> // inet_ntop
+
+#include "access_log.h"
+
+
+namespace {
+
+enum class OutputFormat { Clf, Json };
+
+std::string clientAddress(const http::AccessLogRecord& record) {
+    char address[INET_ADDRSTRLEN];
+    in_addr inAddr = {};
+    inAddr.s_addr = record.clientAddress;
+    return inet_ntop(AF_INET, &inAddr, address, sizeof(address)) ? address : "-";
+}
+
+const char* httpVersion(const http::AccessLogRecord& record) {
+    return record.httpVersion == 11 ? "HTTP/1.1" : record.httpVersion == 10 ? "HTTP/1.0" : "-";
+}
+
+const char* cacheStatus(const http::AccessLogRecord& record) {
+    switch (static_cast<http::CacheStatus>(record.cacheStatus)) {
+        case http::CacheStatus::Hit:  return "\"hit\"";
+        case http::CacheStatus::Miss: return "\"miss\"";
+        default:                      return "null";
+    }
+}
+
+std::tm utcTime(const http::AccessLogRecord& record) {
+    std::time_t seconds = static_cast<std::time_t>(record.timeUs / 1000000);
+    std::tm tm;
+    gmtime_r(&seconds, &tm);
+    return tm;
+}
+
+/**
+ * \brief The path as a JSON string, with the quotes and control characters escaped.
+ */
+std::string jsonString(const std::string& str) {
+    std::string escaped = "\"";
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += static_cast<char>(c);
+        }
+        else if (c < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        }
+        else {
+            escaped += static_cast<char>(c);
+        }
+    }
+    return escaped + "\"";
+}
+
+/**
+ * \brief `host - - [time] "request" status bytes`, the request is "-" for
+ *        the connections shed before being read.
+ */
+void printClf(const http::AccessLogRecord& record, const std::string& path) {
+    char time[32];
+    std::tm tm = utcTime(record);
+    std::strftime(time, sizeof(time), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+
+    std::string request = "-";
+    if (record.method != static_cast<std::uint8_t>(http::AccessMethod::Unknown) || !path.empty()) {
+        request = std::string(http::accessMethodName(static_cast<http::AccessMethod>(record.method))) + " "
+                + path + " " + httpVersion(record);
+    }
+    std::string bytes = record.bytesSent > 0 ? std::to_string(record.bytesSent) : "-";
+    std::printf("%s - - [%s] \"%s\" %u %s\n", clientAddress(record).c_str(), time, request.c_str(),
+                static_cast<unsigned>(record.status), bytes.c_str());
+}
+
+void printJson(const http::AccessLogRecord& record, const std::string& path) {
+    char time[32];
+    std::tm tm = utcTime(record);
+    std::strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    std::string stages;
+    for (std::size_t i = 0; i < static_cast<std::size_t>(http::RequestStage::Count); ++i) {
+        stages += std::string(i == 0 ? "" : ",") + "\"" + http::requestStageName(static_cast<http::RequestStage>(i)) 
+                + "\":" + std::to_string(record.stageUs[i]);
+    }
+
+    std::printf("{\"time\":\"%s.%06lldZ\",\"client\":\"%s\",\"port\":%u,\"method\":\"%s\",\"path\":%s,"
+                "\"version\":\"%s\",\"status\":%u,\"bytes\":%llu,\"duration_us\":%u,\"cache\":%s,"
+                "\"stages_us\":{%s}}\n",
+                time, static_cast<long long>(record.timeUs % 1000000), clientAddress(record).c_str(),
+                static_cast<unsigned>(record.clientPort),
+                http::accessMethodName(static_cast<http::AccessMethod>(record.method)), jsonString(path).c_str(),
+                httpVersion(record), static_cast<unsigned>(record.status),
+                static_cast<unsigned long long>(record.bytesSent), static_cast<unsigned>(record.durationUs),
+                cacheStatus(record), stages.c_str());
+}
+
+} // namespace
+
+
+int main(int argc, char* argv[]) {
+    //
+    OutputFormat format = OutputFormat::Clf;
+    int firstFile = 1;
+    for (; firstFile < argc && argv[firstFile][0] == '-'; ++firstFile) {
+        if (std::strcmp(argv[firstFile], "--clf") == 0)
+            format = OutputFormat::Clf;
+        else if (std::strcmp(argv[firstFile], "--json") == 0)
+            format = OutputFormat::Json;
+        else
+            break;
+    }
+    if (firstFile >= argc || argv[firstFile][0] == '-') {
+        std::fprintf(stderr, "Usage: %s [--clf | --json] FILE...\n", argv[0]);
+        return 2;
+    }
+
+    //
+    int status = 0;
+    for (int i = firstFile; i < argc; ++i) {
+        try {
+            http::AccessLogReader reader(argv[i]);
+            http::AccessLogRecord record;
+            std::string path;
+            while (reader.next(record, path)) {
+                if (format == OutputFormat::Clf)
+                    printClf(record, path);
+                else
+                    printJson(record, path);
+            }
+        }
+        catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            status = 1;
+        }
+    }
+    return status;
+}
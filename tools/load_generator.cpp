@@ -0,0 +1,638 @@
+/**
+ * \file tools/load_generator.cpp
+ *
+ * Drives the server over loopback, with a mix of requests, and reports the
+ * throughput and the latency percentiles.
+ *
+ *     http-server-load [OPTIONS]
+ *     http-server-load --server ./http-server [--duration S]
+ *
+ * Each connection has its thread and a blocking socket. In closed loop, the
+ * default, a connection sends its next requests as soon as it received the
+ * responses, up to --pipeline requests at once. With --rate, the requests are
+ * sent in open loop at a constant rate over all the connections, and their
+ * latency is measured from the time they were due rather than sent, so that a
+ * stalled server is not hidden by the requests it delayed (the coordinated
+ * omission).
+ *
+ * With --server, the server is started on an ephemeral port, from the
+ * directory of its executable, and the scenarios are run against it one after
+ * the other, then it is stopped with SIGTERM.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>       // std::tolower
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>      // std::strerror
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>   // inet_pton
+#include <fcntl.h>       // open
+#include <limits.h>      // PATH_MAX
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <signal.h>      // kill
+#include <sys/socket.h>
+#include <sys/wait.h>    // waitpid
+#include <unistd.h>
+
+#include "metrics.h"
+#include "net.h"
+
+
+#define DEFAULT_HOST              "127.0.0.1"
+#define DEFAULT_PORT              8080
+#define DEFAULT_CONNECTIONS       16
+#define DEFAULT_DURATION_SEC      5
+#define SCENARIO_DURATION_SEC     3
+#define SCENARIO_RATE             2000
+#define UPLOAD_BODY_SIZE          (4 * 1024)
+#define RECV_CHUNK_SIZE           (64 * 1024)
+#define SOCKET_TIMEOUT_SEC        5
+#define MAX_ATTEMPTS              3      // per batch of requests without any response
+#define SERVER_START_TIMEOUT      std::chrono::seconds(10)
+#define SERVER_STOP_TIMEOUT       std::chrono::seconds(10)
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+
+/**
+ * \brief The kinds of requests of the mix.
+ */
+enum class RequestKind { Static, NotFound, Echo, Upload, Count };
+
+const char* const s_kindNames[] = {"static", "404", "echo", "upload"};
+
+
+/**
+ * \brief The options of a run.
+ */
+struct LoadOptions {
+    std::string host = DEFAULT_HOST;
+    int port = DEFAULT_PORT;
+    unsigned connections = DEFAULT_CONNECTIONS;
+    std::chrono::seconds duration{DEFAULT_DURATION_SEC};
+    bool keepAlive = false;
+    unsigned pipeline = 1;                      ///< Requests in flight per connection, in closed loop
+    double rate = 0;                            ///< Requests per second in open loop, 0 for closed loop
+    unsigned mix[static_cast<std::size_t>(RequestKind::Count)] = {100, 0, 0, 0};   ///< Weights
+};
+
+
+/**
+ * \brief What a connection, or a whole run, measured.
+ */
+struct LoadResult {
+    std::uint64_t requests = 0;                 ///< Responses received
+    std::uint64_t errors = 0;                   ///< Requests without response, the connection failing
+    std::uint64_t statusClasses[6] = {};        ///< Responses by status / 100
+    std::vector<std::uint64_t> latency = std::vector<std::uint64_t>(http::HistogramBuckets::COUNT);   ///< ns
+    std::uint64_t latencySum = 0;
+    Clock::duration elapsed{0};                 ///< Until the last response, past the duration when late
+
+    void record(Clock::duration duration) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        std::uint64_t value = ns > 0 ? static_cast<std::uint64_t>(ns) : 0;
+        ++latency[http::HistogramBuckets::indexOf(value)];
+        latencySum += value;
+    }
+
+    void merge(const LoadResult& other) {
+        requests += other.requests;
+        errors += other.errors;
+        for (std::size_t i = 0; i < 6; ++i)
+            statusClasses[i] += other.statusClasses[i];
+        for (std::size_t i = 0; i < latency.size(); ++i)
+            latency[i] += other.latency[i];
+        latencySum += other.latencySum;
+    }
+
+    http::HistogramSnapshot snapshot() const {
+        http::HistogramSnapshot snapshot;
+        snapshot.buckets = latency;
+        snapshot.count = requests;
+        snapshot.sum = latencySum;
+        return snapshot;
+    }
+};
+
+
+/**
+ * \brief The requests of a run, shared by its connections.
+ *
+ * In open loop, the requests are numbered and the i-th is due at
+ * start + i / rate, whichever connection sends it.
+ */
+struct Schedule {
+    Clock::time_point start;
+    Clock::time_point end;
+    Clock::duration interval{0};
+    std::atomic<std::uint64_t> next{0};
+
+    /**
+     * \brief Claim the next request, false once the run is over.
+     *
+     * \param due: The time the request is due at, now in closed loop.
+     */
+    bool claim(Clock::time_point& due) {
+        if (interval == Clock::duration::zero()) {
+            due = Clock::now();
+            return due < end;
+        }
+        due = start + interval * static_cast<Clock::rep>(next.fetch_add(1, std::memory_order_relaxed));
+        return due < end;
+    }
+};
+
+
+/**
+ * \brief A client connection with a blocking socket, reading the responses
+ *        by their Content-Length.
+ */
+class Connection {
+/* Constructor, Destructor and Operators */
+public:
+    explicit Connection(const sockaddr_in& address) : m_address(address), m_fd(-1) {}
+
+    ~Connection() { close(); }
+
+    Connection(const Connection& other) = delete;
+    Connection& operator=(const Connection& other) = delete;
+
+/**/
+public:
+    bool isOpen() const { return m_fd >= 0; }
+
+    bool open() {
+        m_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_fd < 0)
+            return false;
+        int one = 1;
+        setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        timeval timeout = {SOCKET_TIMEOUT_SEC, 0};
+        setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(m_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (connect(m_fd, reinterpret_cast<const sockaddr*>(&m_address), sizeof(m_address)) < 0) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+        m_buffer.clear();
+    }
+
+    bool send(const std::string& data) { return http::sendAll(m_fd, data.data(), data.size()); }
+
+    /**
+     * \brief Read the next response.
+     *
+     * \param status: Set to the status code.
+     * \param closes: Set if the server closes the connection after it.
+     * \return false if the connection was closed or failed before a complete response.
+     */
+    bool readResponse(int& status, bool& closes) {
+        while (true) {
+            std::size_t headEnd = m_buffer.find("\r\n\r\n");
+            if (headEnd != std::string::npos) {
+                std::string head = m_buffer.substr(0, headEnd + 2);
+                std::transform(head.begin(), head.end(), head.begin(), [](unsigned char c) { return std::tolower(c); });
+                if (head.compare(0, 5, "http/") != 0 || head.size() < 12)
+                    return false;
+                status = std::atoi(head.c_str() + 9);
+                closes = head.compare(0, 8, "http/1.0") == 0 || head.find("\r\nconnection: close\r\n") != std::string::npos;
+
+                std::size_t contentLength = 0;
+                std::size_t field = head.find("\r\ncontent-length:");
+                if (field != std::string::npos)
+                    contentLength = std::strtoull(head.c_str() + field + 17, nullptr, 10);
+
+                std::size_t total = headEnd + 4 + contentLength;
+                if (m_buffer.size() >= total) {
+                    m_buffer.erase(0, total);
+                    return true;
+                }
+            }
+
+            char chunk[RECV_CHUNK_SIZE];
+            ssize_t received = recv(m_fd, chunk, sizeof(chunk), 0);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received <= 0)
+                return false;
+            m_buffer.append(chunk, static_cast<std::size_t>(received));
+        }
+    }
+
+private:
+    sockaddr_in m_address;
+    int m_fd;
+    std::string m_buffer;   ///< Received and not yet consumed, the next pipelined responses
+};
+
+
+/**
+ * \brief The text of a request of the mix.
+ */
+std::string requestText(RequestKind kind, bool keepAlive, std::mt19937& rng) {
+    static const std::string s_uploadBody(UPLOAD_BODY_SIZE, 'x');
+    const char* connection = keepAlive ? "keep-alive" : "close";
+
+    std::string target;
+    std::string method = "GET";
+    std::string extraHeaders;
+    switch (kind) {
+        case RequestKind::Static:
+            target = "/home.html";
+            break;
+        case RequestKind::NotFound:
+            // spread over many paths, like a scan, not a single cached miss
+            target = "/missing-" + std::to_string(rng() % 1000) + ".html";
+            break;
+        case RequestKind::Echo:
+            target = "/echo";
+            break;
+        default:
+            method = "POST";
+            target = "/upload";
+            extraHeaders = "Content-Type: text/plain\r\nContent-Length: " + std::to_string(s_uploadBody.size()) + "\r\n";
+            break;
+    }
+
+    std::string text = method + " " + target + " HTTP/1.1\r\n"
+                     + "Host: localhost\r\n"
+                     + "User-Agent: http-server-load\r\n"
+                     + "Connection: " + connection + "\r\n"
+                     + extraHeaders + "\r\n";
+    if (kind == RequestKind::Upload)
+        text += s_uploadBody;
+    return text;
+}
+
+
+/**
+ * \brief Pick a kind of request by the weights of the mix.
+ */
+RequestKind pickKind(const LoadOptions& options, std::mt19937& rng) {
+    unsigned total = 0;
+    for (unsigned weight : options.mix)
+        total += weight;
+    unsigned pick = total > 0 ? static_cast<unsigned>(rng() % total) : 0;
+    for (std::size_t i = 0; i < static_cast<std::size_t>(RequestKind::Count); ++i) {
+        if (pick < options.mix[i])
+            return static_cast<RequestKind>(i);
+        pick -= options.mix[i];
+    }
+    return RequestKind::Static;
+}
+
+
+/**
+ * \brief The loop of a connection, until the schedule is over.
+ *
+ * The server may close the connection after any response, the requests
+ * pipelined after it are then sent again on a new connection.
+ */
+void runConnection(const LoadOptions& options, const sockaddr_in& address, Schedule& schedule,
+                   LoadResult& result, unsigned seed) {
+    struct Pending {
+        RequestKind kind;
+        Clock::time_point due;
+    };
+
+    std::mt19937 rng(seed);
+    Connection connection(address);
+    std::vector<Pending> pending;
+    const std::size_t depth = options.rate > 0 ? 1 : std::max(1u, options.pipeline);
+
+    while (true) {
+        //
+        pending.clear();
+        Clock::time_point due;
+        while (pending.size() < depth && schedule.claim(due))
+            pending.push_back({pickKind(options, rng), due});
+        if (pending.empty())
+            break;
+        if (options.rate > 0)
+            std::this_thread::sleep_until(pending.front().due);
+
+        //
+        std::size_t done = 0;
+        unsigned attempts = 0;
+        while (done < pending.size()) {
+            if (!connection.isOpen() && !connection.open()) {
+                if (++attempts >= MAX_ATTEMPTS)
+                    break;
+                continue;
+            }
+
+            std::string batch;
+            for (std::size_t i = done; i < pending.size(); ++i)
+                batch += requestText(pending[i].kind, options.keepAlive, rng);
+            std::size_t before = done;
+            if (connection.send(batch)) {
+                int status = 0;
+                bool closes = false;
+                while (done < pending.size() && connection.readResponse(status, closes)) {
+                    result.record(Clock::now() - pending[done].due);
+                    ++result.requests;
+                    ++result.statusClasses[status >= 100 && status < 600 ? status / 100 : 0];
+                    ++done;
+                    if (closes || !options.keepAlive)
+                        break;
+                }
+            }
+            if (done < pending.size() || !options.keepAlive)
+                connection.close();
+            if (done == before && ++attempts >= MAX_ATTEMPTS)
+                break;
+        }
+        result.errors += pending.size() - done;
+    }
+}
+
+
+/**
+ * \brief Run the connections until the end of the duration.
+ */
+LoadResult runLoad(const LoadOptions& options) {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<std::uint16_t>(options.port));
+    if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1) {
+        std::fprintf(stderr, "Invalid IPv4 address '%s'\n", options.host.c_str());
+        std::exit(2);
+    }
+
+    Schedule schedule;
+    schedule.start = Clock::now();
+    schedule.end = schedule.start + options.duration;
+    if (options.rate > 0)
+        schedule.interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / options.rate));
+
+    std::vector<LoadResult> results(options.connections);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < options.connections; ++i)
+        threads.emplace_back(runConnection, std::cref(options), std::cref(address), std::ref(schedule),
+                             std::ref(results[i]), 0x5eed + i);
+    for (auto& thread : threads)
+        thread.join();
+
+    LoadResult total;
+    for (const auto& result : results)
+        total.merge(result);
+    total.elapsed = Clock::now() - schedule.start;
+    return total;
+}
+
+
+void printHeader() {
+    std::printf("%-22s %10s %8s %10s %9s %9s %9s %9s\n",
+                "scenario", "requests", "errors", "req/s", "p50 ms", "p99 ms", "p999 ms", "non-2xx");
+}
+
+void printResult(const char* name, const LoadResult& result) {
+    http::HistogramSnapshot latency = result.snapshot();
+    auto ms = [&latency](double q) { return static_cast<double>(latency.quantile(q)) / 1e6; };
+    double seconds = std::chrono::duration<double>(result.elapsed).count();
+    std::uint64_t non2xx = result.requests - result.statusClasses[2];
+    std::printf("%-22s %10llu %8llu %10.0f %9.3f %9.3f %9.3f %9llu\n", name,
+                static_cast<unsigned long long>(result.requests), static_cast<unsigned long long>(result.errors),
+                static_cast<double>(result.requests) / seconds, ms(0.50), ms(0.99), ms(0.999),
+                static_cast<unsigned long long>(non2xx));
+    std::fflush(stdout);
+}
+
+
+/**
+ * \brief A free port, from a socket bound to port 0 then closed.
+ */
+int ephemeralPort() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+        || getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+        std::fprintf(stderr, "Failed to find a free port: %s\n", std::strerror(errno));
+        std::exit(1);
+    }
+    ::close(fd);
+    return ntohs(address.sin_port);
+}
+
+
+/**
+ * \brief Start the server from the directory of its executable, so it finds
+ *        the files directory, with its output discarded.
+ *
+ * \return The pid of the server, once it accepts connections.
+ */
+pid_t startServer(const std::string& path, int port) {
+    char resolved[PATH_MAX];
+    if (realpath(path.c_str(), resolved) == nullptr) {
+        std::fprintf(stderr, "Server '%s' not found\n", path.c_str());
+        std::exit(2);
+    }
+    std::string executable = resolved;
+    std::string directory = executable.substr(0, executable.rfind('/') + 1);
+    std::string portArg = std::to_string(port);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::fprintf(stderr, "Failed to fork: %s\n", std::strerror(errno));
+        std::exit(1);
+    }
+    if (pid == 0) {
+        int devNull = ::open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        if (chdir(directory.c_str()) == 0)
+            execl(executable.c_str(), executable.c_str(), portArg.c_str(), static_cast<char*>(nullptr));
+        _exit(127);
+    }
+
+    //
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<std::uint16_t>(port));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Clock::time_point deadline = Clock::now() + SERVER_START_TIMEOUT;
+    while (Clock::now() < deadline) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            std::fprintf(stderr, "Server exited before accepting connections\n");
+            std::exit(1);
+        }
+        Connection probe(address);
+        if (probe.open())
+            return pid;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    std::fprintf(stderr, "Server didn't accept connections on port %d\n", port);
+    std::exit(1);
+}
+
+
+/**
+ * \brief Stop the server with SIGTERM, so it saves its cache snapshot, or
+ *        SIGKILL if it doesn't exit in time.
+ */
+void stopServer(pid_t pid) {
+    kill(pid, SIGTERM);
+    Clock::time_point deadline = Clock::now() + SERVER_STOP_TIMEOUT;
+    while (Clock::now() < deadline) {
+        if (waitpid(pid, nullptr, WNOHANG) == pid)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+
+/**
+ * \brief The scenarios run against a server started by --server.
+ */
+struct Scenario {
+    const char* name;
+    bool keepAlive;
+    unsigned pipeline;
+    bool openLoop;
+    unsigned mix[static_cast<std::size_t>(RequestKind::Count)];
+};
+
+const Scenario s_scenarios[] = {
+    {"static",            false, 1, false, {100, 0,  0,  0}},
+    {"static-pipelined",  true,  4, false, {100, 0,  0,  0}},
+    {"404",               false, 1, false, {0,   100, 0, 0}},
+    {"mix",               false, 1, false, {78,  10, 10, 2}},
+    {"mix-open-loop",     false, 1, true,  {78,  10, 10, 2}},
+};
+
+
+bool parseMix(const std::string& spec, LoadOptions& options) {
+    std::fill(std::begin(options.mix), std::end(options.mix), 0u);
+    std::size_t begin = 0;
+    while (begin < spec.size()) {
+        std::size_t end = spec.find(',', begin);
+        if (end == std::string::npos)
+            end = spec.size();
+        std::string item = spec.substr(begin, end - begin);
+        std::size_t equal = item.find('=');
+        if (equal == std::string::npos)
+            return false;
+        std::string name = item.substr(0, equal);
+        auto kind = std::find_if(std::begin(s_kindNames), std::end(s_kindNames),
+                                 [&name](const char* kindName) { return name == kindName; });
+        if (kind == std::end(s_kindNames))
+            return false;
+        options.mix[kind - std::begin(s_kindNames)] = static_cast<unsigned>(std::strtoul(item.c_str() + equal + 1, nullptr, 10));
+        begin = end + 1;
+    }
+    return true;
+}
+
+
+void printUsage(const char* program) {
+    std::fprintf(stderr,
+        "Usage: %s [OPTIONS]\n"
+        "  --host ADDR         IPv4 address of the server (default %s)\n"
+        "  --port N            port of the server (default %d)\n"
+        "  --connections N     concurrent connections (default %d)\n"
+        "  --duration S        seconds of load (default %d, %d per scenario with --server)\n"
+        "  --keep-alive        reuse the connections, when the server keeps them open\n"
+        "  --pipeline N        requests in flight per connection in closed loop (default 1)\n"
+        "  --rate R            open loop at R requests per second over all the connections\n"
+        "  --mix SPEC          weights of the requests, e.g. static=70,404=10,echo=15,upload=5\n"
+        "  --server PATH       start this server on an ephemeral port and run the scenarios\n",
+        program, DEFAULT_HOST, DEFAULT_PORT, DEFAULT_CONNECTIONS, DEFAULT_DURATION_SEC, SCENARIO_DURATION_SEC);
+}
+
+} // namespace
+
+
+int main(int argc, char* argv[]) {
+    //
+    LoadOptions options;
+    std::string server;
+    bool durationSet = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--keep-alive")
+            options.keepAlive = true;
+        else if (arg == "--host" && hasValue)
+            options.host = argv[++i];
+        else if (arg == "--port" && hasValue)
+            options.port = std::atoi(argv[++i]);
+        else if (arg == "--connections" && hasValue)
+            options.connections = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        else if (arg == "--duration" && hasValue) {
+            options.duration = std::chrono::seconds(std::max(1, std::atoi(argv[++i])));
+            durationSet = true;
+        }
+        else if (arg == "--pipeline" && hasValue)
+            options.pipeline = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        else if (arg == "--rate" && hasValue)
+            options.rate = std::atof(argv[++i]);
+        else if (arg == "--mix" && hasValue) {
+            if (!parseMix(argv[++i], options)) {
+                std::fprintf(stderr, "Invalid mix '%s'\n", argv[i]);
+                return 2;
+            }
+        }
+        else if (arg == "--server" && hasValue)
+            server = argv[++i];
+        else {
+            printUsage(argv[0]);
+            return 2;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // a single run against a running server
+    if (server.empty()) {
+        printHeader();
+        printResult(options.rate > 0 ? "open-loop" : "closed-loop", runLoad(options));
+        return 0;
+    }
+
+    // the scenarios against a server of our own
+    options.host = "127.0.0.1";
+    options.port = ephemeralPort();
+    if (!durationSet)
+        options.duration = std::chrono::seconds(SCENARIO_DURATION_SEC);
+    pid_t pid = startServer(server, options.port);
+    std::printf("server %s on port %d, %u connections, %lld s per scenario\n", server.c_str(), options.port,
+                options.connections, static_cast<long long>(options.duration.count()));
+    printHeader();
+
+    for (const Scenario& scenario : s_scenarios) {
+        LoadOptions scenarioOptions = options;
+        scenarioOptions.keepAlive = scenario.keepAlive;
+        scenarioOptions.pipeline = scenario.pipeline;
+        scenarioOptions.rate = scenario.openLoop ? (options.rate > 0 ? options.rate : SCENARIO_RATE) : 0;
+        std::copy(std::begin(scenario.mix), std::end(scenario.mix), scenarioOptions.mix);
+        printResult(scenario.name, runLoad(scenarioOptions));
+    }
+
+    stopServer(pid);
+    return 0;
+}